@@ -1,6 +1,7 @@
 use std::cmp::Ordering;
 use std::fmt::{Display, Formatter};
 use std::num::ParseIntError;
+use std::ops::Add;
 
 #[derive(Hash, Eq, PartialEq, Copy, Clone, Debug)]
 pub enum Distance {
@@ -40,6 +41,18 @@ impl From<Distance> for u32 {
     }
 }
 
+/// Distance of a path made of two parts, infinite if any of them is or if the sum exceeds the maximal distance.
+impl Add for Distance {
+    type Output = Self;
+
+    fn add(self, other: Self) -> Self::Output {
+        match (self, other) {
+            (Self::Finite(lhs), Self::Finite(rhs)) => Self::new(lhs.saturating_add(rhs)),
+            _ => Self::Infinite,
+        }
+    }
+}
+
 impl Ord for Distance {
     fn cmp(&self, other: &Self) -> Ordering {
         match (self, other) {
@@ -97,6 +110,13 @@ mod tests {
         assert!(matches!(dist, Distance::Infinite));
     }
 
+    #[test]
+    fn test_add() {
+        assert_eq!(Distance::new(5), Distance::new(2) + Distance::new(3));
+        assert_eq!(Distance::Infinite, Distance::new(Distance::MAX_DISTANCE) + Distance::new(1));
+        assert_eq!(Distance::Infinite, Distance::Infinite + Distance::new(1));
+    }
+
     #[test]
     fn test_from_u32_infinite_2() {
         let dist = Distance::new(Distance::INFINITY_ENCODING);
@@ -0,0 +1,46 @@
+use std::io;
+use std::os::unix::io::RawFd;
+use std::time::Duration;
+
+/// Level triggered epoll instance waiting for sockets to become readable.
+pub struct Epoll {
+    fd: RawFd,
+    events: Vec<libc::epoll_event>,
+}
+
+impl Epoll {
+    const MAX_EVENTS: usize = 64;
+
+    pub fn new() -> io::Result<Self> {
+        let fd = syscall!(epoll_create1(libc::EPOLL_CLOEXEC))?;
+        let events = vec![libc::epoll_event { events: 0, u64: 0 }; Self::MAX_EVENTS];
+        Ok(Self { fd, events })
+    }
+
+    /// Reports readiness of `fd` to read under `token`.
+    pub fn register(&self, fd: RawFd, token: u64) -> io::Result<()> {
+        let mut event = libc::epoll_event { events: libc::EPOLLIN as u32, u64: token };
+        syscall!(epoll_ctl(self.fd, libc::EPOLL_CTL_ADD, fd, &mut event))?;
+        Ok(())
+    }
+
+    /// Waits at most `timeout` for registered descriptors to become readable and appends their tokens to `ready`.
+    pub fn wait(&mut self, timeout: Duration, ready: &mut Vec<u64>) -> io::Result<()> {
+        /* Rounded up, so that the deadline has passed once the wait times out. */
+        let timeout_ms = timeout.as_nanos().div_ceil(1_000_000);
+        let timeout_ms = timeout_ms.min(libc::c_int::MAX as u128) as libc::c_int;
+        let count = match syscall!(epoll_wait(self.fd, self.events.as_mut_ptr(), self.events.len() as libc::c_int, timeout_ms)) {
+            Ok(count) => count as usize,
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => 0,
+            Err(err) => return Err(err),
+        };
+        ready.extend(self.events[..count].iter().map(|event| event.u64));
+        Ok(())
+    }
+}
+
+impl Drop for Epoll {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.fd); }
+    }
+}
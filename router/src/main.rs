@@ -1,3 +1,14 @@
+macro_rules! syscall {
+    ($fn: ident ( $($arg: expr),* $(,)* ) ) => {{
+        let res = unsafe { libc::$fn($($arg, )*) };
+        if res == -1 {
+            Err(std::io::Error::last_os_error())
+        } else {
+            Ok(res)
+        }
+    }};
+}
+
 #[allow(dead_code, unused)]
 
 mod distance;
@@ -6,17 +17,24 @@ mod route;
 mod routing_table;
 mod subnet_mask;
 mod router;
+mod prefix_trie;
+mod epoll;
 
+use std::env;
 use std::io;
 use std::io::Read;
-use crate::router::Router;
+use crate::router::{Router, UpdateMode};
 
 fn main() -> std::io::Result<()> {
     let mut handle = io::stdin();
     let mut buffer = String::new();
     handle.read_to_string(&mut buffer)?;
 
-    let router = Router::from(buffer.as_str());
+    let mut router = Router::from(buffer.as_str());
+    /* Every router of the network has to run in the same mode. */
+    if env::args().skip(1).any(|arg| arg == "--delta") {
+        router.set_update_mode(UpdateMode::Delta);
+    }
     println!("{router}");
-    Ok(())
+    router.run()
 }
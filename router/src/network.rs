@@ -24,17 +24,21 @@ impl Network {
 
     pub fn with_prefix_masking(prefix: Ipv4Addr, subnet_mask: SubNetMask) -> Self {
         let address_bytes = u32::from(prefix);
-        let masked_prefix = Ipv4Addr::from(address_bytes & !((1 << (32 - subnet_mask.value() as u32)) - 1u32));
+        let mask = Self::new(prefix, subnet_mask).mask();
+        let masked_prefix = Ipv4Addr::from(address_bytes & mask);
         Self {
             prefix: masked_prefix,
             subnet_mask,
         }
     }
 
+    /// Mask of the prefix, shifting by 32 overflows so mask of the default route /0 is handled apart.
+    fn mask(&self) -> u32 {
+        u32::MAX.checked_shl(32 - self.subnet_mask.value() as u32).unwrap_or(0)
+    }
+
     pub fn contains(&self, address: Ipv4Addr) -> bool {
-        let network_address = u32::from(self.prefix);
-        let final_address = network_address + self.subnet_mask.address_range();
-        (network_address..=final_address).contains(&address.into())
+        (u32::from(address) ^ u32::from(self.prefix)) & self.mask() == 0
     }
 
     pub fn prefix(&self) -> Ipv4Addr {
@@ -46,7 +50,7 @@ impl Network {
     }
 
     pub fn broadcast_address(&self) -> Ipv4Addr {
-        Ipv4Addr::from(u32::from(self.prefix) | (1 << 32 - self.subnet_mask.value() as u32) - 1)
+        Ipv4Addr::from(u32::from(self.prefix) | !self.mask())
     }
 }
 
@@ -140,6 +144,16 @@ mod tests {
         assert_eq!(network.broadcast_address(), Ipv4Addr::from_str("192.168.0.255").unwrap());
     }
 
+    #[test]
+    fn test_contains() {
+        let network = Network::try_from("192.168.4.0/22").unwrap();
+        assert!(network.contains(Ipv4Addr::from_str("192.168.7.255").unwrap()));
+        assert!(!network.contains(Ipv4Addr::from_str("192.168.8.0").unwrap()));
+        let default_route = Network::try_from("0.0.0.0/0").unwrap();
+        assert!(default_route.contains(Ipv4Addr::from_str("8.8.8.8").unwrap()));
+        assert_eq!(Ipv4Addr::BROADCAST, default_route.broadcast_address());
+    }
+
     #[test]
     fn test_broadcast_3() {
         let ip = Ipv4Addr::from_str("192.168.1.10").unwrap();
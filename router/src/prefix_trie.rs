@@ -0,0 +1,266 @@
+use std::net::Ipv4Addr;
+
+use crate::network::{Network, SubNetMask};
+
+/// Mask of the first `length` bits of an address.
+fn prefix_mask(length: u8) -> u32 {
+    u32::MAX.checked_shl(32 - length as u32).unwrap_or(0)
+}
+
+/// Bit of `address` at `index`, counting from the most significant one.
+fn bit_at(address: u32, index: u8) -> usize {
+    (address >> (31 - index as u32) & 1) as usize
+}
+
+/// Length of the longest common prefix of two prefixes, at most the length of the shorter one.
+fn common_length(lhs: u32, lhs_length: u8, rhs: u32, rhs_length: u8) -> u8 {
+    ((lhs ^ rhs).leading_zeros() as u8).min(lhs_length).min(rhs_length)
+}
+
+struct Node<V> {
+    prefix: u32,
+    length: u8,
+    /* Nodes without value only split paths of their children. */
+    value: Option<V>,
+    children: [Option<Box<Node<V>>>; 2],
+}
+
+impl<V> Node<V> {
+    fn leaf(prefix: u32, length: u8, value: V) -> Self {
+        Self { prefix, length, value: Some(value), children: [None, None] }
+    }
+
+    fn matches(&self, address: u32) -> bool {
+        (address ^ self.prefix) & prefix_mask(self.length) == 0
+    }
+
+    fn network(&self) -> Network {
+        Network::new(Ipv4Addr::from(self.prefix), SubNetMask::new(self.length).unwrap())
+    }
+}
+
+/// Path compressed binary trie (Patricia trie) mapping networks to values.
+///
+/// Every node either holds a value or has two children, so the trie has fewer than two nodes per network.
+/// Any lookup visits at most 33 nodes, one per prefix length, regardless of the number of networks.
+pub struct PrefixTrie<V> {
+    root: Option<Box<Node<V>>>,
+    len: usize,
+}
+
+impl<V> PrefixTrie<V> {
+    pub fn new() -> Self {
+        Self { root: None, len: 0 }
+    }
+
+    #[cfg(test)]
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Inserts value for the network, returns the value it replaced.
+    pub fn insert(&mut self, network: Network, value: V) -> Option<V> {
+        let length = network.subnet_mask().value();
+        let prefix = u32::from(network.prefix()) & prefix_mask(length);
+        let replaced = Self::insert_at(&mut self.root, prefix, length, value);
+        if replaced.is_none() {
+            self.len += 1;
+        }
+        replaced
+    }
+
+    fn insert_at(slot: &mut Option<Box<Node<V>>>, prefix: u32, length: u8, value: V) -> Option<V> {
+        let node = match slot {
+            Some(node) => node,
+            None => {
+                *slot = Some(Box::new(Node::leaf(prefix, length, value)));
+                return None;
+            }
+        };
+        let common = common_length(node.prefix, node.length, prefix, length);
+        if common == node.length && common == length {
+            return node.value.replace(value);
+        }
+        if common == node.length {
+            let child = bit_at(prefix, node.length);
+            return Self::insert_at(&mut node.children[child], prefix, length, value);
+        }
+        /* Network diverges from the path of the node, both hang below a node of their common prefix. */
+        let node = slot.take().unwrap();
+        let mut parent = Node { prefix: prefix & prefix_mask(common), length: common, value: None, children: [None, None] };
+        let node_side = bit_at(node.prefix, common);
+        parent.children[node_side] = Some(node);
+        if common == length {
+            parent.value = Some(value);
+        } else {
+            parent.children[1 - node_side] = Some(Box::new(Node::leaf(prefix, length, value)));
+        }
+        *slot = Some(Box::new(parent));
+        None
+    }
+
+    /// Removes value of the network, nodes left without purpose are merged with their child.
+    pub fn remove(&mut self, network: &Network) -> Option<V> {
+        let length = network.subnet_mask().value();
+        let prefix = u32::from(network.prefix()) & prefix_mask(length);
+        let removed = Self::remove_at(&mut self.root, prefix, length);
+        if removed.is_some() {
+            self.len -= 1;
+        }
+        removed
+    }
+
+    fn remove_at(slot: &mut Option<Box<Node<V>>>, prefix: u32, length: u8) -> Option<V> {
+        let node = slot.as_mut()?;
+        if node.length > length || !node.matches(prefix) {
+            return None;
+        }
+        let removed = if node.length == length {
+            node.value.take()
+        } else {
+            let child = bit_at(prefix, node.length);
+            Self::remove_at(&mut node.children[child], prefix, length)
+        };
+        if node.value.is_none() {
+            match node.children.iter().filter(|child| child.is_some()).count() {
+                0 => *slot = None,
+                1 => {
+                    let child = node.children.iter_mut().find_map(Option::take);
+                    *slot = child;
+                }
+                _ => {}
+            }
+        }
+        removed
+    }
+
+    fn find(&self, prefix: u32, length: u8) -> Option<&Node<V>> {
+        let mut current = self.root.as_deref();
+        while let Some(node) = current {
+            if node.length > length || !node.matches(prefix) {
+                return None;
+            }
+            if node.length == length {
+                return Some(node);
+            }
+            current = node.children[bit_at(prefix, node.length)].as_deref();
+        }
+        None
+    }
+
+    pub fn get(&self, network: &Network) -> Option<&V> {
+        let length = network.subnet_mask().value();
+        self.find(u32::from(network.prefix()) & prefix_mask(length), length)?.value.as_ref()
+    }
+
+    /// Most specific network containing `address` whose value satisfies `is_eligible`.
+    #[cfg(test)]
+    pub fn longest_match<P: Fn(&V) -> bool>(&self, address: Ipv4Addr, is_eligible: P) -> Option<(Network, &V)> {
+        let address = u32::from(address);
+        let mut best = None;
+        let mut current = self.root.as_deref();
+        while let Some(node) = current {
+            if !node.matches(address) {
+                break;
+            }
+            if let Some(value) = node.value.as_ref().filter(|value| is_eligible(value)) {
+                best = Some((node, value));
+            }
+            if node.length == 32 {
+                break;
+            }
+            current = node.children[bit_at(address, node.length)].as_deref();
+        }
+        best.map(|(node, value)| (node.network(), value))
+    }
+
+    /// Networks with their values, ordered by address and then by prefix length.
+    pub fn iter(&self) -> impl Iterator<Item=(Network, &V)> + '_ {
+        let mut stack: Vec<&Node<V>> = self.root.as_deref().into_iter().collect();
+        std::iter::from_fn(move || {
+            while let Some(node) = stack.pop() {
+                node.children.iter().rev().flatten().for_each(|child| stack.push(child));
+                if let Some(value) = &node.value {
+                    return Some((node.network(), value));
+                }
+            }
+            None
+        })
+    }
+}
+
+impl<V> Default for PrefixTrie<V> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl<V: std::fmt::Debug> std::fmt::Debug for PrefixTrie<V> {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_map().entries(self.iter()).finish()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::net::Ipv4Addr;
+    use std::str::FromStr;
+
+    use super::PrefixTrie;
+    use crate::network::Network;
+
+    fn network(repr: &str) -> Network {
+        Network::try_from(repr).unwrap()
+    }
+
+    fn address(repr: &str) -> Ipv4Addr {
+        Ipv4Addr::from_str(repr).unwrap()
+    }
+
+    #[test]
+    fn test_longest_prefix_match() {
+        let mut trie = PrefixTrie::new();
+        trie.insert(network("0.0.0.0/0"), "default");
+        trie.insert(network("10.0.0.0/8"), "ten");
+        trie.insert(network("10.1.0.0/16"), "ten-one");
+        trie.insert(network("10.1.2.0/24"), "ten-one-two");
+        trie.insert(network("192.168.0.0/16"), "private");
+
+        let lookup = |repr: &str| trie.longest_match(address(repr), |_| true).map(|(_, &value)| value);
+        assert_eq!(Some("ten-one-two"), lookup("10.1.2.3"));
+        assert_eq!(Some("ten-one"), lookup("10.1.3.3"));
+        assert_eq!(Some("ten"), lookup("10.2.0.1"));
+        assert_eq!(Some("private"), lookup("192.168.255.255"));
+        assert_eq!(Some("default"), lookup("8.8.8.8"));
+        assert_eq!(
+            Some((network("10.1.0.0/16"), &"ten-one")),
+            trie.longest_match(address("10.1.2.3"), |&value| value != "ten-one-two")
+        );
+    }
+
+    #[test]
+    fn test_insert_replace_and_remove() {
+        let mut trie = PrefixTrie::new();
+        assert_eq!(None, trie.insert(network("10.1.0.0/16"), 1));
+        assert_eq!(None, trie.insert(network("10.2.0.0/16"), 2));
+        assert_eq!(Some(1), trie.insert(network("10.1.0.0/16"), 3));
+        assert_eq!(2, trie.len());
+        assert_eq!(None, trie.get(&network("10.0.0.0/14")));
+
+        assert_eq!(Some(3), trie.remove(&network("10.1.0.0/16")));
+        assert_eq!(None, trie.remove(&network("10.1.0.0/16")));
+        assert_eq!(None, trie.longest_match(address("10.1.0.1"), |_| true));
+        assert_eq!(Some(&2), trie.get(&network("10.2.0.0/16")));
+        assert_eq!(1, trie.len());
+    }
+
+    #[test]
+    fn test_iteration_is_ordered() {
+        let mut trie = PrefixTrie::new();
+        for repr in ["192.168.1.0/24", "10.0.0.0/8", "10.0.0.0/16", "172.16.0.0/12", "1.2.3.4/32"] {
+            trie.insert(network(repr), ());
+        }
+        let networks: Vec<String> = trie.iter().map(|(network, _)| network.to_string()).collect();
+        assert_eq!(vec!["1.2.3.4/32", "10.0.0.0/8", "10.0.0.0/16", "172.16.0.0/12", "192.168.1.0/24"], networks);
+    }
+}
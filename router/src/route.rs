@@ -138,7 +138,51 @@ impl RouteUdpPacket {
     const SUBNET_BYTES: usize = 4;
     const DISTANCE_BYTES: Range<usize> = 5..9;
 
+    pub const SIZE: usize = 9;
+    /* Largest UDP payload which is not fragmented on Ethernet. */
+    pub const MAX_DATAGRAM_SIZE: usize = 1500 - 20 - 8;
+    pub const MAX_PER_DATAGRAM: usize = Self::MAX_DATAGRAM_SIZE / Self::SIZE;
+
+    /// Splits datagram into route packets, None unless it consists of whole valid packets.
+    ///
+    /// Datagram carries one or more routes back to back, at most `MAX_PER_DATAGRAM` of them.
+    pub fn parse_datagram(datagram: &[u8]) -> Option<impl Iterator<Item=Self> + '_> {
+        if datagram.is_empty() || datagram.len() % Self::SIZE != 0 || datagram.len() > Self::MAX_DATAGRAM_SIZE {
+            return None;
+        }
+        let packets = datagram.chunks_exact(Self::SIZE).map(|chunk| Self(chunk.try_into().unwrap()));
+        if packets.clone().all(|packet| packet.is_valid()) {
+            Some(packets)
+        } else {
+            None
+        }
+    }
+
+    /// Packs routes back to back into as few datagrams as possible, see `parse_datagram`.
+    pub fn datagrams<I: IntoIterator<Item=Route>>(routes: I) -> Vec<Vec<u8>> {
+        let mut datagrams: Vec<Vec<u8>> = Vec::new();
+        for route in routes {
+            match datagrams.last_mut() {
+                Some(datagram) if datagram.len() + Self::SIZE <= Self::MAX_DATAGRAM_SIZE => {
+                    datagram.extend_from_slice(Self::from(&route).as_ref());
+                }
+                _ => datagrams.push(Self::from(&route).as_ref().to_vec()),
+            }
+        }
+        datagrams
+    }
+
+    /// Whether the buffer holds a route, that is whether its subnet mask is within range.
+    pub fn is_valid(&self) -> bool {
+        self.0[Self::SUBNET_BYTES] <= 32
+    }
+
     /// Getter that extracts network from underlying buffer.
+    /// Host bits of the address are cleared, so that every network has one representation.
+    ///
+    /// # Panics
+    ///
+    /// This function panics if the packet is not valid.
     pub fn network(&self) -> Network {
         let address = Ipv4Addr::from(
             u32::from_be_bytes(self.0[Self::ADDRESS_BYTES].try_into().unwrap())
@@ -146,7 +190,7 @@ impl RouteUdpPacket {
         let subnet_mask = SubNetMask::new(
             self.0[Self::SUBNET_BYTES]
         ).unwrap();
-        Network::new(address, subnet_mask)
+        Network::with_prefix_masking(address, subnet_mask)
     }
 
     /// Getter that extracts Distance value from underlying buffer.
@@ -201,4 +245,38 @@ impl From<&Route> for RouteUdpPacket {
 
 
 #[cfg(test)]
-mod tests_route_udp_packet {}
+mod tests_route_udp_packet {
+    use super::{Distance, Network, Route, RouteUdpPacket};
+    use std::net::Ipv4Addr;
+
+    #[test]
+    fn test_datagrams_round_trip() {
+        let routes: Vec<Route> = (0..400u32)
+            .map(|index| {
+                let network = Network::try_from(format!("10.{}.{}.0/24", index / 256, index % 256).as_str()).unwrap();
+                Route::new(network, if index % 7 == 0 { Distance::Infinite } else { Distance::new(index % 50) })
+            })
+            .collect();
+        let datagrams = RouteUdpPacket::datagrams(routes.iter().map(|route| Route::new(route.network, route.distance)));
+        assert_eq!(3, datagrams.len());
+        assert_eq!(RouteUdpPacket::MAX_PER_DATAGRAM * RouteUdpPacket::SIZE, datagrams[0].len());
+        let parsed: Vec<Route> = datagrams
+            .iter()
+            .flat_map(|datagram| RouteUdpPacket::parse_datagram(datagram).unwrap())
+            .map(Route::from)
+            .collect();
+        assert!(parsed == routes);
+    }
+
+    #[test]
+    fn test_parse_datagram_rejects_malformed() {
+        let route = Route::new(Network::new(Ipv4Addr::new(10, 0, 0, 0), super::SubNetMask::new(8).unwrap()), Distance::new(1));
+        let mut datagram = RouteUdpPacket::from(&route).as_ref().to_vec();
+        assert_eq!(1, RouteUdpPacket::parse_datagram(&datagram).unwrap().count());
+        datagram.push(0);
+        assert!(RouteUdpPacket::parse_datagram(&datagram).is_none());
+        datagram.truncate(RouteUdpPacket::SIZE);
+        datagram[4] = 33;
+        assert!(RouteUdpPacket::parse_datagram(&datagram).is_none());
+    }
+}
@@ -1,80 +1,146 @@
+use std::collections::HashSet;
 use std::fmt::{Display, Formatter};
-use std::io::{ErrorKind};
+use std::io::{self, ErrorKind};
+use std::mem;
 use std::net::{IpAddr, Ipv4Addr, SocketAddrV4, UdpSocket};
-use std::time::Duration;
-use std::thread;
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::time::{Duration, Instant};
 use std::str::FromStr;
 
-use crate::route::Network;
-use crate::routing_table::{Route, RouteUdpPacket, RoutingTable, RoutingTableEntry};
+use crate::epoll::Epoll;
+use crate::route::{Distance, Network};
+use crate::routing_table::{ConnectionType, Route, RouteUdpPacket, RoutingTable, RoutingTableEntry};
 
 
-#[allow(unused_macros)]
-macro_rules! syscall {
-    ($fn: ident ( $($arg: expr),* $(,)* ) ) => {{
-        let res = unsafe { libc::$fn($($arg, )*) };
-        if res == -1 {
-            Err(std::io::Error::last_os_error())
-        } else {
-            Ok(res)
-        }
-    }};
+const RIP_PORT_NUMBER: u16 = 54321;
+
+/// Binds nonblocking UDP socket with SO_REUSEADDR, so that sockets of particular addresses
+/// may share the port with the socket of the wildcard address.
+fn bind_udp_socket(address: SocketAddrV4) -> io::Result<UdpSocket> {
+    let fd = syscall!(socket(libc::AF_INET, libc::SOCK_DGRAM | libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC, 0))?;
+    /* Socket owns the descriptor from now on, so that it is closed on every error below. */
+    let socket = unsafe { UdpSocket::from_raw_fd(fd) };
+    let enable: libc::c_int = 1;
+    syscall!(setsockopt(
+        fd,
+        libc::SOL_SOCKET,
+        libc::SO_REUSEADDR,
+        &enable as *const libc::c_int as *const libc::c_void,
+        mem::size_of::<libc::c_int>() as libc::socklen_t,
+    ))?;
+    let sockaddr = libc::sockaddr_in {
+        sin_family: libc::AF_INET as libc::sa_family_t,
+        sin_port: address.port().to_be(),
+        sin_addr: libc::in_addr { s_addr: u32::from(*address.ip()).to_be() },
+        sin_zero: [0; 8],
+    };
+    syscall!(bind(
+        fd,
+        &sockaddr as *const libc::sockaddr_in as *const libc::sockaddr,
+        mem::size_of::<libc::sockaddr_in>() as libc::socklen_t,
+    ))?;
+    Ok(socket)
 }
 
-const RIP_PORT_NUMBER: u16 = 54321;
+/// Receives route packets from the socket until it would block.
+fn receive_route_packets(socket: &UdpSocket, packets: &mut Vec<(RouteUdpPacket, Ipv4Addr)>) {
+    /* One byte more than a datagram, so that longer datagrams are recognized and dropped. */
+    let mut buffer = [0u8; RouteUdpPacket::MAX_DATAGRAM_SIZE + 1];
+    loop {
+        match socket.recv_from(&mut buffer) {
+            Ok((length, sender)) => {
+                let route_packets = RouteUdpPacket::parse_datagram(&buffer[..length]);
+                if let (IpAddr::V4(address), Some(route_packets)) = (sender.ip(), route_packets) {
+                    packets.extend(route_packets.map(|packet| (packet, address)));
+                }
+            }
+            Err(err) if err.kind() == ErrorKind::Interrupted => {}
+            /* Would block, or ICMP error of an earlier broadcast, neither leaves anything to read. */
+            Err(_) => break,
+        }
+    }
+}
 
 pub struct Nic {
     socket: UdpSocket,
     ip_address: Ipv4Addr,
+    /* Directly connected network together with its distance. */
+    network: Network,
+    distance: Distance,
+    is_up: bool,
 }
 
 impl Nic {
-    pub fn new(ip_address: Ipv4Addr) -> Self {
+    pub fn new(ip_address: Ipv4Addr, network: Network, distance: Distance) -> Self {
         let socket_address = SocketAddrV4::new(ip_address, RIP_PORT_NUMBER);
-        let socket = UdpSocket::bind(socket_address).unwrap();
-        // socket.set_nonblocking(true).unwrap();
+        let socket = bind_udp_socket(socket_address).unwrap();
         socket.set_broadcast(true).unwrap();
-        Self { socket, ip_address }
+        Self { socket, ip_address, network, distance, is_up: true }
     }
 
-    pub fn broadcast(&self, dest_net: &Network, packet: &[u8]) {
-        match self.socket.send_to(packet, SocketAddrV4::new(dest_net.broadcast_address(), RIP_PORT_NUMBER)) {
-            Ok(_) => {  }
-            Err(err) if err.kind() == ErrorKind::WouldBlock => {  }
-            other_err => { panic!("{:?}", other_err) }
+    /* Messages passed to a single sendmmsg call, as limited by the kernel. */
+    const MAX_MESSAGES_PER_CALL: usize = 1024;
+
+    /// Broadcasts datagrams to the network with as few sendmmsg calls as possible.
+    pub fn broadcast(&self, datagrams: &[Vec<u8>]) -> io::Result<()> {
+        let destination = libc::sockaddr_in {
+            sin_family: libc::AF_INET as libc::sa_family_t,
+            sin_port: RIP_PORT_NUMBER.to_be(),
+            sin_addr: libc::in_addr { s_addr: u32::from(self.network.broadcast_address()).to_be() },
+            sin_zero: [0; 8],
         };
+        let mut iovecs: Vec<libc::iovec> = datagrams
+            .iter()
+            .map(|datagram| libc::iovec { iov_base: datagram.as_ptr() as *mut libc::c_void, iov_len: datagram.len() })
+            .collect();
+        let mut messages: Vec<libc::mmsghdr> = iovecs
+            .iter_mut()
+            .map(|iovec| {
+                let mut message: libc::mmsghdr = unsafe { mem::zeroed() };
+                message.msg_hdr.msg_name = &destination as *const libc::sockaddr_in as *mut libc::c_void;
+                message.msg_hdr.msg_namelen = mem::size_of::<libc::sockaddr_in>() as libc::socklen_t;
+                message.msg_hdr.msg_iov = iovec;
+                message.msg_hdr.msg_iovlen = 1;
+                message
+            })
+            .collect();
+        let mut sent = 0;
+        while sent < messages.len() {
+            let count = (messages.len() - sent).min(Self::MAX_MESSAGES_PER_CALL);
+            match syscall!(sendmmsg(self.socket.as_raw_fd(), messages[sent..].as_mut_ptr(), count as libc::c_uint, 0)) {
+                Ok(count) => sent += count as usize,
+                /* Buffer full, routes will be sent again in the next turn. */
+                Err(err) if err.kind() == ErrorKind::WouldBlock => return Ok(()),
+                Err(err) if err.kind() == ErrorKind::Interrupted => {}
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(())
     }
 
-    /// Note: Socket should be set to non blocking mode so this call does not hang.
-    pub fn collect_route_packets_packets(&mut self) -> Vec<(RouteUdpPacket, Ipv4Addr)> {
-        let mut packets = Vec::new();
-        loop {
-            let mut udp_packet = RouteUdpPacket::default();
-            let (bytes_received, sender) = self.socket.recv_from(udp_packet.as_mut()).unwrap();
-            if bytes_received > 0 {
-                if let IpAddr::V4(address) = sender.ip() {
-                    packets.push((udp_packet, address));
-                } else {
-                    panic!("invalid ip address type")
-                }
-            } else {
-                break
-            }
+    /// Distance advertised to neighbours of this network, split horizon with poisoned reverse:
+    /// routes learned from a neighbour of the network are advertised back as unreachable,
+    /// so that two routers never count to infinity over each other.
+    fn advertised_distance(&self, entry: &RoutingTableEntry) -> Distance {
+        match entry.connection_type() {
+            ConnectionType::Via(router_ip) if self.network.contains(router_ip) => Distance::Infinite,
+            _ => entry.distance(),
         }
-        packets
     }
 }
 
 impl TryFrom<&str> for Nic {
     type Error = <Ipv4Addr as FromStr>::Err;
 
+    /// Expected input format is the one of direct connections, `<ipv4 address>/<mask> distance <distance>`.
     fn try_from(value: &str) -> Result<Self, Self::Error> {
-        let address_repr = value
-            .split_whitespace()
-            .next().expect("missing network")
+        let mut data_iter = value.split_whitespace();
+        let network_repr = data_iter.next().expect("missing network");
+        let address_repr = network_repr
             .split("/")
             .next().expect("incorrect representation");
-        Ok(Self::new(Ipv4Addr::from_str(dbg!(address_repr))?))
+        let route = Route::try_from(value).expect("incorrect representation");
+        Ok(Self::new(Ipv4Addr::from_str(address_repr)?, *route.network(), *route.distance()))
     }
 }
 
@@ -84,40 +150,164 @@ impl Display for Nic {
     }
 }
 
+/// What is advertised in turns.
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum UpdateMode {
+    /// Whole routing table every turn.
+    Full,
+    /// Routes changed since the previous turn, whole routing table every `Router::FULL_SYNC_TURNS` turns.
+    /// Routes are expired as many times slower, so all routers of the network have to run in this mode.
+    Delta,
+}
+
+/// Router running RIP driven by epoll over the sockets of its interfaces.
+///
+/// Routing table is broadcast on every interface once per turn. Changes of distances are
+/// broadcast right away as triggered updates, at most once per `TRIGGERED_UPDATE_DELAY`,
+/// so that the news of a failure spreads in fractions of a second instead of turns.
 pub struct Router {
     network_interfaces: Vec<Nic>,
+    /* Broadcasts are delivered only to sockets of the wildcard address. */
+    broadcast_socket: UdpSocket,
     routing_table: RoutingTable,
+    update_mode: UpdateMode,
+    turn: usize,
+    /* Networks changed since the previous turn, advertised again by turns of the delta mode. */
+    changed_since_turn: HashSet<Network>,
 }
 
 impl Router {
-    const RIP_TURN_WAIT_DURATION: Duration = Duration::from_secs(30);
+    const RIP_TURN_WAIT_DURATION: Duration = Duration::from_secs(10);
+    /* Changes arriving in a burst are sent together. */
+    const TRIGGERED_UPDATE_DELAY: Duration = Duration::from_millis(100);
+    const BROADCAST_SOCKET_TOKEN: u64 = u64::MAX;
+    pub const FULL_SYNC_TURNS: usize = 6;
 
     pub fn new(network_interfaces: Vec<Nic>, routing_table: RoutingTable) -> Self {
-        Self { network_interfaces, routing_table }
+        let broadcast_socket = bind_udp_socket(SocketAddrV4::new(Ipv4Addr::UNSPECIFIED, RIP_PORT_NUMBER)).unwrap();
+        Self {
+            network_interfaces,
+            broadcast_socket,
+            routing_table,
+            update_mode: UpdateMode::Full,
+            turn: 0,
+            changed_since_turn: HashSet::new(),
+        }
+    }
+
+    pub fn set_update_mode(&mut self, update_mode: UpdateMode) {
+        self.update_mode = update_mode;
+    }
+
+    /// Runs the router forever, routing table is printed after every turn.
+    pub fn run(&mut self) -> io::Result<()> {
+        let mut epoll = Epoll::new()?;
+        epoll.register(self.broadcast_socket.as_raw_fd(), Self::BROADCAST_SOCKET_TOKEN)?;
+        for (index, nic) in self.network_interfaces.iter().enumerate() {
+            epoll.register(nic.socket.as_raw_fd(), index as u64)?;
+        }
+        let mut ready = Vec::new();
+        let mut packets = Vec::new();
+        let mut next_turn_at = Instant::now();
+        let mut next_triggered_update_at = Instant::now();
+        loop {
+            let now = Instant::now();
+            if now >= next_turn_at {
+                self.execute_rip_turn();
+                println!("{self}\n");
+                next_turn_at = now + Self::RIP_TURN_WAIT_DURATION;
+            }
+            if self.routing_table.has_changes() && now >= next_triggered_update_at {
+                self.broadcast_changes();
+                next_triggered_update_at = now + Self::TRIGGERED_UPDATE_DELAY;
+            }
+
+            let wake_up_at = if self.routing_table.has_changes() {
+                next_turn_at.min(next_triggered_update_at)
+            } else {
+                next_turn_at
+            };
+            ready.clear();
+            epoll.wait(wake_up_at.saturating_duration_since(Instant::now()), &mut ready)?;
+            for &token in &ready {
+                let socket = match token {
+                    Self::BROADCAST_SOCKET_TOKEN => &self.broadcast_socket,
+                    index => &self.network_interfaces[index as usize].socket,
+                };
+                receive_route_packets(socket, &mut packets);
+            }
+            for (packet, sender) in packets.drain(..) {
+                self.handle_route_packet(packet, sender);
+            }
+        }
     }
 
+    fn handle_route_packet(&mut self, packet: RouteUdpPacket, sender: Ipv4Addr) {
+        /* Own broadcasts come back through the wildcard socket. */
+        if self.network_interfaces.iter().any(|nic| nic.ip_address == sender) {
+            return;
+        }
+        /* Of interfaces whose networks overlap, the sender is a neighbour on the most specific one. */
+        let link = self.network_interfaces.iter()
+            .filter(|nic| nic.is_up && nic.network.contains(sender))
+            .max_by_key(|nic| nic.network.subnet_mask().value());
+        if let Some(link) = link {
+            let (network, distance) = packet.into();
+            let link_distance = link.distance;
+            self.routing_table.update(network, distance, sender, link_distance);
+        }
+    }
+
+    /// Expires stale routes and broadcasts the routing table, or its changes in turns of the delta mode.
+    /// Interface whose broadcast fails is down, its network and routes through it
+    /// become unreachable until a broadcast succeeds again.
     pub fn execute_rip_turn(&mut self) {
-        self.broadcast_routes();
-        thread::sleep(Router::RIP_TURN_WAIT_DURATION);
-        for nic in &mut self.network_interfaces {
-            let packets = nic.collect_route_packets_packets();
-            for (packet, sender) in packets {
-                let (network, distance) = packet.into();
-                self.routing_table.update(network, distance, sender);
+        let is_full_sync = self.update_mode == UpdateMode::Full || self.turn % Self::FULL_SYNC_TURNS == 0;
+        self.turn += 1;
+        let turns_per_refresh = match self.update_mode {
+            UpdateMode::Full => 1,
+            UpdateMode::Delta => Self::FULL_SYNC_TURNS,
+        };
+        self.routing_table.expire_stale_routes(turns_per_refresh);
+        /* Turn advertises the changes, there is nothing left for triggered updates. */
+        let changes = self.routing_table.take_changes();
+        let entries: Vec<RoutingTableEntry> = if is_full_sync {
+            self.routing_table.routing_entries().collect()
+        } else {
+            self.changed_since_turn.extend(changes.iter().map(|entry| entry.network()));
+            self.changed_since_turn.iter().filter_map(|network| self.routing_table.get(network)).collect()
+        };
+        self.changed_since_turn.clear();
+        /* Nothing is sent in quiet turns of the delta mode, so they tell nothing about the interfaces. */
+        if entries.is_empty() {
+            return;
+        }
+        for index in 0..self.network_interfaces.len() {
+            let is_up = self.advertise(&self.network_interfaces[index], &entries).is_ok();
+            let nic = &mut self.network_interfaces[index];
+            if is_up {
+                self.routing_table.connect(nic.network, nic.distance);
+            } else if nic.is_up {
+                self.routing_table.disconnect(nic.network);
             }
+            nic.is_up = is_up;
         }
     }
 
-    fn broadcast_routes(&self) {
-        for nic in &self.network_interfaces {
-            self.routing_table.entries().for_each(move |route| {
-                nic.broadcast(
-                    route.network(),
-                    RouteUdpPacket::from(&route).as_ref()
-                );
-            })
+    fn broadcast_changes(&mut self) {
+        let changes = self.routing_table.take_changes();
+        self.changed_since_turn.extend(changes.iter().map(|entry| entry.network()));
+        for nic in self.network_interfaces.iter().filter(|nic| nic.is_up) {
+            /* Failures are handled by the next turn. */
+            let _ = self.advertise(nic, &changes);
         }
     }
+
+    /// Broadcasts entries packed into datagrams, distances are advertised as the interface sees them.
+    fn advertise(&self, nic: &Nic, entries: &[RoutingTableEntry]) -> io::Result<()> {
+        let routes = entries.iter().map(|entry| Route::new(entry.network(), nic.advertised_distance(entry)));
+        nic.broadcast(&RouteUdpPacket::datagrams(routes))
+    }
 }
 
 impl From<&str> for Router {
@@ -141,3 +331,65 @@ impl Display for Router {
         write!(f, "{}", self.routing_table)
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::net::Ipv4Addr;
+    use std::str::FromStr;
+
+    use super::{Nic, Router, UpdateMode};
+    use crate::route::{Distance, Network};
+    use crate::routing_table::{ConnectionType, Route, RouteUdpPacket, RoutingTable, RoutingTableEntry};
+
+    #[test]
+    fn test_split_horizon_with_poisoned_reverse() {
+        let nic = Nic::try_from("127.0.0.1/8 distance 1").unwrap();
+        let network = Network::try_from("172.16.0.0/16").unwrap();
+        let learned_here = RoutingTableEntry::new(network, Distance::new(3), ConnectionType::Via(Ipv4Addr::from_str("127.0.0.2").unwrap()));
+        let learned_elsewhere = RoutingTableEntry::new(network, Distance::new(3), ConnectionType::Via(Ipv4Addr::from_str("10.0.0.2").unwrap()));
+        let direct = RoutingTableEntry::new(Network::try_from("127.0.0.0/8").unwrap(), Distance::new(1), ConnectionType::Direct);
+        assert_eq!(Distance::Infinite, nic.advertised_distance(&learned_here));
+        assert_eq!(Distance::new(3), nic.advertised_distance(&learned_elsewhere));
+        assert_eq!(Distance::new(1), nic.advertised_distance(&direct));
+    }
+
+    #[test]
+    fn test_route_packets_are_taken_from_neighbours_on_most_specific_interface() {
+        let address = |repr: &str| Ipv4Addr::from_str(repr).unwrap();
+        let network = |repr: &str| Network::try_from(repr).unwrap();
+        let packet = |repr: &str, distance: u32| RouteUdpPacket::from(&Route::new(network(repr), Distance::new(distance)));
+        let nics = vec![
+            Nic::try_from("127.0.0.1/8 distance 1").unwrap(),
+            Nic::try_from("127.1.0.1/16 distance 3").unwrap(),
+        ];
+        let direct_connections = nics.iter().map(|nic| Route::new(nic.network, nic.distance)).collect();
+        let mut router = Router::new(nics, RoutingTable::new(direct_connections));
+        /* Route learned through a neighbour covers senders of the directly connected 127.0.0.0/8 as well. */
+        router.handle_route_packet(packet("127.2.0.0/16", 1), address("127.0.0.2"));
+        router.handle_route_packet(packet("172.16.0.0/16", 2), address("127.2.0.5"));
+        router.handle_route_packet(packet("172.17.0.0/16", 2), address("127.1.0.5"));
+
+        let route = |repr: &str| {
+            let entry = router.routing_table.lookup(address(repr)).unwrap();
+            (entry.distance(), entry.connection_type())
+        };
+        assert_eq!((Distance::new(2), ConnectionType::Via(address("127.0.0.2"))), route("127.2.0.1"));
+        assert_eq!((Distance::new(3), ConnectionType::Via(address("127.2.0.5"))), route("172.16.0.1"));
+        assert_eq!((Distance::new(5), ConnectionType::Via(address("127.1.0.5"))), route("172.17.0.1"));
+    }
+
+    #[test]
+    fn test_quiet_delta_turn_keeps_interface_down() {
+        let mut router = Router::from("1\n127.0.0.1/8 distance 1\n");
+        router.set_update_mode(UpdateMode::Delta);
+        let network = Network::try_from("127.0.0.0/8").unwrap();
+        router.network_interfaces[0].is_up = false;
+        router.routing_table.disconnect(network);
+        router.routing_table.take_changes();
+        /* Turn between full syncs, nothing has changed since the previous one. */
+        router.turn = 1;
+        router.execute_rip_turn();
+        assert!(!router.network_interfaces[0].is_up);
+        assert_eq!(Some(Distance::Infinite), router.routing_table.get(&network).map(|entry| entry.distance()));
+    }
+}
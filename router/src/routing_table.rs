@@ -1,5 +1,4 @@
 use std::collections::{HashMap, HashSet};
-use std::collections::hash_map::Entry;
 use std::fmt::{Display, Formatter};
 use std::fs::File;
 use std::hash::Hash;
@@ -11,6 +10,7 @@ pub use crate::route::{Route, Distance, Network, RouteUdpPacket, SubNetMask};
 use crate::route::ParseRouteError;
 use crate::network::ParseNetworkError;
 use crate::distance::ParseDistanceError;
+use crate::prefix_trie::PrefixTrie;
 use crate::routing_table::ConnectionType::Via;
 
 /// Possible network connection types.
@@ -35,7 +35,7 @@ impl Display for ConnectionType {
     }
 }
 
-#[derive(Debug)]
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
 pub struct RoutingTableEntry {
     network: Network,
     distance: Distance,
@@ -50,6 +50,18 @@ impl RoutingTableEntry {
             connection_type,
         }
     }
+
+    pub fn network(&self) -> Network {
+        self.network
+    }
+
+    pub fn distance(&self) -> Distance {
+        self.distance
+    }
+
+    pub fn connection_type(&self) -> ConnectionType {
+        self.connection_type
+    }
 }
 
 #[derive(Debug)]
@@ -133,11 +145,28 @@ impl TryFrom<&str> for DirectConnectionEntry {
 //     }
 // }
 
+/// Number of turns every indirect route went without being confirmed by its next hop.
 #[derive(Debug, Default)]
 struct ConnectionErrorRegistry(HashMap<Network, u8>);
 
 impl ConnectionErrorRegistry {
+    /* Route is unreachable after that many turns without confirmation and forgotten after twice as many. */
     const MAX_STALL_TURNS: usize = 3;
+
+    fn refresh(&mut self, network: Network) {
+        self.0.remove(&network);
+    }
+
+    /// Counts another turn without confirmation of the route, returns the number of such turns.
+    fn stall(&mut self, network: Network) -> usize {
+        let stalled_turns = self.0.entry(network).or_insert(0);
+        *stalled_turns = stalled_turns.saturating_add(1);
+        *stalled_turns as usize
+    }
+
+    fn forget(&mut self, network: &Network) {
+        self.0.remove(network);
+    }
 }
 
 /*
@@ -153,9 +182,9 @@ matching the one contained in the rule, should be routed using the route
 associated with said rule that contains the ip address of the router that
 the packet should be forwarded to.
 
-By the grace of God we can assume that all networks are in address disjoint.
-That is there is only one possible match and we don't need to bother
-with the usual routing rule hierarchy.
+Networks may overlap, e.g. a default route 0.0.0.0/0 next to more specific ones,
+so the rule of the longest prefix containing the address wins. Entries are kept
+in a prefix trie which finds it in a bounded number of steps.
 
 ////
 
@@ -191,17 +220,21 @@ There is an immense terminological chaos on the internet when it comes to this t
 /// Manager for the collection of Routing Rules.
 /// Routing table updates routing table entries using the Distance Vector Routing method.
 /// It detects and handles stale connections.
+///
+/// Networks whose distance or next hop changed are remembered until they are taken with `take_changes`,
+/// so that they can be advertised right away instead of waiting for the next turn.
 #[derive(Debug, Default)]
 pub struct RoutingTable {
-    entries: HashMap<Network, (Distance, ConnectionType)>,
+    entries: PrefixTrie<(Distance, ConnectionType)>,
     connection_error_registry: ConnectionErrorRegistry,
+    changes: HashSet<Network>,
 }
 
 /*
 tura:
 1. Wysłać
-2. Spi 30 s
-3. sprawdza otrzymane pakiety
+2. Czeka na pakiety i zmiany do końca tury, zmiany wysyła od razu
+3. Przedawnia niepotwierdzone trasy
 Powtarza
 */
 
@@ -215,13 +248,11 @@ impl RoutingTable {
         direct_connections: Vec<Route>,
     ) -> Self
     {
-        let entries = HashMap::from_iter(
-            direct_connections.into_iter()
-                .map(|route| {
-                    let Route { network, distance } = route;
-                    (network, (distance, ConnectionType::Direct))
-                })
-        );
+        let mut entries = PrefixTrie::new();
+        for route in direct_connections {
+            let Route { network, distance } = route;
+            entries.insert(network, (distance, ConnectionType::Direct));
+        }
         Self { entries, ..Self::default() }
     }
 
@@ -254,35 +285,123 @@ impl RoutingTable {
         }
     }
 
-    /// Result if no entry for specified network.
-    pub fn update(&mut self, network: Network, distance: Distance, sender: Ipv4Addr) {
-        match self.entries.entry(network) {
-            Entry::Occupied(mut entry) => {
-                let &mut (old_distance, connection_type) = entry.get_mut();
-                match connection_type {
-                    ConnectionType::Direct => { panic!("distance to directly connected network must not change") }
-                    ConnectionType::Via(router_ip) => {
-                        if router_ip == sender { /* Whatever the distance update */
-                            entry.insert((distance, connection_type));
-                        } else {
-                            if distance < old_distance {
-                                entry.insert((distance, ConnectionType::Via(sender)));
-                            }
-                        }
-                    }
+    fn set(&mut self, network: Network, distance: Distance, connection_type: ConnectionType) {
+        if self.entries.insert(network, (distance, connection_type)) != Some((distance, connection_type)) {
+            self.changes.insert(network);
+        }
+    }
+
+    /// Applies the route to `network` of length `distance` advertised by neighbour `sender`,
+    /// which is reached over a directly connected network of length `link_distance`.
+    pub fn update(&mut self, network: Network, distance: Distance, sender: Ipv4Addr, link_distance: Distance) {
+        let distance = distance + link_distance;
+        match self.entries.get(&network).copied() {
+            Some((old_distance, ConnectionType::Direct)) => {
+                /* Directly connected network is reached around only while its link is down. */
+                if old_distance == Distance::Infinite && distance != Distance::Infinite {
+                    self.connection_error_registry.refresh(network);
+                    self.set(network, distance, ConnectionType::Via(sender));
+                }
+            }
+            Some((_, ConnectionType::Via(router_ip))) if router_ip == sender => {
+                /* Whatever the distance update, the next hop knows best. Unreachable routes are not confirmed,
+                so that they are forgotten eventually. */
+                if distance != Distance::Infinite {
+                    self.connection_error_registry.refresh(network);
                 }
+                self.set(network, distance, ConnectionType::Via(sender));
             }
-            Entry::Vacant(mut entry) => {
-                entry.insert((distance, ConnectionType::Via(sender)));
+            Some((old_distance, ConnectionType::Via(_))) => {
+                if distance < old_distance {
+                    self.connection_error_registry.refresh(network);
+                    self.set(network, distance, ConnectionType::Via(sender));
+                }
+            }
+            None => {
+                if distance != Distance::Infinite {
+                    self.connection_error_registry.refresh(network);
+                    self.set(network, distance, ConnectionType::Via(sender));
+                }
             }
         }
     }
 
+    /// Marks directly connected network as reachable over its link again.
+    pub fn connect(&mut self, network: Network, distance: Distance) {
+        self.connection_error_registry.forget(&network);
+        self.set(network, distance, ConnectionType::Direct);
+    }
+
+    /// Marks directly connected network as unreachable, together with every route whose next hop is in it.
+    pub fn disconnect(&mut self, network: Network) {
+        let unreachable: Vec<(Network, ConnectionType)> = self.entries
+            .iter()
+            .filter(|(other, &(distance, connection_type))| distance != Distance::Infinite && match connection_type {
+                ConnectionType::Direct => *other == network,
+                ConnectionType::Via(router_ip) => network.contains(router_ip),
+            })
+            .map(|(other, &(_, connection_type))| (other, connection_type))
+            .collect();
+        for (network, connection_type) in unreachable {
+            self.set(network, Distance::Infinite, connection_type);
+        }
+    }
+
+    /// Ends a turn, indirect routes not confirmed for `MAX_STALL_TURNS` refreshes become unreachable
+    /// and are removed once they have been advertised as unreachable for as long.
+    /// Neighbours refresh routes every `turns_per_refresh` turns.
+    pub fn expire_stale_routes(&mut self, turns_per_refresh: usize) {
+        let max_stall_turns = ConnectionErrorRegistry::MAX_STALL_TURNS * turns_per_refresh;
+        let indirect: Vec<(Network, Distance, ConnectionType)> = self.entries
+            .iter()
+            .filter(|(_, &(_, connection_type))| connection_type != ConnectionType::Direct)
+            .map(|(network, &(distance, connection_type))| (network, distance, connection_type))
+            .collect();
+        for (network, distance, connection_type) in indirect {
+            let stalled_turns = self.connection_error_registry.stall(network);
+            if stalled_turns > 2 * max_stall_turns {
+                self.entries.remove(&network);
+                self.connection_error_registry.forget(&network);
+                self.changes.remove(&network);
+            } else if stalled_turns > max_stall_turns && distance != Distance::Infinite {
+                self.set(network, Distance::Infinite, connection_type);
+            }
+        }
+    }
+
+    pub fn get(&self, network: &Network) -> Option<RoutingTableEntry> {
+        self.entries
+            .get(network)
+            .map(|&(distance, connection_type)| RoutingTableEntry::new(*network, distance, connection_type))
+    }
+
+    pub fn has_changes(&self) -> bool {
+        !self.changes.is_empty()
+    }
+
+    /// Entries changed since the last call, in no particular order.
+    pub fn take_changes(&mut self) -> Vec<RoutingTableEntry> {
+        let changes: Vec<Network> = self.changes.drain().collect();
+        changes.iter().filter_map(|network| self.get(network)).collect()
+    }
+
+    pub fn routing_entries(&self) -> impl Iterator<Item=RoutingTableEntry> + '_ {
+        self.entries
+            .iter()
+            .map(|(network, &(distance, connection_type))| RoutingTableEntry::new(network, distance, connection_type))
+    }
+
+    /// Forwarding decision for `address`: the reachable entry with the longest prefix containing it.
+    /// Packets are forwarded by the kernel, the router only maintains the table, so only tests look routes up.
+    #[cfg(test)]
+    pub fn lookup(&self, address: Ipv4Addr) -> Option<RoutingTableEntry> {
+        self.entries
+            .longest_match(address, |&(distance, _)| distance != Distance::Infinite)
+            .map(|(network, &(distance, connection_type))| RoutingTableEntry::new(network, distance, connection_type))
+    }
+
     pub fn entries(&self) -> impl Iterator<Item=Route> + '_ {
-        self.entries.iter().map(|entry| {
-            let (&network, &(distance, _)) = entry.clone();
-            Route::new(network, distance)
-        })
+        self.entries.iter().map(|(network, &(distance, _))| Route::new(network, distance))
     }
 }
 
@@ -307,9 +426,111 @@ impl Display for RoutingTable {
 
 #[cfg(test)]
 mod tests {
-    use super::RoutingTable;
+    use super::{ConnectionType, Distance, Network, Route, RoutingTable};
 
-    use std::env;
-    use std::fs::File;
+    use std::net::Ipv4Addr;
+    use std::str::FromStr;
 
+    fn network(repr: &str) -> Network {
+        Network::try_from(repr).unwrap()
+    }
+
+    #[test]
+    fn test_lookup_prefers_longest_reachable_prefix() {
+        let mut table = RoutingTable::new(vec![Route::new(network("10.0.0.0/8"), Distance::new(1))]);
+        let router = Ipv4Addr::from_str("10.0.0.2").unwrap();
+        table.update(network("0.0.0.0/0"), Distance::new(5), router, Distance::new(1));
+        table.update(network("10.1.0.0/16"), Distance::new(2), router, Distance::new(1));
+
+        let next_hop = |table: &RoutingTable, repr: &str| {
+            table.lookup(Ipv4Addr::from_str(repr).unwrap()).map(|entry| entry.connection_type())
+        };
+        assert_eq!(Some(ConnectionType::Via(router)), next_hop(&table, "10.1.2.3"));
+        assert_eq!(Some(ConnectionType::Direct), next_hop(&table, "10.2.0.1"));
+        assert_eq!(Some(ConnectionType::Via(router)), next_hop(&table, "8.8.8.8"));
+        let entry = table.lookup(Ipv4Addr::from_str("10.1.2.3").unwrap()).unwrap();
+        assert_eq!((network("10.1.0.0/16"), Distance::new(3)), (entry.network(), entry.distance()));
+
+        table.update(network("10.1.0.0/16"), Distance::Infinite, router, Distance::new(1));
+        assert_eq!(Some(ConnectionType::Direct), next_hop(&table, "10.1.2.3"));
+    }
+
+    #[test]
+    fn test_update_adds_link_distance_and_prefers_shorter_paths() {
+        let mut table = RoutingTable::new(vec![Route::new(network("10.0.0.0/8"), Distance::new(2))]);
+        let (first, second) = (Ipv4Addr::from_str("10.0.0.2").unwrap(), Ipv4Addr::from_str("10.0.0.3").unwrap());
+        let target = network("172.16.0.0/16");
+        table.update(target, Distance::new(5), first, Distance::new(2));
+        assert_eq!(Some(Distance::new(7)), table.get(&target).map(|entry| entry.distance()));
+        table.update(target, Distance::new(6), second, Distance::new(2));
+        assert_eq!(Some(ConnectionType::Via(first)), table.get(&target).map(|entry| entry.connection_type()));
+        table.update(target, Distance::new(1), second, Distance::new(2));
+        assert_eq!(Some(ConnectionType::Via(second)), table.get(&target).map(|entry| entry.connection_type()));
+
+        /* Directly connected network is not replaced while its link is up. */
+        table.update(network("10.0.0.0/8"), Distance::new(0), first, Distance::new(1));
+        assert_eq!(Some(ConnectionType::Direct), table.get(&network("10.0.0.0/8")).map(|entry| entry.connection_type()));
+        let mut changes: Vec<String> = table.take_changes().iter().map(|entry| entry.network().to_string()).collect();
+        changes.sort();
+        assert_eq!(vec!["172.16.0.0/16"], changes);
+        assert!(!table.has_changes());
+    }
+
+    #[test]
+    fn test_stale_routes_expire() {
+        let mut table = RoutingTable::new(vec![Route::new(network("10.0.0.0/8"), Distance::new(1))]);
+        let router = Ipv4Addr::from_str("10.0.0.2").unwrap();
+        let target = network("172.16.0.0/16");
+        table.update(target, Distance::new(1), router, Distance::new(1));
+        table.take_changes();
+        for _ in 0..3 {
+            table.expire_stale_routes(1);
+        }
+        assert_eq!(Some(Distance::new(2)), table.get(&target).map(|entry| entry.distance()));
+        table.expire_stale_routes(1);
+        assert_eq!(Some(Distance::Infinite), table.get(&target).map(|entry| entry.distance()));
+        assert!(table.has_changes());
+        for _ in 0..3 {
+            table.expire_stale_routes(1);
+        }
+        assert!(table.get(&target).is_none());
+        assert!(table.get(&network("10.0.0.0/8")).is_some());
+    }
+
+    #[test]
+    fn test_stale_routes_expire_slower_with_rare_refreshes() {
+        let mut table = RoutingTable::new(vec![Route::new(network("10.0.0.0/8"), Distance::new(1))]);
+        let router = Ipv4Addr::from_str("10.0.0.2").unwrap();
+        let target = network("172.16.0.0/16");
+        table.update(target, Distance::new(1), router, Distance::new(1));
+        for _ in 0..6 {
+            table.expire_stale_routes(2);
+        }
+        assert_eq!(Some(Distance::new(2)), table.get(&target).map(|entry| entry.distance()));
+        table.expire_stale_routes(2);
+        assert_eq!(Some(Distance::Infinite), table.get(&target).map(|entry| entry.distance()));
+    }
+
+    #[test]
+    fn test_disconnect_makes_routes_through_link_unreachable() {
+        let mut table = RoutingTable::new(vec![
+            Route::new(network("10.0.0.0/8"), Distance::new(1)),
+            Route::new(network("192.168.0.0/24"), Distance::new(1)),
+        ]);
+        let behind_link = Ipv4Addr::from_str("10.0.0.2").unwrap();
+        let elsewhere = Ipv4Addr::from_str("192.168.0.2").unwrap();
+        table.update(network("172.16.0.0/16"), Distance::new(1), behind_link, Distance::new(1));
+        table.update(network("172.17.0.0/16"), Distance::new(1), elsewhere, Distance::new(1));
+        table.disconnect(network("10.0.0.0/8"));
+        let distance = |table: &RoutingTable, repr: &str| table.get(&network(repr)).map(|entry| entry.distance());
+        assert_eq!(Some(Distance::Infinite), distance(&table, "10.0.0.0/8"));
+        assert_eq!(Some(Distance::Infinite), distance(&table, "172.16.0.0/16"));
+        assert_eq!(Some(Distance::new(2)), distance(&table, "172.17.0.0/16"));
+
+        /* Network is reached around while its link is down, until it is connected again. */
+        table.update(network("10.0.0.0/8"), Distance::new(3), elsewhere, Distance::new(1));
+        assert_eq!(Some(Distance::new(4)), distance(&table, "10.0.0.0/8"));
+        table.connect(network("10.0.0.0/8"), Distance::new(1));
+        assert_eq!(Some(ConnectionType::Direct), table.get(&network("10.0.0.0/8")).map(|entry| entry.connection_type()));
+    }
 }
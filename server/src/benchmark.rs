@@ -0,0 +1,369 @@
+//! Mikołaj Depta 328690
+//!
+//! This module holds the load test of the HTTP server.
+//! Server runs on a thread of the test process and serves the `localhost` domain of the crate,
+//! clients on other threads request a mix of small and large resources over keep-alive and one-shot connections.
+//! It reports requests and bytes per second, latency percentiles and heap allocations of the server per request.
+//!
+//! It is run with `cargo test --release -- --ignored --nocapture --test-threads 1 benchmark`.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+use std::io::{self, Read, Write};
+use std::net::{Ipv4Addr, SocketAddr, TcpStream};
+use std::path::Path;
+use std::rc::Rc;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::server::{bind_listener, HttpServer, RequestHandler};
+
+
+// region Allocation counting
+/// Allocator which counts allocations made by threads that opted in, so that clients do not distort the count.
+struct CountingAllocator;
+
+static ALLOCATION_COUNT: AtomicU64 = AtomicU64::new(0);
+
+thread_local! {
+    static IS_COUNTED: Cell<bool> = const { Cell::new(false) };
+}
+
+fn is_counted() -> bool {
+    /* Thread locals are gone while the thread is being torn down. */
+    IS_COUNTED.try_with(Cell::get).unwrap_or(false)
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        if is_counted() {
+            ALLOCATION_COUNT.fetch_add(1, Ordering::Relaxed);
+        }
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        if is_counted() {
+            ALLOCATION_COUNT.fetch_add(1, Ordering::Relaxed);
+        }
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        if is_counted() {
+            ALLOCATION_COUNT.fetch_add(1, Ordering::Relaxed);
+        }
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+// endregion
+
+
+// region Histogram
+/// Histogram of durations in nanoseconds with buckets of logarithmically growing width, as HDR histograms have.
+/// Every power of two range is split into `HALF_BUCKET_COUNT` buckets, so that values are recorded
+/// with relative error below 1/64 with constant memory, regardless of the distribution.
+#[derive(Clone)]
+pub struct Histogram {
+    counts: Vec<u64>,
+    count: u64,
+    max: u64,
+}
+
+impl Histogram {
+    const SUB_BUCKET_BITS: u32 = 7;
+    const SUB_BUCKET_COUNT: usize = 1 << Self::SUB_BUCKET_BITS;
+    const HALF_BUCKET_COUNT: usize = Self::SUB_BUCKET_COUNT / 2;
+
+    pub fn new() -> Self {
+        let magnitudes = (u64::BITS - Self::SUB_BUCKET_BITS + 1) as usize;
+        Self { counts: vec![0; Self::SUB_BUCKET_COUNT + magnitudes * Self::HALF_BUCKET_COUNT], count: 0, max: 0 }
+    }
+
+    fn index(value: u64) -> usize {
+        if value < Self::SUB_BUCKET_COUNT as u64 {
+            return value as usize;
+        }
+        /* Shifted value falls between HALF_BUCKET_COUNT and SUB_BUCKET_COUNT. */
+        let shift = u64::BITS - value.leading_zeros() - Self::SUB_BUCKET_BITS;
+        Self::SUB_BUCKET_COUNT + (shift as usize - 1) * Self::HALF_BUCKET_COUNT
+            + ((value >> shift) as usize - Self::HALF_BUCKET_COUNT)
+    }
+
+    /// Greatest value recorded in the bucket of `index`.
+    fn highest_value(index: usize) -> u64 {
+        if index < Self::SUB_BUCKET_COUNT {
+            return index as u64;
+        }
+        let shift = ((index - Self::SUB_BUCKET_COUNT) / Self::HALF_BUCKET_COUNT + 1) as u32;
+        let sub_bucket = ((index - Self::SUB_BUCKET_COUNT) % Self::HALF_BUCKET_COUNT + Self::HALF_BUCKET_COUNT) as u64;
+        /* Highest bucket ends at u64::MAX, which does not leave room for the exclusive bound. */
+        ((((sub_bucket + 1) as u128) << shift) - 1) as u64
+    }
+
+    pub fn record(&mut self, duration: Duration) {
+        let value = duration.as_nanos().min(u64::MAX as u128) as u64;
+        self.counts[Self::index(value)] += 1;
+        self.count += 1;
+        self.max = self.max.max(value);
+    }
+
+    pub fn merge(&mut self, other: &Histogram) {
+        self.counts.iter_mut().zip(&other.counts).for_each(|(count, other)| *count += other);
+        self.count += other.count;
+        self.max = self.max.max(other.max);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    pub fn max(&self) -> Duration {
+        Duration::from_nanos(self.max)
+    }
+
+    /// Smallest duration not exceeded by `fraction` of recorded ones, up to the bucket precision.
+    pub fn percentile(&self, fraction: f64) -> Duration {
+        let rank = ((self.count as f64 * fraction).ceil() as u64).max(1);
+        let mut seen = 0;
+        for (index, &count) in self.counts.iter().enumerate() {
+            seen += count;
+            if seen >= rank {
+                return Duration::from_nanos(Self::highest_value(index).min(self.max));
+            }
+        }
+        Duration::ZERO
+    }
+}
+// endregion
+
+
+// region Load generation
+/// Resources requested by clients in turn, small pages dominate as they do on real sites.
+const RESOURCES: [&str; 8] = [
+    "/index.html",
+    "/page.html",
+    "/plik.txt",
+    "/index.html",
+    "/css/bootstrap.min.css",
+    "/page.html",
+    "/router-symbol.png",
+    "/file.bin",
+];
+
+/// Starts the server on an ephemeral port of the loopback, it serves until the process exits.
+/// Allocations of the server thread are counted.
+pub fn start_server() -> SocketAddr {
+    let listener = bind_listener(SocketAddr::from((Ipv4Addr::LOCALHOST, 0))).unwrap();
+    let address = listener.local_addr().unwrap();
+    thread::Builder::new()
+        .name("benchmark-server".to_owned())
+        .spawn(move || {
+            IS_COUNTED.with(|is_counted| is_counted.set(true));
+            let catalog: Rc<Path> = Rc::from(Path::new(env!("CARGO_MANIFEST_DIR")));
+            let mut server: HttpServer = HttpServer::with_listener(listener, RequestHandler::default_config(catalog));
+            server.start();
+        })
+        .unwrap();
+    address
+}
+
+/// Results of a single client.
+pub struct ClientReport {
+    pub latencies: Histogram,
+    pub bytes: u64,
+    pub errors: u64,
+}
+
+/// Reads a response into `buffer`, returns its status code and its total length.
+fn read_response(stream: &mut TcpStream, buffer: &mut Vec<u8>) -> io::Result<(u16, usize)> {
+    buffer.clear();
+    let mut chunk = [0; 64 * 1024];
+    let head_length = loop {
+        if let Some(end) = buffer.windows(4).position(|window| window == b"\r\n\r\n") {
+            break end + 4;
+        }
+        let read = stream.read(&mut chunk)?;
+        if read == 0 {
+            return Err(io::ErrorKind::UnexpectedEof.into());
+        }
+        buffer.extend_from_slice(&chunk[..read]);
+    };
+    let head = std::str::from_utf8(&buffer[..head_length]).map_err(|_| io::Error::from(io::ErrorKind::InvalidData))?;
+    let status_code = head.get(9..12).and_then(|code| code.parse().ok()).unwrap_or(0);
+    let content_length: usize = head
+        .split("\r\n")
+        .filter_map(|line| line.split_once(':'))
+        .find(|(name, _)| name.eq_ignore_ascii_case("content-length"))
+        .and_then(|(_, value)| value.trim().parse().ok())
+        .unwrap_or(0);
+    /* Body is not kept, only its length matters. */
+    let mut remaining = (head_length + content_length).saturating_sub(buffer.len());
+    while remaining > 0 {
+        let read = stream.read(&mut chunk[..remaining.min(64 * 1024)])?;
+        if read == 0 {
+            return Err(io::ErrorKind::UnexpectedEof.into());
+        }
+        remaining -= read;
+    }
+    Ok((status_code, head_length + content_length))
+}
+
+/// Requests resources until `deadline`, over one connection if `keep_alive` and a new connection per request otherwise.
+pub fn run_client(address: SocketAddr, keep_alive: bool, first_resource: usize, deadline: Instant) -> ClientReport {
+    let mut report = ClientReport { latencies: Histogram::new(), bytes: 0, errors: 0 };
+    let mut buffer = Vec::with_capacity(64 * 1024);
+    let mut stream: Option<TcpStream> = None;
+    let connection = if keep_alive { "keep-alive" } else { "close" };
+    let mut resource_index = first_resource;
+    while Instant::now() < deadline {
+        let resource = RESOURCES[resource_index % RESOURCES.len()];
+        resource_index += 1;
+        let request = format!("GET {resource} HTTP/1.1\r\nHost: localhost\r\nConnection: {connection}\r\n\r\n");
+        let started_at = Instant::now();
+        let result = (|| {
+            if stream.is_none() {
+                let connected = TcpStream::connect(address)?;
+                connected.set_nodelay(true)?;
+                stream = Some(connected);
+            }
+            let connected = stream.as_mut().unwrap();
+            connected.write_all(request.as_bytes())?;
+            read_response(connected, &mut buffer)
+        })();
+        match result {
+            Ok((200, length)) => {
+                report.latencies.record(started_at.elapsed());
+                report.bytes += length as u64;
+            }
+            _ => {
+                report.errors += 1;
+                stream = None;
+            }
+        }
+        if !keep_alive {
+            stream = None;
+        }
+    }
+    report
+}
+
+/// Aggregated results of all clients of a scenario.
+pub struct LoadReport {
+    pub requests_per_s: f64,
+    pub megabytes_per_s: f64,
+    pub allocations_per_request: f64,
+    pub latencies: Histogram,
+    pub errors: u64,
+}
+
+/// Runs `keep_alive_clients` and `one_shot_clients` against the server for `duration`.
+pub fn run_load(address: SocketAddr, keep_alive_clients: usize, one_shot_clients: usize, duration: Duration) -> LoadReport {
+    let started_at = Instant::now();
+    let deadline = started_at + duration;
+    let allocations_before = ALLOCATION_COUNT.load(Ordering::Relaxed);
+    let handles: Vec<_> = (0..keep_alive_clients + one_shot_clients)
+        .map(|client| thread::spawn(move || run_client(address, client < keep_alive_clients, client, deadline)))
+        .collect();
+    let reports: Vec<ClientReport> = handles.into_iter().map(|handle| handle.join().unwrap()).collect();
+    let elapsed = started_at.elapsed().as_secs_f64();
+    let allocations = ALLOCATION_COUNT.load(Ordering::Relaxed) - allocations_before;
+
+    let mut latencies = Histogram::new();
+    reports.iter().for_each(|report| latencies.merge(&report.latencies));
+    let bytes: u64 = reports.iter().map(|report| report.bytes).sum();
+    let requests = latencies.count();
+    LoadReport {
+        requests_per_s: requests as f64 / elapsed,
+        megabytes_per_s: bytes as f64 / 1e6 / elapsed,
+        allocations_per_request: allocations as f64 / requests.max(1) as f64,
+        latencies,
+        errors: reports.iter().map(|report| report.errors).sum(),
+    }
+}
+// endregion
+
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, Instant};
+
+    use super::{run_client, run_load, start_server, Histogram};
+
+    const DURATION: Duration = Duration::from_secs(3);
+    /* Keep-alive clients and clients opening a connection per request. */
+    const SCENARIOS: [(usize, usize); 4] = [(1, 0), (16, 0), (64, 0), (48, 16)];
+
+    #[test]
+    #[ignore]
+    fn benchmark_load() {
+        let address = start_server();
+        /* Warm up fills the resource cache, so that steady state is measured. */
+        let warm_up = run_client(address, true, 0, Instant::now() + Duration::from_millis(200));
+        assert_eq!(0, warm_up.errors);
+        println!(
+            "{:>10} {:>9} {:>10} {:>9} {:>9} {:>9} {:>9} {:>9} {:>7}",
+            "keep-alive", "one-shot", "req/s", "MB/s", "p50 us", "p99 us", "p999 us", "allocs", "errors",
+        );
+        for (keep_alive_clients, one_shot_clients) in SCENARIOS {
+            let report = run_load(address, keep_alive_clients, one_shot_clients, DURATION);
+            let micros = |fraction: f64| report.latencies.percentile(fraction).as_secs_f64() * 1e6;
+            println!(
+                "{:>10} {:>9} {:>10.0} {:>9.1} {:>9.0} {:>9.0} {:>9.0} {:>9.2} {:>7}",
+                keep_alive_clients,
+                one_shot_clients,
+                report.requests_per_s,
+                report.megabytes_per_s,
+                micros(0.5),
+                micros(0.99),
+                micros(0.999),
+                report.allocations_per_request,
+                report.errors,
+            );
+        }
+    }
+
+    #[test]
+    fn test_serves_resource_mix() {
+        let address = start_server();
+        for keep_alive in [true, false] {
+            let report = run_client(address, keep_alive, 0, Instant::now() + Duration::from_millis(100));
+            assert_eq!(0, report.errors);
+            assert!(report.latencies.count() > 0);
+        }
+    }
+
+    #[test]
+    fn test_histogram_percentiles() {
+        let mut histogram = Histogram::new();
+        (1..=1000).for_each(|micros| histogram.record(Duration::from_micros(micros)));
+        let within_precision = |duration: Duration, micros: f64| {
+            (duration.as_secs_f64() * 1e6 - micros).abs() <= micros / 64.0
+        };
+        assert!(within_precision(histogram.percentile(0.5), 500.0));
+        assert!(within_precision(histogram.percentile(0.99), 990.0));
+        assert_eq!(Duration::from_micros(1000), histogram.percentile(1.0));
+        assert_eq!(Duration::from_nanos(5), {
+            let mut small = Histogram::new();
+            small.record(Duration::from_nanos(5));
+            small.percentile(0.5)
+        });
+    }
+
+    #[test]
+    fn test_histogram_buckets_cover_values() {
+        for value in (0..64).map(|shift| 1u64 << shift).chain([127, 128, 129, 1000, 123_456_789, u64::MAX]) {
+            let index = Histogram::index(value);
+            assert!(Histogram::highest_value(index) >= value);
+            assert!(index == 0 || Histogram::highest_value(index - 1) < value);
+        }
+    }
+}
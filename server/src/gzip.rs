@@ -0,0 +1,552 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes gzip compression (RFC 1952) of whole buffers.
+//! Data is compressed with DEFLATE (RFC 1951): LZ77 over hash chains with lazy matching, followed by
+//! blocks coded with dynamic Huffman codes. Speed matters little since resources are compressed once.
+
+use std::cmp::Reverse;
+use std::collections::BinaryHeap;
+
+
+// region CRC-32
+const CRC_TABLE: [u32; 256] = {
+    let mut table = [0; 256];
+    let mut index = 0;
+    while index < 256 {
+        let mut crc = index as u32;
+        let mut bit = 0;
+        while bit < 8 {
+            crc = if crc & 1 != 0 { 0xEDB8_8320 ^ (crc >> 1) } else { crc >> 1 };
+            bit += 1;
+        }
+        table[index] = crc;
+        index += 1;
+    }
+    table
+};
+
+fn crc32(data: &[u8]) -> u32 {
+    !data.iter().fold(!0, |crc, &byte| CRC_TABLE[((crc ^ byte as u32) & 0xFF) as usize] ^ (crc >> 8))
+}
+// endregion
+
+
+struct BitWriter {
+    output: Vec<u8>,
+    bits: u64,
+    bit_count: u32,
+}
+
+impl BitWriter {
+    fn new(output: Vec<u8>) -> Self {
+        Self { output, bits: 0, bit_count: 0 }
+    }
+
+    /// Writes `count` lowest bits of `value`, least significant first.
+    fn write(&mut self, value: u32, count: u32) {
+        debug_assert!(count <= 32);
+        self.bits |= (value as u64) << self.bit_count;
+        self.bit_count += count;
+        while self.bit_count >= 8 {
+            self.output.push(self.bits as u8);
+            self.bits >>= 8;
+            self.bit_count -= 8;
+        }
+    }
+
+    fn write_code(&mut self, code: &Code) {
+        self.write(code.reversed_bits as u32, code.length as u32);
+    }
+
+    fn finish(mut self) -> Vec<u8> {
+        if self.bit_count > 0 {
+            self.output.push(self.bits as u8);
+        }
+        self.output
+    }
+}
+
+
+// region Huffman codes
+#[derive(Debug, Copy, Clone, Default)]
+struct Code {
+    /* Huffman codes are written starting with the most significant bit, they are stored reversed. */
+    reversed_bits: u16,
+    length: u8,
+}
+
+/// Lengths of Huffman codes of symbols with `frequencies`, none of them longer than `limit`.
+/// Frequencies are flattened until the tree fits the limit, which costs little compression.
+fn code_lengths(frequencies: &[u32], limit: u8) -> Vec<u8> {
+    let mut lengths = vec![0; frequencies.len()];
+    let mut frequencies: Vec<u32> = frequencies.to_vec();
+    let used: Vec<usize> = (0..frequencies.len()).filter(|&symbol| frequencies[symbol] > 0).collect();
+    match used.len() {
+        0 => return lengths,
+        1 => {
+            lengths[used[0]] = 1;
+            return lengths;
+        }
+        _ => {}
+    }
+    loop {
+        /* Nodes past the symbols are internal, parents links them to the root. */
+        let mut parents = vec![usize::MAX; frequencies.len()];
+        let mut heap: BinaryHeap<Reverse<(u64, usize)>> = used
+            .iter()
+            .map(|&symbol| Reverse((frequencies[symbol] as u64, symbol)))
+            .collect();
+        while heap.len() > 1 {
+            let Reverse((first_weight, first)) = heap.pop().unwrap();
+            let Reverse((second_weight, second)) = heap.pop().unwrap();
+            let node = parents.len();
+            parents.push(usize::MAX);
+            parents[first] = node;
+            parents[second] = node;
+            heap.push(Reverse((first_weight + second_weight, node)));
+        }
+        let mut depths = vec![0u8; parents.len()];
+        for node in (0..parents.len()).rev() {
+            if parents[node] != usize::MAX {
+                depths[node] = depths[parents[node]] + 1;
+            }
+        }
+        if used.iter().all(|&symbol| depths[symbol] <= limit) {
+            used.iter().for_each(|&symbol| lengths[symbol] = depths[symbol]);
+            return lengths;
+        }
+        used.iter().for_each(|&symbol| frequencies[symbol] = (frequencies[symbol] >> 1).max(1));
+    }
+}
+
+/// Canonical codes of the given lengths, as defined in RFC 1951 section 3.2.2.
+fn canonical_codes(lengths: &[u8]) -> Vec<Code> {
+    let mut length_counts = [0u16; 16];
+    lengths.iter().filter(|&&length| length > 0).for_each(|&length| length_counts[length as usize] += 1);
+    let mut next_code = [0u16; 16];
+    let mut code = 0;
+    for length in 1..16 {
+        code = (code + length_counts[length - 1]) << 1;
+        next_code[length] = code;
+    }
+    lengths
+        .iter()
+        .map(|&length| {
+            if length == 0 {
+                return Code::default();
+            }
+            let code = next_code[length as usize];
+            next_code[length as usize] += 1;
+            Code { reversed_bits: code.reverse_bits() >> (16 - length), length }
+        })
+        .collect()
+}
+// endregion
+
+
+// region LZ77
+const WINDOW_SIZE: usize = 32 * 1024;
+const MIN_MATCH: usize = 3;
+const MAX_MATCH: usize = 258;
+const HASH_BITS: u32 = 15;
+const MAX_CHAIN_LENGTH: usize = 128;
+/* Matches at least this long are taken without looking for a better one at the next position. */
+const GOOD_MATCH: usize = 32;
+
+#[derive(Debug, Copy, Clone)]
+enum Token {
+    Literal(u8),
+    Match { length: u16, distance: u16 },
+}
+
+fn hash(data: &[u8], position: usize) -> usize {
+    let value = (data[position] as u32) << 16 | (data[position + 1] as u32) << 8 | data[position + 2] as u32;
+    (value.wrapping_mul(0x9E37_79B1) >> (32 - HASH_BITS)) as usize
+}
+
+struct MatchFinder {
+    /* Most recent position of every hash and the previous position of the same hash for every position. */
+    head: Vec<usize>,
+    previous: Vec<usize>,
+}
+
+impl MatchFinder {
+    const NONE: usize = usize::MAX;
+
+    fn new(length: usize) -> Self {
+        Self { head: vec![Self::NONE; 1 << HASH_BITS], previous: vec![Self::NONE; length] }
+    }
+
+    fn insert(&mut self, data: &[u8], position: usize) {
+        if position + MIN_MATCH <= data.len() {
+            let hash = hash(data, position);
+            self.previous[position] = self.head[hash];
+            self.head[hash] = position;
+        }
+    }
+
+    /// Longest match of data at `position` with earlier data in the window, as length and distance.
+    fn longest_match(&self, data: &[u8], position: usize) -> Option<(usize, usize)> {
+        if position + MIN_MATCH > data.len() {
+            return None;
+        }
+        let max_length = (data.len() - position).min(MAX_MATCH);
+        let mut best: Option<(usize, usize)> = None;
+        let mut candidate = self.head[hash(data, position)];
+        let mut chain_length = 0;
+        while candidate != Self::NONE && position - candidate <= WINDOW_SIZE && chain_length < MAX_CHAIN_LENGTH {
+            let best_length = best.map_or(MIN_MATCH - 1, |(length, _)| length);
+            if data[candidate + best_length.min(max_length - 1)] == data[position + best_length.min(max_length - 1)] {
+                let length = data[candidate..candidate + max_length]
+                    .iter()
+                    .zip(&data[position..position + max_length])
+                    .take_while(|(first, second)| first == second)
+                    .count();
+                if length > best_length {
+                    best = Some((length, position - candidate));
+                    if length == max_length {
+                        break;
+                    }
+                }
+            }
+            candidate = self.previous[candidate];
+            chain_length += 1;
+        }
+        best
+    }
+}
+
+fn tokenize(data: &[u8]) -> Vec<Token> {
+    let mut tokens = Vec::with_capacity(data.len() / 2);
+    let mut finder = MatchFinder::new(data.len());
+    let mut position = 0;
+    while position < data.len() {
+        let found = finder.longest_match(data, position);
+        finder.insert(data, position);
+        let (length, distance) = match found {
+            Some((length, distance)) => (length, distance),
+            None => {
+                tokens.push(Token::Literal(data[position]));
+                position += 1;
+                continue;
+            }
+        };
+        /* Lazy matching, literal is emitted if the match starting at the next byte is longer. */
+        if length < GOOD_MATCH {
+            if let Some((next_length, _)) = finder.longest_match(data, position + 1) {
+                if next_length > length {
+                    tokens.push(Token::Literal(data[position]));
+                    position += 1;
+                    continue;
+                }
+            }
+        }
+        tokens.push(Token::Match { length: length as u16, distance: distance as u16 });
+        (position + 1..position + length).for_each(|inserted| finder.insert(data, inserted));
+        position += length;
+    }
+    tokens
+}
+// endregion
+
+
+// region DEFLATE blocks
+const END_OF_BLOCK: usize = 256;
+const LITERAL_LENGTH_CODES: usize = 286;
+const DISTANCE_CODES: usize = 30;
+const TOKENS_PER_BLOCK: usize = 1 << 16;
+
+const LENGTH_BASES: [u16; 29] = [
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+];
+const LENGTH_EXTRA_BITS: [u8; 29] = [0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0];
+const DISTANCE_BASES: [u16; 30] = [
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+    6145, 8193, 12289, 16385, 24577,
+];
+const DISTANCE_EXTRA_BITS: [u8; 30] = [
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+];
+/* Order in which lengths of the code length code are written. */
+const CODE_LENGTH_ORDER: [usize; 19] = [16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15];
+
+/// Index of the code whose base is the greatest not exceeding `value`.
+fn code_index(bases: &[u16], value: u16) -> usize {
+    bases.partition_point(|&base| base <= value) - 1
+}
+
+/// Code length code symbol with its extra bits and their count.
+type CodeLengthSymbol = (usize, u32, u32);
+
+/// Run length encoding of code lengths with symbols 16, 17 and 18.
+fn encode_code_lengths(lengths: &[u8]) -> Vec<CodeLengthSymbol> {
+    let mut symbols = Vec::new();
+    let mut index = 0;
+    while index < lengths.len() {
+        let length = lengths[index];
+        let run = lengths[index..].iter().take_while(|&&other| other == length).count();
+        if length == 0 && run >= 11 {
+            let run = run.min(138);
+            symbols.push((18, (run - 11) as u32, 7));
+            index += run;
+        } else if length == 0 && run >= 3 {
+            symbols.push((17, (run - 3) as u32, 3));
+            index += run;
+        } else if length != 0 && run >= 4 {
+            let run = (run - 1).min(6);
+            symbols.push((length as usize, 0, 0));
+            symbols.push((16, (run - 3) as u32, 2));
+            index += run + 1;
+        } else {
+            symbols.push((length as usize, 0, 0));
+            index += 1;
+        }
+    }
+    symbols
+}
+
+fn write_block(writer: &mut BitWriter, tokens: &[Token], is_final: bool) {
+    let mut literal_frequencies = [0u32; LITERAL_LENGTH_CODES];
+    let mut distance_frequencies = [0u32; DISTANCE_CODES];
+    for token in tokens {
+        match *token {
+            Token::Literal(byte) => literal_frequencies[byte as usize] += 1,
+            Token::Match { length, distance } => {
+                literal_frequencies[257 + code_index(&LENGTH_BASES, length)] += 1;
+                distance_frequencies[code_index(&DISTANCE_BASES, distance)] += 1;
+            }
+        }
+    }
+    literal_frequencies[END_OF_BLOCK] = 1;
+    /* Decoders expect at least one distance code even if there are no matches. */
+    if distance_frequencies.iter().all(|&frequency| frequency == 0) {
+        distance_frequencies[0] = 1;
+    }
+    let literal_lengths = code_lengths(&literal_frequencies, 15);
+    let distance_lengths = code_lengths(&distance_frequencies, 15);
+    let literal_count = 257.max(literal_lengths.iter().rposition(|&length| length > 0).unwrap() + 1);
+    let distance_count = 1.max(distance_lengths.iter().rposition(|&length| length > 0).unwrap() + 1);
+
+    let all_lengths: Vec<u8> = literal_lengths[..literal_count]
+        .iter()
+        .chain(&distance_lengths[..distance_count])
+        .copied()
+        .collect();
+    let code_length_symbols = encode_code_lengths(&all_lengths);
+    let mut code_length_frequencies = [0u32; 19];
+    code_length_symbols.iter().for_each(|&(symbol, _, _)| code_length_frequencies[symbol] += 1);
+    let code_length_lengths = code_lengths(&code_length_frequencies, 7);
+    let code_length_count = 4.max(
+        CODE_LENGTH_ORDER.iter().rposition(|&symbol| code_length_lengths[symbol] > 0).unwrap() + 1,
+    );
+
+    writer.write(is_final as u32, 1);
+    writer.write(2, 2);
+    writer.write((literal_count - 257) as u32, 5);
+    writer.write((distance_count - 1) as u32, 5);
+    writer.write((code_length_count - 4) as u32, 4);
+    for &symbol in &CODE_LENGTH_ORDER[..code_length_count] {
+        writer.write(code_length_lengths[symbol] as u32, 3);
+    }
+    let code_length_codes = canonical_codes(&code_length_lengths);
+    for &(symbol, extra, extra_bits) in &code_length_symbols {
+        writer.write_code(&code_length_codes[symbol]);
+        writer.write(extra, extra_bits);
+    }
+
+    let literal_codes = canonical_codes(&literal_lengths);
+    let distance_codes = canonical_codes(&distance_lengths);
+    for token in tokens {
+        match *token {
+            Token::Literal(byte) => writer.write_code(&literal_codes[byte as usize]),
+            Token::Match { length, distance } => {
+                let length_index = code_index(&LENGTH_BASES, length);
+                writer.write_code(&literal_codes[257 + length_index]);
+                writer.write((length - LENGTH_BASES[length_index]) as u32, LENGTH_EXTRA_BITS[length_index] as u32);
+                let distance_index = code_index(&DISTANCE_BASES, distance);
+                writer.write_code(&distance_codes[distance_index]);
+                writer.write(
+                    (distance - DISTANCE_BASES[distance_index]) as u32,
+                    DISTANCE_EXTRA_BITS[distance_index] as u32,
+                );
+            }
+        }
+    }
+    writer.write_code(&literal_codes[END_OF_BLOCK]);
+}
+// endregion
+
+
+/// Compresses `data` into a single gzip member.
+pub fn compress(data: &[u8]) -> Vec<u8> {
+    /* Magic, deflate, no flags, no modification time, no extra flags, Unix. */
+    const HEADER: [u8; 10] = [0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3];
+    let mut output = Vec::with_capacity(data.len() / 3 + HEADER.len() + 8);
+    output.extend_from_slice(&HEADER);
+
+    let tokens = tokenize(data);
+    let mut writer = BitWriter::new(output);
+    if tokens.is_empty() {
+        write_block(&mut writer, &[], true);
+    }
+    let block_count = (tokens.len() + TOKENS_PER_BLOCK - 1) / TOKENS_PER_BLOCK;
+    for (index, block) in tokens.chunks(TOKENS_PER_BLOCK).enumerate() {
+        write_block(&mut writer, block, index + 1 == block_count);
+    }
+    let mut output = writer.finish();
+
+    output.extend_from_slice(&crc32(data).to_le_bytes());
+    output.extend_from_slice(&(data.len() as u32).to_le_bytes());
+    output
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::{code_lengths, compress, crc32};
+
+    /// Minimal inflater of dynamic and fixed Huffman blocks, modelled after zlib's puff.
+    struct Inflater<'a> {
+        input: &'a [u8],
+        position: usize,
+        bit_buffer: u32,
+        bit_count: u32,
+    }
+
+    struct Huffman {
+        counts: [u16; 16],
+        symbols: Vec<u16>,
+    }
+
+    impl Huffman {
+        fn new(lengths: &[u8]) -> Self {
+            let mut counts = [0u16; 16];
+            lengths.iter().for_each(|&length| counts[length as usize] += 1);
+            counts[0] = 0;
+            let mut symbols: Vec<u16> = (0..lengths.len() as u16).filter(|&symbol| lengths[symbol as usize] > 0).collect();
+            symbols.sort_by_key(|&symbol| lengths[symbol as usize]);
+            Self { counts, symbols }
+        }
+    }
+
+    impl<'a> Inflater<'a> {
+        fn bits(&mut self, count: u32) -> u32 {
+            while self.bit_count < count {
+                self.bit_buffer |= (self.input[self.position] as u32) << self.bit_count;
+                self.position += 1;
+                self.bit_count += 8;
+            }
+            let value = self.bit_buffer & ((1u64 << count) - 1) as u32;
+            self.bit_buffer >>= count;
+            self.bit_count -= count;
+            value
+        }
+
+        fn decode(&mut self, huffman: &Huffman) -> usize {
+            let (mut code, mut first, mut index) = (0i32, 0i32, 0i32);
+            for length in 1..16 {
+                code |= self.bits(1) as i32;
+                let count = huffman.counts[length] as i32;
+                if code - count < first {
+                    return huffman.symbols[(index + code - first) as usize] as usize;
+                }
+                index += count;
+                first = (first + count) << 1;
+                code <<= 1;
+            }
+            panic!("invalid code");
+        }
+
+        fn inflate(input: &[u8]) -> Vec<u8> {
+            const LENGTH_BASES: [usize; 29] = [3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258];
+            const LENGTH_EXTRA: [u32; 29] = [0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0];
+            const DISTANCE_BASES: [usize; 30] = [1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577];
+            const DISTANCE_EXTRA: [u32; 30] = [0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13];
+            const ORDER: [usize; 19] = [16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15];
+
+            let mut inflater = Inflater { input, position: 0, bit_buffer: 0, bit_count: 0 };
+            let mut output = Vec::new();
+            loop {
+                let is_final = inflater.bits(1) == 1;
+                assert_eq!(2, inflater.bits(2), "only dynamic blocks are produced");
+                let literal_count = inflater.bits(5) as usize + 257;
+                let distance_count = inflater.bits(5) as usize + 1;
+                let code_length_count = inflater.bits(4) as usize + 4;
+                let mut code_length_lengths = [0u8; 19];
+                ORDER[..code_length_count].iter().for_each(|&symbol| code_length_lengths[symbol] = inflater.bits(3) as u8);
+                let code_length_code = Huffman::new(&code_length_lengths);
+                let mut lengths = Vec::new();
+                while lengths.len() < literal_count + distance_count {
+                    match inflater.decode(&code_length_code) {
+                        16 => {
+                            let previous = *lengths.last().unwrap();
+                            (0..3 + inflater.bits(2)).for_each(|_| lengths.push(previous));
+                        }
+                        17 => (0..3 + inflater.bits(3)).for_each(|_| lengths.push(0)),
+                        18 => (0..11 + inflater.bits(7)).for_each(|_| lengths.push(0)),
+                        length => lengths.push(length as u8),
+                    }
+                }
+                let literal_code = Huffman::new(&lengths[..literal_count]);
+                let distance_code = Huffman::new(&lengths[literal_count..]);
+                loop {
+                    let symbol = inflater.decode(&literal_code);
+                    if symbol < 256 {
+                        output.push(symbol as u8);
+                        continue;
+                    }
+                    if symbol == 256 {
+                        break;
+                    }
+                    let length = LENGTH_BASES[symbol - 257] + inflater.bits(LENGTH_EXTRA[symbol - 257]) as usize;
+                    let distance_symbol = inflater.decode(&distance_code);
+                    let distance = DISTANCE_BASES[distance_symbol] + inflater.bits(DISTANCE_EXTRA[distance_symbol]) as usize;
+                    let start = output.len() - distance;
+                    (0..length).for_each(|offset| output.push(output[start + offset]));
+                }
+                if is_final {
+                    return output;
+                }
+            }
+        }
+    }
+
+    fn decompress(member: &[u8]) -> Vec<u8> {
+        assert_eq!([0x1F, 0x8B, 8], member[..3]);
+        let trailer = &member[member.len() - 8..];
+        let data = Inflater::inflate(&member[10..member.len() - 8]);
+        assert_eq!(crc32(&data).to_le_bytes(), trailer[..4]);
+        assert_eq!((data.len() as u32).to_le_bytes(), trailer[4..]);
+        data
+    }
+
+    #[test]
+    fn test_crc32() {
+        assert_eq!(0xCBF4_3926, crc32(b"123456789"));
+    }
+
+    #[test]
+    fn test_round_trip() {
+        let text: Vec<u8> = (0..5000)
+            .flat_map(|index: usize| format!("<div class=\"row col-{}\">{}</div>\n", index % 12, index * 7919 % 1000).into_bytes())
+            .collect();
+        let noise: Vec<u8> = (0..100_000u32).map(|index| (index.wrapping_mul(2_654_435_761) >> 24) as u8).collect();
+        for data in [&b""[..], b"a", b"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", &text, &noise] {
+            let compressed = compress(data);
+            assert_eq!(data, &decompress(&compressed)[..]);
+        }
+        assert!(compress(&text).len() * 5 < text.len());
+    }
+
+    #[test]
+    fn test_code_lengths_are_limited() {
+        let fibonacci: Vec<u32> = (0..30).scan((1u32, 1u32), |state, _| {
+            *state = (state.1, state.0 + state.1);
+            Some(state.0)
+        }).collect();
+        let lengths = code_lengths(&fibonacci, 15);
+        assert!(lengths.iter().all(|&length| (1..=15).contains(&length)));
+        let kraft: f64 = lengths.iter().map(|&length| 0.5f64.powi(length as i32)).sum();
+        assert!(kraft <= 1.0);
+    }
+}
@@ -2,13 +2,47 @@
 
 use super::entity::Entity;
 use std::fmt::{Display, Formatter};
+use std::ops::Range;
 use std::str::FromStr;
+use std::time::{SystemTime, UNIX_EPOCH};
 
 pub const CRLF: &str = "\r\n";
 
+/// Formats time as HTTP date in IMF-fixdate format, e.g. `Sun, 06 Nov 1994 08:49:37 GMT`.
+pub fn http_date(time: SystemTime) -> String {
+    const WEEKDAYS: [&str; 7] = ["Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed"];
+    const MONTHS: [&str; 12] = ["Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"];
+
+    /* Times before the epoch are not expected from the filesystem, they are clamped to it. */
+    let seconds = time.duration_since(UNIX_EPOCH).map(|duration| duration.as_secs()).unwrap_or(0);
+    let (days, seconds_of_day) = (seconds / 86400, seconds % 86400);
+
+    /* Civil date from days since the epoch, see http://howardhinnant.github.io/date_algorithms.html#civil_from_days */
+    let z = days + 719468;
+    let era = z / 146097;
+    let day_of_era = z % 146097;
+    let year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    let day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    let shifted_month = (5 * day_of_year + 2) / 153;
+    let day = day_of_year - (153 * shifted_month + 2) / 5 + 1;
+    let month = if shifted_month < 10 { shifted_month + 3 } else { shifted_month - 9 };
+    let year = year_of_era + era * 400 + if month <= 2 { 1 } else { 0 };
+
+    format!(
+        "{}, {:02} {} {} {:02}:{:02}:{:02} GMT",
+        WEEKDAYS[(days % 7) as usize],
+        day,
+        MONTHS[(month - 1) as usize],
+        year,
+        seconds_of_day / 3600,
+        seconds_of_day / 60 % 60,
+        seconds_of_day % 60,
+    )
+}
+
 /// Versions of HTTP protocol.
 #[non_exhaustive]
-#[derive(Copy, Clone)]
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
 pub enum Version {
     V1,
     V1_1,
@@ -18,10 +52,19 @@ pub enum Version {
 
 impl Version {
     const PREFIX_REPR: &'static str = "HTTP/";
-    const V1_REPR: &'static str = "1";
+    const V1_REPR: &'static str = "1.0";
     const V1_1_REPR: &'static str = "1.1";
     const V2_REPR: &'static str = "2";
     const V3_REPR: &'static str = "3";
+
+    /// Versions which may appear in an HTTP/1.x request line.
+    pub fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        match bytes {
+            b"HTTP/1.0" => Some(Self::V1),
+            b"HTTP/1.1" => Some(Self::V1_1),
+            _ => None,
+        }
+    }
 }
 
 impl Display for Version {
@@ -62,14 +105,24 @@ impl FromStr for Version {
 #[non_exhaustive]
 pub enum Body {
     SingleSource(Entity),
+    /* Bytes of the entity within the range. */
+    Partial(Entity, Range<usize>),
 }
 
 pub struct ParseBodyError;
 
-impl AsRef<[u8]> for Body {
-    fn as_ref(&self) -> &[u8] {
+impl Body {
+    pub fn entity(&self) -> &Entity {
+        match self {
+            Body::SingleSource(entity) | Body::Partial(entity, _) => entity,
+        }
+    }
+
+    /// Range of the entity data which is sent.
+    pub fn range(&self) -> Range<usize> {
         match self {
-            Body::SingleSource(entity) => entity.as_ref(),
+            Body::SingleSource(entity) => 0..entity.len(),
+            Body::Partial(_, range) => range.clone(),
         }
     }
 }
@@ -84,7 +137,7 @@ impl TryFrom<&[u8]> for Body {
 
 /// Type of http method.
 #[non_exhaustive]
-#[derive(Debug)]
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
 #[allow(non_camel_case_types)]
 pub enum Method {
     GET,
@@ -92,6 +145,13 @@ pub enum Method {
 
 impl Method {
     const GET_REPR: &'static str = "GET";
+
+    pub fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        match bytes {
+            b"GET" => Some(Self::GET),
+            _ => None,
+        }
+    }
 }
 
 impl Display for Method {
@@ -115,3 +175,16 @@ impl FromStr for Method {
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, UNIX_EPOCH};
+    use super::http_date;
+
+    #[test]
+    fn test_http_date() {
+        assert_eq!("Thu, 01 Jan 1970 00:00:00 GMT", http_date(UNIX_EPOCH));
+        assert_eq!("Sun, 06 Nov 1994 08:49:37 GMT", http_date(UNIX_EPOCH + Duration::from_secs(784111777)));
+        assert_eq!("Tue, 29 Feb 2000 23:59:59 GMT", http_date(UNIX_EPOCH + Duration::from_secs(951868799)));
+    }
+}
@@ -1,52 +1,167 @@
 //! Mikołaj Depta 328690
 
+use std::fs::File;
+use std::ops::Range;
 use std::rc::Rc;
-use super::headers::entity_header::{ContentType, EntityHeader, EntityHeaders};
+use std::sync::Arc;
+use std::time::{SystemTime, UNIX_EPOCH};
+use super::common;
+use super::headers::entity_header::{ContentEncoding, ContentType, EntityHeader, EntityHeaders};
 
+/// Source of the entity data.
+#[derive(Clone)]
+pub enum Content {
+    /* Shared by workers in case of gzip variants. */
+    Memory(Arc<[u8]>),
+    /* Sent straight from the file, which must not be shorter than the entity. */
+    File(Rc<File>),
+}
+
+/// Entity shares its content and headers, cloning it is cheap.
+#[derive(Clone)]
 pub struct Entity {
-    data: Box<[u8]>,
+    content: Content,
+    length: usize,
     headers: EntityHeaders,
+    /* Same resource compressed with gzip, served to clients which accept it. */
+    gzipped: Option<Rc<Entity>>,
 }
 
 impl Entity {
-    pub fn new(data: Box<[u8]>, content_type: ContentType) -> Self {
+    pub fn new(data: Arc<[u8]>, content_type: ContentType) -> Self {
         let headers = Rc::from([
             EntityHeader::ContentType(content_type),
             EntityHeader::ContentLength(data.len()),
-        ]).into_boxed_slice();
-        Self { data, headers }
+        ]);
+        Self { length: data.len(), content: Content::Memory(data), headers, gzipped: None }
+    }
+
+    /// Headers of a file modified at `modified`, its ETag is derived from modification time and size.
+    fn file_headers(length: usize, content_type: ContentType, modified: SystemTime) -> EntityHeaders {
+        let modified_nanos = modified.duration_since(UNIX_EPOCH).map(|duration| duration.as_nanos()).unwrap_or(0);
+        let etag = format!("\"{:x}-{:x}\"", modified_nanos, length);
+        Rc::from([
+            EntityHeader::ContentType(content_type),
+            EntityHeader::ContentLength(length),
+            EntityHeader::ETag(etag),
+            EntityHeader::LastModified(common::http_date(modified)),
+        ])
+    }
+
+    /// Entity of file content read into memory.
+    pub fn with_validators(data: Arc<[u8]>, content_type: ContentType, modified: SystemTime) -> Self {
+        let headers = Self::file_headers(data.len(), content_type, modified);
+        Self { length: data.len(), content: Content::Memory(data), headers, gzipped: None }
+    }
+
+    /// Entity of the first `length` bytes of the file, which are sent without reading them into memory.
+    pub fn from_file(file: File, length: usize, content_type: ContentType, modified: SystemTime) -> Self {
+        let headers = Self::file_headers(length, content_type, modified);
+        Self { length, content: Content::File(Rc::new(file)), headers, gzipped: None }
+    }
+
+
+    /// Data worth compressing with gzip, that of an in-memory entity of compressible type.
+    pub fn compressible_data(&self) -> Option<&[u8]> {
+        match &self.content {
+            Content::Memory(data) if self.content_type().map_or(false, ContentType::is_compressible) => Some(data),
+            _ => None,
+        }
+    }
+
+    /// Attaches `compressed`, the data of the entity compressed with gzip, as its variant.
+    /// Its ETag is the ETag of the entity with "-gzip" suffix, since both variants must be told apart by caches.
+    pub fn with_gzip_variant(mut self, compressed: Arc<[u8]>) -> Self {
+        let headers = self.headers
+            .iter()
+            .map(|header| match header {
+                EntityHeader::ContentLength(_) => EntityHeader::ContentLength(compressed.len()),
+                EntityHeader::ETag(etag) => EntityHeader::ETag(format!("{}-gzip\"", etag.trim_end_matches('"'))),
+                header => header.clone(),
+            })
+            .chain([EntityHeader::ContentEncoding(ContentEncoding::Gzip)])
+            .collect();
+        let variant = Self { length: compressed.len(), content: Content::Memory(compressed), headers, gzipped: None };
+        self.gzipped = Some(Rc::new(variant));
+        self
+    }
+
+    /// Gzip compressed variant of the entity, if there is one.
+    pub fn gzipped(&self) -> Option<&Entity> {
+        self.gzipped.as_deref()
+    }
+
+    fn content_type(&self) -> Option<&ContentType> {
+        self.headers.iter().find_map(|header| match header {
+            EntityHeader::ContentType(content_type) => Some(content_type),
+            _ => None,
+        })
+    }
+
+    fn text(message: &str) -> Self {
+        Self::new(Arc::from(message.as_bytes()), ContentType::Txt)
     }
 
     pub fn headers(&self) -> EntityHeaders {
         self.headers.clone()
     }
 
+    pub fn etag(&self) -> Option<&str> {
+        self.headers.iter().find_map(|header| match header {
+            EntityHeader::ETag(etag) => Some(etag.as_str()),
+            _ => None,
+        })
+    }
+
+    /// Headers describing bytes of the entity within `range`.
+    pub fn partial_headers(&self, range: &Range<usize>) -> EntityHeaders {
+        self.headers
+            .iter()
+            .map(|header| match header {
+                EntityHeader::ContentLength(_) => EntityHeader::ContentLength(range.len()),
+                header => header.clone(),
+            })
+            .chain([EntityHeader::ContentRange(Some(range.clone()), self.length)])
+            .collect()
+    }
+
+    /// Validators of the entity, which are sent in place of the entity that has not been modified.
+    pub fn validator_headers(&self) -> EntityHeaders {
+        self.headers
+            .iter()
+            .filter(|header| matches!(header, EntityHeader::ETag(_) | EntityHeader::LastModified(_)))
+            .cloned()
+            .collect()
+    }
+
+    pub fn content(&self) -> &Content {
+        &self.content
+    }
+
+    pub fn len(&self) -> usize {
+        self.length
+    }
+
     pub fn not_found() -> Self {
-        let data = String::from("Page not found").into_boxed_bytes();
-        Self {
-            data,
-            headers: Rc::from([EntityHeader::ContentType(ContentType::Txt), EntityHeader::ContentLength(data.len())]).into_boxed_slice()
-        }
+        Self::text("Page not found")
     }
 
     pub fn morbidden() -> Self {
-        let data = String::from("Access denied").into_boxed_bytes();
-        Self { data, headers: Rc::from([EntityHeader::ContentType(ContentType::Txt), EntityHeader::ContentLength(data.len())]).into_boxed_slice() }
+        Self::text("Access denied")
     }
 
     pub fn redirect() -> Self {
-        let data = String::from("Redirecting...").into_boxed_bytes();
-        Self { data, headers: Rc::from([EntityHeader::ContentType(ContentType::Txt), EntityHeader::ContentLength(data.len())]).into_boxed_slice() }
+        Self::text("Redirecting...")
     }
 
     pub fn not_implemented() -> Self {
-        let data = String::from("Unrecognized http message").into_boxed_bytes();
-        Self { data, headers: Rc::from([EntityHeader::ContentType(ContentType::Txt), EntityHeader::ContentLength(data.len())]).into_boxed_slice() }
+        Self::text("Unrecognized http message")
     }
-}
 
-impl AsRef<[u8]> for Entity {
-    fn as_ref(&self) -> &[u8] {
-        self.data.as_ref()
+    /// Entity of a response to a request of a range that lies past the end of an entity of `length` bytes.
+    pub fn range_not_satisfiable(length: usize) -> Self {
+        let mut entity = Self::text("Requested range not satisfiable");
+        entity.headers = entity.headers.iter().cloned().chain([EntityHeader::ContentRange(None, length)]).collect();
+        entity
     }
 }
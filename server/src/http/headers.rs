@@ -6,6 +6,7 @@ use std::collections::HashSet;
 use std::path::Path;
 use std::fmt::{Display, Formatter};
 use std::rc::Rc;
+use super::common::CRLF;
 
 // region Errors
 #[derive(Debug)]
@@ -75,7 +76,6 @@ impl Display for ParseHeaderError {
 pub mod response_header {
     use crate::http::headers::{ParseHeaderError, UnsupportedHeaderError};
     use std::fmt::{Display, Formatter};
-    use std::hash::{Hash, Hasher};
     use std::path::{PathBuf};
     use std::rc::Rc;
 
@@ -85,10 +85,14 @@ pub mod response_header {
     #[derive(Debug, Clone, Hash, Eq, PartialEq)]
     pub enum ResponseHeader {
         Location(PathBuf),
+        /* Request headers which select the representation, e.g. "Accept-Encoding". */
+        Vary(&'static str),
     }
 
     impl ResponseHeader {
         const LOCATION_REPR: &'static str = "location";
+        const LOCATION_NAME: &'static str = "Location";
+        const VARY_NAME: &'static str = "Vary";
         const SUPPORTED_HEADERS: [&'static str; 1] = [Self::LOCATION_REPR];
 
         fn is_supported(header_name: &str) -> bool {
@@ -108,15 +112,16 @@ pub mod response_header {
     impl Display for ResponseHeader {
         fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
             match self {
-                ResponseHeader::Location(location) => write!(f, "{}", location.display()),
+                ResponseHeader::Location(location) => write!(f, "{}: {}", Self::LOCATION_NAME, location.display()),
+                ResponseHeader::Vary(names) => write!(f, "{}: {}", Self::VARY_NAME, names),
             }
         }
     }
 }
 
 pub mod entity_header {
-    use std::ffi::OsStr;
     use std::fmt::{Display, Formatter};
+    use std::ops::Range;
     use std::path::Path;
     use std::rc::Rc;
 
@@ -127,11 +132,22 @@ pub mod entity_header {
     pub enum EntityHeader {
         ContentLength(usize),
         ContentType(ContentType),
+        /* Opaque validator of the representation, including the quotes. */
+        ETag(String),
+        /* Formatted once as HTTP date, since it is sent with every response. */
+        LastModified(String),
+        /* Range of bytes sent, None if the requested range was not satisfiable, and the length of the entity. */
+        ContentRange(Option<Range<usize>>, usize),
+        ContentEncoding(ContentEncoding),
     }
 
     impl EntityHeader {
         const CONTENT_LENGTH_REPR: &'static str = "Content-Length";
         const CONTENT_TYPE_REPR: &'static str = "Content-Type";
+        const ETAG_REPR: &'static str = "ETag";
+        const LAST_MODIFIED_REPR: &'static str = "Last-Modified";
+        const CONTENT_RANGE_REPR: &'static str = "Content-Range";
+        const CONTENT_ENCODING_REPR: &'static str = "Content-Encoding";
     }
 
     impl Display for EntityHeader {
@@ -141,7 +157,18 @@ pub mod entity_header {
                     write!(f, "{}: {}", Self::CONTENT_LENGTH_REPR, len)
                 }
                 EntityHeader::ContentType(content_type) => {
-                    write!(f, "{}: {}\r\n", Self::CONTENT_TYPE_REPR, content_type)
+                    write!(f, "{}: {}", Self::CONTENT_TYPE_REPR, content_type)
+                }
+                EntityHeader::ETag(etag) => write!(f, "{}: {}", Self::ETAG_REPR, etag),
+                EntityHeader::LastModified(date) => write!(f, "{}: {}", Self::LAST_MODIFIED_REPR, date),
+                EntityHeader::ContentRange(Some(range), length) => {
+                    write!(f, "{}: bytes {}-{}/{}", Self::CONTENT_RANGE_REPR, range.start, range.end - 1, length)
+                }
+                EntityHeader::ContentRange(None, length) => {
+                    write!(f, "{}: bytes */{}", Self::CONTENT_RANGE_REPR, length)
+                }
+                EntityHeader::ContentEncoding(encoding) => {
+                    write!(f, "{}: {}", Self::CONTENT_ENCODING_REPR, encoding)
                 }
             }
         }
@@ -180,29 +207,51 @@ pub mod entity_header {
         }
     }
 
+    impl ContentType {
+        /// Whether representations of this type shrink when compressed, images and documents are compressed already.
+        pub fn is_compressible(&self) -> bool {
+            matches!(self, Self::Txt | Self::Html | Self::Css)
+        }
+    }
+
     impl Default for ContentType {
         fn default() -> Self {
             Self::OctetSteam
         }
     }
     
-    impl TryFrom<&Path> for ContentType {
-        type Error = ();
-
-        fn try_from(file: &Path) -> Result<Self, Self::Error> {
-            if file.metadata().unwrap().is_file() {
-                match file.extension() {
-                    OsStr::new("txt") => Ok(Self::Txt),
-                    OsStr::new("html") => Ok(Self::Html),
-                    OsStr::new("css") => Ok(Self::Css),
-                    OsStr::new("jpg") => Ok(Self::Jpg),
-                    OsStr::new("jpeg") => Ok(Self::Jpeg),
-                    OsStr::new("png") => Ok(Self::Png),
-                    OsStr::new("pdf") => Ok(Self::Pdf),
-                    _ => Ok(Self::OctetSteam),
-                }
-            } else {
-                Err(()) // NotFound
+    impl From<&Path> for ContentType {
+        /// Content type is guessed from the extension of the file, unknown ones are served as octet stream.
+        fn from(file: &Path) -> Self {
+            match file.extension().and_then(|extension| extension.to_str()) {
+                Some("txt") => Self::Txt,
+                Some("html") => Self::Html,
+                Some("css") => Self::Css,
+                Some("jpg") => Self::Jpg,
+                Some("jpeg") => Self::Jpeg,
+                Some("png") => Self::Png,
+                Some("pdf") => Self::Pdf,
+                _ => Self::OctetSteam,
+            }
+        }
+    }
+    // endregion
+
+    // region Content-Encoding
+    #[non_exhaustive]
+    #[derive(Debug, Copy, Clone, Hash, Eq, PartialEq)]
+    pub enum ContentEncoding {
+        Gzip,
+    }
+
+    impl ContentEncoding {
+        pub const GZIP_REPR: &'static str = "gzip";
+    }
+
+    impl Display for ContentEncoding {
+        fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
+            match self {
+                ContentEncoding::Gzip => write!(f, "{}", Self::GZIP_REPR),
             }
         }
     }
@@ -264,25 +313,27 @@ pub mod general_header {
 
     // region Connection-Type
     #[non_exhaustive]
-    #[derive(Debug, Clone, Hash, Eq, PartialEq)]
+    #[derive(Debug, Copy, Clone, Hash, Eq, PartialEq)]
     pub enum ConnectionType {
         KeepAlive,
         Close,
     }
 
     impl ConnectionType {
-        const KEEP_ALIVE_REPR: &'static str = "KeepAlive";
-        const CLOSE_REPR: &'static str = "Close";
+        const KEEP_ALIVE_REPR: &'static str = "keep-alive";
+        const CLOSE_REPR: &'static str = "close";
     }
 
     impl FromStr for ConnectionType {
         type Err = ();
 
         fn from_str(s: &str) -> std::result::Result<Self, Self::Err> {
-            match s {
-                Self::KEEP_ALIVE_REPR => Ok(Self::KeepAlive),
-                Self::CLOSE_REPR => Ok(Self::Close),
-                _ => Err(()),
+            if s.eq_ignore_ascii_case(Self::KEEP_ALIVE_REPR) {
+                Ok(Self::KeepAlive)
+            } else if s.eq_ignore_ascii_case(Self::CLOSE_REPR) {
+                Ok(Self::Close)
+            } else {
+                Err(())
             }
         }
     }
@@ -333,8 +384,7 @@ pub mod request_header {
 
         pub fn parse(name: &str, value: &str) -> Result<Self, ParseHeaderError> {
             if name.trim().to_lowercase() == patterns::HOST {
-                return if let Some(sep_index) = value.find(':') {
-                    let (domain, port) = value.split_at(sep_index);
+                return if let Some((domain, port)) = value.split_once(':') {
                     let port = port.parse().map_err(|_| {
                         UnsupportedHeaderError::UnsupportedValue(name.to_owned(), value.to_owned())
                     })?;
@@ -442,12 +492,15 @@ impl Headers {
         let mut response_headers = Vec::new();
         let mut entity_headers = Vec::new();
 
-        for header in headers.split("\r\n").map(|line |parser.parse(line)?) {
-            match header {
-                Header::General(general) => { general_headers.push(general); }
-                Header::Request(request) => { request_headers.push(request); }
-                Header::Response(response) => { response_headers.push(response); }
-                Header::Entity(entity) => { entity_headers.push(entity); }
+        for line in headers.split(CRLF).filter(|line| !line.is_empty()) {
+            match parser.parse(line) {
+                Ok(Header::General(general)) => { general_headers.push(general); }
+                Ok(Header::Request(request)) => { request_headers.push(request); }
+                Ok(Header::Response(response)) => { response_headers.push(response); }
+                Ok(Header::Entity(entity)) => { entity_headers.push(entity); }
+                /* Headers we do not understand do not change the meaning of supported ones, they are ignored. */
+                Err(ParseHeaderError::Unsupported(_)) => {}
+                Err(err) => return Err(err),
             }
         }
 
@@ -457,8 +510,8 @@ impl Headers {
 
         Ok(Self::new(
             Rc::from(general_headers.into_boxed_slice()),
-            response_headers,
             request_headers,
+            response_headers,
             entity_headers,
         ))
     }
@@ -467,6 +520,7 @@ impl Headers {
     pub fn location(&self) -> Option<&Path> {
         self.response_headers
             .iter()
+            .flat_map(|headers| headers.iter())
             .filter_map(|header| if let ResponseHeader::Location(path) = header {
                 Some(path.as_path())
             } else {
@@ -476,22 +530,20 @@ impl Headers {
     }
 
     //noinspection ALL
-    pub fn host(&self) -> Option<(&str, Option<usize>)> {
+    pub fn host(&self) -> Option<(&str, Option<u16>)> {
         self.request_headers
             .iter()
-            .filter_map(|header| if let RequestHeader::Host(host, port) = header {
-                Some((host.as_str(), port.clone()))
-            } else {
-                None
-            })
+            .flat_map(|headers| headers.iter())
+            .map(|RequestHeader::Host(host, port)| (host.as_str(), *port))
             .next()
     }
 
     pub fn content_length(&self) -> Option<usize> {
         self.entity_headers
             .iter()
+            .flat_map(|headers| headers.iter())
             .filter_map(|header| if let EntityHeader::ContentLength(length) = header {
-                Some(length)
+                Some(*length)
             } else {
                 None
             })
@@ -501,8 +553,9 @@ impl Headers {
     pub fn content_type(&self) -> Option<ContentType> {
         self.entity_headers
             .iter()
+            .flat_map(|headers| headers.iter())
             .filter_map(|header| if let EntityHeader::ContentType(ct) = header {
-                Some(ct)
+                Some(ct.clone())
             } else {
                 None
             })
@@ -513,11 +566,7 @@ impl Headers {
     pub fn connection(&self) -> Option<ConnectionType> {
         self.general_headers
             .iter()
-            .filter_map(|header| if let GeneralHeader::Connection(connection) = header {
-                Some(connection)
-            } else {
-                None
-            })
+            .map(|GeneralHeader::Connection(connection)| connection.clone())
             .next()
     }
     // endregion
@@ -525,17 +574,17 @@ impl Headers {
 
 impl Display for Headers {
     fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
-        for header in self.general_headers {
-            write!(f, "{}", header)?;
+        for header in self.general_headers.iter() {
+            write!(f, "{}{}", header, CRLF)?;
         }
         if let Some(headers) = &self.response_headers {
-            for header in headers {
-                write!(f, "{}", header)?;
+            for header in headers.iter() {
+                write!(f, "{}{}", header, CRLF)?;
             }
         }
         if let Some(headers) = &self.entity_headers {
-            for header in headers {
-                write!(f, "{}", header)?;
+            for header in headers.iter() {
+                write!(f, "{}{}", header, CRLF)?;
             }
         }
         std::fmt::Result::Ok(())
@@ -546,12 +595,13 @@ impl Display for Headers {
 pub trait HeaderParser : Default {
     fn parse(&self, line: &str) -> Result<Header, ParseHeaderError>;
 
+    /// Splits header line with trailing CRLF already removed into trimmed name and value.
     fn generic_parse(line: &str) -> Result<(&str, &str), InvalidHeaderFormatError> {
-        if !line.ends_with("\r\n") {
+        if line.contains(CRLF) {
             return Err(InvalidHeaderFormatError::CrlfMissing);
         }
-        if let Some(index) = line.find(':') {
-            return Ok(line.split_at(index));
+        if let Some((name, value)) = line.split_once(':') {
+            return Ok((name.trim(), value.trim()));
         }
         Err(InvalidHeaderFormatError::ColonMissing)
     }
@@ -564,7 +614,9 @@ pub struct SimpleHeaderParser {
 
 impl HeaderParser for SimpleHeaderParser {
     fn parse(&self, line: &str) -> Result<Header, ParseHeaderError> {
-        let (name, value) = HeaderParser::generic_parse(line).map_err(ParseHeaderError::from)?;
+        let (name, value) = Self::generic_parse(line).map_err(ParseHeaderError::from)?;
+        let name = name.to_ascii_lowercase();
+        let name = name.as_str();
         if self.supported_request_headers.contains(name) {
             return Ok(Header::Request(request_header::RequestHeader::parse(
                 name, value,
@@ -5,5 +5,6 @@
 pub mod common;
 pub mod entity;
 pub mod headers;
+pub mod parser;
 pub mod request;
 pub mod response;
@@ -0,0 +1,510 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes incremental parser of HTTP/1.x request heads.
+//! Parser is fed with a buffer that grows with every read from the socket and resumes at the first line
+//! it has not parsed yet. Parsed request is returned as slices borrowed from that buffer, nothing is allocated.
+
+use std::ops::Range;
+use super::common::{Method, Version};
+use super::headers::general_header::ConnectionType;
+
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum ParseError {
+    InvalidStartLine,
+    UnsupportedMethod,
+    UnsupportedVersion,
+    InvalidHeader,
+}
+
+/// Head of a request, borrowed from the buffer it was parsed from.
+#[derive(Debug, Copy, Clone)]
+pub struct RequestHead<'a> {
+    pub method: Method,
+    pub target: &'a [u8],
+    pub version: Version,
+    /* Domain from the Host header, without the port. */
+    pub host: Option<&'a [u8]>,
+    pub connection: Option<ConnectionType>,
+    pub range: Option<&'a [u8]>,
+    pub if_none_match: Option<&'a [u8]>,
+    pub accept_encoding: Option<&'a [u8]>,
+    /* Length of the body from Content-Length, body is never used, it is skipped before the next request. */
+    pub body_length: usize,
+    /* Transfer-Encoding or a malformed or conflicting Content-Length, it is not known where the body ends. */
+    pub is_body_unframed: bool,
+}
+
+/// Position of a value in the parsed buffer.
+#[derive(Debug, Copy, Clone, Default)]
+struct Span {
+    start: usize,
+    end: usize,
+}
+
+impl Span {
+    fn of<'a>(&self, buffer: &'a [u8]) -> &'a [u8] {
+        &buffer[self.start..self.end]
+    }
+}
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+enum State {
+    StartLine,
+    Headers,
+    /* Holds length of the head including the empty line. */
+    Complete(usize),
+}
+
+pub struct RequestParser {
+    state: State,
+    /* Start of the first line that has not been parsed yet. */
+    line_start: usize,
+    /* Bytes past `line_start` that are known not to contain the end of the line. */
+    scanned_length: usize,
+    method: Method,
+    target: Span,
+    version: Version,
+    host: Option<Span>,
+    connection: Option<ConnectionType>,
+    range: Option<Span>,
+    if_none_match: Option<Span>,
+    accept_encoding: Option<Span>,
+    body_length: Option<usize>,
+    is_body_unframed: bool,
+}
+
+impl RequestParser {
+    pub fn new() -> Self {
+        Self {
+            state: State::StartLine,
+            line_start: 0,
+            scanned_length: 0,
+            method: Method::GET,
+            target: Span::default(),
+            version: Version::V1_1,
+            host: None,
+            connection: None,
+            range: None,
+            if_none_match: None,
+            accept_encoding: None,
+            body_length: None,
+            is_body_unframed: false,
+        }
+    }
+
+    /// Prepares parser for the next request, which starts at the beginning of the buffer.
+    pub fn reset(&mut self) {
+        *self = Self::new();
+    }
+
+    /// Parses lines of `buffer` completed since the previous call. Buffer has to hold the same bytes
+    /// between calls, it may only grow. Returns length of the head once its empty line has been parsed.
+    pub fn parse(&mut self, buffer: &[u8]) -> Result<Option<usize>, ParseError> {
+        loop {
+            if let State::Complete(head_length) = self.state {
+                return Ok(Some(head_length));
+            }
+            let search_start = self.line_start + self.scanned_length;
+            let line_length = match find_byte(&buffer[search_start..], b'\n') {
+                Some(position) => search_start + position - self.line_start,
+                None => {
+                    self.scanned_length = buffer.len() - self.line_start;
+                    return Ok(None);
+                }
+            };
+            let line_span = Span { start: self.line_start, end: self.line_start + line_length };
+            self.line_start += line_length + 1;
+            self.scanned_length = 0;
+            /* Bare LF is accepted as the line terminator as well. */
+            let line_span = match line_span.of(buffer).last() {
+                Some(b'\r') => Span { end: line_span.end - 1, ..line_span },
+                _ => line_span,
+            };
+            match self.state {
+                /* Empty lines preceding the request line are ignored. */
+                State::StartLine if line_span.start == line_span.end => {}
+                State::StartLine => {
+                    self.parse_start_line(buffer, line_span)?;
+                    self.state = State::Headers;
+                }
+                State::Headers if line_span.start == line_span.end => self.state = State::Complete(self.line_start),
+                State::Headers => self.parse_header(buffer, line_span)?,
+                State::Complete(_) => unreachable!(),
+            }
+        }
+    }
+
+    /// Parsed head, it must be called after `parse` returned its length.
+    pub fn head<'a>(&self, buffer: &'a [u8]) -> RequestHead<'a> {
+        debug_assert!(matches!(self.state, State::Complete(_)));
+        RequestHead {
+            method: self.method,
+            target: self.target.of(buffer),
+            version: self.version,
+            host: self.host.map(|host| host.of(buffer)),
+            connection: self.connection,
+            range: self.range.map(|range| range.of(buffer)),
+            if_none_match: self.if_none_match.map(|if_none_match| if_none_match.of(buffer)),
+            accept_encoding: self.accept_encoding.map(|accept_encoding| accept_encoding.of(buffer)),
+            body_length: self.body_length.unwrap_or(0),
+            is_body_unframed: self.is_body_unframed,
+        }
+    }
+
+    fn parse_start_line(&mut self, buffer: &[u8], line: Span) -> Result<(), ParseError> {
+        let bytes = line.of(buffer);
+        let method_end = find_byte(bytes, b' ').ok_or(ParseError::InvalidStartLine)?;
+        let target_end = find_byte(&bytes[method_end + 1..], b' ')
+            .map(|position| method_end + 1 + position)
+            .ok_or(ParseError::InvalidStartLine)?;
+        if target_end == method_end + 1 {
+            return Err(ParseError::InvalidStartLine);
+        }
+        self.method = Method::from_bytes(&bytes[..method_end]).ok_or(ParseError::UnsupportedMethod)?;
+        self.version = Version::from_bytes(&bytes[target_end + 1..]).ok_or(ParseError::UnsupportedVersion)?;
+        self.target = Span { start: line.start + method_end + 1, end: line.start + target_end };
+        Ok(())
+    }
+
+    fn parse_header(&mut self, buffer: &[u8], line: Span) -> Result<(), ParseError> {
+        let bytes = line.of(buffer);
+        let colon = find_byte(bytes, b':').ok_or(ParseError::InvalidHeader)?;
+        let name = &bytes[..colon];
+        /* Whitespace between the name and the colon is forbidden, it is a known smuggling vector. */
+        if name.is_empty() || name.last().map_or(false, u8::is_ascii_whitespace) {
+            return Err(ParseError::InvalidHeader);
+        }
+        let value = trim(Span { start: line.start + colon + 1, end: line.end }, buffer);
+        match header_name(name) {
+            Some(HeaderName::Host) => {
+                let host = value.of(buffer);
+                /* Port is irrelevant for the choice of the domain. */
+                let domain_length = host.iter().rposition(|&byte| byte == b':').unwrap_or(host.len());
+                self.host = Some(Span { end: value.start + domain_length, ..value });
+            }
+            Some(HeaderName::Connection) => {
+                let tokens = value.of(buffer).split(|&byte| byte == b',').map(|token| token.trim_ascii());
+                for token in tokens {
+                    if token.eq_ignore_ascii_case(b"close") {
+                        self.connection = Some(ConnectionType::Close);
+                    } else if token.eq_ignore_ascii_case(b"keep-alive") && self.connection.is_none() {
+                        self.connection = Some(ConnectionType::KeepAlive);
+                    }
+                }
+            }
+            Some(HeaderName::Range) => self.range = Some(value),
+            Some(HeaderName::IfNoneMatch) => self.if_none_match = Some(value),
+            Some(HeaderName::AcceptEncoding) => self.accept_encoding = Some(value),
+            /* Body would be taken for the next request if its length was misjudged, doubtful lengths are not trusted. */
+            Some(HeaderName::ContentLength) => match parse_number(value.of(buffer)) {
+                Some(length) if self.body_length.map_or(true, |previous| previous == length) => {
+                    self.body_length = Some(length);
+                }
+                _ => self.is_body_unframed = true,
+            },
+            Some(HeaderName::TransferEncoding) => self.is_body_unframed = true,
+            /* Headers we do not understand do not change the meaning of supported ones, they are ignored. */
+            None => {}
+        }
+        Ok(())
+    }
+}
+
+impl Default for RequestParser {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+fn trim(span: Span, buffer: &[u8]) -> Span {
+    let bytes = span.of(buffer);
+    let is_whitespace = |byte: &u8| *byte == b' ' || *byte == b'\t';
+    let start = bytes.iter().position(|byte| !is_whitespace(byte)).unwrap_or(bytes.len());
+    let end = bytes.iter().rposition(|byte| !is_whitespace(byte)).map_or(start, |position| position + 1);
+    Span { start: span.start + start, end: span.start + end }
+}
+
+
+/// Position of the first `needle` in `haystack`.
+/// Eight bytes are tested at once with SWAR, the lowest byte of `word ^ pattern` that is zero is the match.
+pub fn find_byte(haystack: &[u8], needle: u8) -> Option<usize> {
+    const LOW_BITS: u64 = 0x0101_0101_0101_0101;
+    const HIGH_BITS: u64 = 0x8080_8080_8080_8080;
+    let pattern = LOW_BITS * needle as u64;
+    let mut words = haystack.chunks_exact(8);
+    let mut offset = 0;
+    for word in &mut words {
+        let word = u64::from_le_bytes(word.try_into().unwrap()) ^ pattern;
+        /* Bits above the lowest zero byte may be false positives, the lowest one never is. */
+        let zero_bytes = word.wrapping_sub(LOW_BITS) & !word & HIGH_BITS;
+        if zero_bytes != 0 {
+            return Some(offset + (zero_bytes.trailing_zeros() / 8) as usize);
+        }
+        offset += 8;
+    }
+    words.remainder().iter().position(|&byte| byte == needle).map(|position| offset + position)
+}
+
+
+// region Header values
+#[derive(Debug, Clone, Eq, PartialEq)]
+pub enum ByteRange {
+    Satisfiable(Range<usize>),
+    Unsatisfiable,
+    /* Malformed ranges and sets of several ranges, the whole representation is sent instead. */
+    Ignored,
+}
+
+fn parse_number(bytes: &[u8]) -> Option<usize> {
+    if bytes.is_empty() || bytes.len() > 19 || !bytes.iter().all(u8::is_ascii_digit) {
+        return None;
+    }
+    Some(bytes.iter().fold(0, |number, digit| number * 10 + (digit - b'0') as usize))
+}
+
+/// Parses value of the Range header of a request for representation of `length` bytes.
+/// Only single ranges are supported: `bytes=first-last`, `bytes=first-` and `bytes=-suffix_length`.
+pub fn parse_byte_range(value: &[u8], length: usize) -> ByteRange {
+    let range = match value.strip_prefix(b"bytes=") {
+        Some(range) if find_byte(range, b',').is_none() => range.trim_ascii(),
+        _ => return ByteRange::Ignored,
+    };
+    let dash = match find_byte(range, b'-') {
+        Some(dash) => dash,
+        None => return ByteRange::Ignored,
+    };
+    let (first, last) = (&range[..dash], &range[dash + 1..]);
+    let range = match (parse_number(first), parse_number(last)) {
+        (Some(first), Some(last)) if first <= last => first..(last + 1).min(length),
+        (Some(first), None) if last.is_empty() => first..length,
+        (None, Some(suffix_length)) if first.is_empty() => length.saturating_sub(suffix_length)..length,
+        _ => return ByteRange::Ignored,
+    };
+    if range.start >= length || range.is_empty() {
+        return ByteRange::Unsatisfiable;
+    }
+    ByteRange::Satisfiable(range)
+}
+
+/// Whether `etag` is listed in the value of the If-None-Match header, weak comparison is used as RFC 9110 requires.
+pub fn etag_matches(if_none_match: &[u8], etag: &str) -> bool {
+    fn strip_weakness(tag: &[u8]) -> &[u8] {
+        tag.strip_prefix(b"W/").unwrap_or(tag)
+    }
+    let etag = strip_weakness(etag.as_bytes());
+    if_none_match
+        .split(|&byte| byte == b',')
+        .map(|tag| tag.trim_ascii())
+        .any(|tag| tag == b"*" || strip_weakness(tag) == etag)
+}
+
+/// Whether `coding` is acceptable according to the value of the Accept-Encoding header.
+/// Coding listed by name takes precedence over the `*` wildcard and quality 0 means not acceptable.
+pub fn accepts_encoding(accept_encoding: &[u8], coding: &str) -> bool {
+    fn is_acceptable(parameters: &[u8]) -> bool {
+        let quality = parameters
+            .split(|&byte| byte == b';')
+            .map(|parameter| parameter.trim_ascii())
+            .find_map(|parameter| parameter.strip_prefix(b"q=").or_else(|| parameter.strip_prefix(b"Q=")));
+        quality.map_or(true, |quality| quality.iter().any(|&byte| byte.is_ascii_digit() && byte != b'0'))
+    }
+    let mut wildcard = false;
+    for element in accept_encoding.split(|&byte| byte == b',') {
+        let (name, parameters) = match find_byte(element, b';') {
+            Some(semicolon) => (&element[..semicolon], &element[semicolon + 1..]),
+            None => (element, &b""[..]),
+        };
+        let name = name.trim_ascii();
+        if name.eq_ignore_ascii_case(coding.as_bytes()) {
+            return is_acceptable(parameters);
+        }
+        if name == b"*" {
+            wildcard = is_acceptable(parameters);
+        }
+    }
+    wildcard
+}
+// endregion
+
+
+// region Header names
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+enum HeaderName {
+    Host,
+    Connection,
+    Range,
+    IfNoneMatch,
+    AcceptEncoding,
+    ContentLength,
+    TransferEncoding,
+}
+
+const SUPPORTED_HEADERS: [(&[u8], HeaderName); 7] = [
+    (b"host", HeaderName::Host),
+    (b"connection", HeaderName::Connection),
+    (b"range", HeaderName::Range),
+    (b"if-none-match", HeaderName::IfNoneMatch),
+    (b"accept-encoding", HeaderName::AcceptEncoding),
+    (b"content-length", HeaderName::ContentLength),
+    (b"transfer-encoding", HeaderName::TransferEncoding),
+];
+
+const HEADER_TABLE_SIZE: usize = 16;
+
+/// Perfect hash of supported header names, it only looks at the length and the first and last byte.
+const fn header_slot(name: &[u8]) -> usize {
+    let first = name[0].to_ascii_lowercase() as usize;
+    let last = name[name.len() - 1].to_ascii_lowercase() as usize;
+    (name.len() * 7 + first + last) % HEADER_TABLE_SIZE
+}
+
+/// Table is built at compile time, which fails if the hash stops being perfect.
+const HEADER_TABLE: [Option<(&[u8], HeaderName)>; HEADER_TABLE_SIZE] = {
+    let mut table: [Option<(&[u8], HeaderName)>; HEADER_TABLE_SIZE] = [None; HEADER_TABLE_SIZE];
+    let mut index = 0;
+    while index < SUPPORTED_HEADERS.len() {
+        let slot = header_slot(SUPPORTED_HEADERS[index].0);
+        assert!(table[slot].is_none(), "header names collide, change header_slot");
+        table[slot] = Some(SUPPORTED_HEADERS[index]);
+        index += 1;
+    }
+    table
+};
+
+fn header_name(name: &[u8]) -> Option<HeaderName> {
+    if name.is_empty() {
+        return None;
+    }
+    match HEADER_TABLE[header_slot(name)] {
+        Some((candidate, header)) if candidate.eq_ignore_ascii_case(name) => Some(header),
+        _ => None,
+    }
+}
+// endregion
+
+
+#[cfg(test)]
+mod tests {
+    use super::{accepts_encoding, etag_matches, find_byte, header_name, parse_byte_range, ByteRange, HeaderName, ParseError, RequestParser};
+    use crate::http::common::Version;
+    use crate::http::headers::general_header::ConnectionType;
+
+    const REQUEST: &[u8] = b"GET /index.html?x=1 HTTP/1.1\r\nHost: localhost:8888\r\nAccept: */*\r\nconnection:  Close \r\n\r\nGET /";
+
+    #[test]
+    fn test_parse_complete_request() {
+        let mut parser = RequestParser::new();
+        let head_length = parser.parse(REQUEST).unwrap().unwrap();
+        assert_eq!(REQUEST.len() - b"GET /".len(), head_length);
+        let head = parser.head(REQUEST);
+        assert_eq!(b"/index.html?x=1", head.target);
+        assert!(matches!(head.version, Version::V1_1));
+        assert_eq!(Some(&b"localhost"[..]), head.host);
+        assert_eq!(Some(ConnectionType::Close), head.connection);
+    }
+
+    #[test]
+    fn test_parse_in_every_split() {
+        for split in 0..REQUEST.len() {
+            let mut parser = RequestParser::new();
+            let first = parser.parse(&REQUEST[..split]).unwrap();
+            let head_length = first.or_else(|| parser.parse(REQUEST).unwrap()).unwrap();
+            assert_eq!(REQUEST.len() - b"GET /".len(), head_length, "split at {split}");
+            assert_eq!(Some(&b"localhost"[..]), parser.head(REQUEST).host);
+        }
+    }
+
+    #[test]
+    fn test_bare_line_feeds_and_leading_empty_lines() {
+        let request = b"\r\nGET / HTTP/1.0\nHost: lab108-18\n\n";
+        let mut parser = RequestParser::new();
+        assert_eq!(Some(request.len()), parser.parse(request).unwrap());
+        let head = parser.head(request);
+        assert!(matches!(head.version, Version::V1));
+        assert_eq!(None, head.connection);
+    }
+
+    #[test]
+    fn test_request_bodies() {
+        let body = |request: &[u8]| {
+            let mut parser = RequestParser::new();
+            parser.parse(request).unwrap().unwrap();
+            let head = parser.head(request);
+            (head.body_length, head.is_body_unframed)
+        };
+        assert_eq!((27, false), body(b"GET / HTTP/1.1\r\nContent-Length: 27\r\n\r\nGET /secret HTTP/1.1\r\n\r\n"));
+        assert_eq!((27, false), body(b"GET / HTTP/1.1\r\nContent-Length: 27\r\ncontent-length: 27\r\n\r\n"));
+        assert_eq!((0, true), body(b"GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"));
+        assert_eq!((0, true), body(b"GET / HTTP/1.1\r\nContent-Length: 0\r\nContent-Length: 5\r\n\r\n"));
+        assert_eq!((0, true), body(b"GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n"));
+        assert_eq!((0, false), body(REQUEST));
+    }
+
+    #[test]
+    fn test_reject_malformed_requests() {
+        let parse = |request: &[u8]| RequestParser::new().parse(request);
+        assert_eq!(Err(ParseError::InvalidStartLine), parse(b"GET /\r\n\r\n"));
+        assert_eq!(Err(ParseError::UnsupportedMethod), parse(b"POST / HTTP/1.1\r\n\r\n"));
+        assert_eq!(Err(ParseError::UnsupportedVersion), parse(b"GET / HTTP/2\r\n\r\n"));
+        assert_eq!(Err(ParseError::InvalidHeader), parse(b"GET / HTTP/1.1\r\nHost localhost\r\n\r\n"));
+        assert_eq!(Err(ParseError::InvalidHeader), parse(b"GET / HTTP/1.1\r\nHost : localhost\r\n\r\n"));
+        assert_eq!(Ok(None), parse(b"GET / HTTP/1.1\r\nHost: localhost\r\n"));
+    }
+
+    #[test]
+    fn test_parse_byte_range() {
+        assert_eq!(ByteRange::Satisfiable(0..500), parse_byte_range(b"bytes=0-499", 1000));
+        assert_eq!(ByteRange::Satisfiable(500..1000), parse_byte_range(b"bytes=500-", 1000));
+        assert_eq!(ByteRange::Satisfiable(900..1000), parse_byte_range(b"bytes=-100", 1000));
+        assert_eq!(ByteRange::Satisfiable(0..1000), parse_byte_range(b"bytes=-5000", 1000));
+        assert_eq!(ByteRange::Satisfiable(990..1000), parse_byte_range(b"bytes=990-5000", 1000));
+        assert_eq!(ByteRange::Unsatisfiable, parse_byte_range(b"bytes=1000-", 1000));
+        assert_eq!(ByteRange::Unsatisfiable, parse_byte_range(b"bytes=-0", 1000));
+        assert_eq!(ByteRange::Ignored, parse_byte_range(b"bytes=5-1", 1000));
+        assert_eq!(ByteRange::Ignored, parse_byte_range(b"bytes=0-1,5-6", 1000));
+        assert_eq!(ByteRange::Ignored, parse_byte_range(b"items=0-1", 1000));
+    }
+
+    #[test]
+    fn test_etag_matches() {
+        assert!(etag_matches(b"\"a-1\"", "\"a-1\""));
+        assert!(etag_matches(b"\"b\", W/\"a-1\"", "\"a-1\""));
+        assert!(etag_matches(b"*", "\"a-1\""));
+        assert!(!etag_matches(b"\"a-2\"", "\"a-1\""));
+    }
+
+    #[test]
+    fn test_accepts_encoding() {
+        assert!(accepts_encoding(b"gzip, deflate, br", "gzip"));
+        assert!(accepts_encoding(b"br;q=1.0, GZIP;q=0.5", "gzip"));
+        assert!(accepts_encoding(b"*", "gzip"));
+        assert!(!accepts_encoding(b"gzip;q=0, *", "gzip"));
+        assert!(!accepts_encoding(b"*;q=0.000", "gzip"));
+        assert!(!accepts_encoding(b"deflate, br", "gzip"));
+        assert!(!accepts_encoding(b"", "gzip"));
+    }
+
+    #[test]
+    fn test_header_names() {
+        assert_eq!(Some(HeaderName::Host), header_name(b"HOST"));
+        assert_eq!(Some(HeaderName::Connection), header_name(b"Connection"));
+        assert_eq!(Some(HeaderName::Range), header_name(b"Range"));
+        assert_eq!(Some(HeaderName::IfNoneMatch), header_name(b"If-None-Match"));
+        assert_eq!(Some(HeaderName::AcceptEncoding), header_name(b"Accept-Encoding"));
+        assert_eq!(Some(HeaderName::ContentLength), header_name(b"Content-Length"));
+        assert_eq!(Some(HeaderName::TransferEncoding), header_name(b"Transfer-Encoding"));
+        assert_eq!(None, header_name(b"hose"));
+        assert_eq!(None, header_name(b"x"));
+    }
+
+    #[test]
+    fn test_find_byte() {
+        let haystack = b"0123456789abcdef:ghij";
+        for (position, &byte) in haystack.iter().enumerate() {
+            assert_eq!(Some(position), find_byte(haystack, byte));
+        }
+        assert_eq!(None, find_byte(haystack, b'\n'));
+        assert_eq!(Some(9), find_byte(b"\x01\x01\x01\x01\x01\x01\x01\x01\x01\x00", 0));
+    }
+}
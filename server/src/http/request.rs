@@ -5,8 +5,8 @@ use super::common::{
 };
 use super::headers::{
     ParseHeaderError,
-    HeaderParser,
-    Headers
+    Headers,
+    SimpleHeaderParser,
 };
 use std::fmt::{Display, Formatter};
 use std::path::{Path, PathBuf};
@@ -162,9 +162,9 @@ impl TryFrom<&[u8]> for RequestMetaData {
         let sep = metadata
             .find(CRLF)
             .ok_or_else(|| Self::Error::ParseStartLineError(ParseStartLineError::InvalidFormatError(metadata.to_owned())))?;
-        let (start_line, [_, _, headers_repr @ ..]) = metadata.split_at(sep);
+        let (start_line, headers_repr) = (&metadata[..sep], &metadata[sep + CRLF.len()..]);
         let start_line = start_line.parse()?;
-        let headers = Headers::parse(headers_repr)?;
+        let headers = Headers::parse::<SimpleHeaderParser>(headers_repr)?;
 
         Ok(Self { start_line, headers })
     }
@@ -192,6 +192,11 @@ impl Request {
         &self.start_line
     }
 
+    /// Domain from the `Host` header, without the port.
+    pub fn host(&self) -> Option<&str> {
+        self.headers.host().map(|(domain, _)| domain)
+    }
+
     pub fn section_sep_pos(data: &[u8]) -> Option<usize> {
         data.windows(Self::SECTION_SEP.len()).position(|wind| wind == Self::SECTION_SEP)
     }
@@ -208,6 +213,12 @@ impl From<ParseStartLineError> for ParseRequestError {
     }
 }
 
+impl From<ParseHeaderError> for ParseRequestError {
+    fn from(err: ParseHeaderError) -> Self {
+        Self::ParseHeaderError(err)
+    }
+}
+
 impl From<Utf8Error> for ParseRequestError {
     fn from(err: Utf8Error) -> Self {
         Self::InvalidUtf8Error(err)
@@ -3,7 +3,6 @@
 #[allow(dead_code, unused)]
 
 use super::common::{Body, Version};
-use super::headers::{general_header::GeneralHeader, response_header::ResponseHeader};
 use std::fmt::{Display, Formatter};
 use crate::http::common;
 use crate::http::headers::Headers;
@@ -28,23 +27,32 @@ impl Display for StatusLine {
 #[non_exhaustive]
 pub enum StatusCode {
     Ok,
+    PartialContent,
     MovedPermanently,
+    NotModified,
     Forbidden,
     NotFound,
+    RangeNotSatisfiable,
     NotImplemented,
 }
 
 impl StatusCode {
     const OK_CODE: usize = 200;
+    const PARTIAL_CONTENT_CODE: usize = 206;
     const MOVED_PERMANENTLY_CODE: usize = 301;
+    const NOT_MODIFIED_CODE: usize = 304;
     const FORBIDDEN_CODE: usize = 403;
     const NOT_FOUND_CODE: usize = 404;
+    const RANGE_NOT_SATISFIABLE_CODE: usize = 416;
     const NOT_IMPLEMENTED_CODE: usize = 501;
 
     const OK_MESSAGE: &'static str = "OK";
+    const PARTIAL_CONTENT_MESSAGE: &'static str = "Partial Content";
     const MOVED_PERMANENTLY_MESSAGE: &'static str = "Moved Permanently";
+    const NOT_MODIFIED_MESSAGE: &'static str = "Not Modified";
     const FORBIDDEN_MESSAGE: &'static str = "Forbidden";
     const NOT_FOUND_MESSAGE: &'static str = "Not Found";
+    const RANGE_NOT_SATISFIABLE_MESSAGE: &'static str = "Range Not Satisfiable";
     const NOT_IMPLEMENTED_MESSAGE: &'static str = "Not Implemented";
 }
 
@@ -52,6 +60,11 @@ impl Display for StatusCode {
     fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
         let (code, message) = match &self {
             StatusCode::Ok => (Self::OK_CODE, Self::OK_MESSAGE),
+            StatusCode::PartialContent => (Self::PARTIAL_CONTENT_CODE, Self::PARTIAL_CONTENT_MESSAGE),
+            StatusCode::NotModified => (Self::NOT_MODIFIED_CODE, Self::NOT_MODIFIED_MESSAGE),
+            StatusCode::RangeNotSatisfiable => {
+                (Self::RANGE_NOT_SATISFIABLE_CODE, Self::RANGE_NOT_SATISFIABLE_MESSAGE)
+            }
             StatusCode::MovedPermanently => (
                 Self::MOVED_PERMANENTLY_CODE,
                 Self::MOVED_PERMANENTLY_MESSAGE,
@@ -70,7 +83,8 @@ pub struct Response {
     status_line: StatusLine,
     headers: Headers,
     body: Option<Body>,
-    buffer: Vec<u8>,
+    /* Status line and headers, formatted once. Body is shared with the entity and is not copied. */
+    head: Vec<u8>,
 }
 
 impl Response {
@@ -85,24 +99,31 @@ impl Response {
             status_line,
             headers,
             body,
-            buffer: Vec::new(),
+            head: Vec::new(),
         };
-        instance.buffer.extend_from_slice(instance.to_string().as_bytes());
-        if let Some(body) = &instance.body {
-            instance.buffer.extend_from_slice(body.as_ref())
-        }
+        instance.head = instance.to_string().into_bytes();
         instance
     }
 }
 
-impl Display for Response {
-    fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
-        write!(f, "{}{}{}", self.status_line, self.headers, common::CRLF)
+impl Response {
+    /// Status line and headers together with the section separator.
+    pub fn head(&self) -> &[u8] {
+        self.head.as_ref()
+    }
+
+    pub fn body(&self) -> Option<&Body> {
+        self.body.as_ref()
+    }
+
+    /// Total number of bytes of the response.
+    pub fn len(&self) -> usize {
+        self.head.len() + self.body().map_or(0, |body| body.range().len())
     }
 }
 
-impl AsRef<[u8]> for Response {
-    fn as_ref(&self) -> &[u8] {
-        self.buffer.as_ref()
+impl Display for Response {
+    fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
+        write!(f, "{}{}{}", self.status_line, self.headers, common::CRLF)
     }
 }
@@ -0,0 +1,151 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes least recently used cache bounded by the total size of its values.
+
+use std::borrow::Borrow;
+use std::collections::{BTreeMap, HashMap};
+use std::hash::Hash;
+
+
+struct Entry<V> {
+    value: V,
+    size: usize,
+    /* Position in the recency order, greater is more recent. */
+    last_used: u64,
+}
+
+/// Cache which evicts least recently used values once their total size exceeds `capacity`.
+/// Lookups and insertions take logarithmic time.
+pub struct LruCache<K, V> {
+    entries: HashMap<K, Entry<V>>,
+    recency: BTreeMap<u64, K>,
+    capacity: usize,
+    size: usize,
+    clock: u64,
+}
+
+impl<K: Hash + Eq + Clone, V> LruCache<K, V> {
+    pub fn new(capacity: usize) -> Self {
+        Self { entries: HashMap::new(), recency: BTreeMap::new(), capacity, size: 0, clock: 0 }
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Total size of cached values.
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    fn tick(&mut self) -> u64 {
+        self.clock += 1;
+        self.clock
+    }
+
+    /// Returns the value and marks it as the most recently used one.
+    pub fn get<Q>(&mut self, key: &Q) -> Option<&V>
+    where
+        K: Borrow<Q>,
+        Q: Hash + Eq + ?Sized,
+    {
+        let now = self.tick();
+        let entry = self.entries.get_mut(key)?;
+        let key = self.recency.remove(&entry.last_used).unwrap();
+        self.recency.insert(now, key);
+        entry.last_used = now;
+        Some(&entry.value)
+    }
+
+    /// Inserts value replacing the previous one and evicts least recently used values until it fits.
+    /// Values larger than the capacity are not cached at all.
+    pub fn insert(&mut self, key: K, value: V, size: usize) {
+        self.remove(&key);
+        if size > self.capacity {
+            return;
+        }
+        while self.size + size > self.capacity {
+            let (_, evicted_key) = self.recency.pop_first().unwrap();
+            let evicted = self.entries.remove(&evicted_key).unwrap();
+            self.size -= evicted.size;
+        }
+        let now = self.tick();
+        self.recency.insert(now, key.clone());
+        self.entries.insert(key, Entry { value, size, last_used: now });
+        self.size += size;
+    }
+
+    pub fn remove<Q>(&mut self, key: &Q) -> Option<V>
+    where
+        K: Borrow<Q>,
+        Q: Hash + Eq + ?Sized,
+    {
+        let entry = self.entries.remove(key)?;
+        self.recency.remove(&entry.last_used);
+        self.size -= entry.size;
+        Some(entry.value)
+    }
+
+    /// Removes all values whose keys do not satisfy the predicate.
+    pub fn retain<F: FnMut(&K) -> bool>(&mut self, mut predicate: F) {
+        let Self { entries, recency, size, .. } = self;
+        entries.retain(|key, entry| {
+            let keep = predicate(key);
+            if !keep {
+                recency.remove(&entry.last_used);
+                *size -= entry.size;
+            }
+            keep
+        });
+    }
+
+    pub fn clear(&mut self) {
+        self.entries.clear();
+        self.recency.clear();
+        self.size = 0;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::LruCache;
+
+    #[test]
+    fn test_evicts_least_recently_used() {
+        let mut cache = LruCache::new(10);
+        cache.insert("a", 1, 4);
+        cache.insert("b", 2, 4);
+        assert_eq!(Some(&1), cache.get("a"));
+        cache.insert("c", 3, 4);
+        assert_eq!(None, cache.get("b"));
+        assert_eq!(Some(&1), cache.get("a"));
+        assert_eq!(Some(&3), cache.get("c"));
+        assert_eq!(8, cache.size());
+    }
+
+    #[test]
+    fn test_replace_and_oversized_values() {
+        let mut cache = LruCache::new(10);
+        cache.insert("a", 1, 4);
+        cache.insert("a", 2, 6);
+        assert_eq!((1, 6), (cache.len(), cache.size()));
+        cache.insert("b", 3, 11);
+        assert_eq!(None, cache.get("b"));
+        assert_eq!(Some(&2), cache.get("a"));
+    }
+
+    #[test]
+    fn test_retain() {
+        let mut cache = LruCache::new(100);
+        (0..10).for_each(|key| cache.insert(key, key, 1));
+        cache.retain(|key| key % 2 == 0);
+        assert_eq!((5, 5), (cache.len(), cache.size()));
+        cache.insert(100, 100, 95);
+        assert_eq!(Some(&100), cache.get(&100));
+        assert_eq!(100, cache.size());
+    }
+}
@@ -7,8 +7,20 @@ mod resources;
 mod util;
 mod server;
 mod registry;
+mod timer;
+mod lru;
+mod watcher;
+mod gzip;
+#[cfg(test)]
+mod benchmark;
 
 use libc;
+use std::env;
+use std::net::{Ipv4Addr, SocketAddr};
+use std::path::Path;
+use std::sync::Arc;
+use server::WorkerPool;
+use util::OrFailWithMessage;
 
 /* Resources:
 Max accepted size of GET request: https://stackoverflow.com/questions/2659952/maximum-length-of-http-get-request
@@ -17,6 +29,25 @@ RFC TCP: https://datatracker.ietf.org/doc/html/rfc793
 */
 
 
+/* Usage: server <port> <catalog> [workers], there is one worker per core by default. */
 fn main() {
-    println!("Hello, world!");
+    let mut args = env::args().skip(1);
+    let port: u16 = args.next()
+        .or_fail_with_message("port missing")
+        .parse()
+        .or_fail_with_message("invalid format of port");
+    let catalog = args.next().or_fail_with_message("catalog missing");
+    let worker_count = match args.next() {
+        Some(worker_count) => worker_count.parse().ok().filter(|&count| count > 0)
+            .or_fail_with_message("invalid number of workers"),
+        None => WorkerPool::default_worker_count(),
+    };
+    let catalog: Arc<Path> = Arc::from(Path::new(&catalog));
+    if !catalog.is_dir() {
+        util::fail_with_message("catalog is not a directory");
+    }
+    let address = SocketAddr::from((Ipv4Addr::UNSPECIFIED, port));
+    WorkerPool::start(address, catalog, worker_count)
+        .or_fail_with_message(format!("could not bind tcp socket to {}", address).as_str())
+        .join();
 }
@@ -1,19 +1,16 @@
 //! Mikołaj Depta 328690
 //!
 //! This module exposes epoll wrapper in a form of registry.
+//! File descriptors are registered in edge-triggered mode together with a token,
+//! which is handed back with every event of the descriptor.
 
-use crate::{libc, util};
+use crate::libc;
 use libc::epoll_event;
 
 
-use std::collections::HashMap;
 use std::io;
-use std::os::unix::io::{AsRawFd, RawFd};
-use std::time::{Duration, Instant};
-use crate::util::{OrFailWithMessage};
-
-
-/* TODO: expose EventType instead of epoll_event (in registry' await_event())  */
+use std::os::unix::io::RawFd;
+use std::time::Duration;
 
 
 macro_rules! syscall {
@@ -25,6 +22,8 @@ macro_rules! syscall {
     }
 }
 
+pub(crate) use syscall;
+
 
 #[derive(Debug, Copy, Clone, Hash, Eq, PartialEq)]
 pub enum EventType {
@@ -33,132 +32,123 @@ pub enum EventType {
 }
 
 impl EventType {
-    pub(self) const fn epoll_event(&self) -> epoll_event {
-        match &self {
-            EventType::Read =>  Self::read_event(),
-            EventType::Write => Self::write_event(),
+    const fn epoll_flags(&self) -> u32 {
+        match self {
+            EventType::Read => (libc::EPOLLIN | libc::EPOLLRDHUP) as u32,
+            EventType::Write => libc::EPOLLOUT as u32,
         }
     }
+}
 
-    const fn read_event() -> epoll_event {
-        epoll_event { events: Registry::READ_FLAGS as u32, u64: Registry::READ_KEY }
-    }
 
-    const fn write_event() -> epoll_event {
-        epoll_event { events: Registry::READ_FLAGS as u32, u64: Registry::READ_KEY }
-    }
+/// Readiness of a single registered file descriptor.
+#[derive(Debug, Copy, Clone)]
+pub struct Event {
+    pub token: usize,
+    pub is_readable: bool,
+    pub is_writable: bool,
+    /* Peer closed the connection or an error is pending on the descriptor. */
+    pub is_closed: bool,
 }
 
-impl From<EventType> for epoll_event {
-    fn from(event: EventType) -> Self {
-        match event {
-            EventType::Read => {}
-            EventType::Write => {}
+impl From<&epoll_event> for Event {
+    fn from(event: &epoll_event) -> Self {
+        let flags = event.events;
+        Self {
+            token: event.u64 as usize,
+            is_readable: flags & libc::EPOLLIN as u32 != 0,
+            is_writable: flags & libc::EPOLLOUT as u32 != 0,
+            is_closed: flags & (libc::EPOLLHUP | libc::EPOLLERR) as u32 != 0,
         }
     }
 }
 
-// note: this is very incorrect
-impl From<epoll_event> for EventType {
-    fn from(event: epoll_event) -> Self {
-        if event.events & libc::EPOLLIN as u32 != 0 {
-            Self::Read
-        } else {
-            Self::Write
+
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum TimeoutDuration {
+    Infinite,
+    Finite(Duration)
+}
+
+impl TimeoutDuration {
+    /// Timeout in epoll_wait format, finite timeouts are rounded up to whole milliseconds
+    /// so that waiting never ends before the timeout passes.
+    fn as_epoll_timeout(&self) -> libc::c_int {
+        match self {
+            TimeoutDuration::Infinite => -1,
+            TimeoutDuration::Finite(duration) => {
+                let millis = duration.as_nanos().div_ceil(1_000_000);
+                millis.min(libc::c_int::MAX as u128) as libc::c_int
+            }
         }
     }
 }
 
-pub enum Notification {
-    Timeout,
-    Event(EventType, Duration),
-}
 
 pub struct Registry {
     epoll_fd: RawFd,
     events: Vec<epoll_event>,
-    instances: HashMap<RawFd, HashMap<EventType, epoll_event>>,
-    timeout: Duration,
-}
-
-#[derive(Clone)]
-pub enum TimeoutDuration {
-    Infinite,
-    Finite(Duration)
 }
 
 impl Registry {
-    const READ_EVENT_FLAG: libc::c_int = libc::EPOLLIN;
-    const WRITE_EVENT_FLAGS: libc::c_int = libc::EPOLLOUT;
-    const READ_KEY: u64 = 0;
-    const WRITE_KEY: u64 = 1;
-    const DEFAULT_TIMEOUT: TimeoutDuration = TimeoutDuration::Finite(Duration::from_millis(1500));
-    const MAX_ENTRY_COUNT: usize = 1;
-
+    const EDGE_TRIGGERED_FLAG: u32 = libc::EPOLLET as u32;
+    const MAX_EVENT_COUNT: usize = 1024;
 
     pub fn new() -> io::Result<Self> {
-        Self::with_timeout(Self::DEFAULT_TIMEOUT)
+        let epoll_fd = syscall!(epoll_create1(libc::O_CLOEXEC))?;
+        Ok(Self { epoll_fd, events: Vec::with_capacity(Self::MAX_EVENT_COUNT) })
     }
 
-    pub fn with_timeout(timeout: TimeoutDuration) -> io::Result<Self> {
-        let epoll_fd = syscall!(epoll_create1(libc::O_CLOEXEC)).or_fail_with_message("cannot create an epoll");
-        Ok(Self { epoll_fd, events: Vec::with_capacity(Self::MAX_LISTENER_COUNT), instances: HashMap::new(), timeout })
+    fn epoll_event(token: usize, event_types: &[EventType]) -> epoll_event {
+        let events = event_types.iter().fold(Self::EDGE_TRIGGERED_FLAG, |flags, event_type| flags | event_type.epoll_flags());
+        epoll_event { events, u64: token as u64 }
     }
 
-    /* warning: no checking if the number of registered file descriptors is within MAX_LISTENER_COUNT range. */
-    /// Registers interest in `event_type` for `fd`.
-    pub fn add_interest(&mut self, event_type: EventType, fd: impl AsRawFd) -> io::Result<()> {
-        let fd = fd.as_raw_fd();
-        let new_interest_epoll_event = event_type.epoll_event();
-        self.instances.entry(fd)
-            .and_modify(|interests| { interests.insert(event_type, new_interest_epoll_event); })
-            .or_insert(HashMap::from([(event_type, new_interest_epoll_event)]));
-        let event_args = self.instances.get_mut(&fd).unwrap().get_mut(&event_type).unwrap();
-        syscall!(epoll_ctl(self.epoll_fd, libc::EPOLL_CTL_ADD, fd, event_args))?;
+    /// Registers interest in `event_types` for `fd`, events of the descriptor will carry the `token`.
+    pub fn add_interest(&mut self, fd: RawFd, token: usize, event_types: &[EventType]) -> io::Result<()> {
+        let mut event = Self::epoll_event(token, event_types);
+        syscall!(epoll_ctl(self.epoll_fd, libc::EPOLL_CTL_ADD, fd, &mut event))?;
         Ok(())
     }
 
-    pub fn delete_interest(&mut self, event_type: EventType, fd: impl AsRawFd) -> io::Result<()> {
-        let fd = fd.as_raw_fd();
-        syscall!(epoll_ctl(self.epoll_fd, libc::EPOLL_CTL_DEL, fd, std::ptr::null_mut()))?;
-        self.instances.entry(fd).and_modify(|interests| { interests.remove(&event_type); });
+    pub fn modify_interest(&mut self, fd: RawFd, token: usize, event_types: &[EventType]) -> io::Result<()> {
+        let mut event = Self::epoll_event(token, event_types);
+        syscall!(epoll_ctl(self.epoll_fd, libc::EPOLL_CTL_MOD, fd, &mut event))?;
         Ok(())
     }
 
-    pub fn await_indefinitely(&mut self) -> EventType {
-        match self.await_event(&AwaitDuration::Infinite) {
-            Notification::Timeout => panic!("timeout shouldn't have happendend, invalid configuration"),
-            Notification::Event(event, _) => event,
-        }
+    /// Descriptors are removed from epoll once closed, it is only needed for descriptors which stay open.
+    pub fn delete_interest(&mut self, fd: RawFd) -> io::Result<()> {
+        syscall!(epoll_ctl(self.epoll_fd, libc::EPOLL_CTL_DEL, fd, std::ptr::null_mut()))?;
+        Ok(())
     }
 
-    pub fn await_event(&mut self, timeout: &AwaitDuration) -> Notification {
+    /// Waits for events of registered descriptors and replaces `events` with them, none are left on timeout.
+    pub fn await_events(&mut self, timeout: &TimeoutDuration, events: &mut Vec<Event>) -> io::Result<()> {
         self.events.clear();
-        let sleep_start_time = Instant::now();
-
-        let epoll_timeout = match timeout {
-            AwaitDuration::Infinite => { -1 as libc::c_int }
-            AwaitDuration::Finite(duration) => { duration.as_millis() as libc::c_int }
-        };
-
-        let res = syscall!(
+        events.clear();
+        let result = syscall!(
             epoll_wait(
                 self.epoll_fd,
-                self.events.as_mut_ptr() as *mut epoll_event,
-                Self::MAX_LISTENER_COUNT as libc::c_int,
-                epoll_timeout,
+                self.events.as_mut_ptr(),
+                Self::MAX_EVENT_COUNT as libc::c_int,
+                timeout.as_epoll_timeout(),
             )
-        ).map_err(|err| {
-            util::fail_with_message(format!("error during epoll wait: {err}").as_ref());
-        }).unwrap();
-        let sleep_duration = Instant::now() - sleep_start_time;
-        // safety: since events was empty before epoll_wait syscall the length of self.events
-        // after should be exactly res (assuming kernel is correct).
-        unsafe { self.events.set_len(res as usize); }
-        if res == 0 && self.events.len() == 0{
-            Notification::Timeout
-        } else {
-            Notification::Event(EventType::from(self.events[0]), sleep_duration)
-        }
+        );
+        let event_count = match result {
+            Ok(event_count) => event_count as usize,
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => 0,
+            Err(err) => return Err(err),
+        };
+        // safety: kernel has initialized exactly event_count entries of the buffer, which has enough capacity.
+        unsafe { self.events.set_len(event_count); }
+        events.extend(self.events.iter().map(Event::from));
+        Ok(())
+    }
+}
+
+impl Drop for Registry {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.epoll_fd); }
     }
 }
@@ -1,12 +1,21 @@
 //! Mikołaj Depta 328690
 //!
 //! Abstractions for working with server resources.
+//! Resource paths are relative to the catalog, their first component is the domain.
 
+use crate::gzip;
+use crate::http::entity::{Content, Entity};
+use crate::lru::LruCache;
 use crate::util;
-use std::collections::HashSet;
+use crate::watcher::Watcher;
+use std::cell::{Cell, RefCell};
+use std::collections::{HashMap, HashSet};
 use std::fs;
-use std::path::{Path, PathBuf};
+use std::io::Read;
+use std::path::{Component, Path, PathBuf};
 use std::rc::Rc;
+use std::sync::{Arc, Mutex, MutexGuard, PoisonError, Weak};
+use std::time::{Duration, Instant};
 
 #[non_exhaustive]
 #[derive(Debug, Clone)]
@@ -17,7 +26,14 @@ pub enum LoadResourceError {
 pub trait ResourceLoader {
     type LoadError;
 
-    fn load(&self, resource: &Path) -> Result<Box<[u8]>, Self::LoadError>;
+    /// Loads resource which has already been validated.
+    fn load(&self, resource: &Path) -> Result<Entity, Self::LoadError>;
+
+    /// Resource loaded before, provided that the loader knows it has not changed since.
+    /// Such resource has been validated when it was loaded, so it may be served without validating it again.
+    fn cached(&self, _resource: &Path) -> Option<Entity> {
+        None
+    }
 }
 
 pub struct StaticLoader {
@@ -25,6 +41,9 @@ pub struct StaticLoader {
 }
 
 impl StaticLoader {
+    /* Larger files are sent straight from the file instead of being read into memory. */
+    pub const STREAMING_THRESHOLD: usize = 256 * 1024;
+
     pub fn new(catalog: Rc<Path>) -> Self {
         Self { catalog }
     }
@@ -33,10 +52,20 @@ impl StaticLoader {
 impl ResourceLoader for StaticLoader {
     type LoadError = LoadResourceError;
 
-    fn load(&self, resource: &Path) -> Result<Box<[u8]>, Self::LoadError> {
+    fn load(&self, resource: &Path) -> Result<Entity, Self::LoadError> {
         use std::io::ErrorKind;
-        match fs::read(self.catalog.join(resource)) {
-            Ok(data) => Ok(data.into_boxed_slice()),
+        let loaded = fs::File::open(self.catalog.join(resource)).and_then(|mut file| {
+            let metadata = file.metadata()?;
+            let (length, modified) = (metadata.len() as usize, metadata.modified()?);
+            if length > Self::STREAMING_THRESHOLD {
+                return Ok(Entity::from_file(file, length, resource.into(), modified));
+            }
+            let mut data = Vec::with_capacity(length);
+            file.read_to_end(&mut data)?;
+            Ok(Entity::with_validators(Arc::from(data), resource.into(), modified))
+        });
+        match loaded {
+            Ok(entity) => Ok(entity),
             Err(err) if err.kind() == ErrorKind::NotFound => {
                 Err(LoadResourceError::NotFound(resource.to_owned()))
             }
@@ -45,11 +74,175 @@ impl ResourceLoader for StaticLoader {
     }
 }
 
+/// Gzip variants of resources, shared by the caches of all workers so that every resource is compressed once
+/// and kept in memory once. Variant lives as long as any cache holds it and is identified by the ETag of the resource,
+/// so that a changed resource is never served with the variant of its previous content.
+#[derive(Clone, Default)]
+pub struct GzipVariants(Arc<Mutex<HashMap<(PathBuf, String), Weak<[u8]>>>>);
+
+impl GzipVariants {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn lock(&self) -> MutexGuard<'_, HashMap<(PathBuf, String), Weak<[u8]>>> {
+        /* Map is consistent between operations, a worker which panicked cannot leave it broken. */
+        self.0.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Attaches gzip variant to the entity of `resource`, if it is noticeably smaller.
+    /// Resource is compressed unless another worker holds its variant already.
+    pub fn attach(&self, resource: &Path, entity: Entity) -> Entity {
+        let (data, etag) = match (entity.compressible_data(), entity.etag()) {
+            (Some(data), Some(etag)) => (data, etag),
+            _ => return entity,
+        };
+        let key = (resource.to_owned(), etag.to_owned());
+        let shared = self.lock().get(&key).and_then(Weak::upgrade);
+        let compressed = match shared {
+            Some(compressed) => compressed,
+            None => {
+                /* Compressed without the lock, of workers racing for the same resource the first one stores its variant. */
+                let compressed: Arc<[u8]> = Arc::from(gzip::compress(data));
+                /* Variant is not worth negotiating unless it saves at least a tenth of the size. */
+                if compressed.len() * 10 > data.len() * 9 {
+                    return entity;
+                }
+                let mut variants = self.lock();
+                /* Dropped variant keeps its allocation until its weak reference is gone. */
+                variants.retain(|_, variant| variant.strong_count() > 0);
+                match variants.get(&key).and_then(Weak::upgrade) {
+                    Some(stored) => stored,
+                    None => {
+                        variants.insert(key, Arc::downgrade(&compressed));
+                        compressed
+                    }
+                }
+            }
+        };
+        entity.with_gzip_variant(compressed)
+    }
+}
+
+/// Loader which keeps recently loaded resources in memory, so that hot resources are served
+/// without touching the filesystem.
+///
+/// Cached resources are invalidated once inotify reports a change of the file or of any directory on its path,
+/// changes are picked up at most `INVALIDATION_DELAY` late. Only paths without `.`, `..` and symbolic links are cached,
+/// so that every cached resource has exactly one name. Without inotify nothing is cached.
+pub struct CachedLoader<L = StaticLoader>
+where
+    L: ResourceLoader,
+{
+    loader: L,
+    catalog: Rc<Path>,
+    cache: RefCell<LruCache<PathBuf, Entity>>,
+    watcher: Option<RefCell<Watcher>>,
+    changes: RefCell<Vec<PathBuf>>,
+    next_invalidation_at: Cell<Instant>,
+    gzip_variants: GzipVariants,
+}
+
+impl<L: ResourceLoader> CachedLoader<L> {
+    pub const DEFAULT_CAPACITY: usize = 64 * 1024 * 1024;
+    const INVALIDATION_DELAY: Duration = Duration::from_millis(50);
+    /* Size charged for an open file, it bounds the number of descriptors held by the cache. */
+    const FILE_ENTRY_SIZE: usize = 64 * 1024;
+
+    fn entry_size(entity: &Entity) -> usize {
+        let content_size = match entity.content() {
+            Content::Memory(data) => data.len(),
+            Content::File(_) => Self::FILE_ENTRY_SIZE,
+        };
+        content_size + entity.gzipped().map_or(0, Self::entry_size)
+    }
+
+    /// Creates cache of at most `capacity` bytes of resources loaded by `loader` from `catalog`.
+    pub fn new(loader: L, catalog: Rc<Path>, capacity: usize, gzip_variants: GzipVariants) -> Self {
+        let watcher = match Watcher::new() {
+            Ok(watcher) => Some(RefCell::new(watcher)),
+            Err(err) => {
+                eprintln!("resources are not cached, inotify is not available: {err}");
+                None
+            }
+        };
+        Self {
+            loader,
+            catalog,
+            cache: RefCell::new(LruCache::new(capacity)),
+            watcher,
+            changes: RefCell::new(Vec::new()),
+            next_invalidation_at: Cell::new(Instant::now()),
+            gzip_variants,
+        }
+    }
+
+    /// Removes changed resources, inotify is read at most once per `INVALIDATION_DELAY`.
+    fn invalidate_changed(&self, watcher: &RefCell<Watcher>) {
+        let now = Instant::now();
+        if now < self.next_invalidation_at.get() {
+            return;
+        }
+        self.next_invalidation_at.set(now + Self::INVALIDATION_DELAY);
+        let mut changes = self.changes.borrow_mut();
+        let mut cache = self.cache.borrow_mut();
+        if watcher.borrow_mut().changes(&mut changes).is_err() {
+            /* Changes may have been lost. */
+            cache.clear();
+        }
+        for changed in changes.drain(..) {
+            cache.retain(|resource| !resource.starts_with(&changed));
+        }
+    }
+
+    /// Watches every directory on the path of the resource, returns whether the resource can be cached.
+    /// It has to happen before the resource is read, otherwise its change in between would be missed.
+    fn watch(&self, watcher: &RefCell<Watcher>, resource: &Path) -> bool {
+        if !resource.components().all(|component| matches!(component, Component::Normal(_))) {
+            return false;
+        }
+        let mut watcher = watcher.borrow_mut();
+        let directories_watched = resource
+            .ancestors()
+            .skip(1)
+            .all(|directory| watcher.watch(&self.catalog.join(directory), directory).is_ok());
+        let is_symlink = fs::symlink_metadata(self.catalog.join(resource))
+            .map_or(true, |metadata| metadata.file_type().is_symlink());
+        directories_watched && !is_symlink
+    }
+}
+
+impl<L: ResourceLoader> ResourceLoader for CachedLoader<L> {
+    type LoadError = L::LoadError;
+
+    fn load(&self, resource: &Path) -> Result<Entity, Self::LoadError> {
+        let watcher = match &self.watcher {
+            Some(watcher) => watcher,
+            None => return self.loader.load(resource),
+        };
+        let is_cacheable = self.watch(watcher, resource);
+        let mut entity = self.loader.load(resource)?;
+        if is_cacheable {
+            /* Compressed once, cached variant is shared by all clients accepting gzip until the resource changes. */
+            entity = self.gzip_variants.attach(resource, entity);
+            self.cache.borrow_mut().insert(resource.to_owned(), entity.clone(), Self::entry_size(&entity));
+        }
+        Ok(entity)
+    }
+
+    fn cached(&self, resource: &Path) -> Option<Entity> {
+        let watcher = self.watcher.as_ref()?;
+        self.invalidate_changed(watcher);
+        self.cache.borrow_mut().get(resource).cloned()
+    }
+}
+
 #[non_exhaustive]
 #[derive(Debug, Clone)]
 pub enum ValidationResourceError {
     OutdatedResourcePath(PathBuf),
     UnauthorizedResourceAccess(PathBuf),
+    NotFound(PathBuf),
 }
 
 pub trait ResourceValidator {
@@ -58,6 +251,7 @@ pub trait ResourceValidator {
     fn validate(&self, resource_path: &Path) -> Result<(), Self::ValidationError>;
 }
 
+/// Canonical paths of domain directories.
 pub type Domains = Rc<HashSet<PathBuf>>;
 
 pub struct StaticValidator {
@@ -71,14 +265,11 @@ impl StaticValidator {
     }
 
     pub fn default_config(catalog: Rc<Path>) -> Self {
-        let mut base_dir = PathBuf::from(&catalog);
-        let directories = HashSet::from(
-            ["localhost", "lab108-18"].map(|domain| {
-                let mut domain_dir = base_dir.clone();
-                domain_dir.push(domain);
-                domain_dir
-            })
-        );
+        /* Domains missing from the catalog cannot be canonicalized and are skipped. */
+        let directories = ["localhost", "lab108-18"]
+            .iter()
+            .filter_map(|domain| catalog.join(domain).canonicalize().ok())
+            .collect();
         Self { catalog, domains: Rc::new(directories) }
     }
 }
@@ -87,29 +278,46 @@ impl ResourceValidator for StaticValidator {
     type ValidationError = ValidationResourceError;
 
     fn validate(&self, resource_path: &Path) -> Result<(), Self::ValidationError>  {
-        if self.domains.contains(resource_path) {
-            return Err(ValidationResourceError::OutdatedResourcePath(
+        let absolute_path = match self.catalog.join(resource_path).canonicalize() {
+            Ok(absolute_path) => absolute_path,
+            Err(_) => return Err(ValidationResourceError::NotFound(resource_path.to_owned())),
+        };
+        if !self.domains.iter().any(|domain| absolute_path.starts_with(domain)) {
+            return Err(ValidationResourceError::UnauthorizedResourceAccess(
                 resource_path.to_owned(),
             ));
         }
-        return match resource_path.canonicalize() {
-            Ok(absolute_path) => {
-                for domain in self.domains {
-                    let mut domain_path = self.catalog.clone();
-                    domain_path.push(domain);
-                    if absolute_path.starts_with(domain_path) {
-                        return Ok(());
-                    }
-                }
-                Err(ValidationResourceError::UnauthorizedResourceAccess(
-                    resource_path.to_owned(),
-                ))
-            }
-            Err(_) => {
-                Err(ValidationResourceError::UnauthorizedResourceAccess(
-                    resource_path.to_owned(),
-                ))
-            }
+        if absolute_path.is_dir() {
+            return Err(ValidationResourceError::OutdatedResourcePath(
+                resource_path.to_owned(),
+            ));
         }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::path::Path;
+    use std::rc::Rc;
+    use std::sync::Arc;
+    use super::{GzipVariants, ResourceLoader, StaticLoader};
+    use crate::http::entity::{Content, Entity};
+
+    #[test]
+    fn test_workers_share_gzip_variants() {
+        let catalog: Rc<Path> = Rc::from(Path::new(env!("CARGO_MANIFEST_DIR")));
+        let resource = Path::new("localhost/index.html");
+        let variants = GzipVariants::new();
+        /* Every worker loads the resource on its own. */
+        let load = |variants: &GzipVariants| variants.attach(resource, StaticLoader::new(catalog.clone()).load(resource).unwrap());
+        let compressed = |entity: &Entity| match entity.gzipped().map(Entity::content) {
+            Some(Content::Memory(data)) => data.clone(),
+            _ => panic!("gzip variant missing"),
+        };
+        let first = load(&variants);
+        let second = load(&variants.clone());
+        assert!(Arc::ptr_eq(&compressed(&first), &compressed(&second)));
+        assert!(!Arc::ptr_eq(&compressed(&first), &compressed(&load(&GzipVariants::new()))));
     }
 }
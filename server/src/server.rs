@@ -1,40 +1,198 @@
 //! Mikołaj Depta 328690
+//!
+//! This module exposes the HTTP server.
+//! Server runs a single threaded, edge-triggered epoll event loop over nonblocking connections.
+//! Every connection is a state machine which alternates between downloading a request and sending a response,
+//! connections are kept alive between requests and closed by a timer wheel once idle.
 
 
-use std::cmp::Ordering;
 use std::io;
-use std::io::{Read, Write, BufWriter, BufReader};
-use std::net::{TcpListener, TcpStream, SocketAddr};
+use std::io::{IoSlice, Read, Write};
+use std::net::{Shutdown, TcpListener, TcpStream, SocketAddr};
+use std::mem;
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::ffi::OsStr;
+use std::os::unix::ffi::OsStrExt;
 use std::path::{Path, PathBuf};
+use std::ops::Range;
 use std::rc::Rc;
-use std::time::Duration;
-use crate::http::common::Body;
-use crate::http::headers::{general_header::GeneralHeader, Headers, response_header::ResponseHeader};
-use crate::http::request::{Request, RequestMetaData};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+use crate::http::common::{Body, Version};
+use crate::http::headers::{general_header::{ConnectionType, GeneralHeader, GeneralHeaders}, Headers, response_header::ResponseHeader};
+use crate::http::parser::{accepts_encoding, etag_matches, find_byte, parse_byte_range, ByteRange, RequestHead, RequestParser};
 use crate::http::response::{Response, StatusCode, StatusLine};
-use crate::http::entity::Entity;
-use crate::http::headers::entity_header::ContentType;
+use crate::http::entity::{Content, Entity};
 use crate::http::headers::response_header::ResponseHeaders;
+use crate::http::headers::entity_header::ContentEncoding;
 
-use crate::resources::{StaticValidator, StaticLoader, ResourceLoader, ResourceValidator, ValidationResourceError};
-use crate::registry::{Registry, TimeoutDuration};
+use crate::resources::{CachedLoader, GzipVariants, StaticValidator, StaticLoader, ResourceLoader, ResourceValidator, ValidationResourceError};
+use crate::registry::{syscall, Event, EventType, Registry, TimeoutDuration};
+use crate::timer::TimerWheel;
 use crate::util::OrFailWithMessage;
+use crate::libc;
 
 
-pub struct HttpServer<D, S, L = StaticLoader, V = StaticValidator,>
+/// Builds responses to requests, it is shared by all connections of the server.
+pub struct RequestHandler<L = CachedLoader, V = StaticValidator>
+where
+    L: ResourceLoader,
+    V: ResourceValidator<ValidationError = ValidationResourceError>,
+{
+    loader: L,
+    validator: V,
+}
+
+impl RequestHandler<CachedLoader, StaticValidator> {
+    /// Handler serving domains of the catalog through the resource cache.
+    pub fn default_config(dir: Rc<Path>) -> Self {
+        Self::worker_config(dir, CachedLoader::<StaticLoader>::DEFAULT_CAPACITY, GzipVariants::new())
+    }
+
+    /// Handler of one of the workers, whose caches split the capacity and share gzip variants.
+    pub fn worker_config(dir: Rc<Path>, cache_capacity: usize, gzip_variants: GzipVariants) -> Self {
+        let loader = CachedLoader::new(StaticLoader::new(dir.clone()), dir.clone(), cache_capacity, gzip_variants);
+        let validator = StaticValidator::default_config(dir);
+        Self::new(loader, validator)
+    }
+}
+
+impl<L, V> RequestHandler<L, V>
+where
+    L: ResourceLoader,
+    V: ResourceValidator<ValidationError = ValidationResourceError>,
+{
+    pub fn new(loader: L, validator: V) -> Self {
+        Self { loader, validator }
+    }
+
+    fn general_headers(request: &RequestHead) -> GeneralHeaders {
+        match request.connection {
+            Some(connection) => Rc::from([GeneralHeader::Connection(connection)]),
+            None => Rc::from([]),
+        }
+    }
+
+    fn response(request: &RequestHead, status_code: StatusCode, entity: Entity, response_headers: Option<ResponseHeaders>) -> Response {
+        let status_line = StatusLine::new(request.version, status_code);
+        let headers = Headers::new(
+            Self::general_headers(request),
+            None,
+            response_headers,
+            Some(entity.headers()),
+        );
+        Response::new(status_line, headers, Some(Body::SingleSource(entity)))
+    }
+
+    /// Response with the resource, conditional and range requests are answered with a part of it.
+    /// Gzip variant is chosen if the client accepts it, unless a range is requested, ranges refer to the identity body.
+    fn resource_response(request: &RequestHead, entity: Entity) -> Response {
+        let vary = entity.gzipped().map(|_| ResponseHeaders::from([ResponseHeader::Vary("Accept-Encoding")]));
+        let entity = match (entity.gzipped(), request.accept_encoding) {
+            (Some(gzipped), Some(accept_encoding))
+                if request.range.is_none() && accepts_encoding(accept_encoding, ContentEncoding::GZIP_REPR) => gzipped.clone(),
+            _ => entity,
+        };
+        let is_not_modified = request.if_none_match
+            .zip(entity.etag())
+            .map_or(false, |(if_none_match, etag)| etag_matches(if_none_match, etag));
+        if is_not_modified {
+            let status_line = StatusLine::new(request.version, StatusCode::NotModified);
+            let headers = Headers::new(Self::general_headers(request), None, vary, Some(entity.validator_headers()));
+            return Response::new(status_line, headers, None);
+        }
+        match request.range.map(|range| parse_byte_range(range, entity.len())) {
+            Some(ByteRange::Satisfiable(range)) => {
+                let status_line = StatusLine::new(request.version, StatusCode::PartialContent);
+                let headers = Headers::new(Self::general_headers(request), None, vary, Some(entity.partial_headers(&range)));
+                Response::new(status_line, headers, Some(Body::Partial(entity, range)))
+            }
+            Some(ByteRange::Unsatisfiable) => {
+                let entity = Entity::range_not_satisfiable(entity.len());
+                Self::response(request, StatusCode::RangeNotSatisfiable, entity, None)
+            }
+            Some(ByteRange::Ignored) | None => Self::response(request, StatusCode::Ok, entity, vary),
+        }
+    }
+
+    /// Response to a message that could not be parsed, connection is closed after it is sent.
+    pub fn not_implemented() -> Response {
+        let status_line = StatusLine::new(Version::V1_1, StatusCode::NotImplemented);
+        let entity = Entity::not_implemented();
+        let headers = Headers::new(
+            Rc::from([GeneralHeader::Connection(ConnectionType::Close)]),
+            None,
+            None,
+            Some(entity.headers()),
+        );
+        Response::new(status_line, headers, Some(Body::SingleSource(entity)))
+    }
+
+    pub fn handle(&self, request: &RequestHead) -> Response {
+        let domain = match request.host {
+            Some(domain) => Path::new(OsStr::from_bytes(domain)),
+            None => return Self::not_implemented(),
+        };
+        /* Query is irrelevant for static resources. */
+        let target = request.target;
+        let url = Path::new(OsStr::from_bytes(&target[..find_byte(target, b'?').unwrap_or(target.len())]));
+        let resource_path = domain.join(url.strip_prefix("/").unwrap_or(url));
+
+        if let Some(entity) = self.loader.cached(&resource_path) {
+            return Self::resource_response(request, entity);
+        }
+        match self.validator.validate(&resource_path) {
+            Ok(_) => {
+                match self.loader.load(&resource_path) {
+                    Ok(entity) => Self::resource_response(request, entity),
+                    Err(_) => Self::response(request, StatusCode::NotFound, Entity::not_found(), None),
+                }
+            }
+            Err(ValidationResourceError::UnauthorizedResourceAccess(_)) => {
+                Self::response(request, StatusCode::Forbidden, Entity::morbidden(), None)
+            }
+            Err(ValidationResourceError::OutdatedResourcePath(_)) => {
+                let mut new_path = PathBuf::from("/");
+                new_path.push(url);
+                new_path.push("index.html");
+                let location = ResponseHeaders::from([ResponseHeader::Location(new_path)]);
+                Self::response(request, StatusCode::MovedPermanently, Entity::redirect(), Some(location))
+            }
+            Err(_) => Self::response(request, StatusCode::NotFound, Entity::not_found(), None),
+        }
+    }
+}
+
+
+pub struct HttpServer<D = HttpDownloader, S = HttpSender, L = CachedLoader, V = StaticValidator>
 where
     D: Downloader,
     S: Sender,
     L: ResourceLoader,
-    V: ResourceValidator,
+    V: ResourceValidator<ValidationError = ValidationResourceError>,
 {
     address: SocketAddr,
-    loader: L,
-    validator: V,
+    handler: RequestHandler<L, V>,
     listener: TcpListener,
     registry: Registry,
-    catalog: Rc<Path>,
-    connections: Vec<Connection<D, S>>,
+    /* Slab of connections, connection in slot i is registered with token i + 1. */
+    connections: Vec<Option<Connection<D, S>>>,
+    free_slots: Vec<usize>,
+    connection_count: usize,
+    next_connection_id: u64,
+    /* Timers are keyed with slot and id of the connection, so that timers of closed connections are recognized. */
+    timers: TimerWheel<(usize, u64)>,
+}
+
+impl<D, S> HttpServer<D, S, CachedLoader, StaticValidator>
+where
+    D: Downloader,
+    S: Sender,
+{
+    pub fn new(address: SocketAddr, dir: Rc<Path>) -> Self {
+        Self::with_handler(address, RequestHandler::default_config(dir))
+    }
 }
 
 impl<D, S, L, V> HttpServer<D, S, L, V>
@@ -42,97 +200,271 @@ where
     D: Downloader,
     S: Sender,
     L: ResourceLoader,
-    V: ResourceValidator,
+    V: ResourceValidator<ValidationError = ValidationResourceError>,
 {
-    const MAX_CONNECTIONS: usize = 1;
+    const MAX_CONNECTIONS: usize = 4096;
+    const LISTENER_TOKEN: usize = 0;
+    const TIMER_TICK: Duration = Duration::from_millis(10);
+    const TIMER_SLOT_COUNT: usize = 1024;
 
-    pub fn new(address: SocketAddr, dir: Rc<Path>) -> Self {
-        let listener = TcpListener::bind(address)
+    pub fn with_handler(address: SocketAddr, handler: RequestHandler<L, V>) -> Self {
+        let listener = bind_listener(address)
             .or_fail_with_message(format!("could not bind tcp socket to {}", address).as_str());
-        let loader = StaticLoader::new(dir.clone());
-        let validator = StaticValidator::default_config(dir.clone());
-        let registry = Registry::new()
+        Self::with_listener(listener, handler)
+    }
+
+    /// Server accepting connections of a nonblocking `listener`.
+    pub fn with_listener(listener: TcpListener, handler: RequestHandler<L, V>) -> Self {
+        let address = listener.local_addr().or_fail_with_message("listener is not bound");
+        let mut registry = Registry::new()
             .or_fail_with_message("could not create an epoll event queue");
-        Self { address, loader, validator, listener, registry, catalog: dir, connections: Vec::new() }
+        registry.add_interest(listener.as_raw_fd(), Self::LISTENER_TOKEN, &[EventType::Read])
+            .or_fail_with_message("could not register the listener");
+        Self {
+            address,
+            handler,
+            listener,
+            registry,
+            connections: Vec::new(),
+            free_slots: Vec::new(),
+            connection_count: 0,
+            next_connection_id: 0,
+            timers: TimerWheel::new(Self::TIMER_TICK, Self::TIMER_SLOT_COUNT, Instant::now()),
+        }
+    }
+
+    pub fn address(&self) -> SocketAddr {
+        self.address
     }
 
     fn connection_limit_exceeded(&self) -> bool {
-        self.connections.len() < Self::MAX_CONNECTIONS
+        self.connection_count >= Self::MAX_CONNECTIONS
     }
 
-    fn handle_request(&mut self, request: &Request) -> Response {
-        let domain = request.host();
-        let resource_path = request.start_line().url();
-        let mut full_resource_path = PathBuf::from(&self.catalog);
+    fn accept_connections(&mut self, now: Instant) {
+        loop {
+            let tcp_stream = match self.listener.accept() {
+                Ok((tcp_stream, _)) => tcp_stream,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                /* Connections reset before being accepted, or lack of descriptors, do not stop the server. */
+                Err(_) => break,
+            };
+            if self.connection_limit_exceeded() {
+                continue;  /* Dropping the stream closes the connection. */
+            }
+            if tcp_stream.set_nonblocking(true).is_err() {
+                continue;
+            }
+            let _ = tcp_stream.set_nodelay(true);
+            let slot = self.free_slots.pop().unwrap_or_else(|| {
+                self.connections.push(None);
+                self.connections.len() - 1
+            });
+            if self.registry.add_interest(tcp_stream.as_raw_fd(), slot + 1, &[EventType::Read, EventType::Write]).is_err() {
+                self.free_slots.push(slot);
+                continue;
+            }
+            let id = self.next_connection_id;
+            self.next_connection_id += 1;
+            let mut connection = Connection::new(tcp_stream, id, D::default(), S::default());
+            connection.touch(now);
+            Self::schedule_timer(&mut self.timers, slot, &mut connection);
+            self.connections[slot] = Some(connection);
+            self.connection_count += 1;
+        }
+    }
 
-        let http_version = request.start_line().version().clone();
+    fn schedule_timer(timers: &mut TimerWheel<(usize, u64)>, slot: usize, connection: &mut Connection<D, S>) {
+        if connection.is_timer_scheduled {
+            return;
+        }
+        if let Some(deadline) = connection.deadline {
+            timers.schedule((slot, connection.id), deadline);
+            connection.is_timer_scheduled = true;
+        }
+    }
 
-        full_resource_path.push(domain);
-        full_resource_path.push(resource_path);
-        match self.validator.validate(&full_resource_path) {
-            Ok(_) => {
-                match self.loader.load(&full_resource_path) {
-                    Ok(data) => {
-                        let status_line = StatusLine::new(http_version, StatusCode::Ok);
-                        let entity = Entity::new(data, request.headers().content_type().unwrap_or_default());
-                        let headers = Headers::new(
-                            request.headers().general_headers(),
-                            None,
-                            None,
-                            Some(entity.headers()),
-                        );
-                        Response::new(status_line, headers, Some(Body::SingleSource(entity)))
-                    }
-                    Err(_) => {
-                        let status_line = StatusLine::new(http_version, StatusCode::NotFound);
-                        let entity = Entity::not_found();
-                        let headers = Headers::new(
-                            request.headers().general_headers(),
-                            None,
-                            None,
-                            Some(entity.headers()),
-                        );
-                        Response::new(status_line, headers, Some(Body::SingleSource(entity)))
-                    }
-                }
+    fn close_connection(&mut self, slot: usize) {
+        /* Dropping the stream closes the descriptor, which also removes it from epoll. */
+        if self.connections[slot].take().is_some() {
+            self.free_slots.push(slot);
+            self.connection_count -= 1;
+        }
+    }
+
+    /// Advances connections which got events, closes those that finished or failed.
+    pub fn process_connections(&mut self, events: &[Event], now: Instant) {
+        for event in events {
+            if event.token == Self::LISTENER_TOKEN {
+                self.accept_connections(now);
+                continue;
             }
-            Err(ValidationResourceError::UnauthorizedResourceAccess(_)) => {
-                // prepare 403 message
-                let status_line = StatusLine::new(http_version, StatusCode::Forbidden);
-                let entity = Entity::morbidden();
-                let headers = Headers::new(
-                    request.headers().general_headers(),
-                    None,
-                    None,
-                    Some(entity.headers()),
-                );
-                Response::new(status_line, headers, Some(Body::SingleSource(entity)))
+            let slot = event.token - 1;
+            let connection = match self.connections.get_mut(slot).and_then(Option::as_mut) {
+                Some(connection) => connection,
+                None => continue,
+            };
+            match connection.advance(&self.handler, event.is_closed) {
+                Ok(ConnectionState::Open) => {
+                    connection.touch(now);
+                    Self::schedule_timer(&mut self.timers, slot, connection);
+                }
+                Ok(ConnectionState::Closed) | Err(_) => self.close_connection(slot),
             }
-            Err(ValidationResourceError::OutdatedResourcePath(path)) => {
-                // prepare 301 message
-                let status_line = StatusLine::new(http_version, StatusCode::MovedPermanently);
-                let entity = Entity::redirect();
-                let mut new_path = PathBuf::from(path);
-                new_path.push("/index.html");
-                let headers = Headers::new(
-                    request.headers().general_headers(),
-                    None,
-                    Some(ResponseHeaders::from([ResponseHeader::Location(new_path)])),
-                    Some(entity.headers()),
-                );
-                Response::new(status_line, headers, Some(Body::SingleSource(entity)))
+        }
+    }
+
+    /// Closes connections whose deadline passed, timers of connections that were active since are scheduled again.
+    fn expire_connections(&mut self, now: Instant, expired: &mut Vec<((usize, u64), Instant)>) {
+        expired.clear();
+        self.timers.expire(now, expired);
+        for &((slot, id), _) in expired.iter() {
+            let connection = match self.connections[slot].as_mut() {
+                Some(connection) if connection.id == id => connection,
+                _ => continue,
+            };
+            connection.is_timer_scheduled = false;
+            if connection.deadline.map_or(false, |deadline| deadline <= now) {
+                self.close_connection(slot);
+            } else {
+                Self::schedule_timer(&mut self.timers, slot, connection);
             }
-            other => { panic!("some wierd edge case") }
         }
     }
-    
-    pub fn process_connections(&mut self) { 
-        for connection in self.connections {
 
+    /// Runs the event loop forever.
+    pub fn start(&mut self) {
+        let mut events = Vec::new();
+        let mut expired = Vec::new();
+        loop {
+            let timeout = self.timers.next_timeout(Instant::now())
+                .map(TimeoutDuration::Finite)
+                .unwrap_or(TimeoutDuration::Infinite);
+            self.registry.await_events(&timeout, &mut events)
+                .or_fail_with_message("error during epoll wait");
+            let now = Instant::now();
+            self.process_connections(&events, now);
+            self.expire_connections(now, &mut expired);
+        }
+    }
+}
+
+
+/// Binds nonblocking listener with SO_REUSEPORT, so that several listeners of the same address may coexist
+/// and the kernel spreads incoming connections between them.
+pub fn bind_listener(address: SocketAddr) -> io::Result<TcpListener> {
+    const BACKLOG: libc::c_int = 1024;
+    let domain = if address.is_ipv4() { libc::AF_INET } else { libc::AF_INET6 };
+    let fd = syscall!(socket(domain, libc::SOCK_STREAM | libc::SOCK_NONBLOCK | libc::SOCK_CLOEXEC, 0))?;
+    /* Listener owns the descriptor from now on, so that it is closed on every error below. */
+    let listener = unsafe { TcpListener::from_raw_fd(fd) };
+    let enable: libc::c_int = 1;
+    for option in [libc::SO_REUSEADDR, libc::SO_REUSEPORT] {
+        syscall!(setsockopt(
+            fd,
+            libc::SOL_SOCKET,
+            option,
+            &enable as *const libc::c_int as *const libc::c_void,
+            mem::size_of::<libc::c_int>() as libc::socklen_t,
+        ))?;
+    }
+    let mut storage: libc::sockaddr_storage = unsafe { mem::zeroed() };
+    let length = match address {
+        SocketAddr::V4(address) => {
+            let sockaddr = unsafe { &mut *(&mut storage as *mut _ as *mut libc::sockaddr_in) };
+            sockaddr.sin_family = libc::AF_INET as libc::sa_family_t;
+            sockaddr.sin_port = address.port().to_be();
+            sockaddr.sin_addr = libc::in_addr { s_addr: u32::from(*address.ip()).to_be() };
+            mem::size_of::<libc::sockaddr_in>()
+        }
+        SocketAddr::V6(address) => {
+            let sockaddr = unsafe { &mut *(&mut storage as *mut _ as *mut libc::sockaddr_in6) };
+            sockaddr.sin6_family = libc::AF_INET6 as libc::sa_family_t;
+            sockaddr.sin6_port = address.port().to_be();
+            sockaddr.sin6_addr = libc::in6_addr { s6_addr: address.ip().octets() };
+            mem::size_of::<libc::sockaddr_in6>()
+        }
+    };
+    syscall!(bind(fd, &storage as *const _ as *const libc::sockaddr, length as libc::socklen_t))?;
+    syscall!(listen(fd, BACKLOG))?;
+    Ok(listener)
+}
+
+
+/// Servers running on their own threads, one per core. Every worker owns its listener of the shared address,
+/// its event loop, connections and resource cache, so that nothing is locked while serving cached resources.
+/// Caches split the capacity of a single cache and share gzip variants, which are locked only when a resource is loaded.
+pub struct WorkerPool {
+    address: SocketAddr,
+    handles: Vec<JoinHandle<()>>,
+}
+
+impl WorkerPool {
+    /// Starts `worker_count` workers serving `catalog` on `address`, the port is chosen once for all workers
+    /// if `address` has port 0. Workers are pinned to the cores the process may run on, in turn.
+    pub fn start(address: SocketAddr, catalog: Arc<Path>, worker_count: usize) -> io::Result<Self> {
+        let first_listener = bind_listener(address)?;
+        let address = first_listener.local_addr()?;
+        let mut listeners = vec![first_listener];
+        for _ in 1..worker_count {
+            listeners.push(bind_listener(address)?);
+        }
+        let cores = Self::allowed_cores();
+        let cache_capacity = CachedLoader::<StaticLoader>::DEFAULT_CAPACITY / worker_count.max(1);
+        let gzip_variants = GzipVariants::new();
+        let handles = listeners
+            .into_iter()
+            .enumerate()
+            .map(|(index, listener)| {
+                let catalog = catalog.clone();
+                let gzip_variants = gzip_variants.clone();
+                let core = cores.get(index % cores.len().max(1)).copied();
+                thread::Builder::new()
+                    .name(format!("worker-{index}"))
+                    .spawn(move || {
+                        if let Some(core) = core {
+                            let _ = Self::pin_to_core(core);
+                        }
+                        let catalog: Rc<Path> = Rc::from(&*catalog);
+                        let handler = RequestHandler::worker_config(catalog, cache_capacity, gzip_variants);
+                        let mut server: HttpServer = HttpServer::with_listener(listener, handler);
+                        server.start();
+                    })
+            })
+            .collect::<io::Result<Vec<_>>>()?;
+        Ok(Self { address, handles })
+    }
+
+    /// Number of cores the process may run on.
+    pub fn default_worker_count() -> usize {
+        thread::available_parallelism().map(usize::from).unwrap_or(1)
+    }
+
+    pub fn address(&self) -> SocketAddr {
+        self.address
+    }
+
+    /// Waits for the workers, which serve until the process exits.
+    pub fn join(self) {
+        for handle in self.handles {
+            let _ = handle.join();
+        }
+    }
+
+    fn allowed_cores() -> Vec<usize> {
+        let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+        if syscall!(sched_getaffinity(0, mem::size_of::<libc::cpu_set_t>(), &mut set)).is_err() {
+            return Vec::new();
         }
+        (0..libc::CPU_SETSIZE as usize).filter(|&core| unsafe { libc::CPU_ISSET(core, &set) }).collect()
     }
 
-    pub fn start(&mut self) { }
+    fn pin_to_core(core: usize) -> io::Result<()> {
+        let mut set: libc::cpu_set_t = unsafe { mem::zeroed() };
+        unsafe { libc::CPU_SET(core, &mut set); }
+        syscall!(sched_setaffinity(0, mem::size_of::<libc::cpu_set_t>(), &set))?;
+        Ok(())
+    }
 }
 
 
@@ -141,144 +473,104 @@ where
 /// Action is will be injected into `HttpConnection` and will control the process of
 /// downloading a Request and sending a Response.
 ///
-/// `advance` will be called continuously until `is_finished` returns `true`.
+/// `advance` is called whenever the stream becomes ready, it has to make progress until the stream would block,
+/// since readiness is reported only once. It will be called continuously until `is_finished` returns `true`.
 pub trait Action {
     type Output;
-    
-    fn advance(&mut self) -> io::Result<Self::Output>;
+
+    fn advance<T: Read + Write + AsRawFd>(&mut self, stream: &mut T) -> io::Result<Self::Output>;
 
     fn is_finished(&self) -> bool;
-    
+
     fn timeout(&self) -> &TimeoutDuration;
 }
 
-pub trait Downloader : Action<Output=Option<Request>> { }
+/// Downloader yields `true` once head of a request is downloaded, the head is then available from `request`.
+/// Malformed requests are reported with `io::ErrorKind::InvalidData` and closed connection with `UnexpectedEof`.
+pub trait Downloader : Action<Output=bool> + Default {
+    /// Downloaded request head, borrowed from the buffer of the downloader.
+    fn request(&self) -> Option<RequestHead<'_>>;
 
-pub trait Sender : Action<Output=()> { }
+    /// Prepares downloader for the next request on the same connection, bytes received past the previous
+    /// request are kept.
+    fn reset(&mut self);
+}
+
+pub trait Sender : Action<Output=()> + Default {
+    fn start(&mut self, response: Response);
+}
 
 
 // region Downloader
 /// Provides functionality of downloading HTTP Request until end of header section.
 /// HTTP Entity event if present will be ignored.
-struct HttpDownloader<R> where R: Read {
-    reader: BufReader<R>,
+pub struct HttpDownloader {
     timeout: TimeoutDuration,
-    store: Vec<u8>,
-    download_buffer: Vec<u8>,
+    buffer: Box<[u8]>,
+    length: usize,
+    parser: RequestParser,
+    /* Length of the downloaded head, bytes past it belong to the next request. */
+    head_length: Option<usize>,
+    /* Bytes of the body of the previous request that have not arrived yet, they are dropped. */
+    body_remaining: usize,
     is_finished: bool,
-    request_metadata: Option<RequestMetaData>,
-    content_length: Option<usize>,
-    body: Option<Body>,
 }
 
-impl<R> HttpDownloader<R> where R: Read {
-    pub fn new(reader: R) -> Self {
+impl HttpDownloader {
+    pub const MAX_HEAD_SIZE: usize = 8192;
+
+    pub fn new() -> Self {
         Self {
-            reader,
-            timeout: TimeoutDuration::Infinite,
-            store: Vec::new(),
-            download_buffer: Vec::new(),
+            timeout: Connection::<Self, HttpSender>::STALE_CONNECTION_TIMEOUT,
+            buffer: vec![0; Self::MAX_HEAD_SIZE].into_boxed_slice(),
+            length: 0,
+            parser: RequestParser::new(),
+            head_length: None,
+            body_remaining: 0,
             is_finished: false,
-            request_metadata: None,
-            content_length: None,
-            body: None
         }
     }
+}
 
-    pub fn reset(&mut self, reader: R) {
-        self.reader = BufReader::new(reader);
-        self.download_buffer.clear();
-        self.store.clear();
-        self.is_finished = false;
-        self.request_metadata = None;
-        self.content_length = None;
-        self.body = None;
+impl Default for HttpDownloader {
+    fn default() -> Self {
+        Self::new()
     }
 }
 
-impl<R> HttpDownloader<R> where R: Read {
-    fn download_metadata(&mut self) -> io::Result<()> {
-        loop {
-            self.download_buffer.clear();
-            match self.reader.read(&mut self.download_buffer)? {
-                0 => Ok(()),
-                bytes_read=> {
-                    // section separator can be downloaded in two separate messages eg:
-                    // [.., b"\r", b"\n", b"\r"]
-                    // [b"\n", ..]
-                    // so we must first add data to the store buffer, check if stored section sep
-                    // and move excessive data.
-                    let prev_store_len = self.store.len();
-                    let sep_range = prev_store_len.saturating_sub(3)..prev_store_len + bytes_read;
-                    self.store.extend_from_slice(&self.download_buffer);
-                    if let Some(pos) = Request::section_sep_pos(&self.store[sep_range]) {
-                        /* addition of Request::SECTION_SEP.len() / 2 adds CRLF at the end, final header wouldn't be valid otherwise.  */
-                        self.store.resize(prev_store_len.saturating_sub(3) + pos + Request::SECTION_SEP.len() / 2, 0);
-                        self.download_buffer.drain(..pos + Request::SECTION_SEP.len() - 3);
-                        self.request_metadata = Some(RequestMetaData::try_from(&self.store)?);
-                        
-                        let metadata_ref = &self.request_metadata.unwrap();
-                        if let Some(content_length) = metadata_ref.headers.content_length() {
-                            /* once metadata section was parsed store can be reused for payload download. */
-                            self.store.clear();
-                            /* move all the remaining bytes from download buffer into store */
-                            let payload_range = 0..self.download_buffer.len().min(content_length);
-                            self.store.extend(self.download_buffer.drain(payload_range));
-                        } else {
-                            /* if no content-type information is present request is ready */
-                            self.is_finished = true;
-                        }
-                        Ok(())
-                    }
-                }
-            }
-        }
-    }
+impl Action for HttpDownloader {
+    type Output = bool;
 
-    fn download_payload(&mut self) -> io::Result<()> {
-        loop {
-            self.download_buffer.clear();
-            match self.reader.read(&mut self.download_buffer)? {
-                0 => Ok(()),
-                _ => {
-                    self.store.extend_from_slice(&self.download_buffer);
-                    match (self.store.len()).cmp(&self.content_length.unwrap()) {
-                        Ordering::Less => {
-                            continue;
-                        }
-                        _ => {
-                            let overhead = self.store.len() - self.content_length.unwrap();
-                            self.body = Some(Body::SingleSource(
-                                Entity::new(
-                                    Vec::from(&self.store[..overhead]).into_boxed_slice(),
-                                    self.request_metadata.unwrap().headers.content_type().unwrap_or_default(),
-                                )
-                            ));
-                            self.is_finished = true;
-                        }
-                    }
-                    Ok(())
+    fn advance<T: Read + Write + AsRawFd>(&mut self, stream: &mut T) -> io::Result<Self::Output> {
+        while !self.is_finished {
+            let skipped_length = self.body_remaining.min(self.length);
+            if skipped_length > 0 {
+                self.buffer.copy_within(skipped_length..self.length, 0);
+                self.length -= skipped_length;
+                self.body_remaining -= skipped_length;
+            }
+            if self.body_remaining == 0 {
+                /* Bytes left by the previous request are parsed before anything is read. */
+                let parsed = self.parser.parse(&self.buffer[..self.length])
+                    .map_err(|_| io::Error::new(io::ErrorKind::InvalidData, "malformed request"))?;
+                if let Some(head_length) = parsed {
+                    self.head_length = Some(head_length);
+                    self.is_finished = true;
+                    return Ok(true);
+                }
+                if self.length == self.buffer.len() {
+                    return Err(io::Error::new(io::ErrorKind::InvalidData, "request head too long"));
                 }
             }
-        }
-    }
-}
-
-impl<R> Action for HttpDownloader<R> where R: Read {
-    type Output = Option<Request>;
-    
-    fn advance(&mut self) -> io::Result<Self::Output> {
-        if !self.is_finished {
-            if self.request_metadata.is_none() {
-                self.download_metadata()?;
-            } else {
-                self.download_payload()?;
+            match stream.read(&mut self.buffer[self.length..]) {
+                Ok(0) => return Err(io::Error::from(io::ErrorKind::UnexpectedEof)),
+                Ok(bytes_read) => self.length += bytes_read,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => break,
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
             }
-        } else {
-            let RequestMetaData { start_line, headers } = self.request_metadata.take().unwrap();
-            Ok(Some(Request::new(start_line, headers, self.body.take())))
         }
-        Ok(None)
+        Ok(false)
     }
 
     fn is_finished(&self) -> bool {
@@ -290,41 +582,141 @@ impl<R> Action for HttpDownloader<R> where R: Read {
     }
 }
 
-impl<R> Downloader for HttpDownloader<R> where R: Read { }
+impl Downloader for HttpDownloader {
+    fn request(&self) -> Option<RequestHead<'_>> {
+        self.head_length.map(|_| self.parser.head(&self.buffer[..self.length]))
+    }
+
+    fn reset(&mut self) {
+        if let Some(head_length) = self.head_length.take() {
+            self.body_remaining = self.parser.head(&self.buffer[..self.length]).body_length;
+            self.buffer.copy_within(head_length..self.length, 0);
+            self.length -= head_length;
+        }
+        self.parser.reset();
+        self.is_finished = false;
+    }
+}
 // endregion
 
 
 // region Sender
-struct HttpSender<W> where W: Write {
-    writer: BufWriter<W>,
-    data: Box<[u8]>,
+pub struct HttpSender {
+    response: Option<Response>,
     timeout: TimeoutDuration,
     bytes_sent: usize,
     is_finished: bool,
 }
 
-impl<W> HttpSender<W> where W: Write {
-    pub fn new(writer: W, data: Box<[u8]>) -> Self {
+impl HttpSender {
+    /* Slow clients are given much more time to receive a response than to send a request. */
+    const TIMEOUT: TimeoutDuration = TimeoutDuration::Finite(Duration::from_secs(10));
+
+    pub fn new() -> Self {
         Self {
-            writer,
-            data,
-            timeout: TimeoutDuration::Infinite,
+            response: None,
+            timeout: Self::TIMEOUT,
             bytes_sent: 0,
             is_finished: false,
         }
     }
 }
 
-impl<W> Action for HttpSender<W> where W: Write {
+impl Default for HttpSender {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl HttpSender {
+    /* Bounds time spent on a single connection when the client keeps up with the server. */
+    const MAX_SENDFILE_CHUNK: usize = 1 << 20;
+
+    /// Writes `parts` from `self.bytes_sent` on with vectored writes, returns whether everything was written.
+    fn write_vectored<T: Write>(&mut self, stream: &mut T, parts: [&[u8]; 2]) -> io::Result<bool> {
+        let [first, second] = parts;
+        while self.bytes_sent < first.len() + second.len() {
+            let slices = if self.bytes_sent < first.len() {
+                [IoSlice::new(&first[self.bytes_sent..]), IoSlice::new(second)]
+            } else {
+                [IoSlice::new(&second[self.bytes_sent - first.len()..]), IoSlice::new(&[])]
+            };
+            match stream.write_vectored(&slices) {
+                Ok(0) => return Err(io::Error::from(io::ErrorKind::WriteZero)),
+                Ok(bytes_written) => self.bytes_sent += bytes_written,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(false),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(true)
+    }
+
+    /// Writes the head telling the kernel that more data follows, so that the head and the beginning
+    /// of the file share segments despite TCP_NODELAY.
+    fn write_head_before_file<T: AsRawFd>(&mut self, stream: &T, head: &[u8]) -> io::Result<bool> {
+        while self.bytes_sent < head.len() {
+            let remaining = &head[self.bytes_sent..];
+            let result = syscall!(send(
+                stream.as_raw_fd(),
+                remaining.as_ptr() as *const libc::c_void,
+                remaining.len(),
+                libc::MSG_MORE | libc::MSG_NOSIGNAL,
+            ));
+            match result {
+                Ok(bytes_written) => self.bytes_sent += bytes_written as usize,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(false),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(true)
+    }
+
+    /// Sends `range` of the file with sendfile, it follows `head_length` bytes of the head.
+    fn send_file<T: AsRawFd>(&mut self, stream: &T, file: &std::fs::File, head_length: usize, range: Range<usize>) -> io::Result<bool> {
+        while self.bytes_sent < head_length + range.len() {
+            let mut offset = (range.start + self.bytes_sent - head_length) as libc::off_t;
+            let count = (head_length + range.len() - self.bytes_sent).min(Self::MAX_SENDFILE_CHUNK);
+            match syscall!(sendfile(stream.as_raw_fd(), file.as_raw_fd(), &mut offset, count)) {
+                /* File got truncated since its length was read. */
+                Ok(0) => return Err(io::Error::from(io::ErrorKind::UnexpectedEof)),
+                Ok(bytes_written) => self.bytes_sent += bytes_written as usize,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(false),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            }
+        }
+        Ok(true)
+    }
+}
+
+impl Action for HttpSender {
     type Output = ();
-    
-    fn advance(&mut self) -> io::Result<Self::Output> {
-        while self.bytes_sent < self.data.len() {
-            let bytes_written = self.writer.write(self.bytes_sent[self.bytes_sent..])?;
-            self.bytes_sent += bytes_written;
-            if self.bytes_sent == self.data.len() {
+
+    fn advance<T: Read + Write + AsRawFd>(&mut self, stream: &mut T) -> io::Result<Self::Output> {
+        /* Response is moved out, so that its parts may be borrowed while progress is recorded. */
+        let response = match self.response.take() {
+            Some(response) => response,
+            None => {
                 self.is_finished = true;
+                return Ok(());
+            }
+        };
+        let head = response.head();
+        let result = match response.body().map(|body| (body.entity().content(), body.range())) {
+            Some((Content::File(file), range)) => {
+                self.write_head_before_file(stream, head)
+                    .and_then(|is_sent| if is_sent { self.send_file(stream, file, head.len(), range) } else { Ok(false) })
             }
+            Some((Content::Memory(data), range)) => self.write_vectored(stream, [head, &data[range]]),
+            None => self.write_vectored(stream, [head, &[]]),
+        };
+        match result {
+            /* Shared body is released as soon as it is sent. */
+            Ok(true) => self.is_finished = true,
+            Ok(false) => self.response = Some(response),
+            Err(err) => return Err(err),
         }
         Ok(())
     }
@@ -338,16 +730,27 @@ impl<W> Action for HttpSender<W> where W: Write {
     }
 }
 
-impl<W> Sender for HttpSender<W> where W: Write { }
+impl Sender for HttpSender {
+    fn start(&mut self, response: Response) {
+        self.response = Some(response);
+        self.bytes_sent = 0;
+        self.is_finished = false;
+    }
+}
 // endregion
 
 
 // region Connection
 pub enum ActionStatus {
     DownloadPending,
-    DownloadFinished,
     SendPending,
-    SendFinished,
+    /* Last response has been sent, whatever the peer still sends is read until it closes its side. */
+    ClosePending,
+}
+
+pub enum ConnectionState {
+    Open,
+    Closed,
 }
 
 pub struct Connection<D, S>
@@ -357,6 +760,10 @@ where
 {
     tcp_stream: TcpStream,
     status: ActionStatus,
+    id: u64,
+    keep_alive: bool,
+    deadline: Option<Instant>,
+    is_timer_scheduled: bool,
     pub downloader: D,
     pub sender: S,
 }
@@ -368,11 +775,14 @@ where
 {
     const STALE_CONNECTION_TIMEOUT: TimeoutDuration = TimeoutDuration::Finite(Duration::from_millis(500));
 
-    pub fn new(mut tcp_stream: TcpStream, downloader: D, sender: S) -> Self {
-        tcp_stream.set_nonblocking(true).unwrap();
+    pub fn new(tcp_stream: TcpStream, id: u64, downloader: D, sender: S) -> Self {
         Self {
             tcp_stream,
             status: ActionStatus::DownloadPending,
+            id,
+            keep_alive: true,
+            deadline: None,
+            is_timer_scheduled: false,
             downloader,
             sender
         }
@@ -385,17 +795,294 @@ where
 
     pub fn timeout(&self) -> &TimeoutDuration {
         match self.status {
-            ActionStatus::Pending => self.action.timeout(),
-            ActionStatus::Finished => &Self::STALE_CONNECTION_TIMEOUT
+            ActionStatus::DownloadPending => self.downloader.timeout(),
+            ActionStatus::SendPending => self.sender.timeout(),
+            ActionStatus::ClosePending => &Self::STALE_CONNECTION_TIMEOUT,
         }
     }
 
+    /// Moves the deadline of the connection, it is called on every activity.
+    fn touch(&mut self, now: Instant) {
+        self.deadline = match self.timeout() {
+            TimeoutDuration::Infinite => None,
+            TimeoutDuration::Finite(timeout) => Some(now + *timeout),
+        };
+    }
+
     pub fn advance_send(&mut self) -> io::Result<()> {
-        self.sender.advance()
+        self.sender.advance(&mut self.tcp_stream)
+    }
+
+    pub fn advance_download(&mut self) -> io::Result<bool> {
+        self.downloader.advance(&mut self.tcp_stream)
+    }
+
+    fn keeps_alive(request: &RequestHead) -> bool {
+        /* Requests without Host are answered with not_implemented, which closes the connection. */
+        if request.host.is_none() || request.is_body_unframed {
+            return false;
+        }
+        match (request.connection, request.version) {
+            (Some(connection), _) => connection == ConnectionType::KeepAlive,
+            (None, Version::V1) => false,
+            (None, _) => true,
+        }
     }
 
-    pub fn advance_download(&mut self) -> io::Result<Option<Request>> {
-        self.downloader.advance()
+    /// Downloads requests and sends responses until the stream would block.
+    /// Peer that hung up is served until the last request it managed to send.
+    pub fn advance<L, V>(&mut self, handler: &RequestHandler<L, V>, is_peer_closed: bool) -> io::Result<ConnectionState>
+    where
+        L: ResourceLoader,
+        V: ResourceValidator<ValidationError = ValidationResourceError>,
+    {
+        loop {
+            match self.status {
+                ActionStatus::DownloadPending => {
+                    let response = match self.advance_download() {
+                        Ok(true) => {
+                            let request = self.downloader.request().unwrap();
+                            self.keep_alive = Self::keeps_alive(&request);
+                            /* Response has to announce the close, even if the request asked for keep-alive. */
+                            let request = match self.keep_alive {
+                                true => request,
+                                false => RequestHead { connection: Some(ConnectionType::Close), ..request },
+                            };
+                            handler.handle(&request)
+                        }
+                        Ok(false) if is_peer_closed => return Ok(ConnectionState::Closed),
+                        Ok(false) => return Ok(ConnectionState::Open),
+                        Err(err) if err.kind() == io::ErrorKind::InvalidData => {
+                            self.keep_alive = false;
+                            RequestHandler::<L, V>::not_implemented()
+                        }
+                        Err(err) => return Err(err),
+                    };
+                    self.sender.start(response);
+                    self.status = ActionStatus::SendPending;
+                }
+                ActionStatus::SendPending => {
+                    self.advance_send()?;
+                    if !self.sender.is_finished() {
+                        return Ok(ConnectionState::Open);
+                    }
+                    if !self.keep_alive {
+                        /* Closing with unread bytes would reset the connection and could discard the response. */
+                        let _ = self.tcp_stream.shutdown(Shutdown::Write);
+                        self.status = ActionStatus::ClosePending;
+                        continue;
+                    }
+                    self.downloader.reset();
+                    self.status = ActionStatus::DownloadPending;
+                }
+                ActionStatus::ClosePending => {
+                    let mut discarded = [0; 4096];
+                    match self.tcp_stream.read(&mut discarded) {
+                        Ok(0) => return Ok(ConnectionState::Closed),
+                        Ok(_) => {}
+                        Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(ConnectionState::Open),
+                        Err(err) if err.kind() == io::ErrorKind::Interrupted => {}
+                        Err(err) => return Err(err),
+                    }
+                }
+            }
+        }
     }
 }
 // endregion
+
+
+#[cfg(test)]
+mod tests {
+    use std::io::{Read, Write};
+    use std::net::{Ipv4Addr, SocketAddr, TcpStream};
+    use std::path::Path;
+    use std::rc::Rc;
+    use std::sync::mpsc;
+    use std::thread;
+    use super::{HttpServer, RequestHandler};
+    use crate::http::common::Body;
+    use crate::http::parser::RequestParser;
+    use crate::http::response::Response;
+
+    /// Serves the `localhost` domain of the crate on a thread that lives as long as the test process.
+    fn start_server() -> SocketAddr {
+        let (address_sender, address_receiver) = mpsc::channel();
+        thread::spawn(move || {
+            let dir: Rc<Path> = Rc::from(Path::new(env!("CARGO_MANIFEST_DIR")));
+            let mut server: HttpServer = HttpServer::new(SocketAddr::from((Ipv4Addr::LOCALHOST, 0)), dir);
+            address_sender.send(server.address()).unwrap();
+            server.start();
+        });
+        address_receiver.recv().unwrap()
+    }
+
+    /// Reads the next response, returns its head and body.
+    fn read_response(stream: &mut TcpStream, buffer: &mut Vec<u8>) -> (String, Vec<u8>) {
+        let head_length = loop {
+            if let Some(position) = buffer.windows(4).position(|window| window == b"\r\n\r\n") {
+                break position + 4;
+            }
+            let mut chunk = [0; 4096];
+            let length = stream.read(&mut chunk).unwrap();
+            assert!(length > 0, "connection closed before the response");
+            buffer.extend_from_slice(&chunk[..length]);
+        };
+        let head = String::from_utf8(buffer[..head_length].to_vec()).unwrap();
+        let body_length = head.lines()
+            .find_map(|line| line.strip_prefix("Content-Length: "))
+            .map_or(0, |length| length.trim().parse().unwrap());
+        while buffer.len() < head_length + body_length {
+            let mut chunk = [0; 4096];
+            let length = stream.read(&mut chunk).unwrap();
+            assert!(length > 0, "connection closed before the end of the body");
+            buffer.extend_from_slice(&chunk[..length]);
+        }
+        let body = buffer[head_length..head_length + body_length].to_vec();
+        buffer.drain(..head_length + body_length);
+        (head, body)
+    }
+
+    fn assert_closed_cleanly(stream: &mut TcpStream, buffer: &[u8]) {
+        /* Reset would fail the read, data after the last response would mean that more was served. */
+        assert!(buffer.is_empty());
+        assert_eq!(0, stream.read_to_end(&mut Vec::new()).unwrap());
+    }
+
+    #[test]
+    fn test_body_is_skipped_before_next_request() {
+        let address = start_server();
+        let mut stream = TcpStream::connect(address).unwrap();
+        let smuggled = "GET /plik.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        let head = format!("GET /index.html HTTP/1.1\r\nHost: localhost\r\nContent-Length: {}\r\n\r\n", smuggled.len());
+        stream.write_all(head.as_bytes()).unwrap();
+        /* Body split between writes is skipped from the buffer and from later reads. */
+        stream.write_all(&smuggled.as_bytes()[..10]).unwrap();
+        stream.write_all(&smuggled.as_bytes()[10..]).unwrap();
+        stream.write_all(b"GET /page.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n").unwrap();
+        let mut buffer = Vec::new();
+        let (first_head, first_body) = read_response(&mut stream, &mut buffer);
+        assert!(first_head.starts_with("HTTP/1.1 200"));
+        assert!(!first_head.contains("Connection: close"));
+        assert_eq!(std::fs::read(Path::new(env!("CARGO_MANIFEST_DIR")).join("localhost/index.html")).unwrap(), first_body);
+        let (second_head, second_body) = read_response(&mut stream, &mut buffer);
+        assert!(second_head.starts_with("HTTP/1.1 200"));
+        assert!(second_head.contains("Connection: close"));
+        assert_eq!(std::fs::read(Path::new(env!("CARGO_MANIFEST_DIR")).join("localhost/page.html")).unwrap(), second_body);
+        assert_closed_cleanly(&mut stream, &buffer);
+    }
+
+    #[test]
+    fn test_unframed_body_closes_connection() {
+        let address = start_server();
+        let mut stream = TcpStream::connect(address).unwrap();
+        let mut writer = stream.try_clone().unwrap();
+        /* Body is still arriving when the response is sent, closing the socket over it would reset the connection. */
+        let body_writer = thread::spawn(move || {
+            let _ = writer.write_all(b"GET /index.html HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n");
+            let chunk = format!("{:x}\r\n{}\r\n", 1 << 16, "x".repeat(1 << 16));
+            for _ in 0..16 {
+                let _ = writer.write_all(chunk.as_bytes());
+            }
+            let _ = writer.write_all(b"0\r\n\r\n");
+        });
+        let mut buffer = Vec::new();
+        let (head, _) = read_response(&mut stream, &mut buffer);
+        assert!(head.starts_with("HTTP/1.1 200"));
+        assert!(head.contains("Connection: close"));
+        assert_closed_cleanly(&mut stream, &buffer);
+        body_writer.join().unwrap();
+    }
+
+    #[test]
+    fn test_request_without_host_closes_connection() {
+        let address = start_server();
+        let mut stream = TcpStream::connect(address).unwrap();
+        stream.write_all(b"GET /index.html HTTP/1.1\r\n\r\nGET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n").unwrap();
+        let mut buffer = Vec::new();
+        let (head, _) = read_response(&mut stream, &mut buffer);
+        assert!(head.starts_with("HTTP/1.1 501"));
+        assert!(head.contains("Connection: close"));
+        assert_closed_cleanly(&mut stream, &buffer);
+    }
+
+    const STYLESHEET: &str = "localhost/css/bootstrap.min.css";
+
+    fn handler() -> RequestHandler {
+        RequestHandler::default_config(Rc::from(Path::new(env!("CARGO_MANIFEST_DIR"))))
+    }
+
+    fn stylesheet_length() -> usize {
+        std::fs::metadata(Path::new(env!("CARGO_MANIFEST_DIR")).join(STYLESHEET)).unwrap().len() as usize
+    }
+
+    /// Response of the handler to a request for the stylesheet with additional `headers`.
+    fn respond(handler: &RequestHandler, headers: &str) -> (String, Response) {
+        let request = format!("GET /css/bootstrap.min.css HTTP/1.1\r\nHost: localhost\r\n{headers}\r\n");
+        let mut parser = RequestParser::new();
+        parser.parse(request.as_bytes()).unwrap().unwrap();
+        let response = handler.handle(&parser.head(request.as_bytes()));
+        (String::from_utf8(response.head().to_vec()).unwrap(), response)
+    }
+
+    fn header<'a>(head: &'a str, name: &str) -> Option<&'a str> {
+        head.lines().find_map(|line| line.strip_prefix(name)?.strip_prefix(": "))
+    }
+
+    #[test]
+    fn test_gzip_variant_is_negotiated() {
+        let handler = handler();
+        let (identity, response) = respond(&handler, "");
+        assert!(identity.starts_with("HTTP/1.1 200"));
+        assert_eq!(None, header(&identity, "Content-Encoding"));
+        assert_eq!(Some("Accept-Encoding"), header(&identity, "Vary"));
+        assert_eq!(stylesheet_length(), response.body().unwrap().entity().len());
+
+        let (gzipped, response) = respond(&handler, "Accept-Encoding: br, gzip\r\n");
+        assert!(gzipped.starts_with("HTTP/1.1 200"));
+        assert_eq!(Some("gzip"), header(&gzipped, "Content-Encoding"));
+        assert_eq!(Some("Accept-Encoding"), header(&gzipped, "Vary"));
+        assert_ne!(header(&identity, "ETag"), header(&gzipped, "ETag"));
+        let length = response.body().unwrap().entity().len();
+        assert!(length < stylesheet_length());
+        assert_eq!(Some(length.to_string().as_str()), header(&gzipped, "Content-Length"));
+    }
+
+    #[test]
+    fn test_range_is_served_from_identity_body() {
+        let (head, response) = respond(&handler(), "Accept-Encoding: gzip\r\nRange: bytes=100-199\r\n");
+        assert!(head.starts_with("HTTP/1.1 206"), "{head}");
+        assert_eq!(Some(format!("bytes 100-199/{}", stylesheet_length()).as_str()), header(&head, "Content-Range"));
+        assert_eq!(Some("100"), header(&head, "Content-Length"));
+        assert_eq!(None, header(&head, "Content-Encoding"));
+        assert_eq!(Some("Accept-Encoding"), header(&head, "Vary"));
+        assert!(matches!(response.body(), Some(Body::Partial(entity, range))
+            if entity.len() == stylesheet_length() && *range == (100..200)));
+    }
+
+    #[test]
+    fn test_unsatisfiable_range() {
+        let (head, _) = respond(&handler(), &format!("Range: bytes={}-\r\n", stylesheet_length()));
+        assert!(head.starts_with("HTTP/1.1 416"), "{head}");
+        assert_eq!(Some(format!("bytes */{}", stylesheet_length()).as_str()), header(&head, "Content-Range"));
+    }
+
+    #[test]
+    fn test_not_modified_carries_validators_only() {
+        let handler = handler();
+        let (gzipped, _) = respond(&handler, "Accept-Encoding: gzip\r\n");
+        let etag = header(&gzipped, "ETag").unwrap();
+        let (head, response) = respond(&handler, &format!("Accept-Encoding: gzip\r\nIf-None-Match: \"x\", {etag}\r\n"));
+        assert!(head.starts_with("HTTP/1.1 304"), "{head}");
+        assert_eq!(Some(etag), header(&head, "ETag"));
+        assert!(header(&head, "Last-Modified").is_some());
+        assert_eq!(Some("Accept-Encoding"), header(&head, "Vary"));
+        for name in ["Content-Length", "Content-Type", "Content-Encoding", "Content-Range"] {
+            assert_eq!(None, header(&head, name), "{head}");
+        }
+        assert!(response.body().is_none());
+        /* Validator of the gzip variant does not match the identity body. */
+        let (head, _) = respond(&handler, &format!("If-None-Match: {etag}\r\n"));
+        assert!(head.starts_with("HTTP/1.1 200"), "{head}");
+    }
+}
@@ -0,0 +1,129 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes hashed timer wheel used for connection timeouts.
+//! Scheduling and expiring a timer takes constant time, which matters with thousands of connections
+//! whose deadlines move with every request.
+
+use std::time::{Duration, Instant};
+
+
+/// Timer wheel of `slot_count` slots, each covering `tick` of time.
+///
+/// Timers are never cancelled, owners are expected to ignore expired timers whose deadline has been moved
+/// and schedule them again. Deadlines further than one revolution away expire early in the same way.
+pub struct TimerWheel<K> {
+    slots: Box<[Vec<(K, Instant)>]>,
+    tick: Duration,
+    started_at: Instant,
+    /* Index of the tick whose slot has not been expired yet. */
+    current_tick: u64,
+    len: usize,
+}
+
+impl<K> TimerWheel<K> {
+    pub fn new(tick: Duration, slot_count: usize, now: Instant) -> Self {
+        debug_assert!(slot_count > 0 && !tick.is_zero());
+        let slots = (0..slot_count).map(|_| Vec::new()).collect();
+        Self { slots, tick, started_at: now, current_tick: 0, len: 0 }
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    fn tick_of(&self, instant: Instant) -> u64 {
+        (instant.saturating_duration_since(self.started_at).as_nanos() / self.tick.as_nanos()) as u64
+    }
+
+    fn slot_index(&self, tick: u64) -> usize {
+        (tick % self.slots.len() as u64) as usize
+    }
+
+    /// Schedules timer that expires in the first tick that ends after the deadline.
+    pub fn schedule(&mut self, key: K, deadline: Instant) {
+        let tick = (self.tick_of(deadline) + 1).max(self.current_tick);
+        let slot_index = self.slot_index(tick);
+        self.slots[slot_index].push((key, deadline));
+        self.len += 1;
+    }
+
+    /// Moves timers of all the ticks that passed until `now` into `expired`.
+    pub fn expire(&mut self, now: Instant, expired: &mut Vec<(K, Instant)>) {
+        let now_tick = self.tick_of(now);
+        /* After a long pause there is no point in visiting the same slot more than once. */
+        let first_tick = self.current_tick.max((now_tick + 1).saturating_sub(self.slots.len() as u64));
+        for tick in first_tick..=now_tick {
+            let slot_index = self.slot_index(tick);
+            self.len -= self.slots[slot_index].len();
+            expired.append(&mut self.slots[slot_index]);
+        }
+        self.current_tick = self.current_tick.max(now_tick + 1);
+    }
+
+    /// Time left until the nearest slot with any timers, None if there are no timers.
+    pub fn next_timeout(&self, now: Instant) -> Option<Duration> {
+        if self.is_empty() {
+            return None;
+        }
+        let nearest_tick = (self.current_tick..self.current_tick + self.slots.len() as u64)
+            .find(|&tick| !self.slots[self.slot_index(tick)].is_empty())?;
+        let expires_at = self.started_at + self.tick * nearest_tick as u32;
+        Some(expires_at.saturating_duration_since(now))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::{Duration, Instant};
+    use super::TimerWheel;
+
+    const TICK: Duration = Duration::from_millis(10);
+
+    #[test]
+    fn test_timer_expires_after_deadline() {
+        let now = Instant::now();
+        let mut wheel = TimerWheel::new(TICK, 8, now);
+        wheel.schedule(1, now + Duration::from_millis(25));
+        let mut expired = Vec::new();
+        wheel.expire(now + Duration::from_millis(25), &mut expired);
+        assert!(expired.is_empty());
+        wheel.expire(now + Duration::from_millis(30), &mut expired);
+        assert_eq!(vec![1], expired.iter().map(|(key, _)| *key).collect::<Vec<_>>());
+        assert!(wheel.is_empty());
+    }
+
+    #[test]
+    fn test_far_deadline_expires_early() {
+        let now = Instant::now();
+        let mut wheel = TimerWheel::new(TICK, 4, now);
+        let deadline = now + Duration::from_millis(100);
+        wheel.schedule(1, deadline);
+        let mut expired = Vec::new();
+        wheel.expire(now + Duration::from_millis(60), &mut expired);
+        assert_eq!(vec![(1, deadline)], expired);
+    }
+
+    #[test]
+    fn test_next_timeout() {
+        let now = Instant::now();
+        let mut wheel = TimerWheel::new(TICK, 8, now);
+        assert_eq!(None, wheel.next_timeout(now));
+        wheel.schedule(1, now + Duration::from_millis(15));
+        assert_eq!(Some(Duration::from_millis(20)), wheel.next_timeout(now));
+    }
+
+    #[test]
+    fn test_long_pause_expires_everything_once() {
+        let now = Instant::now();
+        let mut wheel = TimerWheel::new(TICK, 4, now);
+        (0..4).for_each(|key| wheel.schedule(key, now + TICK * key));
+        let mut expired = Vec::new();
+        wheel.expire(now + Duration::from_secs(1), &mut expired);
+        assert_eq!(4, expired.len());
+        assert!(wheel.is_empty());
+    }
+}
@@ -0,0 +1,147 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes inotify wrapper which reports changes of entries of watched directories.
+//! Every directory is watched under a name chosen by the caller and changes are reported as paths under that name.
+
+use crate::libc;
+use crate::registry::syscall;
+
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::io;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::RawFd;
+use std::path::{Path, PathBuf};
+
+
+pub struct Watcher {
+    fd: RawFd,
+    names: HashMap<libc::c_int, PathBuf>,
+    descriptors: HashMap<PathBuf, libc::c_int>,
+    buffer: Box<[u8]>,
+}
+
+impl Watcher {
+    /* Any of those may change either content of a file or the result of validating its path. */
+    const CHANGE_MASK: u32 = libc::IN_MODIFY | libc::IN_ATTRIB | libc::IN_CLOSE_WRITE | libc::IN_CREATE
+        | libc::IN_DELETE | libc::IN_MOVED_FROM | libc::IN_MOVED_TO | libc::IN_DELETE_SELF | libc::IN_MOVE_SELF;
+    /* Symbolic links are not followed, otherwise one directory could be watched under several names. */
+    const WATCH_FLAGS: u32 = libc::IN_ONLYDIR | libc::IN_DONT_FOLLOW;
+    const EVENT_HEADER_SIZE: usize = 16;
+    const BUFFER_SIZE: usize = 16 * 1024;
+
+    pub fn new() -> io::Result<Self> {
+        let fd = syscall!(inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC))?;
+        Ok(Self {
+            fd,
+            names: HashMap::new(),
+            descriptors: HashMap::new(),
+            buffer: vec![0; Self::BUFFER_SIZE].into_boxed_slice(),
+        })
+    }
+
+    /// Watches entries of `directory`, their changes are reported as `name` joined with the entry name.
+    /// Fails if the directory is a symbolic link or is already watched under a different name.
+    pub fn watch(&mut self, directory: &Path, name: &Path) -> io::Result<()> {
+        if self.descriptors.contains_key(name) {
+            return Ok(());
+        }
+        let directory = CString::new(directory.as_os_str().as_bytes())
+            .map_err(|err| io::Error::new(io::ErrorKind::InvalidInput, err))?;
+        let wd = syscall!(inotify_add_watch(self.fd, directory.as_ptr(), Self::CHANGE_MASK | Self::WATCH_FLAGS))?;
+        if self.names.contains_key(&wd) {
+            return Err(io::Error::new(io::ErrorKind::AlreadyExists, "directory is watched under another name"));
+        }
+        self.names.insert(wd, name.to_owned());
+        self.descriptors.insert(name.to_owned(), wd);
+        Ok(())
+    }
+
+    fn unwatch(&mut self, wd: libc::c_int) {
+        if let Some(name) = self.names.remove(&wd) {
+            self.descriptors.remove(&name);
+        }
+    }
+
+    /// Appends paths which changed since the last call to `changes`, never blocks.
+    /// Change of a directory itself is reported as its name and empty path means that anything might have changed.
+    pub fn changes(&mut self, changes: &mut Vec<PathBuf>) -> io::Result<()> {
+        loop {
+            let result = syscall!(read(self.fd, self.buffer.as_mut_ptr() as *mut libc::c_void, self.buffer.len()));
+            let length = match result {
+                Ok(length) => length as usize,
+                Err(err) if err.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(err) if err.kind() == io::ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err),
+            };
+            let mut offset = 0;
+            while offset + Self::EVENT_HEADER_SIZE <= length {
+                let field = |index: usize| {
+                    let start = offset + 4 * index;
+                    u32::from_ne_bytes(self.buffer[start..start + 4].try_into().unwrap())
+                };
+                let (wd, mask, name_length) = (field(0) as libc::c_int, field(1), field(3) as usize);
+                let name_start = offset + Self::EVENT_HEADER_SIZE;
+                /* Name is padded with NUL bytes to alignment. */
+                let entry_name = &self.buffer[name_start..name_start + name_length];
+                let entry_name = &entry_name[..entry_name.iter().position(|&byte| byte == 0).unwrap_or(name_length)];
+                offset = name_start + name_length;
+
+                if mask & libc::IN_Q_OVERFLOW != 0 {
+                    changes.push(PathBuf::new());
+                    continue;
+                }
+                let name = match self.names.get(&wd) {
+                    Some(name) => name,
+                    None => continue,
+                };
+                if entry_name.is_empty() {
+                    changes.push(name.clone());
+                } else {
+                    changes.push(name.join(std::ffi::OsStr::from_bytes(entry_name)));
+                }
+                /* Watch follows the moved directory, whose name is not known anymore. */
+                if mask & libc::IN_MOVE_SELF != 0 {
+                    unsafe { libc::inotify_rm_watch(self.fd, wd); }
+                    self.unwatch(wd);
+                } else if mask & libc::IN_IGNORED != 0 {
+                    self.unwatch(wd);
+                }
+            }
+        }
+    }
+}
+
+impl Drop for Watcher {
+    fn drop(&mut self) {
+        unsafe { libc::close(self.fd); }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::path::{Path, PathBuf};
+    use super::Watcher;
+
+    #[test]
+    fn test_reports_changed_entries() {
+        let directory = std::env::temp_dir().join(format!("server-watcher-{}", std::process::id()));
+        let _ = fs::remove_dir_all(&directory);
+        fs::create_dir_all(directory.join("nested")).unwrap();
+        let mut watcher = Watcher::new().unwrap();
+        watcher.watch(&directory, Path::new("domain")).unwrap();
+        watcher.watch(&directory.join("nested"), Path::new("domain/nested")).unwrap();
+
+        let mut changes = Vec::new();
+        watcher.changes(&mut changes).unwrap();
+        assert!(changes.is_empty());
+
+        fs::write(directory.join("nested").join("file.html"), b"content").unwrap();
+        fs::rename(directory.join("nested"), directory.join("moved")).unwrap();
+        watcher.changes(&mut changes).unwrap();
+        assert!(changes.contains(&PathBuf::from("domain/nested/file.html")));
+        assert!(changes.contains(&PathBuf::from("domain/nested")));
+        fs::remove_dir_all(&directory).unwrap();
+    }
+}
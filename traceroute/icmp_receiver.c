@@ -4,45 +4,85 @@
 
 #include "icmp_receiver.h"
 
-// region IPICMPPacket
+// region ICMPPacket
 
-void ip_icmp_package_init_from_filled_buffer(IPICMPPacket* restrict self) {
-    const struct ip* _temp_ip_header = (struct ip*) self->buffer;
-    self->header_len = IP_HEADER_SIZE_IN_BYTES(_temp_ip_header);
-    self->data_len = IP_MAXPACKET - self->header_len;
-    self->sender_ipv4_address.s_addr = _temp_ip_header->ip_src.s_addr;
-}
+_Static_assert(MAX_IP_ICMP_PACKET_SIZE % 8 == 0, "batch buffers must stay aligned");
 
-// endregion
 
+bool icmp_packet_parse(const u8* ip_packet, usize length, ICMPPacket* packet) {
+    if (length < MIN_IP_HEADER_SIZE) {
+        return false;
+    }
+    const struct ip* ip_header = (const struct ip*) ip_packet;
+    const usize header_len = IP_HEADER_SIZE_IN_BYTES(ip_header);
+    if (ip_header->ip_v != 4 || header_len < MIN_IP_HEADER_SIZE || header_len + ICMP_MINLEN > length) {
+        return false;
+    }
+    packet->header = (const struct icmp*) (ip_packet + header_len);
+    packet->data = ip_packet + header_len + ICMP_MINLEN;
+    packet->data_len = length - header_len - ICMP_MINLEN;
+    return true;
+}
 
 
-// region ICMPPacket
+const struct icmp* icmp_packet_time_exceeded_embedded_icmp_header(const ICMPPacket* self) {
+    assert(self->header->icmp_type == ICMP_TIME_EXCEEDED);
+    if (self->data_len < MIN_IP_HEADER_SIZE) {
+        return NULL;
+    }
+    const struct ip* embedded_ip_header = (const struct ip*) self->data;
+    const usize embedded_ip_header_len = IP_HEADER_SIZE_IN_BYTES(embedded_ip_header);
+    if (embedded_ip_header_len < MIN_IP_HEADER_SIZE || embedded_ip_header_len + ICMP_MINLEN > self->data_len) {
+        return NULL;
+    }
+    return (const struct icmp*) (self->data + embedded_ip_header_len);
+}
 
-ICMPPacket icmp_packet_from_ip_icmp_packet(const IPICMPPacket* ip_icmp_packet) {
-    ICMPPacket new = {0};
-    const u8* icmp_packet_data = ip_icmp_packet->buffer + ip_icmp_packet->header_len;
-    memcpy(&new.header, icmp_packet_data, ICMP_MINLEN);
-    memcpy(new.data, icmp_packet_data + ICMP_MINLEN, MAX_ICMP_PACKET_SIZE - ICMP_MINLEN);
-    return new;
+
+bool icmp_packet_echo_request_id_seq(const ICMPPacket* self, u16* identifier, u16* sequence_number) {
+    const struct icmp* echo_header = self->header;
+    if (self->header->icmp_type == ICMP_TIME_EXCEEDED) {
+        echo_header = icmp_packet_time_exceeded_embedded_icmp_header(self);
+    } else if (self->header->icmp_type != ICMP_ECHOREPLY) {
+        return false;
+    }
+    if (echo_header == NULL) {
+        return false;
+    }
+    *identifier = echo_header->icmp_hun.ih_idseq.icd_id;
+    *sequence_number = echo_header->icmp_hun.ih_idseq.icd_seq;
+    return true;
 }
 
 
-void icmp_packet_time_exceeded_embedded_icmp_header(const ICMPPacket* self, struct icmp* header) {
-    assert(self->header.icmp_type == ICMP_TIME_EXCEEDED);
-    const struct ip* embedded_ip_header = (struct ip*) self->data;
-    const usize embedded_ip_header_len = IP_HEADER_SIZE_IN_BYTES(embedded_ip_header);
-    memcpy(header, self->data + embedded_ip_header_len, ICMP_MINLEN);
+bool icmp_packet_echo_request_flow_identifier(const ICMPPacket* self, u16* flow_identifier) {
+    if (self->header->icmp_type == ICMP_TIME_EXCEEDED) {
+        const struct icmp* echo_header = icmp_packet_time_exceeded_embedded_icmp_header(self);
+        if (echo_header == NULL) {
+            return false;
+        }
+        *flow_identifier = echo_header->icmp_cksum;
+        return true;
+    }
+    if (self->header->icmp_type != ICMP_ECHOREPLY) {
+        return false;
+    }
+    // Type word of the reply is smaller by the type of the request, so its checksum is larger by as much.
+    const u16 type_word = htons(ICMP_ECHO << 8);
+    u32 sum = (u32) self->header->icmp_cksum + (u16) ~type_word;
+    sum = (sum & 0xffff) + (sum >> 16);
+    *flow_identifier = (u16) sum;
+    return true;
 }
 
 
 extern bool icmp_packet_is_time_to_live_exceeded_message(const ICMPPacket* self) {
-    return self->header.icmp_type == ICMP_TIME_EXCEEDED;
+    return self->header->icmp_type == ICMP_TIME_EXCEEDED;
 }
 
 
 bool icmp_packet_is_echo_reply_message(const ICMPPacket* self) {
-    return self->header.icmp_type == ICMP_ECHOREPLY;
+    return self->header->icmp_type == ICMP_ECHOREPLY;
 }
 
 
@@ -51,14 +91,14 @@ bool icmp_packet_is_time_to_live_exceeded_message_valid(
         const EchoRequestParams* echo_params
 ) {
     if (icmp_packet_is_time_to_live_exceeded_message(self)) {
-        struct icmp embedded_header = {0};
-        icmp_packet_time_exceeded_embedded_icmp_header(self, &embedded_header);
+        const struct icmp* embedded_header = icmp_packet_time_exceeded_embedded_icmp_header(self);
         return (
-            embedded_header.icmp_hun.ih_idseq.icd_id == echo_params->identifier &&
-            embedded_header.icmp_hun.ih_idseq.icd_seq == echo_params->sequence_number
+            embedded_header != NULL &&
+            embedded_header->icmp_hun.ih_idseq.icd_id == echo_params->identifier &&
+            embedded_header->icmp_hun.ih_idseq.icd_seq == echo_params->sequence_number
         );
     } else {
-        fprintf(stderr, "Expected ICMP Time Exceeded Message - Type 11, got Type: %d\n", self->header.icmp_type);
+        fprintf(stderr, "Expected ICMP Time Exceeded Message - Type 11, got Type: %d\n", self->header->icmp_type);
         exit(EXIT_FAILURE);
     }
 }
@@ -70,11 +110,11 @@ bool icmp_packet_is_echo_reply_message_valid(
 ) {
     if (icmp_packet_is_echo_reply_message(self)) {
         return (
-            self->header.icmp_hun.ih_idseq.icd_id == echo_params->identifier &&
-            self->header.icmp_hun.ih_idseq.icd_seq == echo_params->sequence_number
+            self->header->icmp_hun.ih_idseq.icd_id == echo_params->identifier &&
+            self->header->icmp_hun.ih_idseq.icd_seq == echo_params->sequence_number
         );
     } else {
-        fprintf(stderr, "Expected ICMP Echo Reply Message - Type 0, got Type: %d\n", self->header.icmp_type);
+        fprintf(stderr, "Expected ICMP Echo Reply Message - Type 0, got Type: %d\n", self->header->icmp_type);
         exit(EXIT_FAILURE);
     }
 }
@@ -83,36 +123,173 @@ bool icmp_packet_is_echo_reply_message_valid(
 
 
 
+// region ICMPPacketBatch
+
+bool icmp_packet_batch_get(const ICMPPacketBatch* self, usize index, ICMPPacket* packet) {
+    assert(index < self->count);
+    // Truncated packets report only the stored length, so headers never get read past the buffer.
+    return icmp_packet_parse(self->buffers[index], self->messages[index].msg_len, packet);
+}
+
+// endregion
+
+
+
 // region PingInfo
 
+internal void ping_info_add_reply(
+        PingInfo* restrict self,
+        struct in_addr sender_address,
+        bool is_timed,
+        u64 round_trip_time_ns
+) {
+    if (self->collected_packets == self->probe_count) {
+        return;  /* Ignore duplicated replies. */
+    }
+    self->collected_packets++;
+    if (is_timed) {
+        rtt_statistics_add(&self->round_trip_times, round_trip_time_ns);
+    }
+    // region check if current ip address is not already stored
+    for (usize i = 0; i < self->address_count; i++) {
+        if (self->ip_addresses[i].s_addr == sender_address.s_addr) {
+            return;
+        }
+    }
+    if (self->address_count < MAX_HOP_ADDRESSES) {
+        self->ip_addresses[self->address_count++] = sender_address;
+    } else {
+        self->extra_address_count++;
+    }
+    // endregion
+}
+
+
+PingInfo ping_info_new_awaiting(usize ttl, usize probe_count) {
+    assert(1 <= probe_count && probe_count <= MAX_PROBE_COUNT);
+    PingInfo new = {0};
+    new.ttl = ttl;
+    new.timeout = true;
+    new.message_type = ICMP_TIME_EXCEEDED;
+    new.probe_count = probe_count;
+    new.round_trip_times = rtt_statistics_new();
+    return new;
+}
+
+
+void ping_info_record_reply(
+        PingInfo* restrict self,
+        const ICMPPacket* icmp_packet,
+        struct in_addr sender_address,
+        const struct timespec* received_at
+) {
+    const u64 round_trip_time_ns = time_elapsed_ns(&self->sent_at, received_at);
+    // Reply to a request of an earlier round would be timed from the later sent_at.
+    u16 flow_identifier = self->first_flow_identifier;
+    const bool is_timed = (
+        self->round_first_probe == 0 ||
+        (icmp_packet_echo_request_flow_identifier(icmp_packet, &flow_identifier) &&
+         (u16) (flow_identifier - self->first_flow_identifier) >= self->round_first_probe)
+    );
+    if (icmp_packet->header->icmp_type == ICMP_ECHOREPLY) {
+        if (self->message_type != ICMP_ECHOREPLY) {
+            // Echo Reply takes precedence, discard Time Exceeded replies collected so far.
+            self->message_type = ICMP_ECHOREPLY;
+            self->address_count = 0;
+            self->extra_address_count = 0;
+            self->collected_packets = 0;
+            self->round_trip_times = rtt_statistics_new();
+        }
+        self->timeout = false;
+        self->message_code = icmp_packet->header->icmp_code;
+        ping_info_add_reply(self, sender_address, is_timed, round_trip_time_ns);
+    } else if (self->message_type == ICMP_TIME_EXCEEDED) {
+        self->timeout = false;
+        self->message_code = icmp_packet->header->icmp_code;
+        ping_info_add_reply(self, sender_address, is_timed, round_trip_time_ns);
+    }
+}
+
+
+bool ping_infos_are_complete(const PingInfo* ping_infos, usize hop_count) {
+    for (usize i = 0; i < hop_count; i++) {
+        if (ping_infos[i].collected_packets < ping_infos[i].probe_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void ping_info_update_rto_estimator(const PingInfo* self, RTOEstimator* estimator) {
+    if (!self->timeout && self->round_trip_times.count > 0) {
+        rto_estimator_add_sample(estimator, self->round_trip_times.max_ns);
+    }
+}
+
+
 usize ping_info_process_results(const PingInfo* self) {
     char address_buffer[20];
     printf("%hhu.", self->ttl);
     if (self->timeout) {
         printf(" *\n");
-    } else if (self->message_type == ICMP_ECHOREPLY) {
-        inet_ntop(AF_INET, &self->echo_reply.ip_address, address_buffer, sizeof(address_buffer));
+        return NO_SUCCESS;
+    }
+    for (usize i = 0; i < self->address_count; i++) {
+        inet_ntop(AF_INET, &self->ip_addresses[i], address_buffer, sizeof(address_buffer));
         printf(" %-15s", address_buffer);
-        u64 time = self->echo_reply.round_trip_time.tv_usec / 1000 + self->echo_reply.round_trip_time.tv_sec * 1000;
-        printf(" %lums\n", time);
-        return SUCCESS;
-    } else {
-        for (usize i = 0; i < self->ttl_exceeded.unique_address_count; i++) {
-            inet_ntop(AF_INET, &self->ttl_exceeded.ip_addresses[i], address_buffer, sizeof(address_buffer));
-            printf(" %-15s", address_buffer);
-        }
-        if (self->ttl_exceeded.collected_packets == PACKET_COUNT) {
-            struct timeval total = {0};
-            timeradd(&self->ttl_exceeded.round_trip_times[0], &total, &total);
-            timeradd(&self->ttl_exceeded.round_trip_times[1], &total, &total);
-            timeradd(&self->ttl_exceeded.round_trip_times[2], &total, &total);
-            u64 time = (total.tv_usec / 1000 + total.tv_sec * 1000) / 3;
-            printf(" %lums\n", time);
-        } else {
-            printf(" ???\n");
-        }
     }
-    return NO_SUCCESS;
+    if (self->extra_address_count > 0) {
+        printf(" (+%hu more)", self->extra_address_count);
+    }
+    const RTTStatistics* statistics = &self->round_trip_times;
+    if (statistics->count > 0) {
+        printf(
+                " %.3f/%.3f/%.3f/%.3fms",
+                statistics->min_ns / 1e6,
+                statistics->mean_ns / 1e6,
+                statistics->max_ns / 1e6,
+                rtt_statistics_stddev_ns(statistics) / 1e6
+        );
+    }
+    const f64 loss = 1.0 - (f64) self->collected_packets / self->probe_count;
+    printf(" %.0f%% loss\n", loss * 100.0);
+    return self->message_type == ICMP_ECHOREPLY ? SUCCESS : NO_SUCCESS;
+}
+
+// endregion
+
+
+
+// region Time
+
+struct timespec time_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+
+struct timespec time_now_realtime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now;
+}
+
+
+struct timespec time_add_ns(const struct timespec* time, u64 ns) {
+    const u64 total_ns = (u64) time->tv_nsec + ns;
+    const struct timespec new = {
+            .tv_sec = time->tv_sec + (time_t) (total_ns / 1000000000ULL),
+            .tv_nsec = (long) (total_ns % 1000000000ULL)
+    };
+    return new;
+}
+
+
+u64 time_elapsed_ns(const struct timespec* since, const struct timespec* now) {
+    const i64 elapsed_ns = (i64) (now->tv_sec - since->tv_sec) * 1000000000LL + (now->tv_nsec - since->tv_nsec);
+    return elapsed_ns > 0 ? (u64) elapsed_ns : 0;
 }
 
 // endregion
@@ -121,128 +298,323 @@ usize ping_info_process_results(const PingInfo* self) {
 
 // region ICMPReceiver
 
-internal void icmp_receiver_reset_descriptor_set(ICMPReceiver* self) {
-    fd_set descriptor_set;
-    FD_ZERO(&descriptor_set);
-    FD_SET(self->socket_fd, &descriptor_set);
-    self->descriptor_set = descriptor_set;
+internal void icmp_receiver_add_interest(const ICMPReceiver* self, i32 fd) {
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        fprintf(stderr, "Could not register file descriptor in epoll: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 }
 
 
 ICMPReceiver icmp_receiver_new(i32 socket_fd) {
     ICMPReceiver new = {0};
     new.socket_fd = socket_fd;
-    icmp_receiver_reset_descriptor_set(&new);
+    new.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (new.epoll_fd < 0) {
+        fprintf(stderr, "Could not create an epoll: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    new.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (new.timer_fd < 0) {
+        fprintf(stderr, "Could not create a timer: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    const i32 enable = 1;
+    if (setsockopt(new.socket_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+        fprintf(stderr, "Could not enable receive timestamps: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    icmp_receiver_add_interest(&new, new.socket_fd);
+    icmp_receiver_add_interest(&new, new.timer_fd);
     return new;
 }
 
 
-/*
- * Note:
- *     [select()] ...
- *     Upon return, each of the file descriptor sets is modified in place
- *     to indicate which file descriptors are currently "ready".
- *     Thus, if using select() within a loop, the sets must be reinitialized before each call.
- *
- * Note:
- *      On Linux, select() modifies timeout to reflect the amount of time not slept;
- */
+void icmp_receiver_close(ICMPReceiver* self) {
+    close(self->timer_fd);
+    close(self->epoll_fd);
+    self->timer_fd = -1;
+    self->epoll_fd = -1;
+}
+
+
+void icmp_receiver_attach_filter(const ICMPReceiver* self, u16 base_identifier, usize identifier_count) {
+    assert(0 < identifier_count && identifier_count <= 65536);
+    // Identifier is written to the header in host byte order, so it has to be assembled from bytes the same way.
+    const bool is_big_endian = htons(1) == 1;
+    const u32 high_byte_offset = is_big_endian ? 4 : 5;
+    const u32 low_byte_offset = is_big_endian ? 5 : 4;
+
+    // Offsets are relative to the ICMP header, raw socket delivers packets starting with the IPv4 header.
+    struct sock_filter program[] = {
+            /*  0 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                        /* X = outer IPv4 header length */
+            /*  1 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),                         /* A = ICMP Type */
+            /*  2 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 9, 0),     /* Echo Reply -> 12 */
+            /*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 0, 18),/* other types -> 22 */
+            /*  4 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8 + 9),                     /* A = embedded IPv4 Protocol */
+            /*  5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 16),      /* not ICMP -> 22 */
+            /*  6 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),                         /* A = embedded IPv4 header length */
+            /*  7 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0f),
+            /*  8 */ BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+            /*  9 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+            /* 10 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 8),
+            /* 11 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),                               /* X = embedded ICMP header */
+            /* 12 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, high_byte_offset),          /* A = Identifier */
+            /* 13 */ BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+            /* 14 */ BPF_STMT(BPF_ST, 0),
+            /* 15 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, low_byte_offset),
+            /* 16 */ BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+            /* 17 */ BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+            /* 18 */ BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, base_identifier),       /* A = (Identifier - base) mod 2^16 */
+            /* 19 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffff),
+            /* 20 */ BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, identifier_count, 1, 0),   /* out of range -> 22 */
+            /* 21 */ BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),                         /* accept whole packet */
+            /* 22 */ BPF_STMT(BPF_RET | BPF_K, 0),                                  /* drop */
+    };
+    const struct sock_fprog filter = { .len = sizeof(program) / sizeof(program[0]), .filter = program };
+    if (setsockopt(self->socket_fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+        fprintf(stderr, "Could not attach socket filter: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void icmp_receiver_set_deadline(ICMPReceiver* restrict self, const struct timespec* deadline) {
+    struct itimerspec timer = {0};
+    if (deadline != NULL) {
+        timer.it_value = *deadline;
+        if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0) {
+            timer.it_value.tv_nsec = 1;     /* Zero would disarm the timer. */
+        }
+    }
+    // Rearming the timer also discards expirations that have not been read yet.
+    if (timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+        fprintf(stderr, "Could not arm the timer: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+u32 icmp_receiver_await_events(ICMPReceiver* restrict self) {
+    struct epoll_event events[2];
+    i32 ready;
+    do {
+        ready = epoll_wait(self->epoll_fd, events, 2, -1);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0) {
+        fprintf(stderr, "Error occurred while awaiting for file socket file descriptor: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    u32 result = 0;
+    for (i32 i = 0; i < ready; i++) {
+        if (events[i].data.fd == self->socket_fd) {
+            result |= ICMP_RECEIVER_READABLE;
+        } else {
+            u64 expirations;
+            // Expiration might have been discarded by rearming the timer after epoll_wait returned.
+            if (read(self->timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                result |= ICMP_RECEIVER_DEADLINE;
+            }
+        }
+    }
+    return result;
+}
+
+
+usize icmp_receiver_receive_batch(ICMPReceiver* restrict self, ICMPPacketBatch* batch) {
+    // region prepare batch
+    memset(batch->messages, 0, sizeof(batch->messages));
+    for (usize i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+        batch->iovecs[i].iov_base = batch->buffers[i];
+        batch->iovecs[i].iov_len = MAX_IP_ICMP_PACKET_SIZE;
+
+        struct msghdr* message = &batch->messages[i].msg_hdr;
+        message->msg_name = &batch->sender_addresses[i];
+        message->msg_namelen = sizeof(batch->sender_addresses[i]);
+        message->msg_iov = &batch->iovecs[i];
+        message->msg_iovlen = 1;
+        message->msg_control = batch->control_messages[i].buffer;
+        message->msg_controllen = sizeof(batch->control_messages[i].buffer);
+    }
+    // endregion
+
+    // Packets longer than the buffer get truncated, everything we inspect lies within the first MAX_IP_ICMP_PACKET_SIZE bytes.
+    const i32 result = recvmmsg(self->socket_fd, batch->messages, RECEIVE_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (result < 0) {
+        if (errno == EWOULDBLOCK) {
+            batch->count = 0;
+            return 0;
+        }
+        fprintf(stderr, "Error occurred while reading incoming IPv4 packets: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    batch->count = result;
+
+    // region extract receive timestamps
+    bool has_fallback_timestamp = false;
+    struct timespec fallback_timestamp = {0};
+    for (usize i = 0; i < batch->count; i++) {
+        struct msghdr* message = &batch->messages[i].msg_hdr;
+        bool has_timestamp = false;
+        for (struct cmsghdr* control_message = CMSG_FIRSTHDR(message);
+             control_message != NULL;
+             control_message = CMSG_NXTHDR(message, control_message)) {
+            if (control_message->cmsg_level == SOL_SOCKET && control_message->cmsg_type == SCM_TIMESTAMPNS) {
+                memcpy(&batch->timestamps[i], CMSG_DATA(control_message), sizeof(batch->timestamps[i]));
+                has_timestamp = true;
+            }
+        }
+        if (!has_timestamp) {
+            // Kernel should always attach the timestamp, read the clock at most once per batch if it did not.
+            if (!has_fallback_timestamp) {
+                fallback_timestamp = time_now_realtime();
+                has_fallback_timestamp = true;
+            }
+            batch->timestamps[i] = fallback_timestamp;
+        }
+    }
+    // endregion
+    return batch->count;
+}
+
 
 PingInfo icmp_receiver_await_icmp_packets(
         ICMPReceiver* restrict self,
-        const EchoRequestParams* echo_params
+        const EchoRequestParams* echo_params,
+        usize probe_count,
+        const struct timespec* sent_at,
+        u64 timeout_ns
 ){
-    PingInfo ping_info = {0};
-    ping_info.ttl = echo_params->ttl;
-    ping_info.timeout = false;
+    PingInfo ping_info = ping_info_new_awaiting(echo_params->ttl, probe_count);
+    ping_info.sent_at = *sent_at;
+    icmp_receiver_collect_replies(self, echo_params, &ping_info, timeout_ns);
+    return ping_info;
+}
+
+
+void icmp_receiver_collect_replies(
+        ICMPReceiver* restrict self,
+        const EchoRequestParams* echo_params,
+        PingInfo* ping_info,
+        u64 timeout_ns
+){
+    bool timeout = false;
     ICMPPacket icmp_packet = {0};
-    IPICMPPacket ip_icmp_packet = {0};
-    u8 collected_packets = 0;
+    ICMPPacketBatch batch;
 
     // region setup timers
-    struct timeval stop_time, wait_time, round_trip_time;
-    stop_time.tv_sec = MAX_WAIT_TIME_IN_SECONDS;
-    stop_time.tv_usec = 0;
-    wait_time.tv_sec = MAX_WAIT_TIME_IN_SECONDS;
-    wait_time.tv_usec = 0;
+    const struct timespec start_time = time_now();
+    const struct timespec deadline = time_add_ns(&start_time, timeout_ns);
+    icmp_receiver_set_deadline(self, &deadline);
     // endregion
 
-    while (collected_packets < PACKET_COUNT && ping_info.timeout == false) {
-        icmp_receiver_reset_descriptor_set(self);
-        // !! select modifies the descriptor sets !!
-        i32 ready = select(
-                self->socket_fd + 1,
-                &self->descriptor_set,
-                NULL,
-                NULL,
-                &wait_time
-        );
-        if (ready > 0) {
-            bool read_bytes = true;
-            while (read_bytes) {
-                struct sockaddr_in sender_address = {0};
-                socklen_t sender_struct_size = sizeof(sender_address);
-                isize result = recvfrom(
-                        self->socket_fd, 
-                        ip_icmp_packet.buffer,
-                        IP_MAXPACKET, 
-                        MSG_DONTWAIT,
-                        (struct sockaddr*) &sender_address, 
-                        &sender_struct_size
-                );
-                if (result < 0) {
-                    if (errno == EWOULDBLOCK) {
-                        read_bytes = false;
-                    } else {
-                        fprintf(stderr, "Error occurred while reading incoming IPv4 packets: %s", strerror(errno));
-                        exit(EXIT_FAILURE);
+    while (!timeout && !ping_infos_are_complete(ping_info, 1)) {
+        const u32 events = icmp_receiver_await_events(self);
+        if (events & ICMP_RECEIVER_READABLE) {
+            // Batch that was not filled completely means the socket has been drained.
+            do {
+                icmp_receiver_receive_batch(self, &batch);
+                for (usize i = 0; i < batch.count; i++) {
+                    if (!icmp_packet_batch_get(&batch, i, &icmp_packet)) {     /* Extract ICMP packet from IP packet. */
+                        continue;  /* Ignore malformed packets. */
                     }
-                } else {
-                    ip_icmp_package_init_from_filled_buffer(&ip_icmp_packet);
-                    icmp_packet = icmp_packet_from_ip_icmp_packet(&ip_icmp_packet);    /* Extract ICMP packet from IP packet. */
-
-                    timersub(&stop_time, &wait_time, &round_trip_time);                              /* calculate round trip time */
-                    ping_info.message_type = icmp_packet.header.icmp_type;
 
                     // region ICMP message validation
-                    switch (ping_info.message_type) {
+                    bool is_valid = false;
+                    switch (icmp_packet.header->icmp_type) {
                         case ICMP_ECHOREPLY: {
-                            if (icmp_packet_is_echo_reply_message_valid(&icmp_packet, echo_params)) {
-                                ping_info.echo_reply.ip_address = sender_address.sin_addr;
-                                ping_info.echo_reply.round_trip_time = round_trip_time;
-                                return ping_info;
-                            }
+                            is_valid = icmp_packet_is_echo_reply_message_valid(&icmp_packet, echo_params);
                         } break;
                         case ICMP_TIME_EXCEEDED: {
-                            if (icmp_packet_is_time_to_live_exceeded_message_valid(&icmp_packet, echo_params)) {
-                                ping_info.ttl_exceeded.round_trip_times[collected_packets] = round_trip_time;
-                                // region check if current ip address is not already stored
-                                bool ip_address_already_added = false;
-                                for (usize i = 0; i < ping_info.ttl_exceeded.unique_address_count; i++) {
-                                    ip_address_already_added = ping_info.ttl_exceeded.ip_addresses[i].s_addr == sender_address.sin_addr.s_addr;
-                                }
-                                if (!ip_address_already_added) {
-                                    ping_info.ttl_exceeded.ip_addresses[ping_info.ttl_exceeded.unique_address_count++] = sender_address.sin_addr;
-                                }
-                                collected_packets++;
-                                // endregion
-                            }
+                            is_valid = icmp_packet_is_time_to_live_exceeded_message_valid(&icmp_packet, echo_params);
                         } break;
                         default:
                             continue;  /* Ignore all other ICMP message types. */
                     }
                     // endregion
+
+                    if (is_valid) {
+                        ping_info_record_reply(
+                                ping_info,
+                                &icmp_packet,
+                                batch.sender_addresses[i].sin_addr,
+                                &batch.timestamps[i]
+                        );
+                    }
                 }
-            }
-        } else if (ready == 0) {
-            ping_info.timeout = true;
-        } else {
-            fprintf(stderr, "Error occurred while awaiting for file socket file descriptor: %s", strerror(errno));
-            exit(EXIT_FAILURE);
+            } while (batch.count == RECEIVE_BATCH_SIZE);
+        }
+        if (events & ICMP_RECEIVER_DEADLINE) {
+            timeout = true;
         }
     }
-    ping_info.ttl_exceeded.collected_packets = collected_packets;
-    return ping_info;
+}
+
+usize icmp_receiver_await_icmp_packets_window(
+        ICMPReceiver* restrict self,
+        const EchoRequestParams* echo_params,
+        usize window_size,
+        usize probe_count,
+        const struct timespec* sent_at,
+        u64 timeout_ns,
+        PingInfo* ping_infos
+){
+    assert(window_size <= MAX_HOPS);
+    const usize first_ttl = echo_params->ttl;
+    usize destination_hop = window_size;        /* index of the lowest hop that responded with Echo Reply */
+    bool timeout = false;
+    ICMPPacket icmp_packet = {0};
+    ICMPPacketBatch batch;
+
+    // Until proven otherwise every hop is a silent router.
+    for (usize i = 0; i < window_size; i++) {
+        ping_infos[i] = ping_info_new_awaiting(first_ttl + i, probe_count);
+        ping_infos[i].sent_at = *sent_at;
+    }
+
+    // region setup timers
+    const struct timespec start_time = time_now();
+    const struct timespec deadline = time_add_ns(&start_time, timeout_ns);
+    icmp_receiver_set_deadline(self, &deadline);
+    // endregion
+
+    while (!timeout && !ping_infos_are_complete(ping_infos, destination_hop)) {
+        const u32 events = icmp_receiver_await_events(self);
+        if (events & ICMP_RECEIVER_READABLE) {
+            // Batch that was not filled completely means the socket has been drained.
+            do {
+                icmp_receiver_receive_batch(self, &batch);
+                for (usize i = 0; i < batch.count; i++) {
+                    const struct sockaddr_in sender_address = batch.sender_addresses[i];
+                    if (!icmp_packet_batch_get(&batch, i, &icmp_packet)) {             /* Extract ICMP packet from IP packet. */
+                        continue;  /* Ignore malformed packets. */
+                    }
+
+                    // region match reply with the hop it was sent to
+                    u16 identifier, sequence_number;
+                    if (!icmp_packet_echo_request_id_seq(&icmp_packet, &identifier, &sequence_number) ||
+                        identifier != echo_params->identifier ||
+                        sequence_number < first_ttl ||
+                        sequence_number >= first_ttl + window_size) {
+                        continue;  /* Ignore all other ICMP messages. */
+                    }
+                    const usize hop = sequence_number - first_ttl;
+                    // endregion
+
+                    ping_info_record_reply(&ping_infos[hop], &icmp_packet, sender_address.sin_addr, &batch.timestamps[i]);
+                    if (ping_infos[hop].message_type == ICMP_ECHOREPLY && hop < destination_hop) {
+                        destination_hop = hop;
+                    }
+                }
+            } while (batch.count == RECEIVE_BATCH_SIZE);
+        }
+        if (events & ICMP_RECEIVER_DEADLINE) {
+            timeout = true;
+        }
+    }
+    return destination_hop < window_size ? destination_hop + 1 : window_size;
 }
 
 // endregion
@@ -5,11 +5,21 @@
 #ifndef TRACEROUTE_RECEIVER_H
 #define TRACEROUTE_RECEIVER_H
 
+// sendmmsg() and recvmmsg() are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <features.h>
 #include <netinet/ip_icmp.h>
 #include <features.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -17,77 +27,102 @@
 #include <sys/time.h>
 #include "types.h"
 #include "icmp_sender.h"
+#include "rtt_statistics.h"
+#include "rto_estimator.h"
 
 #define SUCCESS 1
 #define NO_SUCCESS 0
+// Default number of Echo Requests sent for every ttl.
 #define PACKET_COUNT 3
+#define MAX_PROBE_COUNT UINT16_MAX
+// Number of distinct sender addresses remembered for a single hop, further ones are only counted.
+#define MAX_HOP_ADDRESSES 8
+// Default time to wait for replies, upper bound of the adaptive timeout.
 #define MAX_WAIT_TIME_IN_SECONDS 1
+#define ICMP_RECEIVER_READABLE 1
+#define ICMP_RECEIVER_DEADLINE 2
 // Time Exceeded Message contains: 8 bytes header + max 60 from IPv4 header + 8 bytes
 #define MAX_ICMP_PACKET_SIZE 76
 #define MAX_HOPS 30
+// Maximal number of packets read from the socket with a single recvmmsg() call.
+#define RECEIVE_BATCH_SIZE 64
+// IPv4 header with maximal options length followed by the longest ICMP message we inspect.
+#define MAX_IP_ICMP_PACKET_SIZE (60 + MAX_ICMP_PACKET_SIZE)
+#define MIN_IP_HEADER_SIZE 20
 
 #define IP_HEADER_SIZE_IN_BYTES(ip_header) (ip_header)->ip_hl * 4
 
 
-// region IPICMPPacket
+// region ICMPPacket
 
 /*
- * Representation of ICMP Packet contained in IPv4 packet.
- * It contains buffer in which whole IPv4 packet should be stored.
- * header_len and data_len contain byte lengths of IPv4 header and data sections.
- * the icmp packet is contained inside IPv4 packet at offset equal to header_len.
- * It also contains copy of the sender ipv4 address.
+ * View of ICMP Packet stored in the receive buffer, nothing is copied.
+ * header points to the minimal shared ICMP message header of 8 bytes,
+ * rest of the packet is considered as a separate data section of the packet.
+ * View is valid for as long as the buffer it was parsed from is not reused.
+ *
+ * header: ICMP header, always ICMP_MINLEN bytes long.
+ * data: data section following the header.
+ * data_len: number of bytes of data section that have been received.
  */
 typedef struct {
-    u8 buffer[IP_MAXPACKET];
-    u32 header_len;
-    u32 data_len;
-    struct in_addr sender_ipv4_address;
-} IPICMPPacket;
+    const struct icmp* header;
+    const u8* data;
+    usize data_len;
+} ICMPPacket;
 
 
 /*
- * Given IPICMPPacket with buffer filled with valid ipv4 header data.
- * Assign all other fields by parsing the ipv4 header contained in tha buffer.
+ * Parse IPv4 packet containing ICMP Packet.
+ * Header lengths are validated against the number of received bytes, malformed packets are rejected.
+ *
+ * ip_packet: raw IPv4 packet, must be aligned to 4 bytes.
+ * length: number of bytes of ip_packet that have been received.
+ * packet: Reference to ICMPPacket struct that should be initialized.
+ *
+ * returns: false if packet is not a well-formed IPv4 packet with a complete ICMP header.
  */
-extern void ip_icmp_package_init_from_filled_buffer(IPICMPPacket* self);
-
-// endregion
+extern bool icmp_packet_parse(const u8* ip_packet, usize length, ICMPPacket* packet);
 
 
-
-// region ICMPPacket
-
 /*
- * Representation of ICMP Packet.
- * It contains the header which is truncated to the minimal shared ICMP message header size of 8 bytes.
- * rest of the packet is considered as a separate data section of the packet.
+ * Find the first 8 bytes of the original Echo Request Message in the Time Exceeded Message data section.
+ * These 8 bytes of original echo message will contain the Identifier and Sequence Number needed for
+ * validation of Time Exceeded Message.
+ *
+ * self: Reference to ICMPPacket struct.
+ *
+ * returns: embedded icmp header or NULL if data section is too short to contain it.
  */
-typedef struct {
-    struct icmp header;
-    u8 data[MAX_ICMP_PACKET_SIZE - ICMP_MINLEN];
-} ICMPPacket;
+extern const struct icmp* icmp_packet_time_exceeded_embedded_icmp_header(const ICMPPacket* self);
 
 
 /*
- * Extract ICMP Packet from IP packet containing ICMP Packet.
+ * Extract Identifier and Sequence Number of the Echo Request Message that given packet is a response to.
+ * For Echo Reply Message these are taken from its own header,
+ * for Time Exceeded Message from the Echo Request header embedded in its data section.
  *
- * ip_icmp_packet: Reference to IPICMPPacket struct that should be parsed for ICMPPacket data.
+ * self: Reference to ICMPPacket struct.
+ * identifier: Reference to Identifier that should be initialized.
+ * sequence_number: Reference to Sequence Number that should be initialized.
  *
- * returns: new instance of ICMPPacket from IPICMPPacket.
+ * returns: false if packet is neither an Echo Reply nor a Time Exceeded Message.
  */
-extern ICMPPacket icmp_packet_from_ip_icmp_packet(const IPICMPPacket* ip_icmp_packet);
+extern bool icmp_packet_echo_request_id_seq(const ICMPPacket* self, u16* identifier, u16* sequence_number);
 
 
 /*
- * Parse Time Exceeded Message data section for the first 8 bytes of the original Echo Request Message.
- * These 8 bytes of original echo message will contain the Identifier and Sequence Number needed for
- * validation of Time Exceeded Message.
+ * Extract flow identifier of the Echo Request Message that given packet is a response to.
+ * For Time Exceeded Message it is the checksum of the Echo Request header embedded in its data section.
+ * Echo Reply Message differs from the request only in its type, so the flow identifier is its checksum
+ * with the change of the type taken back in one's complement arithmetic, up to the two representations of zero.
  *
  * self: Reference to ICMPPacket struct.
- * self: Reference to icmp header that should be initialized.
+ * flow_identifier: Reference to flow identifier that should be initialized.
+ *
+ * returns: false if packet is neither an Echo Reply nor a Time Exceeded Message.
  */
-extern void icmp_packet_time_exceeded_embedded_icmp_header(const ICMPPacket* self, struct icmp* header);
+extern bool icmp_packet_echo_request_flow_identifier(const ICMPPacket* self, u16* flow_identifier);
 
 
 /* 
@@ -149,49 +184,155 @@ extern bool icmp_packet_is_echo_reply_message_valid(
 
 
 
+// region ICMPPacketBatch
+
+/*
+ * Ancillary data buffer for a single SCM_TIMESTAMPNS control message.
+ * Union with cmsghdr guarantees alignment required by CMSG_* macros.
+ */
+typedef union {
+    u8 buffer[CMSG_SPACE(sizeof(struct timespec))];
+    struct cmsghdr align;
+} TimestampControlMessage;
+
+
+/*
+ * Buffers for a batch of IPv4 packets containing ICMP packets received with a single recvmmsg() call.
+ * Only the first MAX_IP_ICMP_PACKET_SIZE bytes of each packet are stored, the rest gets truncated.
+ * Every buffer is aligned to 8 bytes, so headers can be read in place.
+ *
+ * buffers: raw IPv4 packets.
+ * sender_addresses: sender address of each packet.
+ * timestamps: kernel receive timestamp of each packet (CLOCK_REALTIME).
+ * control_messages: ancillary data buffers the timestamps are delivered in.
+ * iovecs, messages: recvmmsg() arguments pointing into buffers, sender_addresses and control_messages.
+ * count: number of packets received into the batch.
+ */
+typedef struct {
+    _Alignas(8) u8 buffers[RECEIVE_BATCH_SIZE][MAX_IP_ICMP_PACKET_SIZE];
+    struct sockaddr_in sender_addresses[RECEIVE_BATCH_SIZE];
+    struct timespec timestamps[RECEIVE_BATCH_SIZE];
+    TimestampControlMessage control_messages[RECEIVE_BATCH_SIZE];
+    struct iovec iovecs[RECEIVE_BATCH_SIZE];
+    struct mmsghdr messages[RECEIVE_BATCH_SIZE];
+    usize count;
+} ICMPPacketBatch;
+
+
+/*
+ * Parse ICMP Packet from index-th IPv4 packet of the batch.
+ *
+ * self: Reference to ICMPPacketBatch struct.
+ * index: index of the packet, must be less than self->count.
+ * packet: Reference to ICMPPacket struct that should be initialized, valid until the batch is reused.
+ *
+ * returns: false if packet is malformed and should be ignored.
+ */
+extern bool icmp_packet_batch_get(const ICMPPacketBatch* self, usize index, ICMPPacket* packet);
+
+// endregion
+
+
+
 // region PingInfo
 
 /*
  * Data struct that contains bundle of information about single ping round.
- * Because of how pinging mechanism is implemented it contains either one data set for Echo Reply Message
- * or PACKET_COUNT sets for Time Exceeded Messages.
+ * Memory usage is bounded regardless of the number of probes, replies are only aggregated into statistics.
  *
- * timeout: signifies that last ping round timed out.
+ * timeout: signifies that no reply has been received in the ping round.
  * message_type: type of received ICMP message(s).
+ * message_code: code of the last recorded ICMP message.
  * ttl: time to live used in ping round.
+ * address_count: number of unique sender addresses stored in ip_addresses.
+ * extra_address_count: number of unique sender addresses that did not fit into ip_addresses.
+ * probe_count: number of Echo Requests sent in the ping round.
+ * collected_packets: number of replies recorded in the ping round.
+ * first_flow_identifier: flow identifier of the first Echo Request of the ping round.
+ * round_first_probe: index of the first Echo Request sent at sent_at, counted by flow identifier from
+ *  first_flow_identifier. Replies to earlier requests are recorded without round trip time, since it is
+ *  unknown when they were sent. Both are 0 unless Echo Requests of the ping round are sent in several rounds.
+ * sent_at: time at which Echo Requests of the round were handed to the kernel (CLOCK_REALTIME).
+ * ip_addresses: unique sender addresses, we can possibly get responses from few different hosts.
+ * round_trip_times: statistics of round trip times of all recorded replies.
  *
- * Two union variants: ttl_exceeded and echo_reply differ in the number of data sets passed.
- * In case of Echo Reply Message is it assumed that pinging function will return immediately once this type
- * of message is received. Thus, we need only one set of parameters that is:
- *  - round trip time (RRT)
- *  - ip address of the sender
- * In case of Time Exceeded Message however we need to collect more samples in order to better estimate round trip time.
- * Now we can possibly get response from few different hosts, we don't want any duplicates tho.
- * This is the purpose of ip_addresses and unique_address_count fields.
- * First stores unique sender addresses and second is the count of stored addresses (length of ip_addresses).
- * round_trip_times stores RRT's for all received packets and collected_packets is the final number of collected packets.
+ * Echo Reply Message takes precedence over Time Exceeded Messages, once the first Echo Reply has been received
+ * previously collected Time Exceeded replies are discarded and only Echo Replies are collected from then on.
  */
 typedef struct {
     bool timeout;
     u8 message_type;
+    u8 message_code;
     u8 ttl;
-    union {
-        struct {
-            struct timeval round_trip_times[PACKET_COUNT];
-            struct in_addr ip_addresses[PACKET_COUNT];
-            u8 collected_packets;
-            u8 unique_address_count;
-        } ttl_exceeded;
-        struct {
-            struct timeval round_trip_time;
-            struct in_addr ip_address;
-        } echo_reply;
-    };
+    u8 address_count;
+    u16 extra_address_count;
+    u16 probe_count;
+    u16 collected_packets;
+    u16 first_flow_identifier;
+    u16 round_first_probe;
+    struct timespec sent_at;
+    struct in_addr ip_addresses[MAX_HOP_ADDRESSES];
+    RTTStatistics round_trip_times;
 } PingInfo;
 
 
 /*
- * Process ping round results and display them accordingly to specification.
+ * Constructor for PingInfo of a hop that has not responded yet.
+ * Until any reply gets recorded it is considered a timed out Time Exceeded round.
+ *
+ * Caller is responsible for setting sent_at once Echo Requests have been sent.
+ *
+ * ttl: time to live used in ping round.
+ * probe_count: number of Echo Requests sent in the ping round, from range 1..MAX_PROBE_COUNT.
+ *
+ * returns: new instance of PingInfo.
+ */
+extern PingInfo ping_info_new_awaiting(usize ttl, usize probe_count);
+
+
+/*
+ * Record reply to one of the Echo Requests of the ping round.
+ * Echo Reply Message takes precedence, once recorded all further Time Exceeded Messages are ignored.
+ * Replies are collected until probe_count of them have been recorded.
+ *
+ * self: reference to PingInfo struct created with ping_info_new_awaiting.
+ * icmp_packet: valid Echo Reply or Time Exceeded Message.
+ * sender_address: address of the sender of the icmp_packet.
+ * received_at: kernel receive timestamp of the icmp_packet (CLOCK_REALTIME).
+ */
+extern void ping_info_record_reply(
+        PingInfo* self,
+        const ICMPPacket* icmp_packet,
+        struct in_addr sender_address,
+        const struct timespec* received_at
+);
+
+
+/*
+ * Check if every one of hop_count ping rounds has collected replies to all of its probes.
+ *
+ * ping_infos: array of at least hop_count PingInfo structs.
+ * hop_count: number of ping rounds to check.
+ *
+ * returns: information if no more replies are needed for any of the rounds.
+ */
+extern bool ping_infos_are_complete(const PingInfo* ping_infos, usize hop_count);
+
+
+/*
+ * Update reply timeout estimate with the results of the ping round.
+ * Only the slowest reply is used, so the timeout covers the spread of replies within a hop
+ * while RTTVAR follows the growth of round trip times between hops. Rounds without timed replies are skipped.
+ *
+ * self: reference to PingInfo struct.
+ * estimator: estimator that should be updated.
+ */
+extern void ping_info_update_rto_estimator(const PingInfo* self, RTOEstimator* estimator);
+
+
+/*
+ * Process ping round results and display sender addresses followed by
+ * min/avg/max/stddev of round trip times in milliseconds and the loss rate.
  *
  * self: reference to PingInfo struct.
  *
@@ -206,16 +347,52 @@ extern usize ping_info_process_results(const PingInfo* self);
 
 
 
+// region Time
+
+/*
+ * Current time of the monotonic clock, used for deadlines.
+ */
+extern struct timespec time_now(void);
+
+
+/*
+ * Current time of the realtime clock, kernel receive timestamps are taken from the same clock.
+ */
+extern struct timespec time_now_realtime(void);
+
+
+/*
+ * Point in time ns nanoseconds after time.
+ */
+extern struct timespec time_add_ns(const struct timespec* time, u64 ns);
+
+
+/*
+ * Nanoseconds elapsed between since and now, 0 if now precedes since.
+ */
+extern u64 time_elapsed_ns(const struct timespec* since, const struct timespec* now);
+
+// endregion
+
+
+
 // region ICMPReceiver
 
 /*
  * ICMP message receiver contains data need for pinging requests.
+ * Socket has SO_TIMESTAMPNS enabled, so every packet carries the time the kernel received it
+ * and round trip times do not include our own scheduling and parsing delay.
+ * Waiting is done with epoll over the socket and a single timerfd that fires at the armed deadline,
+ * so cost of a wakeup does not depend on the number of probes in flight.
  *
  * socket_fd: file descriptor associated with raw ICMP socket that should be used.
+ * epoll_fd: epoll instance watching socket_fd and timer_fd.
+ * timer_fd: timer armed with the deadline of the earliest outstanding probe.
  */
 typedef struct {
     i32 socket_fd;
-    fd_set descriptor_set;
+    i32 epoll_fd;
+    i32 timer_fd;
 } ICMPReceiver;
 
 
@@ -229,18 +406,124 @@ typedef struct {
 extern ICMPReceiver icmp_receiver_new(i32 socket_fd);
 
 
+/*
+ * Release epoll and timer file descriptors owned by the receiver.
+ * Socket file descriptor is not closed.
+ *
+ * self: Reference to ICMPReceiver struct.
+ */
+extern void icmp_receiver_close(ICMPReceiver* self);
+
+
+/*
+ * Attach classic BPF program to the socket so that the kernel drops every ICMP message
+ * that is neither Echo Reply nor Time Exceeded carrying one of our Echo Requests.
+ * Only messages whose Identifier lies in range base_identifier..base_identifier + identifier_count (modulo 2^16)
+ * are copied to user space.
+ *
+ * self: Reference to ICMPReceiver struct.
+ * base_identifier: first Identifier that should be accepted.
+ * identifier_count: number of consecutive Identifiers that should be accepted, at most 65536.
+ */
+extern void icmp_receiver_attach_filter(const ICMPReceiver* self, u16 base_identifier, usize identifier_count);
+
+
+/*
+ * Arm the timer to fire at the given point in time, replacing previous deadline.
+ *
+ * self: Reference to ICMPReceiver struct.
+ * deadline: absolute point in time of the monotonic clock, NULL disarms the timer.
+ */
+extern void icmp_receiver_set_deadline(ICMPReceiver* self, const struct timespec* deadline);
+
+
+/*
+ * Block until the socket becomes readable or the armed deadline passes.
+ *
+ * self: Reference to ICMPReceiver struct.
+ *
+ * returns: bitmask of ICMP_RECEIVER_READABLE and ICMP_RECEIVER_DEADLINE.
+ */
+extern u32 icmp_receiver_await_events(ICMPReceiver* self);
+
+
+/*
+ * Read all pending packets from the socket, up to RECEIVE_BATCH_SIZE, with a single recvmmsg() call.
+ * Function does not block.
+ *
+ * self: Reference to ICMPReceiver struct.
+ * batch: Reference to ICMPPacketBatch that should be filled.
+ *
+ * returns: number of received packets, 0 if there were no pending packets.
+ */
+extern usize icmp_receiver_receive_batch(ICMPReceiver* self, ICMPPacketBatch* batch);
+
+
 /*
  * Await for icmp packets identified by parameters passed in echo_params.
- * Function will asynchronously wait for MAX_WAIT_TIME_IN_SECONDS seconds.
+ * Function will asynchronously wait for timeout_ns nanoseconds.
  *
  * self: Reference to ICMPReceiver struct.
  * echo_params: Parameters of icmp packets that should be accepted.
+ * probe_count: number of Echo Requests that were sent.
+ * sent_at: time at which Echo Requests were sent (CLOCK_REALTIME).
+ * timeout_ns: how long to wait for replies.
  *
  * returns: information about received packets.
  */
 extern PingInfo icmp_receiver_await_icmp_packets(
         ICMPReceiver* self,
-        const EchoRequestParams* echo_params
+        const EchoRequestParams* echo_params,
+        usize probe_count,
+        const struct timespec* sent_at,
+        u64 timeout_ns
+);
+
+
+/*
+ * Record replies to Echo Requests identified by echo_params into an existing ping round
+ * until it collects replies to all of its probe_count probes or timeout_ns nanoseconds pass.
+ * Allows probing a single ttl in several rounds, probe_count and sent_at can be updated between calls.
+ *
+ * self: Reference to ICMPReceiver struct.
+ * echo_params: Parameters of icmp packets that should be accepted.
+ * ping_info: ping round replies should be recorded into.
+ * timeout_ns: how long to wait for replies.
+ */
+extern void icmp_receiver_collect_replies(
+        ICMPReceiver* self,
+        const EchoRequestParams* echo_params,
+        PingInfo* ping_info,
+        u64 timeout_ns
+);
+
+
+/*
+ * Await for icmp packets sent for a whole window of consecutive ttls at once.
+ * All probes of the window share a single timeout_ns nanoseconds long wait.
+ * Replies are matched with hops by the Sequence Number of the Echo Request,
+ * taken either from Echo Reply or from the header embedded in Time Exceeded Message,
+ * which is expected to be equal to the ttl the probe was sent with.
+ *
+ * self: Reference to ICMPReceiver struct.
+ * echo_params: Parameters of icmp packets that should be accepted, ttl is the first ttl of the window.
+ * window_size: number of consecutive ttls that were probed, at most MAX_HOPS.
+ * probe_count: number of Echo Requests that were sent for each ttl.
+ * sent_at: time at which Echo Requests were sent (CLOCK_REALTIME).
+ * timeout_ns: how long to wait for replies.
+ * ping_infos: array of at least window_size PingInfo structs, results for ttl echo_params->ttl + i are stored at i.
+ *
+ * returns: number of hops whose results should be reported, that is the index of the first hop
+ *          that responded with Echo Reply plus one, or window_size if the destination has not been reached.
+ */
+extern usize icmp_receiver_await_icmp_packets_window(
+        ICMPReceiver* self,
+        const EchoRequestParams* echo_params,
+        usize window_size,
+        usize probe_count,
+        const struct timespec* sent_at,
+        u64 timeout_ns,
+        PingInfo* ping_infos
 );
 
 // endregion
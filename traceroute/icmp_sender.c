@@ -36,6 +36,7 @@ EchoRequestParams echo_request_params_new(
     const EchoRequestParams new = {
             .identifier=identifier,
             .sequence_number=sequence_number,
+            .flow_identifier=identifier,
             .ttl=ttl,
             .socket_address=socket_address
     };
@@ -59,15 +60,25 @@ EchoRequestParams echo_request_params_from_string(
 }
 
 
-isize icmp_sender_echo_request(const ICMPSender* self, const EchoRequestParams* echo_request_params) {
+internal struct icmp icmp_sender_echo_request_header(const EchoRequestParams* echo_request_params) {
     // Create icmp echo request header.
     struct icmp header = {0};
     header.icmp_type = ICMP_ECHO;
     header.icmp_hun.ih_idseq.icd_id = echo_request_params->identifier;
     header.icmp_hun.ih_idseq.icd_seq = echo_request_params->sequence_number;
 
-    // Calculate header checksum for echo request.
-    header.icmp_cksum = icmp_sender_compute_checksum((void *) &header, sizeof(header));
+    // Checksum is fixed to the flow identifier, the first payload word compensates the rest of the message
+    // so that one's complement sum of the whole message stays 0xffff.
+    header.icmp_cksum = echo_request_params->flow_identifier;
+    const u16 compensation = icmp_sender_compute_checksum((void *) &header, sizeof(header));
+    memcpy(header.icmp_data, &compensation, sizeof(compensation));
+    assert(icmp_sender_compute_checksum((void *) &header, sizeof(header)) == 0);
+    return header;
+}
+
+
+isize icmp_sender_echo_request(const ICMPSender* self, const EchoRequestParams* echo_request_params) {
+    struct icmp header = icmp_sender_echo_request_header(echo_request_params);
 
     // set net ttl for the socket.
     setsockopt(self->socket_fd, IPPROTO_IP, IP_TTL, &echo_request_params->ttl, sizeof(i32));
@@ -82,3 +93,63 @@ isize icmp_sender_echo_request(const ICMPSender* self, const EchoRequestParams*
     );
     return result;
 }
+
+
+/*
+ * Ancillary data buffer for a single IP_TTL control message.
+ * Union with cmsghdr guarantees alignment required by CMSG_* macros.
+ */
+typedef union {
+    u8 buffer[CMSG_SPACE(sizeof(i32))];
+    struct cmsghdr align;
+} TTLControlMessage;
+
+
+isize icmp_sender_echo_request_batch(
+        const ICMPSender* self,
+        const EchoRequestParams* echo_requests_params,
+        usize count
+) {
+    struct icmp headers[SEND_BATCH_SIZE];
+    struct iovec iovecs[SEND_BATCH_SIZE];
+    TTLControlMessage control_messages[SEND_BATCH_SIZE];
+    struct mmsghdr messages[SEND_BATCH_SIZE];
+
+    usize total_sent = 0;
+    while (total_sent < count) {
+        const usize remaining = count - total_sent;
+        const usize batch_size = remaining < SEND_BATCH_SIZE ? remaining : SEND_BATCH_SIZE;
+
+        // region prepare batch
+        memset(messages, 0, batch_size * sizeof(messages[0]));
+        for (usize i = 0; i < batch_size; i++) {
+            const EchoRequestParams* params = &echo_requests_params[total_sent + i];
+            headers[i] = icmp_sender_echo_request_header(params);
+            iovecs[i].iov_base = &headers[i];
+            iovecs[i].iov_len = sizeof(headers[i]);
+
+            struct msghdr* message = &messages[i].msg_hdr;
+            message->msg_name = (void*) &params->socket_address;
+            message->msg_namelen = sizeof(params->socket_address);
+            message->msg_iov = &iovecs[i];
+            message->msg_iovlen = 1;
+            message->msg_control = control_messages[i].buffer;
+            message->msg_controllen = sizeof(control_messages[i].buffer);
+
+            struct cmsghdr* control_message = CMSG_FIRSTHDR(message);
+            control_message->cmsg_level = IPPROTO_IP;
+            control_message->cmsg_type = IP_TTL;
+            control_message->cmsg_len = CMSG_LEN(sizeof(i32));
+            const i32 ttl = (i32) params->ttl;
+            memcpy(CMSG_DATA(control_message), &ttl, sizeof(ttl));
+        }
+        // endregion
+
+        const i32 sent = sendmmsg(self->socket_fd, messages, batch_size, 0);
+        if (sent < 0) {
+            return total_sent > 0 ? (isize) total_sent : -1;
+        }
+        total_sent += sent;
+    }
+    return (isize) total_sent;
+}
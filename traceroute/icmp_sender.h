@@ -5,6 +5,11 @@
 #ifndef TRACEROUTE_ICMP_SENDER_H
 #define TRACEROUTE_ICMP_SENDER_H
 
+// sendmmsg() and recvmmsg() are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <features.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
@@ -15,8 +20,11 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/socket.h>
 #include "types.h"
 
+// Maximal number of Echo Requests passed to the kernel with a single sendmmsg() call.
+#define SEND_BATCH_SIZE 64
 
 
 /*
@@ -42,6 +50,7 @@ extern ICMPSender icmp_sender_new(i32 socket_fd);
 
 /*
  * Constructor for EchoRequestParams.
+ * Flow identifier is equal to the identifier, so all requests sent to a target follow a single path.
  *
  * returns: new EchoRequestParams instance.
  */
@@ -76,4 +85,22 @@ extern EchoRequestParams echo_request_params_from_string(
  */
 extern isize icmp_sender_echo_request(const ICMPSender* self, const EchoRequestParams* echo_request_params);
 
+
+/*
+ * Send multiple ICMP Echo Requests with as few system calls as possible.
+ * Requests are passed to the kernel with sendmmsg() in chunks of SEND_BATCH_SIZE,
+ * ttl of every request is set through IP_TTL ancillary data so no setsockopt() calls are needed.
+ *
+ * icmp_sender: reference to sender object.
+ * echo_requests_params: array of count ICMP Echo Request params.
+ * count: number of requests to send.
+ *
+ * returns: number of requests sent or -1 if sendmmsg() failed before any request was sent.
+ */
+extern isize icmp_sender_echo_request_batch(
+        const ICMPSender* self,
+        const EchoRequestParams* echo_requests_params,
+        usize count
+);
+
 #endif //TRACEROUTE_ICMP_SENDER_H
@@ -1,5 +1,6 @@
 // Mikołaj Depta 328690
 
+#define _GNU_SOURCE
 #include <features.h>
 #include <netinet/ip.h>
 #include <unistd.h>
@@ -7,44 +8,475 @@
 #include "types.h"
 #include "icmp_sender.h"
 #include "icmp_receiver.h"
+#include "trace_engine.h"
+#include "trace_writer.h"
+#include "multipath.h"
+#include "trace_cache.h"
 
+#define DEFAULT_CACHE_PREFIX_LENGTH 24
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Expected IPv4 network address.\n");
+
+internal void print_usage(const char* program_name) {
+    fprintf(
+            stderr,
+            "Usage: %s [-p | -w window | -e [-c confidence]] [-q probes] [-o format] [-a] [-m floor] [-M ceiling] "
+            "[-j targets] [-C prefix] [-T seconds] <IPv4 network address>...\n",
+            program_name
+    );
+    fprintf(stderr, "  -p         probe all ttls 1..%d in parallel.\n", MAX_HOPS);
+    fprintf(stderr, "  -w window  probe window consecutive ttls in parallel, implies -p.\n");
+    fprintf(stderr, "  -e         enumerate all load balanced paths to a single address, -q is ignored.\n");
+    fprintf(
+            stderr,
+            "  -c confidence  percentage of certainty that no path was missed, %.0f by default, implies -e.\n",
+            (1.0 - MDA_DEFAULT_ALPHA) * 100.0
+    );
+    fprintf(stderr, "  -q probes  send probes Echo Requests per ttl, %d by default.\n", PACKET_COUNT);
+    fprintf(stderr, "  -o format  write results to stdout as ndjson or binary records instead of text.\n");
+    fprintf(stderr, "  -a         adapt the time to wait for replies to the observed round trip times.\n");
+    fprintf(
+            stderr,
+            "  -m floor   shortest adaptive wait in milliseconds, %d by default, implies -a.\n",
+            RTO_ESTIMATOR_DEFAULT_FLOOR_MS
+    );
+    fprintf(
+            stderr,
+            "  -M ceiling longest wait in milliseconds, %d by default, implies -a.\n",
+            MAX_WAIT_TIME_IN_SECONDS * 1000
+    );
+    fprintf(stderr, "  -j targets trace at most targets addresses at once, all by default.\n");
+    fprintf(
+            stderr,
+            "  -C prefix  reuse hops shared by addresses with common prefix bits, %d by default, implies caching.\n",
+            DEFAULT_CACHE_PREFIX_LENGTH
+    );
+    fprintf(
+            stderr,
+            "  -T seconds forget cached hops after seconds, %d by default, implies caching.\n",
+            TRACE_CACHE_DEFAULT_TIME_TO_LIVE_SECONDS
+    );
+    fprintf(stderr, "Multiple addresses are traced simultaneously over a single socket.\n");
+    fprintf(stderr, "With caching, hops known from earlier targets are only verified with a single probe.\n");
+}
+
+
+/*
+ * Report results of a single hop either as text or through the writer.
+ *
+ * writer: structured output writer, NULL for human readable text.
+ *
+ * returns: SUCCESS if the hop is the destination, NO_SUCCESS otherwise.
+ */
+internal usize report_hop(TraceWriter* writer, struct in_addr destination, const PingInfo* ping_info) {
+    if (writer == NULL) {
+        return ping_info_process_results(ping_info);
+    }
+    trace_writer_write_hop(writer, destination, ping_info);
+    return ping_info->message_type == ICMP_ECHOREPLY ? SUCCESS : NO_SUCCESS;
+}
+
+
+/*
+ * TraceCompletedCallback, context is the TraceWriter or NULL for human readable text.
+ */
+internal void print_trace(const TraceTarget* target, void* context) {
+    TraceWriter* writer = context;
+    if (writer != NULL) {
+        for (usize i = 0; i < target->hop_count; i++) {
+            trace_writer_write_hop(writer, target->destination, &target->ping_infos[i]);
+        }
+        return;
+    }
+    char address_buffer[20];
+    inet_ntop(AF_INET, &target->destination, address_buffer, sizeof(address_buffer));
+    printf("traceroute to %s\n", address_buffer);
+    for (usize i = 0; i < target->hop_count; i++) {
+        ping_info_process_results(&target->ping_infos[i]);
+    }
+    fflush(stdout);
+}
+
+
+/*
+ * Trace routes to all target_count addresses at once with TraceEngine.
+ */
+internal i32 trace_multiple(
+        i32 socket_fd,
+        char* addresses[],
+        usize target_count,
+        usize window_size,
+        usize probe_count,
+        const RTOEstimator* timeout_policy,
+        usize max_active_targets,
+        TraceCache* cache,
+        TraceWriter* writer
+) {
+    if (target_count > MAX_TRACE_TARGETS) {
+        fprintf(stderr, "At most %d addresses can be traced at once, got: %zu\n", MAX_TRACE_TARGETS, target_count);
         exit(EXIT_FAILURE);
     }
-    const i32 socket_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-    if (socket_fd < 0) {
-        fprintf(stderr, "Could not create a socket: %s]\n", strerror(errno));
+    TraceTarget* targets = calloc(target_count, sizeof(TraceTarget));
+    if (targets == NULL) {
+        fprintf(stderr, "Could not allocate memory for %zu targets\n", target_count);
         exit(EXIT_FAILURE);
     }
-    ICMPSender sender = icmp_sender_new(socket_fd);
-    ICMPReceiver receiver = icmp_receiver_new(socket_fd);
-    PingInfo ping_info = {0};
-    EchoRequestParams echo_params = echo_request_params_from_string(
+    for (usize i = 0; i < target_count; i++) {
+        targets[i] = trace_target_from_string(addresses[i]);
+    }
+    TraceEngine* engine = malloc(sizeof(TraceEngine));
+    if (engine == NULL) {
+        fprintf(stderr, "Could not allocate memory for the trace engine\n");
+        exit(EXIT_FAILURE);
+    }
+    trace_engine_init(
+            engine,
+            socket_fd,
             getpid(),
-            1,
-            1,
-            argv[1]
+            targets,
+            target_count,
+            window_size,
+            probe_count,
+            timeout_policy,
+            max_active_targets < target_count ? max_active_targets : target_count,
+            cache
     );
-    for (echo_params.ttl = 1; echo_params.ttl < MAX_HOPS; echo_params.ttl++) {
-        echo_params.sequence_number = echo_params.ttl;
-        setsockopt (sender.socket_fd, IPPROTO_IP, IP_TTL, &echo_params.ttl, sizeof(int));
+    trace_engine_run(engine, print_trace, writer);
+    free(engine);
+    free(targets);
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Send probe_count Echo Requests for each of ttl_count consecutive ttls starting at echo_params->ttl.
+ * Requests are sent in chunks of SEND_BATCH_SIZE, so any number of probes can be sent.
+ *
+ * returns: time at which the first chunk has been sent (CLOCK_REALTIME).
+ */
+internal struct timespec send_probes(
+        const ICMPSender* sender,
+        const EchoRequestParams* echo_params,
+        usize ttl_count,
+        usize probe_count
+) {
+    const struct timespec sent_at = time_now_realtime();
+    EchoRequestParams requests[SEND_BATCH_SIZE];
+    usize request_count = 0;
+    for (usize i = 0; i < probe_count; i++) {
+        for (usize ttl = echo_params->ttl; ttl < echo_params->ttl + ttl_count; ttl++) {
+            requests[request_count] = *echo_params;
+            requests[request_count].ttl = ttl;
+            requests[request_count].sequence_number = ttl;
+            if (++request_count == SEND_BATCH_SIZE) {
+                icmp_sender_echo_request_batch(sender, requests, request_count);
+                request_count = 0;
+            }
+        }
+    }
+    icmp_sender_echo_request_batch(sender, requests, request_count);
+    return sent_at;
+}
+
+
+/*
+ * Trace the route one ttl at a time, each ttl gets its own wait, as long as reply_timeout estimates.
+ */
+internal i32 trace_sequential(
+        const ICMPSender* sender,
+        ICMPReceiver* receiver,
+        EchoRequestParams* echo_params,
+        usize probe_count,
+        RTOEstimator* reply_timeout,
+        TraceWriter* writer
+) {
+    PingInfo ping_info = {0};
+    for (echo_params->ttl = 1; echo_params->ttl < MAX_HOPS; echo_params->ttl++) {
+        echo_params->sequence_number = echo_params->ttl;
 
         // send ICMP echo requests
-        icmp_sender_echo_request(&sender, &echo_params);
-        icmp_sender_echo_request(&sender, &echo_params);
-        icmp_sender_echo_request(&sender, &echo_params);
+        const struct timespec sent_at = send_probes(sender, echo_params, 1, probe_count);
 
         // await for packet arrival
-        ping_info = icmp_receiver_await_icmp_packets(&receiver, &echo_params);
+        ping_info = icmp_receiver_await_icmp_packets(
+                receiver,
+                echo_params,
+                probe_count,
+                &sent_at,
+                rto_estimator_timeout_ns(reply_timeout)
+        );
+        ping_info_update_rto_estimator(&ping_info, reply_timeout);
 
         // process received packets
-        usize result = ping_info_process_results(&ping_info);
+        usize result = report_hop(writer, echo_params->socket_address.sin_addr, &ping_info);
         if (result == SUCCESS) {
-            // printf("\nTraceroute completed.\n");
             return EXIT_SUCCESS;
         }
     }
-}
\ No newline at end of file
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Trace the route one ttl at a time, probing every hop with as many flows as needed
+ * to discover all of its load balanced interfaces with probability 1 - alpha.
+ */
+internal i32 trace_multipath(
+        const ICMPSender* sender,
+        ICMPReceiver* receiver,
+        EchoRequestParams* echo_params,
+        f64 alpha,
+        RTOEstimator* reply_timeout,
+        TraceWriter* writer
+) {
+    for (echo_params->ttl = 1; echo_params->ttl < MAX_HOPS; echo_params->ttl++) {
+        echo_params->sequence_number = echo_params->ttl;
+        const PingInfo ping_info = multipath_enumerate_hop(sender, receiver, echo_params, alpha, reply_timeout);
+        if (report_hop(writer, echo_params->socket_address.sin_addr, &ping_info) == SUCCESS) {
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Trace the route window_size ttls at a time, probes for all ttls of the window are sent at once
+ * and share a single wait, as long as reply_timeout estimates.
+ */
+internal i32 trace_parallel(
+        const ICMPSender* sender,
+        ICMPReceiver* receiver,
+        EchoRequestParams* echo_params,
+        usize window_size,
+        usize probe_count,
+        RTOEstimator* reply_timeout,
+        TraceWriter* writer
+) {
+    PingInfo ping_infos[MAX_HOPS] = {0};
+    for (usize first_ttl = 1; first_ttl <= MAX_HOPS; first_ttl += window_size) {
+        const usize remaining_hops = MAX_HOPS - first_ttl + 1;
+        const usize current_window_size = window_size < remaining_hops ? window_size : remaining_hops;
+
+        // send ICMP echo requests for every ttl of the window
+        echo_params->ttl = first_ttl;
+        const struct timespec sent_at = send_probes(sender, echo_params, current_window_size, probe_count);
+
+        // await for packet arrival
+        const usize hop_count = icmp_receiver_await_icmp_packets_window(
+                receiver,
+                echo_params,
+                current_window_size,
+                probe_count,
+                &sent_at,
+                rto_estimator_timeout_ns(reply_timeout),
+                ping_infos
+        );
+        for (usize i = 0; i < hop_count; i++) {
+            ping_info_update_rto_estimator(&ping_infos[i], reply_timeout);
+        }
+
+        // process received packets
+        for (usize i = 0; i < hop_count; i++) {
+            if (report_hop(writer, echo_params->socket_address.sin_addr, &ping_infos[i]) == SUCCESS) {
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char *argv[]) {
+    bool parallel = false;
+    usize window_size = MAX_HOPS;
+    usize probe_count = PACKET_COUNT;
+    bool structured_output = false;
+    bool adaptive_timeout = false;
+    bool multipath = false;
+    f64 multipath_alpha = MDA_DEFAULT_ALPHA;
+    long timeout_floor_ms = RTO_ESTIMATOR_DEFAULT_FLOOR_MS;
+    long timeout_ceiling_ms = MAX_WAIT_TIME_IN_SECONDS * 1000;
+    TraceOutputFormat output_format = TRACE_OUTPUT_NDJSON;
+    usize max_active_targets = MAX_TRACE_TARGETS;
+    bool caching = false;
+    long cache_prefix_length = DEFAULT_CACHE_PREFIX_LENGTH;
+    long cache_time_to_live_s = TRACE_CACHE_DEFAULT_TIME_TO_LIVE_SECONDS;
+    i32 option;
+    while ((option = getopt(argc, argv, "pw:q:o:am:M:ec:j:C:T:")) != -1) {
+        switch (option) {
+            case 'p': {
+                parallel = true;
+            } break;
+            case 'w': {
+                const long value = strtol(optarg, NULL, 10);
+                if (value < 1 || value > MAX_HOPS) {
+                    fprintf(stderr, "Window size must be in range 1..%d, got: %s\n", MAX_HOPS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                parallel = true;
+                window_size = value;
+            } break;
+            case 'q': {
+                const long value = strtol(optarg, NULL, 10);
+                if (value < 1 || value > MAX_PROBE_COUNT) {
+                    fprintf(stderr, "Probe count must be in range 1..%d, got: %s\n", MAX_PROBE_COUNT, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                probe_count = value;
+            } break;
+            case 'o': {
+                if (!trace_output_format_from_string(optarg, &output_format)) {
+                    fprintf(stderr, "Output format must be ndjson or binary, got: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                structured_output = true;
+            } break;
+            case 'a': {
+                adaptive_timeout = true;
+            } break;
+            case 'e': {
+                multipath = true;
+            } break;
+            case 'c': {
+                const f64 value = strtod(optarg, NULL);
+                if (!(value > 0.0 && value < 100.0)) {
+                    fprintf(stderr, "Confidence must be a percentage in range (0, 100), got: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                multipath = true;
+                multipath_alpha = 1.0 - value / 100.0;
+            } break;
+            case 'm':
+            case 'M': {
+                const long value = strtol(optarg, NULL, 10);
+                if (value < 1 || value > RTO_ESTIMATOR_MAX_CEILING_MS) {
+                    fprintf(stderr, "Timeout must be in range 1..%d ms, got: %s\n", RTO_ESTIMATOR_MAX_CEILING_MS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                adaptive_timeout = true;
+                if (option == 'm') {
+                    timeout_floor_ms = value;
+                } else {
+                    timeout_ceiling_ms = value;
+                }
+            } break;
+            case 'j': {
+                const long value = strtol(optarg, NULL, 10);
+                if (value < 1 || value > MAX_TRACE_TARGETS) {
+                    fprintf(stderr, "Target count must be in range 1..%d, got: %s\n", MAX_TRACE_TARGETS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                max_active_targets = value;
+            } break;
+            case 'C': {
+                char* end;
+                const long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < 0 || value > 32) {
+                    fprintf(stderr, "Prefix length must be in range 0..32, got: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                caching = true;
+                cache_prefix_length = value;
+            } break;
+            case 'T': {
+                const long value = strtol(optarg, NULL, 10);
+                if (value < 1) {
+                    fprintf(stderr, "Cache time to live must be a positive number of seconds, got: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                caching = true;
+                cache_time_to_live_s = value;
+            } break;
+            default: {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (argc - optind < 1) {
+        fprintf(stderr, "Expected IPv4 network address.\n");
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (multipath && (parallel || argc - optind > 1)) {
+        fprintf(stderr, "Path enumeration probes a single address one ttl at a time, it excludes -p and -w.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (timeout_floor_ms > timeout_ceiling_ms) {
+        fprintf(stderr, "Timeout floor %ld ms exceeds the ceiling %ld ms\n", timeout_floor_ms, timeout_ceiling_ms);
+        exit(EXIT_FAILURE);
+    }
+    // Without -a the timeout is constant, estimator with equal bounds always returns the ceiling.
+    RTOEstimator reply_timeout = rto_estimator_new(
+            (adaptive_timeout ? timeout_floor_ms : timeout_ceiling_ms) * 1000000ULL,
+            timeout_ceiling_ms * 1000000ULL
+    );
+
+    const i32 socket_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Could not create a socket: %s]\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    TraceWriter* writer = NULL;
+    if (structured_output) {
+        writer = malloc(sizeof(TraceWriter));
+        if (writer == NULL) {
+            fprintf(stderr, "Could not allocate memory for the output buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        trace_writer_init(writer, STDOUT_FILENO, output_format);
+    }
+
+    i32 result;
+    if (argc - optind > 1) {
+        TraceCache cache;
+        if (caching) {
+            trace_cache_init(&cache, cache_prefix_length, cache_time_to_live_s * 1000000000ULL);
+        }
+        result = trace_multiple(
+                socket_fd,
+                argv + optind,
+                argc - optind,
+                window_size,
+                probe_count,
+                &reply_timeout,
+                max_active_targets,
+                caching ? &cache : NULL,
+                writer
+        );
+        if (caching) {
+            trace_cache_free(&cache);
+        }
+    } else {
+        ICMPSender sender = icmp_sender_new(socket_fd);
+        ICMPReceiver receiver = icmp_receiver_new(socket_fd);
+        icmp_receiver_attach_filter(&receiver, getpid(), 1);
+        EchoRequestParams echo_params = echo_request_params_from_string(
+                getpid(),
+                1,
+                1,
+                argv[optind]
+        );
+        if (multipath) {
+            result = trace_multipath(&sender, &receiver, &echo_params, multipath_alpha, &reply_timeout, writer);
+        } else if (parallel) {
+            result = trace_parallel(
+                    &sender,
+                    &receiver,
+                    &echo_params,
+                    window_size,
+                    probe_count,
+                    &reply_timeout,
+                    writer
+            );
+        } else {
+            result = trace_sequential(&sender, &receiver, &echo_params, probe_count, &reply_timeout, writer);
+        }
+    }
+
+    if (writer != NULL) {
+        trace_writer_flush(writer);
+        free(writer);
+    }
+    return result;
+}
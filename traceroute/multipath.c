@@ -0,0 +1,85 @@
+// Mikołaj Depta 328690
+//
+
+#include "multipath.h"
+
+
+// region MultipathEnumeration
+
+usize multipath_probe_count(usize interface_count, f64 alpha) {
+    assert(interface_count >= 1);
+    assert(0.0 < alpha && alpha < 1.0);
+    const f64 k = (f64) interface_count;
+    const f64 target = alpha / (k + 1.0);
+    /* Smallest n with (k / (k + 1))^n <= alpha / (k + 1), found by multiplying out instead of with libm logarithms. */
+    f64 miss_probability = 1.0;
+    usize probe_count = 0;
+    while (miss_probability > target && probe_count < MAX_PROBE_COUNT) {
+        miss_probability *= k / (k + 1.0);
+        probe_count++;
+    }
+    return probe_count;
+}
+
+
+/*
+ * Send Echo Requests with flow identifiers first_flow..first_flow + count - 1.
+ *
+ * returns: time at which the requests have been sent (CLOCK_REALTIME).
+ */
+internal struct timespec multipath_send_flows(
+        const ICMPSender* sender,
+        const EchoRequestParams* echo_params,
+        usize first_flow,
+        usize count
+) {
+    const struct timespec sent_at = time_now_realtime();
+    EchoRequestParams requests[SEND_BATCH_SIZE];
+    usize request_count = 0;
+    for (usize i = 0; i < count; i++) {
+        requests[request_count] = *echo_params;
+        requests[request_count].flow_identifier = (u16) (echo_params->flow_identifier + first_flow + i);
+        if (++request_count == SEND_BATCH_SIZE) {
+            icmp_sender_echo_request_batch(sender, requests, request_count);
+            request_count = 0;
+        }
+    }
+    icmp_sender_echo_request_batch(sender, requests, request_count);
+    return sent_at;
+}
+
+
+PingInfo multipath_enumerate_hop(
+        const ICMPSender* sender,
+        ICMPReceiver* receiver,
+        const EchoRequestParams* echo_params,
+        f64 alpha,
+        RTOEstimator* reply_timeout
+) {
+    PingInfo ping_info = ping_info_new_awaiting(echo_params->ttl, 1);
+    ping_info.probe_count = 0;
+    ping_info.first_flow_identifier = echo_params->flow_identifier;
+    usize sent_count = 0;
+    while (true) {
+        // Silent hop is given as many probes as a hop with a single interface.
+        usize interface_count = ping_info.address_count + ping_info.extra_address_count;
+        if (interface_count == 0) {
+            interface_count = 1;
+        }
+        const usize required_count = multipath_probe_count(interface_count, alpha);
+        if (sent_count >= required_count) {
+            break;
+        }
+
+        // Late replies of earlier rounds are still collected, but they are not timed from this round.
+        ping_info.round_first_probe = (u16) sent_count;
+        ping_info.sent_at = multipath_send_flows(sender, echo_params, sent_count, required_count - sent_count);
+        ping_info.probe_count = required_count;
+        sent_count = required_count;
+        icmp_receiver_collect_replies(receiver, echo_params, &ping_info, rto_estimator_timeout_ns(reply_timeout));
+    }
+    ping_info_update_rto_estimator(&ping_info, reply_timeout);
+    return ping_info;
+}
+
+// endregion
@@ -0,0 +1,61 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_MULTIPATH_H
+#define TRACEROUTE_MULTIPATH_H
+
+// sendmmsg() and recvmmsg() are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "types.h"
+#include "icmp_sender.h"
+#include "icmp_receiver.h"
+#include "rto_estimator.h"
+
+// Probability of missing some of the interfaces of a hop.
+#define MDA_DEFAULT_ALPHA 0.05
+
+
+// region MultipathEnumeration
+
+/*
+ * Number of probes with distinct flow identifiers that have to be sent to a hop, without discovering
+ * new interface, to rule out with probability 1 - alpha that the hop has more than interface_count interfaces.
+ * Stopping rule of the Multipath Detection Algorithm: n_k = ceil(ln(alpha / (k + 1)) / ln(k / (k + 1))).
+ * For alpha = 0.05 that is 6 probes for a single interface, 11 for two and 16 for three.
+ *
+ * interface_count: number of interfaces discovered so far, at least 1.
+ * alpha: acceptable probability of missing an interface, from range (0, 1).
+ *
+ * returns: required total number of probes, at most MAX_PROBE_COUNT.
+ */
+extern usize multipath_probe_count(usize interface_count, f64 alpha);
+
+
+/*
+ * Enumerate all interfaces responding at echo_params->ttl, that is every branch of load balancers
+ * in front of the hop. Probes are sent in rounds with new flow identifiers, every round tops up
+ * the number of probes to the one required by the stopping rule for the interfaces discovered so far.
+ * Flow identifiers start at echo_params->flow_identifier at every hop, so the same flows are followed along the path.
+ *
+ * sender: sender used for Echo Requests.
+ * receiver: receiver used for replies.
+ * echo_params: parameters of the Echo Requests, ttl is the probed hop.
+ * alpha: acceptable probability of missing an interface.
+ * reply_timeout: estimator of the time to wait for replies, updated with the results.
+ *
+ * returns: results of the hop, ip_addresses holds discovered interfaces.
+ */
+extern PingInfo multipath_enumerate_hop(
+        const ICMPSender* sender,
+        ICMPReceiver* receiver,
+        const EchoRequestParams* echo_params,
+        f64 alpha,
+        RTOEstimator* reply_timeout
+);
+
+// endregion
+
+#endif //TRACEROUTE_MULTIPATH_H
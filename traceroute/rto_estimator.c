@@ -0,0 +1,50 @@
+// Mikołaj Depta 328690
+//
+
+#include <assert.h>
+#include <math.h>
+#include "rto_estimator.h"
+
+
+// region RTOEstimator
+
+RTOEstimator rto_estimator_new(u64 floor_ns, u64 ceiling_ns) {
+    assert(floor_ns <= ceiling_ns);
+    RTOEstimator new = {0};
+    new.has_sample = false;
+    new.floor_ns = floor_ns;
+    new.ceiling_ns = ceiling_ns;
+    return new;
+}
+
+
+void rto_estimator_add_sample(RTOEstimator* self, u64 round_trip_time_ns) {
+    const f64 sample = (f64) round_trip_time_ns;
+    if (!self->has_sample) {
+        self->srtt_ns = sample;
+        self->rttvar_ns = sample / 2.0;
+        self->has_sample = true;
+        return;
+    }
+    // RTTVAR has to be updated with the SRTT from before this sample.
+    self->rttvar_ns = (1.0 - RTO_ESTIMATOR_BETA) * self->rttvar_ns + RTO_ESTIMATOR_BETA * fabs(self->srtt_ns - sample);
+    self->srtt_ns = (1.0 - RTO_ESTIMATOR_ALPHA) * self->srtt_ns + RTO_ESTIMATOR_ALPHA * sample;
+}
+
+
+u64 rto_estimator_timeout_ns(const RTOEstimator* self) {
+    if (!self->has_sample) {
+        return self->ceiling_ns;
+    }
+    const f64 variation = RTO_ESTIMATOR_K * self->rttvar_ns;
+    const f64 timeout = self->srtt_ns + (variation > RTO_ESTIMATOR_GRANULARITY_NS ? variation : RTO_ESTIMATOR_GRANULARITY_NS);
+    if (timeout < (f64) self->floor_ns) {
+        return self->floor_ns;
+    }
+    if (timeout > (f64) self->ceiling_ns) {
+        return self->ceiling_ns;
+    }
+    return (u64) timeout;
+}
+
+// endregion
@@ -0,0 +1,69 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_RTO_ESTIMATOR_H
+#define TRACEROUTE_RTO_ESTIMATOR_H
+
+#include <stdbool.h>
+#include "types.h"
+
+// Constants of RFC 6298 retransmission timeout computation.
+#define RTO_ESTIMATOR_ALPHA (1.0 / 8.0)
+#define RTO_ESTIMATOR_BETA (1.0 / 4.0)
+#define RTO_ESTIMATOR_K 4.0
+// Resolution of our timers, see TIMER_WHEEL_TICK_NS.
+#define RTO_ESTIMATOR_GRANULARITY_NS 1000000ULL
+#define RTO_ESTIMATOR_DEFAULT_FLOOR_MS 10
+#define RTO_ESTIMATOR_MAX_CEILING_MS 60000
+
+
+// region RTOEstimator
+
+/*
+ * Estimator of how long to wait for replies, computed from observed round trip times
+ * the same way TCP computes its retransmission timeout (RFC 6298).
+ * Until the first sample is recorded the ceiling is used.
+ * Estimator whose floor equals its ceiling always yields that constant timeout.
+ *
+ * has_sample: information if any sample has been recorded.
+ * srtt_ns: smoothed round trip time.
+ * rttvar_ns: round trip time variation.
+ * floor_ns, ceiling_ns: bounds of the computed timeout.
+ */
+typedef struct {
+    bool has_sample;
+    f64 srtt_ns;
+    f64 rttvar_ns;
+    u64 floor_ns;
+    u64 ceiling_ns;
+} RTOEstimator;
+
+
+/*
+ * Constructor for RTOEstimator.
+ *
+ * floor_ns: smallest timeout that can be returned.
+ * ceiling_ns: largest timeout that can be returned, used before any sample is recorded.
+ *
+ * returns: new instance of RTOEstimator.
+ */
+extern RTOEstimator rto_estimator_new(u64 floor_ns, u64 ceiling_ns);
+
+
+/*
+ * Update the estimate with a single round trip time measurement.
+ *
+ * self: Reference to RTOEstimator struct.
+ * round_trip_time_ns: measured round trip time in nanoseconds.
+ */
+extern void rto_estimator_add_sample(RTOEstimator* self, u64 round_trip_time_ns);
+
+
+/*
+ * Current timeout in nanoseconds, SRTT + max(G, K * RTTVAR) clamped to [floor_ns, ceiling_ns].
+ */
+extern u64 rto_estimator_timeout_ns(const RTOEstimator* self);
+
+// endregion
+
+#endif //TRACEROUTE_RTO_ESTIMATOR_H
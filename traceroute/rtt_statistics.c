@@ -0,0 +1,77 @@
+// Mikołaj Depta 328690
+//
+
+#include <assert.h>
+#include "rtt_statistics.h"
+
+#define NS_PER_MICROSECOND 1000ULL
+
+
+// region RTTStatistics
+
+RTTStatistics rtt_statistics_new(void) {
+    RTTStatistics new = {0};
+    new.min_ns = UINT64_MAX;
+    return new;
+}
+
+
+void rtt_statistics_add(RTTStatistics* self, u64 round_trip_time_ns) {
+    if (self->count < RTT_STATISTICS_SAMPLE_COUNT) {
+        self->samples_ns[self->count] = round_trip_time_ns;
+    }
+    self->count++;
+    if (round_trip_time_ns < self->min_ns) {
+        self->min_ns = round_trip_time_ns;
+    }
+    if (round_trip_time_ns > self->max_ns) {
+        self->max_ns = round_trip_time_ns;
+    }
+    const f64 delta = (f64) round_trip_time_ns - self->mean_ns;
+    self->mean_ns += delta / self->count;
+    self->m2 += delta * ((f64) round_trip_time_ns - self->mean_ns);
+    self->histogram[rtt_statistics_bucket(round_trip_time_ns)]++;
+}
+
+
+usize rtt_statistics_sample_count(const RTTStatistics* self) {
+    return self->count < RTT_STATISTICS_SAMPLE_COUNT ? self->count : RTT_STATISTICS_SAMPLE_COUNT;
+}
+
+
+f64 rtt_statistics_stddev_ns(const RTTStatistics* self) {
+    if (self->count < 2) {
+        return 0.0;
+    }
+    const f64 variance = self->m2 / (self->count - 1);
+    if (variance <= 0.0) {
+        return 0.0;
+    }
+    /* Newton iteration instead of sqrt, which would need libm while nothing else in the tool does. */
+    f64 x = variance > 1.0 ? variance : 1.0;
+    for (;;) {
+        const f64 next = (x + variance / x) / 2;
+        if (next >= x) {
+            return x;
+        }
+        x = next;
+    }
+}
+
+
+usize rtt_statistics_bucket(u64 round_trip_time_ns) {
+    const u64 microseconds = round_trip_time_ns / NS_PER_MICROSECOND;
+    if (microseconds == 0) {
+        return 0;
+    }
+    const usize bucket = 64 - __builtin_clzll(microseconds);
+    return bucket < RTT_HISTOGRAM_BUCKET_COUNT ? bucket : RTT_HISTOGRAM_BUCKET_COUNT - 1;
+}
+
+
+u64 rtt_statistics_bucket_lower_bound_ns(usize bucket) {
+    assert(bucket < RTT_HISTOGRAM_BUCKET_COUNT);
+    return bucket == 0 ? 0 : (1ULL << (bucket - 1)) * NS_PER_MICROSECOND;
+}
+
+// endregion
@@ -0,0 +1,83 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_RTT_STATISTICS_H
+#define TRACEROUTE_RTT_STATISTICS_H
+
+#include <stdbool.h>
+#include "types.h"
+
+// Bucket 0 holds samples below 1 microsecond, bucket b holds samples from [2^(b-1), 2^b) microseconds.
+// The last bucket is open-ended and also holds all longer samples.
+#define RTT_HISTOGRAM_BUCKET_COUNT 24
+// Number of the first samples that are also kept verbatim.
+#define RTT_STATISTICS_SAMPLE_COUNT 8
+
+
+// region RTTStatistics
+
+/*
+ * Running statistics of round trip times, memory usage does not depend on the number of samples.
+ * Mean and variance are updated with Welford's algorithm, so they stay accurate for any number of samples.
+ *
+ * count: number of recorded samples.
+ * min_ns, max_ns: extremes of recorded samples in nanoseconds, valid if count > 0.
+ * mean_ns: mean of recorded samples in nanoseconds.
+ * m2: sum of squared differences from the mean, variance is m2 / (count - 1).
+ * histogram: number of samples that fell into each of the log2 scaled buckets.
+ * samples_ns: first RTT_STATISTICS_SAMPLE_COUNT samples in the order they were recorded.
+ */
+typedef struct {
+    u32 count;
+    u64 min_ns;
+    u64 max_ns;
+    f64 mean_ns;
+    f64 m2;
+    u32 histogram[RTT_HISTOGRAM_BUCKET_COUNT];
+    u64 samples_ns[RTT_STATISTICS_SAMPLE_COUNT];
+} RTTStatistics;
+
+
+/*
+ * Constructor for RTTStatistics without any samples.
+ *
+ * returns: new instance of RTTStatistics.
+ */
+extern RTTStatistics rtt_statistics_new(void);
+
+
+/*
+ * Record a single round trip time.
+ *
+ * self: Reference to RTTStatistics struct.
+ * round_trip_time_ns: round trip time in nanoseconds.
+ */
+extern void rtt_statistics_add(RTTStatistics* self, u64 round_trip_time_ns);
+
+
+/*
+ * Number of valid entries in samples_ns.
+ */
+extern usize rtt_statistics_sample_count(const RTTStatistics* self);
+
+
+/*
+ * Sample standard deviation of recorded round trip times in nanoseconds, 0 if less than two samples were recorded.
+ */
+extern f64 rtt_statistics_stddev_ns(const RTTStatistics* self);
+
+
+/*
+ * Index of the histogram bucket round trip time falls into.
+ */
+extern usize rtt_statistics_bucket(u64 round_trip_time_ns);
+
+
+/*
+ * Smallest round trip time in nanoseconds that falls into given histogram bucket.
+ */
+extern u64 rtt_statistics_bucket_lower_bound_ns(usize bucket);
+
+// endregion
+
+#endif //TRACEROUTE_RTT_STATISTICS_H
@@ -0,0 +1,134 @@
+// Mikołaj Depta 328690
+//
+
+#include <string.h>
+#include <assert.h>
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOT_COUNT - 1)
+#define NS_PER_SECOND 1000000000ULL
+
+
+internal u64 timespec_to_ns(const struct timespec* time) {
+    return (u64) time->tv_sec * NS_PER_SECOND + (u64) time->tv_nsec;
+}
+
+
+u64 timer_wheel_tick_from_timespec(const struct timespec* time) {
+    return (timespec_to_ns(time) + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS;
+}
+
+
+struct timespec timer_wheel_tick_to_timespec(u64 tick) {
+    const u64 ns = tick * TIMER_WHEEL_TICK_NS;
+    const struct timespec time = { .tv_sec = ns / NS_PER_SECOND, .tv_nsec = ns % NS_PER_SECOND };
+    return time;
+}
+
+
+// region TimerWheel
+
+internal void timer_wheel_mark_slot(TimerWheel* self, usize slot) {
+    if (self->slots[slot] != NULL) {
+        self->occupancy[slot / 64] |= 1ULL << (slot % 64);
+    } else {
+        self->occupancy[slot / 64] &= ~(1ULL << (slot % 64));
+    }
+}
+
+
+void timer_wheel_init(TimerWheel* self, const struct timespec* now) {
+    memset(self, 0, sizeof(*self));
+    self->current_tick = timespec_to_ns(now) / TIMER_WHEEL_TICK_NS;
+}
+
+
+void timer_wheel_schedule(TimerWheel* self, TimerWheelEntry* entry, const struct timespec* deadline) {
+    timer_wheel_cancel(self, entry);
+    u64 expiry_tick = timer_wheel_tick_from_timespec(deadline);
+    if (expiry_tick < self->current_tick) {
+        expiry_tick = self->current_tick;   /* Deadline already passed, expire with the next tick. */
+    }
+    const usize slot = expiry_tick & TIMER_WHEEL_SLOT_MASK;
+
+    entry->expiry_tick = expiry_tick;
+    entry->scheduled = true;
+    entry->next = self->slots[slot];
+    entry->pprev = &self->slots[slot];
+    if (entry->next != NULL) {
+        entry->next->pprev = &entry->next;
+    }
+    self->slots[slot] = entry;
+    timer_wheel_mark_slot(self, slot);
+    self->entry_count++;
+}
+
+
+void timer_wheel_cancel(TimerWheel* self, TimerWheelEntry* entry) {
+    if (!entry->scheduled) {
+        return;
+    }
+    *entry->pprev = entry->next;
+    if (entry->next != NULL) {
+        entry->next->pprev = entry->pprev;
+    }
+    entry->next = NULL;
+    entry->pprev = NULL;
+    entry->scheduled = false;
+    timer_wheel_mark_slot(self, entry->expiry_tick & TIMER_WHEEL_SLOT_MASK);
+    assert(self->entry_count > 0);
+    self->entry_count--;
+}
+
+
+TimerWheelEntry* timer_wheel_expire(TimerWheel* self, const struct timespec* now) {
+    const u64 now_tick = timespec_to_ns(now) / TIMER_WHEEL_TICK_NS;
+    if (now_tick < self->current_tick) {
+        return NULL;
+    }
+    // Every slot has to be visited at most once, no matter how many ticks have elapsed.
+    const u64 elapsed_ticks = now_tick - self->current_tick + 1;
+    const u64 ticks_to_visit = elapsed_ticks < TIMER_WHEEL_SLOT_COUNT ? elapsed_ticks : TIMER_WHEEL_SLOT_COUNT;
+
+    TimerWheelEntry* expired = NULL;
+    for (u64 i = 0; i < ticks_to_visit && self->entry_count > 0; i++) {
+        const usize slot = (self->current_tick + i) & TIMER_WHEEL_SLOT_MASK;
+        if ((self->occupancy[slot / 64] & (1ULL << (slot % 64))) == 0) {
+            continue;
+        }
+        TimerWheelEntry* entry = self->slots[slot];
+        while (entry != NULL) {
+            TimerWheelEntry* next = entry->next;
+            if (entry->expiry_tick <= now_tick) {
+                timer_wheel_cancel(self, entry);
+                entry->next = expired;
+                expired = entry;
+            }
+            entry = next;
+        }
+    }
+    self->current_tick = now_tick + 1;
+    return expired;
+}
+
+
+bool timer_wheel_next_deadline(const TimerWheel* self, struct timespec* deadline) {
+    if (self->entry_count == 0) {
+        return false;
+    }
+    const usize start_slot = self->current_tick & TIMER_WHEEL_SLOT_MASK;
+    for (usize offset = 0; offset < TIMER_WHEEL_SLOT_COUNT;) {
+        const usize slot = (start_slot + offset) & TIMER_WHEEL_SLOT_MASK;
+        const u64 bits = self->occupancy[slot / 64] >> (slot % 64);
+        if (bits != 0) {
+            offset += __builtin_ctzll(bits);
+            *deadline = timer_wheel_tick_to_timespec(self->current_tick + offset);
+            return true;
+        }
+        offset += 64 - slot % 64;
+    }
+    assert(false && "occupancy bitmap is out of sync with entry count");
+    return false;
+}
+
+// endregion
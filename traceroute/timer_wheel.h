@@ -0,0 +1,126 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_TIMER_WHEEL_H
+#define TRACEROUTE_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+#include "types.h"
+
+// Number of slots, must be a power of two. Together with the tick length determines the wheel horizon.
+#define TIMER_WHEEL_SLOT_COUNT 1024
+#define TIMER_WHEEL_TICK_NS 1000000ULL
+#define TIMER_WHEEL_OCCUPANCY_WORDS (TIMER_WHEEL_SLOT_COUNT / 64)
+
+// Obtain pointer to the struct that embeds given TimerWheelEntry as member.
+#define TIMER_WHEEL_ENTRY_OWNER(entry, type, member) ((type*) ((u8*) (entry) - offsetof(type, member)))
+
+
+// region TimerWheelEntry
+
+/*
+ * Intrusive timer, should be embedded in the struct whose deadline it represents.
+ *
+ * next: next entry in the same slot or in the list of expired entries.
+ * pprev: address of the pointer that points to this entry.
+ * expiry_tick: tick at which the timer expires.
+ * scheduled: information if the entry is currently stored in a wheel.
+ */
+typedef struct TimerWheelEntry {
+    struct TimerWheelEntry* next;
+    struct TimerWheelEntry** pprev;
+    u64 expiry_tick;
+    bool scheduled;
+} TimerWheelEntry;
+
+// endregion
+
+
+
+// region TimerWheel
+
+/*
+ * Hashed timer wheel with TIMER_WHEEL_TICK_NS resolution.
+ *
+ * Scheduling and cancelling timers is O(1), expiring is O(1) per expired timer plus O(1) per elapsed tick.
+ * Timers further than TIMER_WHEEL_SLOT_COUNT ticks away share slots with closer ones
+ * and only expire once their tick has been reached.
+ *
+ * slots: heads of the lists of timers, timer is stored in slot expiry_tick % TIMER_WHEEL_SLOT_COUNT.
+ * occupancy: bitmap of nonempty slots, used to find the next expiry without walking the timers.
+ * current_tick: first tick that has not been processed yet.
+ * entry_count: number of scheduled timers.
+ */
+typedef struct {
+    TimerWheelEntry* slots[TIMER_WHEEL_SLOT_COUNT];
+    u64 occupancy[TIMER_WHEEL_OCCUPANCY_WORDS];
+    u64 current_tick;
+    usize entry_count;
+} TimerWheel;
+
+
+/*
+ * Convert point in time to a wheel tick, rounding up so that timers never expire early.
+ */
+extern u64 timer_wheel_tick_from_timespec(const struct timespec* time);
+
+
+/*
+ * Convert wheel tick to a point in time.
+ */
+extern struct timespec timer_wheel_tick_to_timespec(u64 tick);
+
+
+/*
+ * Initialize empty wheel in place.
+ *
+ * self: Reference to TimerWheel struct.
+ * now: current time, ticks before it are considered processed.
+ */
+extern void timer_wheel_init(TimerWheel* self, const struct timespec* now);
+
+
+/*
+ * Schedule entry to expire at given point in time.
+ * Entry that is already scheduled gets rescheduled.
+ *
+ * self: Reference to TimerWheel struct.
+ * entry: Reference to entry embedded in the timer owner.
+ * deadline: point in time at which entry should expire.
+ */
+extern void timer_wheel_schedule(TimerWheel* self, TimerWheelEntry* entry, const struct timespec* deadline);
+
+
+/*
+ * Remove entry from the wheel, does nothing if entry is not scheduled.
+ */
+extern void timer_wheel_cancel(TimerWheel* self, TimerWheelEntry* entry);
+
+
+/*
+ * Remove all entries that expire at or before now from the wheel.
+ *
+ * self: Reference to TimerWheel struct.
+ * now: current time.
+ *
+ * returns: list of expired entries linked through next field, NULL if none expired.
+ */
+extern TimerWheelEntry* timer_wheel_expire(TimerWheel* self, const struct timespec* now);
+
+
+/*
+ * Find the earliest tick at which some of the scheduled entries might expire.
+ * Cost depends only on TIMER_WHEEL_SLOT_COUNT, not on the number of scheduled entries.
+ *
+ * self: Reference to TimerWheel struct.
+ * deadline: Reference to timespec that should be initialized.
+ *
+ * returns: false if wheel is empty.
+ */
+extern bool timer_wheel_next_deadline(const TimerWheel* self, struct timespec* deadline);
+
+// endregion
+
+#endif //TRACEROUTE_TIMER_WHEEL_H
@@ -0,0 +1,134 @@
+// Mikołaj Depta 328690
+//
+
+#include "trace_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define TRACE_CACHE_SLOT_MASK (TRACE_CACHE_CAPACITY - 1)
+
+
+// region TraceCache
+
+internal bool timespec_is_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+internal u32 trace_cache_prefix(const TraceCache* self, struct in_addr destination) {
+    const u32 mask = self->prefix_length == 0 ? 0 : UINT32_MAX << (32 - self->prefix_length);
+    return htonl(ntohl(destination.s_addr) & mask);
+}
+
+
+internal usize trace_cache_first_slot(u32 prefix) {
+    return (usize) ((ntohl(prefix) * 2654435761U) >> 12) & TRACE_CACHE_SLOT_MASK;
+}
+
+
+internal bool trace_cache_entry_is_valid(const TraceCacheEntry* entry, const struct timespec* now) {
+    return timespec_is_before(now, &entry->expires_at);
+}
+
+
+void trace_cache_init(TraceCache* self, u8 prefix_length, u64 time_to_live_ns) {
+    assert(prefix_length <= 32);
+    self->prefix_length = prefix_length;
+    self->time_to_live_ns = time_to_live_ns;
+    self->entries = calloc(TRACE_CACHE_CAPACITY, sizeof(TraceCacheEntry));
+    if (self->entries == NULL) {
+        fprintf(stderr, "Could not allocate memory for the trace cache\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void trace_cache_free(TraceCache* self) {
+    free(self->entries);
+    self->entries = NULL;
+}
+
+
+const TraceCacheEntry* trace_cache_lookup(const TraceCache* self, struct in_addr destination, const struct timespec* now) {
+    const u32 prefix = trace_cache_prefix(self, destination);
+    const usize first_slot = trace_cache_first_slot(prefix);
+    for (usize i = 0; i < TRACE_CACHE_ASSOCIATIVITY; i++) {
+        const TraceCacheEntry* entry = &self->entries[(first_slot + i) & TRACE_CACHE_SLOT_MASK];
+        if (entry->prefix == prefix && trace_cache_entry_is_valid(entry, now)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Responder of the hop as stored in the cache, hops with several responders are represented by the first one.
+ */
+internal struct in_addr trace_cache_hop_responder(const PingInfo* ping_info) {
+    struct in_addr responder = { .s_addr = INADDR_ANY };
+    if (!ping_info->timeout && ping_info->address_count > 0) {
+        responder = ping_info->ip_addresses[0];
+    }
+    return responder;
+}
+
+
+void trace_cache_update(
+        TraceCache* self,
+        struct in_addr destination,
+        const PingInfo* ping_infos,
+        usize hop_count,
+        const struct timespec* now
+) {
+    assert(hop_count <= MAX_HOPS);
+    // Destination itself is specific to the target, only transit hops are shared.
+    usize transit_hop_count = hop_count;
+    if (hop_count > 0 && ping_infos[hop_count - 1].message_type == ICMP_ECHOREPLY) {
+        transit_hop_count--;
+    }
+
+    // region find slot
+    const u32 prefix = trace_cache_prefix(self, destination);
+    const usize first_slot = trace_cache_first_slot(prefix);
+    TraceCacheEntry* entry = NULL;
+    TraceCacheEntry* replaced = NULL;
+    for (usize i = 0; i < TRACE_CACHE_ASSOCIATIVITY && entry == NULL; i++) {
+        TraceCacheEntry* candidate = &self->entries[(first_slot + i) & TRACE_CACHE_SLOT_MASK];
+        if (candidate->prefix == prefix && trace_cache_entry_is_valid(candidate, now)) {
+            entry = candidate;
+        } else if (replaced == NULL || timespec_is_before(&candidate->expires_at, &replaced->expires_at)) {
+            replaced = candidate;
+        }
+    }
+    // endregion
+
+    if (entry == NULL) {
+        entry = replaced;
+        entry->prefix = prefix;
+        entry->known_hop_count = transit_hop_count;
+        for (usize i = 0; i < transit_hop_count; i++) {
+            entry->hops[i] = trace_cache_hop_responder(&ping_infos[i]);
+        }
+    } else {
+        // Silent hop says nothing about the route, it only diverges once both routes got different responders.
+        usize diverging_hop = 0;
+        const usize common_hop_count = entry->known_hop_count < transit_hop_count
+                ? entry->known_hop_count
+                : transit_hop_count;
+        for (; diverging_hop < common_hop_count; diverging_hop++) {
+            const struct in_addr responder = trace_cache_hop_responder(&ping_infos[diverging_hop]);
+            struct in_addr* known_responder = &entry->hops[diverging_hop];
+            if (known_responder->s_addr == INADDR_ANY) {
+                *known_responder = responder;
+            } else if (responder.s_addr != INADDR_ANY && responder.s_addr != known_responder->s_addr) {
+                break;
+            }
+        }
+        entry->known_hop_count = diverging_hop;
+    }
+    entry->expires_at = time_add_ns(now, self->time_to_live_ns);
+}
+
+// endregion
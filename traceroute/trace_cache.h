@@ -0,0 +1,113 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_TRACE_CACHE_H
+#define TRACEROUTE_TRACE_CACHE_H
+
+// sendmmsg() and recvmmsg() are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <netinet/ip.h>
+#include <stdbool.h>
+#include <time.h>
+#include "types.h"
+#include "icmp_receiver.h"
+
+// Number of entries, must be a power of two.
+#define TRACE_CACHE_CAPACITY 4096
+// Number of consecutive slots an entry can be stored in, bounds the cost of lookup and insertion.
+#define TRACE_CACHE_ASSOCIATIVITY 8
+#define TRACE_CACHE_DEFAULT_TIME_TO_LIVE_SECONDS 300
+
+
+// region TraceCacheEntry
+
+/*
+ * Hops shared by the routes to all destinations of a prefix traced so far.
+ *
+ * prefix: destination prefix in network byte order.
+ * known_hop_count: number of leading hops, hops before the first diverging one, that all routes have in common.
+ * hops: responder of each of the known hops, INADDR_ANY for hops that did not respond.
+ * expires_at: point in time of the monotonic clock after which entry is no longer valid.
+ */
+typedef struct {
+    u32 prefix;
+    usize known_hop_count;
+    struct in_addr hops[MAX_HOPS];
+    struct timespec expires_at;
+} TraceCacheEntry;
+
+// endregion
+
+
+
+// region TraceCache
+
+/*
+ * Cache of route prefixes keyed by destination prefix.
+ * Entries are stored in a set associative table, once all TRACE_CACHE_ASSOCIATIVITY slots of a prefix are taken
+ * the entry that expires first gets replaced.
+ *
+ * prefix_length: number of leading bits of the destination address that make up the key.
+ * time_to_live_ns: time after which an entry expires, counted from its last update.
+ * entries: table of TRACE_CACHE_CAPACITY entries, slots with zero expires_at are empty.
+ */
+typedef struct {
+    u8 prefix_length;
+    u64 time_to_live_ns;
+    TraceCacheEntry* entries;
+} TraceCache;
+
+
+/*
+ * Initialize empty TraceCache in place.
+ *
+ * self: Reference to TraceCache struct.
+ * prefix_length: number of leading bits of the destination address that make up the key, from range 0..32.
+ * time_to_live_ns: time after which an entry expires.
+ */
+extern void trace_cache_init(TraceCache* self, u8 prefix_length, u64 time_to_live_ns);
+
+
+/*
+ * Release memory owned by the cache.
+ */
+extern void trace_cache_free(TraceCache* self);
+
+
+/*
+ * Find valid entry for the prefix of the destination.
+ *
+ * self: Reference to TraceCache struct.
+ * destination: traced address.
+ * now: current time of the monotonic clock.
+ *
+ * returns: entry or NULL if no valid entry exists.
+ */
+extern const TraceCacheEntry* trace_cache_lookup(const TraceCache* self, struct in_addr destination, const struct timespec* now);
+
+
+/*
+ * Merge the route to destination into the entry of its prefix.
+ * Only hops before the destination are stored, known hop count of an existing entry shrinks
+ * to the first hop at which the new route got a different responder.
+ *
+ * self: Reference to TraceCache struct.
+ * destination: traced address.
+ * ping_infos: results of hop_count consecutive hops starting at ttl 1.
+ * hop_count: number of hops of the route.
+ * now: current time of the monotonic clock.
+ */
+extern void trace_cache_update(
+        TraceCache* self,
+        struct in_addr destination,
+        const PingInfo* ping_infos,
+        usize hop_count,
+        const struct timespec* now
+);
+
+// endregion
+
+#endif //TRACEROUTE_TRACE_CACHE_H
@@ -0,0 +1,354 @@
+// Mikołaj Depta 328690
+//
+
+#include "trace_engine.h"
+
+// region TraceTarget
+
+TraceTarget trace_target_new(struct in_addr destination) {
+    TraceTarget new = {0};
+    new.destination = destination;
+    new.status = TRACE_TARGET_PENDING;
+    new.first_ttl = 1;
+    new.cached_hop_count = 0;
+    new.destination_hop = MAX_HOPS;
+    new.hop_count = 0;
+    return new;
+}
+
+
+TraceTarget trace_target_from_string(const char* destination_ipv4_address) {
+    struct in_addr in_address = {0};
+    if (inet_pton(AF_INET, destination_ipv4_address, &in_address) != 1) {
+        fprintf(stderr, "Invalid IPv4 network address: %s\n", destination_ipv4_address);
+        exit(EXIT_FAILURE);
+    }
+    return trace_target_new(in_address);
+}
+
+
+/*
+ * Index one past the last hop of the window currently in flight.
+ */
+internal usize trace_target_window_end(const TraceTarget* self, usize window_size) {
+    const usize window_end = self->first_ttl - 1 + window_size;
+    return window_end < MAX_HOPS ? window_end : MAX_HOPS;
+}
+
+
+/*
+ * Index one past the last hop whose replies are still awaited, hops past the destination are not taken into account.
+ */
+internal usize trace_target_last_awaited_hop(const TraceTarget* self, usize window_size) {
+    const usize window_end = trace_target_window_end(self, window_size);
+    return self->destination_hop < window_end ? self->destination_hop + 1 : window_end;
+}
+
+
+/*
+ * Check if reply for the ttl belongs to the window currently in flight or to the cached hops being verified.
+ */
+internal bool trace_target_is_ttl_in_flight(const TraceTarget* self, usize ttl, usize window_size) {
+    return (1 <= ttl && ttl <= self->cached_hop_count) ||
+           (self->first_ttl <= ttl && ttl <= trace_target_window_end(self, window_size));
+}
+
+
+/*
+ * Check if no more replies are needed for the window currently in flight.
+ * Hops past the destination are not taken into account.
+ */
+internal bool trace_target_is_window_complete(const TraceTarget* self, usize window_size) {
+    const usize window_start = self->first_ttl - 1;
+    const usize last_hop = trace_target_last_awaited_hop(self, window_size);
+    const usize cached_hop_count = self->cached_hop_count < last_hop ? self->cached_hop_count : last_hop;
+    return ping_infos_are_complete(self->ping_infos, cached_hop_count) &&
+           (last_hop <= window_start ||
+            ping_infos_are_complete(self->ping_infos + window_start, last_hop - window_start));
+}
+
+
+internal void trace_target_finish(TraceTarget* self, TraceCompletedCallback on_completed, void* context) {
+    self->status = TRACE_TARGET_FINISHED;
+    self->hop_count = self->destination_hop < MAX_HOPS ? self->destination_hop + 1 : MAX_HOPS;
+    on_completed(self, context);
+}
+
+// endregion
+
+
+
+// region TraceEngine
+
+void trace_engine_init(
+        TraceEngine* self,
+        i32 socket_fd,
+        u16 base_identifier,
+        TraceTarget* targets,
+        usize target_count,
+        usize window_size,
+        usize probe_count,
+        const RTOEstimator* timeout_policy,
+        usize max_active_targets,
+        TraceCache* cache
+) {
+    assert(target_count <= MAX_TRACE_TARGETS);
+    assert(max_active_targets >= 1);
+    assert(1 <= window_size && window_size <= MAX_HOPS);
+    assert(1 <= probe_count && probe_count <= MAX_PROBE_COUNT);
+    self->sender = icmp_sender_new(socket_fd);
+    self->receiver = icmp_receiver_new(socket_fd);
+    icmp_receiver_attach_filter(&self->receiver, base_identifier, target_count);
+    self->base_identifier = base_identifier;
+    self->targets = targets;
+    self->target_count = target_count;
+    self->window_size = window_size;
+    self->probe_count = probe_count;
+    self->max_active_targets = max_active_targets;
+    self->started_count = 0;
+    self->cache = cache;
+    for (usize i = 0; i < target_count; i++) {
+        targets[i].reply_timeout = *timeout_policy;
+    }
+    self->pending_count = 0;
+    const struct timespec now = time_now();
+    timer_wheel_init(&self->timers, &now);
+}
+
+
+internal u16 trace_engine_identifier(const TraceEngine* self, usize target_index) {
+    return (u16) (self->base_identifier + target_index);
+}
+
+
+/*
+ * Find target that Echo Requests with given Identifier were sent to.
+ *
+ * returns: target or NULL if identifier does not belong to any of the targets.
+ */
+internal TraceTarget* trace_engine_lookup(TraceEngine* self, u16 identifier) {
+    const usize target_index = (u16) (identifier - self->base_identifier);
+    return target_index < self->target_count ? &self->targets[target_index] : NULL;
+}
+
+
+/*
+ * Send all queued Echo Requests and stamp the rounds they belong to with the send time.
+ * Round whose probes span several flushes keeps the time of the first one, so round trip times never go negative.
+ */
+internal void trace_engine_flush_requests(TraceEngine* self) {
+    if (self->pending_count == 0) {
+        return;
+    }
+    const struct timespec sent_at = time_now_realtime();
+    icmp_sender_echo_request_batch(&self->sender, self->pending_requests, self->pending_count);
+    for (usize i = 0; i < self->pending_count; i++) {
+        const EchoRequestParams* request = &self->pending_requests[i];
+        TraceTarget* target = trace_engine_lookup(self, request->identifier);
+        PingInfo* ping_info = &target->ping_infos[request->ttl - 1];
+        if (ping_info->sent_at.tv_sec == 0 && ping_info->sent_at.tv_nsec == 0) {
+            ping_info->sent_at = sent_at;
+        }
+    }
+    self->pending_count = 0;
+}
+
+
+/*
+ * Queue probe_count Echo Requests for every ttl from the range first_ttl..last_ttl of the target.
+ */
+internal void trace_engine_queue_requests(
+        TraceEngine* self,
+        TraceTarget* target,
+        usize first_ttl,
+        usize last_ttl,
+        usize probe_count
+) {
+    const u16 identifier = trace_engine_identifier(self, target - self->targets);
+    for (usize ttl = first_ttl; ttl <= last_ttl; ttl++) {
+        target->ping_infos[ttl - 1] = ping_info_new_awaiting(ttl, probe_count);
+        for (usize j = 0; j < probe_count; j++) {
+            self->pending_requests[self->pending_count++] = echo_request_params_new(
+                    identifier,
+                    ttl,
+                    ttl,
+                    target->destination
+            );
+            if (self->pending_count == SEND_BATCH_SIZE) {
+                trace_engine_flush_requests(self);
+            }
+        }
+    }
+}
+
+
+/*
+ * Queue Echo Requests for the current window of the target and schedule its deadline.
+ */
+internal void trace_engine_send_window(TraceEngine* self, TraceTarget* target, const struct timespec* now) {
+    const usize window_end = trace_target_window_end(target, self->window_size);
+    trace_engine_queue_requests(self, target, target->first_ttl, window_end, self->probe_count);
+    const struct timespec deadline = time_add_ns(now, rto_estimator_timeout_ns(&target->reply_timeout));
+    timer_wheel_schedule(&self->timers, &target->timer, &deadline);
+}
+
+
+/*
+ * Start tracing the next pending target, if there is any.
+ * Hops known from the cache are verified with a single Echo Request and the first window starts right after them.
+ */
+internal void trace_engine_start_next_target(TraceEngine* self, const struct timespec* now) {
+    if (self->started_count == self->target_count) {
+        return;
+    }
+    TraceTarget* target = &self->targets[self->started_count++];
+    target->status = TRACE_TARGET_PROBING;
+    if (self->cache != NULL) {
+        const TraceCacheEntry* entry = trace_cache_lookup(self->cache, target->destination, now);
+        if (entry != NULL) {
+            // At least one hop has to be probed in full.
+            target->cached_hop_count = entry->known_hop_count < MAX_HOPS ? entry->known_hop_count : MAX_HOPS - 1;
+            target->first_ttl = target->cached_hop_count + 1;
+            trace_engine_queue_requests(self, target, 1, target->cached_hop_count, 1);
+        }
+    }
+    trace_engine_send_window(self, target, now);
+}
+
+
+/*
+ * Called once the current window of the target completed or its deadline passed.
+ * Finishes target that reached its destination or ran out of ttls and starts the next pending one,
+ * sends the next window otherwise.
+ *
+ * returns: true if target has been finished.
+ */
+internal bool trace_engine_advance(
+        TraceEngine* self,
+        TraceTarget* target,
+        const struct timespec* now,
+        TraceCompletedCallback on_completed,
+        void* context
+) {
+    timer_wheel_cancel(&self->timers, &target->timer);
+    const usize last_hop = trace_target_last_awaited_hop(target, self->window_size);
+    const usize first_hop = target->cached_hop_count > 0 ? 0 : target->first_ttl - 1;
+    for (usize hop = first_hop; hop < last_hop; hop++) {
+        ping_info_update_rto_estimator(&target->ping_infos[hop], &target->reply_timeout);
+    }
+    target->first_ttl += self->window_size;
+    target->cached_hop_count = 0;
+    if (target->destination_hop < MAX_HOPS || target->first_ttl > MAX_HOPS) {
+        trace_target_finish(target, on_completed, context);
+        if (self->cache != NULL) {
+            trace_cache_update(self->cache, target->destination, target->ping_infos, target->hop_count, now);
+        }
+        trace_engine_start_next_target(self, now);
+        return true;
+    }
+    trace_engine_send_window(self, target, now);
+    return false;
+}
+
+
+/*
+ * Read all pending replies and advance targets whose windows completed.
+ *
+ * returns: number of targets that have been finished.
+ */
+internal usize trace_engine_receive_replies(TraceEngine* self, TraceCompletedCallback on_completed, void* context) {
+    ICMPPacket icmp_packet = {0};
+    ICMPPacketBatch batch;
+    usize finished_count = 0;
+
+    // Batch that was not filled completely means the socket has been drained.
+    do {
+        icmp_receiver_receive_batch(&self->receiver, &batch);
+        const struct timespec now = time_now();
+        for (usize i = 0; i < batch.count; i++) {
+            if (!icmp_packet_batch_get(&batch, i, &icmp_packet)) {             /* Extract ICMP packet from IP packet. */
+                continue;  /* Ignore malformed packets. */
+            }
+
+            // region demultiplex reply
+            u16 identifier, sequence_number;
+            if (!icmp_packet_echo_request_id_seq(&icmp_packet, &identifier, &sequence_number)) {
+                continue;  /* Ignore all other ICMP messages. */
+            }
+            TraceTarget* target = trace_engine_lookup(self, identifier);
+            if (target == NULL ||
+                target->status != TRACE_TARGET_PROBING ||
+                !trace_target_is_ttl_in_flight(target, sequence_number, self->window_size)) {
+                continue;  /* Ignore replies of other processes and late replies from previous windows. */
+            }
+            const usize hop = sequence_number - 1;
+            // endregion
+
+            ping_info_record_reply(
+                    &target->ping_infos[hop],
+                    &icmp_packet,
+                    batch.sender_addresses[i].sin_addr,
+                    &batch.timestamps[i]
+            );
+            if (target->ping_infos[hop].message_type == ICMP_ECHOREPLY && hop < target->destination_hop) {
+                target->destination_hop = hop;
+            }
+            if (trace_target_is_window_complete(target, self->window_size) &&
+                trace_engine_advance(self, target, &now, on_completed, context)) {
+                finished_count++;
+            }
+        }
+    } while (batch.count == RECEIVE_BATCH_SIZE);
+    return finished_count;
+}
+
+
+/*
+ * Advance all targets whose window deadlines have passed, missing replies are left as timeouts.
+ *
+ * returns: number of targets that have been finished.
+ */
+internal usize trace_engine_expire_windows(TraceEngine* self, TraceCompletedCallback on_completed, void* context) {
+    const struct timespec now = time_now();
+    usize finished_count = 0;
+    TimerWheelEntry* entry = timer_wheel_expire(&self->timers, &now);
+    while (entry != NULL) {
+        TimerWheelEntry* next = entry->next;
+        TraceTarget* target = TIMER_WHEEL_ENTRY_OWNER(entry, TraceTarget, timer);
+        if (trace_engine_advance(self, target, &now, on_completed, context)) {
+            finished_count++;
+        }
+        entry = next;
+    }
+    return finished_count;
+}
+
+
+void trace_engine_run(TraceEngine* self, TraceCompletedCallback on_completed, void* context) {
+    const struct timespec start_time = time_now();
+    while (self->started_count < self->max_active_targets && self->started_count < self->target_count) {
+        trace_engine_start_next_target(self, &start_time);
+    }
+
+    // Finished target immediately starts the next pending one, so some target is active until all are finished.
+    usize remaining_count = self->target_count;
+    while (remaining_count > 0) {
+        trace_engine_flush_requests(self);
+
+        struct timespec deadline;
+        const bool has_deadline = timer_wheel_next_deadline(&self->timers, &deadline);
+        assert(has_deadline && "every active target has a window in flight");
+        icmp_receiver_set_deadline(&self->receiver, &deadline);
+
+        const u32 events = icmp_receiver_await_events(&self->receiver);
+        if (events & ICMP_RECEIVER_READABLE) {
+            remaining_count -= trace_engine_receive_replies(self, on_completed, context);
+        }
+        if (events & ICMP_RECEIVER_DEADLINE) {
+            remaining_count -= trace_engine_expire_windows(self, on_completed, context);
+        }
+    }
+    icmp_receiver_close(&self->receiver);
+}
+
+// endregion
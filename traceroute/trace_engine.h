@@ -0,0 +1,183 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_TRACE_ENGINE_H
+#define TRACEROUTE_TRACE_ENGINE_H
+
+// sendmmsg() and recvmmsg() are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <netinet/ip.h>
+#include <stdbool.h>
+#include "types.h"
+#include "icmp_sender.h"
+#include "icmp_receiver.h"
+#include "timer_wheel.h"
+#include "rto_estimator.h"
+#include "trace_cache.h"
+
+// Every target gets its own Echo Request Identifier, identifiers are 16 bit wide.
+#define MAX_TRACE_TARGETS 65536
+
+
+// region TraceTarget
+
+/*
+ * Progress of tracing the route to a single target.
+ *
+ * TRACE_TARGET_PENDING: no Echo Requests have been sent yet.
+ * TRACE_TARGET_PROBING: replies for the window of ttls currently in flight are still awaited.
+ * TRACE_TARGET_FINISHED: route has been traced, results have been emitted.
+ */
+typedef enum {
+    TRACE_TARGET_PENDING,
+    TRACE_TARGET_PROBING,
+    TRACE_TARGET_FINISHED,
+} TraceTargetStatus;
+
+
+/*
+ * State of the route tracing to a single destination.
+ *
+ * destination: IPv4 address of the target.
+ * status: progress of the trace.
+ * first_ttl: first ttl of the window of ttls currently in flight.
+ * cached_hop_count: number of leading hops known from the trace cache, they are verified with a single probe
+ *                   along with the first window and are 0 afterwards.
+ * destination_hop: index of the lowest hop that responded with Echo Reply, MAX_HOPS if none did.
+ * hop_count: number of valid entries in ping_infos, known once trace is finished.
+ * reply_timeout: estimate of how long to wait for replies, updated with results of every window.
+ * timer: deadline of the current window, reply timeout after it has been queued.
+ * ping_infos: results of ping rounds, round for ttl is stored at index ttl - 1.
+ */
+typedef struct {
+    struct in_addr destination;
+    TraceTargetStatus status;
+    usize first_ttl;
+    usize cached_hop_count;
+    usize destination_hop;
+    usize hop_count;
+    RTOEstimator reply_timeout;
+    TimerWheelEntry timer;
+    PingInfo ping_infos[MAX_HOPS];
+} TraceTarget;
+
+
+/*
+ * Constructor for TraceTarget.
+ *
+ * destination: IPv4 address of the target.
+ *
+ * returns: new instance of TraceTarget.
+ */
+extern TraceTarget trace_target_new(struct in_addr destination);
+
+
+/*
+ * Creates new instance of TraceTarget from string.
+ *
+ * returns: new instance of TraceTarget.
+ */
+extern TraceTarget trace_target_from_string(const char* destination_ipv4_address);
+
+// endregion
+
+
+
+// region TraceEngine
+
+/*
+ * Callback invoked once for every target as soon as its route has been traced.
+ *
+ * target: finished target, its results are valid for the duration of the call.
+ * context: user data passed to trace_engine_run.
+ */
+typedef void (*TraceCompletedCallback)(const TraceTarget* target, void* context);
+
+
+/*
+ * Engine that traces routes to many targets at once over a single raw ICMP socket.
+ *
+ * Every target advances on its own: probe_count Echo Requests are sent for each ttl of its window
+ * and the next window is sent as soon as the current one completes or its deadline passes.
+ * At most max_active_targets targets are traced at once, the next target starts once one of them finishes.
+ * With a trace cache, target whose prefix has been traced before starts probing at the first unknown hop,
+ * known hops are only verified with a single Echo Request each and route of every finished target updates the cache.
+ * Deadlines of all targets are kept in a timer wheel, the receiver timer is armed only with the earliest one.
+ * Replies are demultiplexed in constant time with a flat index: target is identified by
+ * the Identifier (base_identifier + target index) and hop by the Sequence Number (equal to the ttl).
+ *
+ * sender: sender used for all Echo Requests.
+ * receiver: receiver used for all replies.
+ * base_identifier: Identifier of the first target.
+ * targets: array of target_count targets owned by the caller.
+ * target_count: number of targets, at most MAX_TRACE_TARGETS.
+ * window_size: number of consecutive ttls probed for each target at once.
+ * probe_count: number of Echo Requests sent for every ttl.
+ * max_active_targets: number of targets traced at once.
+ * started_count: number of targets that have been started, targets are started in order.
+ * cache: shared hops of already traced prefixes, NULL if caching is disabled.
+ * timers: deadlines of windows in flight.
+ * pending_requests: Echo Requests queued to be sent with a single system call.
+ * pending_count: number of valid entries in pending_requests.
+ */
+typedef struct {
+    ICMPSender sender;
+    ICMPReceiver receiver;
+    u16 base_identifier;
+    TraceTarget* targets;
+    usize target_count;
+    usize window_size;
+    usize probe_count;
+    usize max_active_targets;
+    usize started_count;
+    TraceCache* cache;
+    TimerWheel timers;
+    EchoRequestParams pending_requests[SEND_BATCH_SIZE];
+    usize pending_count;
+} TraceEngine;
+
+
+/*
+ * Initialize TraceEngine in place, engine is too large to be returned by value.
+ *
+ * self: Reference to TraceEngine struct.
+ * socket_fd: file descriptor of the raw ICMP socket that should be used.
+ * base_identifier: Identifier of the first target, consecutive targets use consecutive identifiers.
+ * targets: array of target_count targets created with trace_target_new.
+ * target_count: number of targets, at most MAX_TRACE_TARGETS.
+ * window_size: number of consecutive ttls probed for each target at once, from range 1..MAX_HOPS.
+ * probe_count: number of Echo Requests sent for every ttl, from range 1..MAX_PROBE_COUNT.
+ * timeout_policy: initial reply timeout estimator, every target gets its own copy.
+ * max_active_targets: number of targets traced at once, at least 1.
+ * cache: trace cache owned by the caller, NULL to disable caching.
+ */
+extern void trace_engine_init(
+        TraceEngine* self,
+        i32 socket_fd,
+        u16 base_identifier,
+        TraceTarget* targets,
+        usize target_count,
+        usize window_size,
+        usize probe_count,
+        const RTOEstimator* timeout_policy,
+        usize max_active_targets,
+        TraceCache* cache
+);
+
+
+/*
+ * Trace routes to all targets.
+ * Function returns once every target has been finished, receiver is closed afterwards.
+ *
+ * self: Reference to TraceEngine struct.
+ * on_completed: callback invoked for each target as soon as its trace is finished.
+ * context: user data passed to on_completed.
+ */
+extern void trace_engine_run(TraceEngine* self, TraceCompletedCallback on_completed, void* context);
+
+// endregion
+
+#endif //TRACEROUTE_TRACE_ENGINE_H
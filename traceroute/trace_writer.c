@@ -0,0 +1,193 @@
+// Mikołaj Depta 328690
+//
+
+#include "trace_writer.h"
+
+_Static_assert(sizeof(TraceHopRecord) % 8 == 0, "records must stay aligned when stored back to back");
+
+
+// region TraceHopRecord
+
+TraceHopRecord trace_hop_record_new(struct in_addr target, const PingInfo* ping_info) {
+    TraceHopRecord new = {0};
+    new.magic = TRACE_HOP_RECORD_MAGIC;
+    new.target = target.s_addr;
+    new.ttl = ping_info->ttl;
+    new.probe_count = ping_info->probe_count;
+    new.sent_at_ns = (u64) ping_info->sent_at.tv_sec * 1000000000ULL + (u64) ping_info->sent_at.tv_nsec;
+    if (ping_info->timeout) {
+        return new;
+    }
+    new.icmp_type = ping_info->message_type;
+    new.icmp_code = ping_info->message_code;
+    new.reply_count = ping_info->collected_packets;
+    new.address_count = ping_info->address_count;
+    for (usize i = 0; i < ping_info->address_count; i++) {
+        new.addresses[i] = ping_info->ip_addresses[i].s_addr;
+    }
+
+    const RTTStatistics* statistics = &ping_info->round_trip_times;
+    if (statistics->count == 0) {
+        return new;  /* Only replies without known send time were recorded. */
+    }
+    new.min_ns = statistics->min_ns;
+    new.mean_ns = (u64) statistics->mean_ns;
+    new.max_ns = statistics->max_ns;
+    new.stddev_ns = (u64) rtt_statistics_stddev_ns(statistics);
+    memcpy(new.samples_ns, statistics->samples_ns, rtt_statistics_sample_count(statistics) * sizeof(u64));
+    memcpy(new.histogram, statistics->histogram, sizeof(new.histogram));
+    return new;
+}
+
+// endregion
+
+
+
+// region TraceWriter
+
+void trace_writer_init(TraceWriter* self, i32 fd, TraceOutputFormat format) {
+    self->fd = fd;
+    self->format = format;
+    self->length = 0;
+}
+
+
+bool trace_output_format_from_string(const char* name, TraceOutputFormat* format) {
+    if (strcmp(name, "ndjson") == 0) {
+        *format = TRACE_OUTPUT_NDJSON;
+        return true;
+    }
+    if (strcmp(name, "binary") == 0) {
+        *format = TRACE_OUTPUT_BINARY;
+        return true;
+    }
+    return false;
+}
+
+
+void trace_writer_flush(TraceWriter* self) {
+    usize written = 0;
+    while (written < self->length) {
+        const isize result = write(self->fd, self->buffer + written, self->length - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Could not write results: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        written += result;
+    }
+    self->length = 0;
+}
+
+
+internal void trace_writer_append(TraceWriter* self, const void* data, usize length) {
+    assert(self->length + length <= TRACE_WRITER_BUFFER_SIZE);
+    memcpy(self->buffer + self->length, data, length);
+    self->length += length;
+}
+
+
+internal void trace_writer_append_string(TraceWriter* self, const char* string) {
+    trace_writer_append(self, string, strlen(string));
+}
+
+
+internal void trace_writer_append_u64(TraceWriter* self, u64 value) {
+    char digits[20];
+    usize digit_count = 0;
+    do {
+        digits[sizeof(digits) - ++digit_count] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    trace_writer_append(self, digits + sizeof(digits) - digit_count, digit_count);
+}
+
+
+internal void trace_writer_append_address(TraceWriter* self, u32 address) {
+    const struct in_addr in_address = { .s_addr = address };
+    char address_buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &in_address, address_buffer, sizeof(address_buffer));
+    trace_writer_append(self, "\"", 1);
+    trace_writer_append_string(self, address_buffer);
+    trace_writer_append(self, "\"", 1);
+}
+
+
+internal void trace_writer_append_field(TraceWriter* self, const char* name, u64 value) {
+    trace_writer_append_string(self, name);
+    trace_writer_append_u64(self, value);
+}
+
+
+internal void trace_writer_append_u64_array(TraceWriter* self, const char* name, const u64* values, usize count) {
+    trace_writer_append_string(self, name);
+    trace_writer_append(self, "[", 1);
+    for (usize i = 0; i < count; i++) {
+        if (i > 0) {
+            trace_writer_append(self, ",", 1);
+        }
+        trace_writer_append_u64(self, values[i]);
+    }
+    trace_writer_append(self, "]", 1);
+}
+
+
+/*
+ * Format record as a single line JSON object, fields are appended directly to the buffer.
+ */
+internal void trace_writer_append_ndjson(TraceWriter* self, const TraceHopRecord* record) {
+    trace_writer_append_string(self, "{\"target\":");
+    trace_writer_append_address(self, record->target);
+    trace_writer_append_field(self, ",\"ttl\":", record->ttl);
+    trace_writer_append_field(self, ",\"probes\":", record->probe_count);
+    trace_writer_append_field(self, ",\"replies\":", record->reply_count);
+    if (record->reply_count > 0) {
+        trace_writer_append_field(self, ",\"type\":", record->icmp_type);
+        trace_writer_append_field(self, ",\"code\":", record->icmp_code);
+    }
+    trace_writer_append_string(self, ",\"responders\":[");
+    for (usize i = 0; i < record->address_count; i++) {
+        if (i > 0) {
+            trace_writer_append(self, ",", 1);
+        }
+        trace_writer_append_address(self, record->addresses[i]);
+    }
+    trace_writer_append(self, "]", 1);
+    trace_writer_append_field(self, ",\"sent_at_ns\":", record->sent_at_ns);
+    if (record->reply_count > 0) {
+        const usize sample_count = record->reply_count < RTT_STATISTICS_SAMPLE_COUNT
+                ? record->reply_count
+                : RTT_STATISTICS_SAMPLE_COUNT;
+        u64 histogram[RTT_HISTOGRAM_BUCKET_COUNT];
+        for (usize i = 0; i < RTT_HISTOGRAM_BUCKET_COUNT; i++) {
+            histogram[i] = record->histogram[i];
+        }
+        trace_writer_append_u64_array(self, ",\"rtt_ns\":", record->samples_ns, sample_count);
+        trace_writer_append_field(self, ",\"min_ns\":", record->min_ns);
+        trace_writer_append_field(self, ",\"avg_ns\":", record->mean_ns);
+        trace_writer_append_field(self, ",\"max_ns\":", record->max_ns);
+        trace_writer_append_field(self, ",\"stddev_ns\":", record->stddev_ns);
+        trace_writer_append_u64_array(self, ",\"histogram\":", histogram, RTT_HISTOGRAM_BUCKET_COUNT);
+    }
+    trace_writer_append_string(self, "}\n");
+}
+
+
+void trace_writer_write_hop(TraceWriter* self, struct in_addr target, const PingInfo* ping_info) {
+    if (TRACE_WRITER_BUFFER_SIZE - self->length < TRACE_WRITER_MAX_RECORD_SIZE) {
+        trace_writer_flush(self);
+    }
+    const TraceHopRecord record = trace_hop_record_new(target, ping_info);
+    switch (self->format) {
+        case TRACE_OUTPUT_NDJSON: {
+            trace_writer_append_ndjson(self, &record);
+        } break;
+        case TRACE_OUTPUT_BINARY: {
+            trace_writer_append(self, &record, sizeof(record));
+        } break;
+    }
+}
+
+// endregion
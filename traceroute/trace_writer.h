@@ -0,0 +1,148 @@
+// Mikołaj Depta 328690
+//
+
+#ifndef TRACEROUTE_TRACE_WRITER_H
+#define TRACEROUTE_TRACE_WRITER_H
+
+// sendmmsg() and recvmmsg() are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <netinet/ip.h>
+#include <stdbool.h>
+#include "types.h"
+#include "icmp_receiver.h"
+
+#define TRACE_WRITER_BUFFER_SIZE 65536
+// Flush once less than that is left in the buffer, enough for the longest NDJSON record.
+#define TRACE_WRITER_MAX_RECORD_SIZE 2048
+// "TRC1" in little endian, lets readers detect misaligned or foreign data.
+#define TRACE_HOP_RECORD_MAGIC 0x31435254
+
+
+// region TraceHopRecord
+
+/*
+ * Fixed size binary record of a single hop, records are appended back to back so that a file
+ * of them can be mmap'ed and indexed as an array. All fields are stored in host byte order,
+ * except for addresses which are stored in network byte order as in struct in_addr.
+ * Hop that did not respond has reply_count equal 0, icmp_type and icmp_code are meaningless then.
+ *
+ * magic: TRACE_HOP_RECORD_MAGIC.
+ * target: traced IPv4 address.
+ * ttl: time to live used for the hop.
+ * icmp_type, icmp_code: type and code of ICMP messages the hop responded with.
+ * address_count: number of valid entries in addresses.
+ * probe_count: number of Echo Requests sent to the hop.
+ * reply_count: number of replies received from the hop.
+ * addresses: unique responder addresses.
+ * sent_at_ns: time at which probes were sent, nanoseconds since the Unix epoch.
+ * min_ns, mean_ns, max_ns, stddev_ns: round trip time statistics, 0 if hop did not respond.
+ * samples_ns: round trip times of the first min(reply_count, RTT_STATISTICS_SAMPLE_COUNT) replies.
+ * histogram: round trip time histogram, buckets as in RTTStatistics.
+ */
+typedef struct {
+    u32 magic;
+    u32 target;
+    u8 ttl;
+    u8 icmp_type;
+    u8 icmp_code;
+    u8 address_count;
+    u16 probe_count;
+    u16 reply_count;
+    u32 addresses[MAX_HOP_ADDRESSES];
+    u64 sent_at_ns;
+    u64 min_ns;
+    u64 mean_ns;
+    u64 max_ns;
+    u64 stddev_ns;
+    u64 samples_ns[RTT_STATISTICS_SAMPLE_COUNT];
+    u32 histogram[RTT_HISTOGRAM_BUCKET_COUNT];
+} TraceHopRecord;
+
+
+/*
+ * Constructor for TraceHopRecord.
+ *
+ * target: traced IPv4 address.
+ * ping_info: results of the hop.
+ *
+ * returns: new instance of TraceHopRecord.
+ */
+extern TraceHopRecord trace_hop_record_new(struct in_addr target, const PingInfo* ping_info);
+
+// endregion
+
+
+
+// region TraceWriter
+
+/*
+ * Machine readable output formats.
+ *
+ * TRACE_OUTPUT_NDJSON: one JSON object per hop, separated with new lines.
+ * TRACE_OUTPUT_BINARY: one TraceHopRecord per hop.
+ */
+typedef enum {
+    TRACE_OUTPUT_NDJSON,
+    TRACE_OUTPUT_BINARY,
+} TraceOutputFormat;
+
+
+/*
+ * Buffered writer of hop results, data is written to the file descriptor only once the buffer fills up
+ * or on explicit flush, so a single write() call carries many records.
+ *
+ * fd: file descriptor records are written to.
+ * format: format of the records.
+ * length: number of bytes currently stored in buffer.
+ * buffer: records that have not been written yet.
+ */
+typedef struct {
+    i32 fd;
+    TraceOutputFormat format;
+    usize length;
+    u8 buffer[TRACE_WRITER_BUFFER_SIZE];
+} TraceWriter;
+
+
+/*
+ * Initialize TraceWriter in place.
+ *
+ * self: Reference to TraceWriter struct.
+ * fd: file descriptor records should be written to.
+ * format: format of the records.
+ */
+extern void trace_writer_init(TraceWriter* self, i32 fd, TraceOutputFormat format);
+
+
+/*
+ * Parse name of the output format.
+ *
+ * name: "ndjson" or "binary".
+ * format: Reference to TraceOutputFormat that should be initialized.
+ *
+ * returns: false if name does not denote any of the formats.
+ */
+extern bool trace_output_format_from_string(const char* name, TraceOutputFormat* format);
+
+
+/*
+ * Append record of a single hop.
+ *
+ * self: Reference to TraceWriter struct.
+ * target: traced IPv4 address.
+ * ping_info: results of the hop.
+ */
+extern void trace_writer_write_hop(TraceWriter* self, struct in_addr target, const PingInfo* ping_info);
+
+
+/*
+ * Write all buffered records to the file descriptor.
+ */
+extern void trace_writer_flush(TraceWriter* self);
+
+// endregion
+
+#endif //TRACEROUTE_TRACE_WRITER_H
@@ -29,6 +29,9 @@ typedef double f64;
  *
  * identifier: identifier used in ICMP header.
  * sequence_number: sequence number used in ICMP header.
+ * flow_identifier: value of the ICMP checksum, kept constant by a compensation word in the payload.
+ *  Load balancers hash the first bytes of the ICMP header (type, code and checksum) to pick a path,
+ *  so requests with the same flow_identifier follow the same path regardless of their sequence numbers.
  *
  * ttl: Time-To-Live parameter of IPv4 datagram that will contain the echo request.
  * socket_address: struct containing IPv4 addressing information.
@@ -36,6 +39,7 @@ typedef double f64;
 typedef struct {
     u16 identifier;
     u16 sequence_number;
+    u16 flow_identifier;
     usize ttl;
     struct sockaddr_in socket_address;
 } EchoRequestParams;
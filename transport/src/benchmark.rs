@@ -0,0 +1,314 @@
+//! Mikołaj Depta 328690
+//!
+//! This module holds the throughput benchmark of the downloader.
+//! Benchmark downloads a file from an in-process fake server which speaks our protocol
+//! and injects loss, reordering, duplication and delay of responses.
+//! For every scenario and window size it reports goodput, retransmit ratio, syscalls per MB and completion times.
+//!
+//! It is run with `make benchmark`, that is `cargo test --release -- --ignored --nocapture benchmark`.
+
+#![allow(dead_code)]
+
+use std::cmp::Reverse;
+use std::collections::BinaryHeap;
+use std::fs;
+use std::net::{Ipv4Addr, SocketAddr, SocketAddrV4, UdpSocket};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, Instant};
+
+use crate::bitmap::SegmentBitmap;
+use crate::checkpoint::Checkpoint;
+use crate::downloader::{DownloadStatistics, Downloader};
+use crate::output::MappedFile;
+use crate::segment::Segment;
+
+
+/// Impairments of the link between the fake server and the downloader, probabilities apply to every response.
+#[derive(Debug, Copy, Clone)]
+pub struct Impairments {
+    pub loss: f64,
+    pub reorder: f64,
+    pub duplication: f64,
+    pub delay: Duration,
+    /* Extra delay of reordered responses. */
+    pub reorder_delay: Duration,
+}
+
+impl Impairments {
+    pub const NONE: Self = Self {
+        loss: 0.0,
+        reorder: 0.0,
+        duplication: 0.0,
+        delay: Duration::ZERO,
+        reorder_delay: Duration::ZERO,
+    };
+}
+
+
+/// Xorshift generator, good enough to decide the fate of responses and cheap enough not to slow the server down.
+struct Random(u64);
+
+impl Random {
+    fn next_f64(&mut self) -> f64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        (self.0 >> 11) as f64 / (1u64 << 53) as f64
+    }
+
+    fn happens(&mut self, probability: f64) -> bool {
+        self.next_f64() < probability
+    }
+}
+
+
+/// Content of the served file, every byte depends on its offset so that misplaced segments are detected.
+pub fn file_byte(offset: usize) -> u8 {
+    (offset ^ (offset >> 8) ^ (offset >> 16)) as u8
+}
+
+
+/// Parses `GET start length\n`, None for anything else.
+fn parse_request(request: &[u8]) -> Option<(usize, usize)> {
+    let request = std::str::from_utf8(request).ok()?.strip_prefix("GET ")?.strip_suffix('\n')?;
+    let (start, length) = request.split_once(' ')?;
+    Some((start.parse().ok()?, length.parse().ok()?))
+}
+
+
+/// UDP server running on its own thread, stops when dropped.
+pub struct FakeServer {
+    address: SocketAddrV4,
+    stop: Arc<AtomicBool>,
+    handle: Option<JoinHandle<()>>,
+}
+
+impl FakeServer {
+    const POLL_INTERVAL: Duration = Duration::from_micros(200);
+
+    pub fn start(file_size: usize, impairments: Impairments, seed: u64) -> Self {
+        let socket = UdpSocket::bind(SocketAddrV4::new(Ipv4Addr::LOCALHOST, 0)).unwrap();
+        socket.set_read_timeout(Some(Self::POLL_INTERVAL)).unwrap();
+        let address = match socket.local_addr().unwrap() {
+            SocketAddr::V4(address) => address,
+            SocketAddr::V6(_) => unreachable!(),
+        };
+        let stop = Arc::new(AtomicBool::new(false));
+        let handle = {
+            let stop = stop.clone();
+            thread::spawn(move || Self::serve(socket, file_size, impairments, Random(seed | 1), &stop))
+        };
+        Self { address, stop, handle: Some(handle) }
+    }
+
+    pub fn address(&self) -> SocketAddrV4 {
+        self.address
+    }
+
+    fn serve(socket: UdpSocket, file_size: usize, impairments: Impairments, mut random: Random, stop: &AtomicBool) {
+        let mut request_buffer = [0; 64];
+        /* Responses waiting for their delay to pass, ordered by release time and then by arrival. */
+        let mut delayed: BinaryHeap<Reverse<(Instant, u64, SocketAddr, Vec<u8>)>> = BinaryHeap::new();
+        let mut sequence_number = 0;
+        while !stop.load(Ordering::Relaxed) {
+            let now = Instant::now();
+            while let Some(Reverse((release_at, ..))) = delayed.peek() {
+                if *release_at > now {
+                    break;
+                }
+                let Reverse((_, _, client, response)) = delayed.pop().unwrap();
+                let _ = socket.send_to(&response, client);
+            }
+            let (request_size, client) = match socket.recv_from(&mut request_buffer) {
+                Ok(received) => received,
+                Err(_) => continue,
+            };
+            let (start, length) = match parse_request(&request_buffer[..request_size]) {
+                Some((start, length)) if length <= Segment::SIZE && start + length <= file_size => (start, length),
+                _ => continue,
+            };
+            if random.happens(impairments.loss) {
+                continue;
+            }
+            let mut response = format!("DATA {start} {length}\n").into_bytes();
+            response.extend((start..start + length).map(file_byte));
+            let mut release_at = Instant::now() + impairments.delay;
+            if random.happens(impairments.reorder) {
+                release_at += impairments.reorder_delay;
+            }
+            let copy_count = if random.happens(impairments.duplication) { 2 } else { 1 };
+            for _ in 0..copy_count {
+                sequence_number += 1;
+                delayed.push(Reverse((release_at, sequence_number, client, response.clone())));
+            }
+        }
+    }
+}
+
+impl Drop for FakeServer {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(handle) = self.handle.take() {
+            let _ = handle.join();
+        }
+    }
+}
+
+
+/// Outcome of a single download.
+#[derive(Debug, Copy, Clone)]
+pub struct Run {
+    pub duration: Duration,
+    pub statistics: DownloadStatistics,
+}
+
+/// Downloads the file from the server with a fresh downloader and checks its content.
+pub fn run_download(server_address: SocketAddrV4, file_size: usize, window_size: usize, run_index: usize) -> Run {
+    let file_name = std::env::temp_dir()
+        .join(format!("transport-benchmark-{}-{run_index}", std::process::id()))
+        .to_str()
+        .unwrap()
+        .to_owned();
+    let _ = fs::remove_file(&file_name);
+    let output = Arc::new(MappedFile::create(&file_name, file_size).unwrap());
+    let segment_count = (file_size + Segment::SIZE - 1) / Segment::SIZE;
+    let checkpoint = Checkpoint::new(Checkpoint::path_for(&file_name), output.clone(), SegmentBitmap::new(segment_count));
+    let mut downloader = Downloader::new(
+        server_address,
+        output,
+        Arc::new(SegmentBitmap::new(segment_count)),
+        Arc::new(checkpoint),
+    );
+    downloader.set_window_size(window_size);
+
+    let started_at = Instant::now();
+    downloader.download();
+    let duration = started_at.elapsed();
+
+    let content = fs::read(&file_name).unwrap();
+    assert!(content.iter().enumerate().all(|(offset, &byte)| byte == file_byte(offset)), "corrupted download");
+    fs::remove_file(&file_name).unwrap();
+    Run { duration, statistics: *downloader.statistics() }
+}
+
+
+/// Aggregated results of repeated downloads of the same scenario.
+#[derive(Debug)]
+pub struct Report {
+    pub goodput_mb_per_s: f64,
+    pub retransmit_ratio: f64,
+    pub syscalls_per_mb: f64,
+    pub median: Duration,
+    pub p99: Duration,
+}
+
+impl Report {
+    pub fn new(file_size: usize, runs: &[Run]) -> Self {
+        debug_assert!(!runs.is_empty());
+        let mut durations: Vec<Duration> = runs.iter().map(|run| run.duration).collect();
+        durations.sort();
+        let percentile = |fraction: f64| durations[((durations.len() as f64 * fraction).ceil() as usize).max(1) - 1];
+        let total_megabytes = (file_size * runs.len()) as f64 / 1e6;
+        let segment_count = ((file_size + Segment::SIZE - 1) / Segment::SIZE * runs.len()) as f64;
+        let requests_sent: usize = runs.iter().map(|run| run.statistics.requests_sent).sum();
+        let syscall_count: usize = runs.iter().map(|run| run.statistics.syscall_count()).sum();
+        let total_duration: Duration = durations.iter().sum();
+        Self {
+            goodput_mb_per_s: total_megabytes / total_duration.as_secs_f64(),
+            retransmit_ratio: (requests_sent as f64 - segment_count).max(0.0) / segment_count.max(1.0),
+            syscalls_per_mb: syscall_count as f64 / total_megabytes.max(f64::MIN_POSITIVE),
+            median: percentile(0.5),
+            p99: percentile(0.99),
+        }
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::{FakeServer, Impairments, Random, Report, Run, parse_request, run_download};
+    use crate::downloader::DownloadStatistics;
+
+    const FILE_SIZE: usize = 2_000_000;
+    const RUN_COUNT: usize = 10;
+    const WINDOW_SIZES: [usize; 4] = [64, 256, 1000, 4000];
+
+    fn scenarios() -> [(&'static str, Impairments); 4] {
+        [
+            ("clean", Impairments::NONE),
+            ("delay 5ms", Impairments { delay: Duration::from_millis(5), ..Impairments::NONE }),
+            ("loss 10%", Impairments { loss: 0.1, ..Impairments::NONE }),
+            ("loss 5% reorder 5% dup 1% delay 2ms", Impairments {
+                loss: 0.05,
+                reorder: 0.05,
+                duplication: 0.01,
+                delay: Duration::from_millis(2),
+                reorder_delay: Duration::from_millis(3),
+            }),
+        ]
+    }
+
+    #[test]
+    #[ignore]
+    fn benchmark_window_sizes() {
+        println!(
+            "{:<38} {:>6} {:>10} {:>11} {:>14} {:>9} {:>9}",
+            "scenario", "window", "MB/s", "retransmit", "syscalls/MB", "p50 ms", "p99 ms",
+        );
+        for (name, impairments) in scenarios() {
+            let server = FakeServer::start(FILE_SIZE, impairments, 0x5eed);
+            for window_size in WINDOW_SIZES {
+                let runs: Vec<Run> = (0..RUN_COUNT)
+                    .map(|run_index| run_download(server.address(), FILE_SIZE, window_size, run_index))
+                    .collect();
+                let report = Report::new(FILE_SIZE, &runs);
+                println!(
+                    "{:<38} {:>6} {:>10.2} {:>11.3} {:>14.0} {:>9.1} {:>9.1}",
+                    name,
+                    window_size,
+                    report.goodput_mb_per_s,
+                    report.retransmit_ratio,
+                    report.syscalls_per_mb,
+                    report.median.as_secs_f64() * 1e3,
+                    report.p99.as_secs_f64() * 1e3,
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn test_download_from_impaired_server() {
+        let impairments = Impairments { loss: 0.2, reorder: 0.2, duplication: 0.2, ..Impairments::NONE };
+        let server = FakeServer::start(100_000 + 17, impairments, 7);
+        let run = run_download(server.address(), 100_000 + 17, 64, usize::MAX);
+        assert!(run.statistics.requests_sent > 201);
+    }
+
+    #[test]
+    fn test_parse_request() {
+        assert_eq!(Some((1500, 500)), parse_request(b"GET 1500 500\n"));
+        assert_eq!(None, parse_request(b"GET 1500 500"));
+        assert_eq!(None, parse_request(b"DATA 1500 500\n"));
+    }
+
+    #[test]
+    fn test_report_percentiles() {
+        let runs: Vec<Run> = (1..=100)
+            .map(|millis| Run { duration: Duration::from_millis(millis), statistics: DownloadStatistics::default() })
+            .collect();
+        let report = Report::new(1000, &runs);
+        assert_eq!(Duration::from_millis(50), report.median);
+        assert_eq!(Duration::from_millis(99), report.p99);
+    }
+
+    #[test]
+    fn test_random_is_uniform_enough() {
+        let mut random = Random(42);
+        let hits = (0..10_000).filter(|_| random.happens(0.1)).count();
+        assert!((800..1200).contains(&hits));
+    }
+}
@@ -0,0 +1,142 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes compact bitmap of received segments.
+//! Bits are set atomically, so a single bitmap can be shared by all download workers.
+
+#![allow(dead_code)]
+
+use std::ops::Range;
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+
+#[derive(Debug)]
+pub struct SegmentBitmap {
+    words: Box<[AtomicU64]>,
+    len: usize,
+    set_count: AtomicUsize,
+}
+
+impl SegmentBitmap {
+    const WORD_BITS: usize = u64::BITS as usize;
+
+    pub fn new(len: usize) -> Self {
+        let words = (0..(len + Self::WORD_BITS - 1) / Self::WORD_BITS).map(|_| AtomicU64::new(0)).collect();
+        Self { words, len, set_count: AtomicUsize::new(0) }
+    }
+
+    /// Restores the bitmap from words of `snapshot`, returns None if words do not match the length.
+    pub fn from_words(len: usize, words: &[u64]) -> Option<Self> {
+        let word_count = (len + Self::WORD_BITS - 1) / Self::WORD_BITS;
+        let trailing_bits = len % Self::WORD_BITS;
+        let is_padding_clear = trailing_bits == 0 || words.last().map_or(true, |word| word >> trailing_bits == 0);
+        if words.len() != word_count || !is_padding_clear {
+            return None;
+        }
+        let set_count = words.iter().map(|word| word.count_ones() as usize).sum();
+        let words = words.iter().map(|&word| AtomicU64::new(word)).collect();
+        Some(Self { words, len, set_count: AtomicUsize::new(set_count) })
+    }
+
+    /// Copy of the current words, bits set concurrently may or may not be included.
+    pub fn snapshot(&self) -> Vec<u64> {
+        self.words.iter().map(|word| word.load(Ordering::Acquire)).collect()
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Number of set bits.
+    pub fn count(&self) -> usize {
+        self.set_count.load(Ordering::Acquire)
+    }
+
+    pub fn is_complete(&self) -> bool {
+        self.count() == self.len
+    }
+
+    pub fn get(&self, index: usize) -> bool {
+        debug_assert!(index < self.len);
+        self.words[index / Self::WORD_BITS].load(Ordering::Acquire) & (1 << (index % Self::WORD_BITS)) != 0
+    }
+
+    /// Sets the bit, returns false if it has already been set by anyone.
+    pub fn set(&self, index: usize) -> bool {
+        debug_assert!(index < self.len);
+        let mask = 1 << (index % Self::WORD_BITS);
+        let previous = self.words[index / Self::WORD_BITS].fetch_or(mask, Ordering::AcqRel);
+        if previous & mask != 0 {
+            return false;
+        }
+        self.set_count.fetch_add(1, Ordering::AcqRel);
+        true
+    }
+
+    /// Index of the first bit from the range that is not set, whole words of set bits are skipped at once.
+    pub fn first_missing(&self, range: Range<usize>) -> Option<usize> {
+        let mut index = range.start;
+        while index < range.end {
+            let word = !self.words[index / Self::WORD_BITS].load(Ordering::Acquire) >> (index % Self::WORD_BITS);
+            if word == 0 {
+                index = (index / Self::WORD_BITS + 1) * Self::WORD_BITS;
+                continue;
+            }
+            index += word.trailing_zeros() as usize;
+            return if index < range.end { Some(index) } else { None };
+        }
+        None
+    }
+
+    /// Number of bits from the range that are not set.
+    pub fn missing_count(&self, range: Range<usize>) -> usize {
+        range.filter(|&index| !self.get(index)).count()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::SegmentBitmap;
+
+    #[test]
+    fn test_set_and_get() {
+        let bitmap = SegmentBitmap::new(130);
+        assert!(!bitmap.get(0));
+        assert!(bitmap.set(0));
+        assert!(bitmap.set(129));
+        assert!(!bitmap.set(129));
+        assert!(bitmap.get(0) && bitmap.get(129) && !bitmap.get(64));
+        assert_eq!(2, bitmap.count());
+        assert_eq!(128, bitmap.missing_count(1..129));
+    }
+
+    #[test]
+    fn test_is_complete() {
+        let bitmap = SegmentBitmap::new(3);
+        (0..3).for_each(|index| { bitmap.set(index); });
+        assert!(bitmap.is_complete());
+        assert!(SegmentBitmap::new(0).is_complete());
+    }
+
+    #[test]
+    fn test_first_missing() {
+        let bitmap = SegmentBitmap::new(200);
+        (0..130).for_each(|index| { bitmap.set(index); });
+        assert_eq!(Some(130), bitmap.first_missing(0..200));
+        assert_eq!(Some(150), bitmap.first_missing(150..200));
+        assert_eq!(None, bitmap.first_missing(10..130));
+        (130..200).for_each(|index| { bitmap.set(index); });
+        assert_eq!(None, bitmap.first_missing(0..200));
+    }
+
+    #[test]
+    fn test_snapshot_round_trip() {
+        let bitmap = SegmentBitmap::new(70);
+        bitmap.set(3);
+        bitmap.set(69);
+        let restored = SegmentBitmap::from_words(70, &bitmap.snapshot()).unwrap();
+        assert_eq!(2, restored.count());
+        assert!(restored.get(3) && restored.get(69) && !restored.get(4));
+        assert!(SegmentBitmap::from_words(70, &[0]).is_none());
+        assert!(SegmentBitmap::from_words(70, &[0, 1 << 6]).is_none());
+    }
+}
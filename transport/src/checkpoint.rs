@@ -0,0 +1,184 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes the on-disk checkpoint of a download, which allows to resume it after the client dies.
+//! Checkpoint holds the size of the file and the bitmap of segments that have been written to the output file.
+//! It is saved periodically next to the output file and removed once the download finishes.
+//!
+//! Format, all numbers little endian: `MAGIC`, file size as u64, words of the bitmap as u64.
+
+#![allow(dead_code)]
+
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use crate::bitmap::SegmentBitmap;
+use crate::output::MappedFile;
+use crate::segment::Segment;
+
+
+pub struct Checkpoint {
+    path: PathBuf,
+    temporary_path: PathBuf,
+    output: Arc<MappedFile>,
+    /* Segments whose data has been copied to the output, bits of the received bitmap are set before that happens. */
+    written: SegmentBitmap,
+    next_save_at: Mutex<Instant>,
+}
+
+impl Checkpoint {
+    pub const SAVE_INTERVAL: Duration = Duration::from_secs(1);
+    const MAGIC: &'static [u8; 8] = b"TRCKPT01";
+    const HEADER_SIZE: usize = 16;
+    const WORD_SIZE: usize = 8;
+
+    /// Path of the checkpoint of the output file.
+    pub fn path_for(file_name: &str) -> PathBuf {
+        PathBuf::from(format!("{file_name}.checkpoint"))
+    }
+
+    /// Reads segments written before the previous run ended, None if there is no checkpoint.
+    pub fn load(path: &Path, file_size: usize) -> io::Result<Option<SegmentBitmap>> {
+        let bytes = match fs::read(path) {
+            Ok(bytes) => bytes,
+            Err(err) if err.kind() == io::ErrorKind::NotFound => return Ok(None),
+            Err(err) => return Err(err),
+        };
+        let invalid = |message: &str| io::Error::new(io::ErrorKind::InvalidData, message.to_owned());
+        if bytes.len() < Self::HEADER_SIZE || &bytes[..Self::MAGIC.len()] != Self::MAGIC {
+            return Err(invalid("not a checkpoint file"));
+        }
+        let saved_file_size = u64::from_le_bytes(bytes[Self::MAGIC.len()..Self::HEADER_SIZE].try_into().unwrap());
+        if saved_file_size != file_size as u64 {
+            return Err(invalid("checkpoint belongs to a file of different size"));
+        }
+        let words_bytes = &bytes[Self::HEADER_SIZE..];
+        if words_bytes.len() % Self::WORD_SIZE != 0 {
+            return Err(invalid("checkpoint is truncated"));
+        }
+        let words: Vec<u64> = words_bytes
+            .chunks_exact(Self::WORD_SIZE)
+            .map(|word| u64::from_le_bytes(word.try_into().unwrap()))
+            .collect();
+        let segment_count = (file_size + Segment::SIZE - 1) / Segment::SIZE;
+        SegmentBitmap::from_words(segment_count, &words)
+            .map(Some)
+            .ok_or_else(|| invalid("checkpoint is truncated"))
+    }
+
+    /// Creates checkpoint of the output, `written` holds segments already present in the file.
+    pub fn new(path: PathBuf, output: Arc<MappedFile>, written: SegmentBitmap) -> Self {
+        let mut temporary_path = path.clone().into_os_string();
+        temporary_path.push(".tmp");
+        Self {
+            path,
+            temporary_path: PathBuf::from(temporary_path),
+            output,
+            written,
+            next_save_at: Mutex::new(Instant::now() + Self::SAVE_INTERVAL),
+        }
+    }
+
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Has to be called once data of the segment is copied to the output file.
+    pub fn mark_written(&self, seg_index: usize) {
+        self.written.set(seg_index);
+    }
+
+    /// Saves the checkpoint if `SAVE_INTERVAL` passed since the last save.
+    /// Only one of the workers calling it concurrently saves, others return immediately.
+    pub fn save_if_due(&self, now: Instant) -> io::Result<()> {
+        let mut next_save_at = match self.next_save_at.try_lock() {
+            Ok(next_save_at) => next_save_at,
+            Err(_) => return Ok(()),
+        };
+        if now < *next_save_at {
+            return Ok(());
+        }
+        *next_save_at = now + Self::SAVE_INTERVAL;
+        self.save()
+    }
+
+    /// Replaces the checkpoint atomically, so that a crash while saving leaves the previous one intact.
+    pub fn save(&self) -> io::Result<()> {
+        let words = self.written.snapshot();
+        /* Data has to reach the disk before the checkpoint claims it is there. */
+        self.output.sync()?;
+        let mut bytes = Vec::with_capacity(Self::HEADER_SIZE + words.len() * Self::WORD_SIZE);
+        bytes.extend_from_slice(Self::MAGIC);
+        bytes.extend_from_slice(&(self.output.len() as u64).to_le_bytes());
+        words.iter().for_each(|word| bytes.extend_from_slice(&word.to_le_bytes()));
+
+        let mut file = File::create(&self.temporary_path)?;
+        file.write_all(&bytes)?;
+        file.sync_all()?;
+        fs::rename(&self.temporary_path, &self.path)
+    }
+
+    /// Removes the checkpoint of a finished download.
+    pub fn finish(&self) -> io::Result<()> {
+        self.output.sync()?;
+        match fs::remove_file(&self.path) {
+            Err(err) if err.kind() == io::ErrorKind::NotFound => Ok(()),
+            result => result,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+    use std::path::PathBuf;
+    use std::sync::Arc;
+
+    use super::Checkpoint;
+    use crate::bitmap::SegmentBitmap;
+    use crate::output::MappedFile;
+    use crate::segment::Segment;
+
+    fn temporary_file_name(name: &str) -> String {
+        let path: PathBuf = std::env::temp_dir().join(format!("transport-{}-{name}", std::process::id()));
+        let _ = fs::remove_file(&path);
+        path.to_str().unwrap().to_owned()
+    }
+
+    #[test]
+    fn test_missing_checkpoint() {
+        let path = Checkpoint::path_for(&temporary_file_name("missing"));
+        assert!(Checkpoint::load(&path, 1000).unwrap().is_none());
+    }
+
+    #[test]
+    fn test_save_and_load() {
+        let file_size = 100 * Segment::SIZE + 7;
+        let file_name = temporary_file_name("save");
+        let path = Checkpoint::path_for(&file_name);
+        let output = Arc::new(MappedFile::create(&file_name, file_size).unwrap());
+        let checkpoint = Checkpoint::new(path.clone(), output, SegmentBitmap::new(101));
+        checkpoint.mark_written(0);
+        checkpoint.mark_written(100);
+        checkpoint.save().unwrap();
+
+        let written = Checkpoint::load(&path, file_size).unwrap().unwrap();
+        assert_eq!(2, written.count());
+        assert!(written.get(0) && written.get(100) && !written.get(1));
+        assert!(Checkpoint::load(&path, file_size + 1).is_err());
+
+        checkpoint.finish().unwrap();
+        assert!(!path.exists());
+        fs::remove_file(&file_name).unwrap();
+    }
+
+    #[test]
+    fn test_reject_foreign_file() {
+        let file_name = temporary_file_name("foreign");
+        fs::write(&file_name, b"definitely not a checkpoint").unwrap();
+        assert!(Checkpoint::load(file_name.as_ref(), 10).is_err());
+        fs::remove_file(&file_name).unwrap();
+    }
+}
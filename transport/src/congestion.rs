@@ -0,0 +1,203 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes round trip time estimation and congestion control
+//! which decide how long to wait for responses and how many requests to keep in flight.
+
+#![allow(dead_code)]
+
+use std::time::Duration;
+
+
+/// Smoothed round trip time estimator as described in RFC 6298.
+#[derive(Debug, Clone)]
+pub struct RttEstimator {
+    smoothed: Option<Duration>,
+    variation: Duration,
+    min_timeout: Duration,
+    max_timeout: Duration,
+}
+
+impl RttEstimator {
+    const ALPHA_SHIFT: u32 = 3;
+    const BETA_SHIFT: u32 = 2;
+    const K: u32 = 4;
+    const MAX_BACKOFF_SHIFT: u32 = 6;
+
+    pub fn new(min_timeout: Duration, max_timeout: Duration) -> Self {
+        debug_assert!(min_timeout <= max_timeout);
+        Self { smoothed: None, variation: Duration::ZERO, min_timeout, max_timeout }
+    }
+
+    pub fn add_sample(&mut self, sample: Duration) {
+        match self.smoothed {
+            None => {
+                self.smoothed = Some(sample);
+                self.variation = sample / 2;
+            }
+            Some(smoothed) => {
+                let deviation = if smoothed > sample { smoothed - sample } else { sample - smoothed };
+                self.variation = self.variation - self.variation / (1 << Self::BETA_SHIFT) + deviation / (1 << Self::BETA_SHIFT);
+                self.smoothed = Some(smoothed - smoothed / (1 << Self::ALPHA_SHIFT) + sample / (1 << Self::ALPHA_SHIFT));
+            }
+        }
+    }
+
+    pub fn smoothed(&self) -> Option<Duration> {
+        self.smoothed
+    }
+
+    /// Time to wait for a response, `max_timeout` until the first sample arrives.
+    pub fn timeout(&self) -> Duration {
+        match self.smoothed {
+            None => self.max_timeout,
+            Some(smoothed) => (smoothed + self.variation * Self::K).clamp(self.min_timeout, self.max_timeout),
+        }
+    }
+
+    /// Time to wait for a response to the n-th request for the same segment,
+    /// timeout doubles with every retransmission up to `max_timeout`.
+    pub fn retransmission_timeout(&self, transmission_count: u32) -> Duration {
+        let backoff = 1u32 << transmission_count.saturating_sub(1).min(Self::MAX_BACKOFF_SHIFT);
+        (self.timeout() * backoff).min(self.max_timeout)
+    }
+}
+
+
+/// AIMD congestion window measured in segments, updated once per round of requests.
+/// Outcomes of single requests are gathered into rounds of the current window size.
+///
+/// Window doubles during slow start and grows by `ADDITIVE_INCREASE` afterwards.
+/// Only rounds that lost more than `CONGESTION_LOSS_FRACTION` of their requests are treated as congestion
+/// and halve the window, so that random loss on a lossy link does not collapse it.
+#[derive(Debug, Clone)]
+pub struct CongestionWindow {
+    size: f64,
+    slow_start_threshold: f64,
+    max_size: f64,
+    received_count: usize,
+    lost_count: usize,
+}
+
+impl CongestionWindow {
+    const INITIAL_SIZE: f64 = 32.0;
+    const MIN_SIZE: f64 = 4.0;
+    const ADDITIVE_INCREASE: f64 = 8.0;
+    const MULTIPLICATIVE_DECREASE: f64 = 0.5;
+    const CONGESTION_LOSS_FRACTION: f64 = 0.25;
+
+    pub fn new(max_size: usize) -> Self {
+        let max_size = max_size as f64;
+        Self {
+            size: Self::INITIAL_SIZE.min(max_size),
+            slow_start_threshold: max_size,
+            max_size,
+            received_count: 0,
+            lost_count: 0,
+        }
+    }
+
+    pub fn size(&self) -> usize {
+        self.size as usize
+    }
+
+    pub fn on_response(&mut self) {
+        self.received_count += 1;
+        self.end_round_if_complete();
+    }
+
+    pub fn on_loss(&mut self) {
+        self.lost_count += 1;
+        self.end_round_if_complete();
+    }
+
+    fn end_round_if_complete(&mut self) {
+        let requested_count = self.received_count + self.lost_count;
+        if requested_count >= self.size() {
+            self.on_round_end(requested_count, self.received_count);
+            self.received_count = 0;
+            self.lost_count = 0;
+        }
+    }
+
+    pub fn on_round_end(&mut self, requested_count: usize, received_count: usize) {
+        if requested_count == 0 {
+            return;
+        }
+        let lost_count = requested_count.saturating_sub(received_count);
+        if lost_count as f64 > requested_count as f64 * Self::CONGESTION_LOSS_FRACTION {
+            self.slow_start_threshold = (self.size * Self::MULTIPLICATIVE_DECREASE).max(Self::MIN_SIZE);
+            self.size = self.slow_start_threshold;
+        } else if self.size < self.slow_start_threshold {
+            self.size = (self.size * 2.0).min(self.slow_start_threshold);
+        } else {
+            self.size = (self.size + Self::ADDITIVE_INCREASE).min(self.max_size);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+    use super::{CongestionWindow, RttEstimator};
+
+    #[test]
+    fn test_timeout_before_first_sample() {
+        let estimator = RttEstimator::new(Duration::from_millis(10), Duration::from_millis(1000));
+        assert_eq!(Duration::from_millis(1000), estimator.timeout());
+    }
+
+    #[test]
+    fn test_timeout_after_first_sample() {
+        let mut estimator = RttEstimator::new(Duration::from_millis(10), Duration::from_millis(1000));
+        estimator.add_sample(Duration::from_millis(20));
+        /* srtt + 4 * rttvar = 20 + 4 * 10 */
+        assert_eq!(Duration::from_millis(60), estimator.timeout());
+    }
+
+    #[test]
+    fn test_timeout_is_clamped() {
+        let mut estimator = RttEstimator::new(Duration::from_millis(10), Duration::from_millis(1000));
+        estimator.add_sample(Duration::from_micros(100));
+        assert_eq!(Duration::from_millis(10), estimator.timeout());
+    }
+
+    #[test]
+    fn test_retransmission_timeout_backoff() {
+        let mut estimator = RttEstimator::new(Duration::from_millis(10), Duration::from_millis(1000));
+        estimator.add_sample(Duration::from_millis(20));
+        assert_eq!(Duration::from_millis(60), estimator.retransmission_timeout(1));
+        assert_eq!(Duration::from_millis(120), estimator.retransmission_timeout(2));
+        assert_eq!(Duration::from_millis(1000), estimator.retransmission_timeout(10));
+    }
+
+    #[test]
+    fn test_window_slow_start_and_additive_increase() {
+        let mut window = CongestionWindow::new(100);
+        window.on_round_end(32, 32);
+        assert_eq!(64, window.size());
+        window.on_round_end(64, 64);
+        assert_eq!(100, window.size());
+        window.on_round_end(100, 60);
+        assert_eq!(50, window.size());
+        window.on_round_end(50, 50);
+        assert_eq!(58, window.size());
+    }
+
+    #[test]
+    fn test_window_gathers_single_outcomes_into_rounds() {
+        let mut window = CongestionWindow::new(1000);
+        for _ in 0..31 {
+            window.on_response();
+        }
+        assert_eq!(32, window.size());
+        window.on_loss();
+        assert_eq!(64, window.size());
+    }
+
+    #[test]
+    fn test_window_tolerates_random_loss() {
+        let mut window = CongestionWindow::new(1000);
+        window.on_round_end(32, 30);
+        assert_eq!(64, window.size());
+    }
+}
@@ -6,17 +6,20 @@
 #![allow(dead_code)]
 
 use std::fmt::Debug;
-use std::fs::{File, OpenOptions};
 use std::io;
-use std::io::Write as _;
-use std::fmt::Write as _;
 use std::net::{Ipv4Addr, SocketAddr, SocketAddrV4, UdpSocket};
 use std::os::unix::prelude::*;
-use std::time::Duration;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
 
-use crate::messages::{ByteRange, Request, Response};
+use crate::bitmap::SegmentBitmap;
+use crate::checkpoint::Checkpoint;
+use crate::congestion::{CongestionWindow, RttEstimator};
+use crate::messages::{ByteRange, Response};
+use crate::output::MappedFile;
 use crate::segment::Segment;
 use crate::registry::{EventType, Registry};
+use crate::sender::BatchSender;
 use crate::window::Window;
 use crate::{registry, util};
 use crate::util::FailWithMessage;
@@ -33,6 +36,12 @@ impl SegmentByteRangeIter {
     pub fn new(file_size: usize, seg_size: usize) -> Self {
         Self { base_byte_offset: 0, file_size, seg_size }
     }
+
+    /// Iterates over segments of the byte range, whose start has to be a multiple of `seg_size`.
+    pub fn with_range(byte_range: ByteRange, seg_size: usize) -> Self {
+        debug_assert_eq!(byte_range.start % seg_size, 0);
+        Self { base_byte_offset: byte_range.start, file_size: byte_range.end, seg_size }
+    }
 }
 
 impl Iterator for SegmentByteRangeIter {
@@ -71,6 +80,14 @@ mod tests_segment_byte_range_iter {
         assert_eq!(Some(0..100), seg_iter.next());
         assert_eq!(None, seg_iter.next());
     }
+
+    #[test]
+    fn test_with_range() {
+        let mut seg_iter = SegmentByteRangeIter::with_range(600..1000, 300);
+        assert_eq!(Some(600..900), seg_iter.next());
+        assert_eq!(Some(900..1000), seg_iter.next());
+        assert_eq!(None, seg_iter.next());
+    }
 }
 
 enum Notification {
@@ -79,82 +96,170 @@ enum Notification {
 }
 
 
+/// Counters of the download hot path, they let benchmarks compare tuning of the downloader.
+#[derive(Debug, Default, Copy, Clone)]
+pub struct DownloadStatistics {
+    pub requests_sent: usize,
+    pub send_calls: usize,
+    pub receive_calls: usize,
+    pub wait_calls: usize,
+}
+
+impl DownloadStatistics {
+    pub fn syscall_count(&self) -> usize {
+        self.send_calls + self.receive_calls + self.wait_calls
+    }
+}
+
+
 pub struct Downloader {
     socket: UdpSocket,
     registry: Registry,
-    window: Window,
+    sender: BatchSender,
+    request_batch: Vec<ByteRange>,
+    next_send_at: Instant,
+    congestion_window: CongestionWindow,
+    rtt_estimator: RttEstimator,
+    window_size: usize,
+    statistics: DownloadStatistics,
     server_address: SocketAddrV4,
-    segment_byte_ranges: SegmentByteRangeIter,
-    file_size: usize,
-    file_handle: File
+    output: Arc<MappedFile>,
+    received: Arc<SegmentBitmap>,
+    checkpoint: Arc<Checkpoint>,
 }
 
 impl Downloader {
     const TIMEOUT: Duration = Duration::from_millis(1000);
+    const MIN_TIMEOUT: Duration = Duration::from_millis(10);
+    /* Granularity of the registry timeouts, requests are spread over ticks of that length. */
+    const PACING_TICK: Duration = Duration::from_millis(1);
 
-    pub fn new(server_address: SocketAddrV4, file_name: &str, file_size: usize) -> Self {
+    /// Creates downloader with its own socket, that stores segments in the shared output file and bitmap.
+    pub fn new(
+        server_address: SocketAddrV4,
+        output: Arc<MappedFile>,
+        received: Arc<SegmentBitmap>,
+        checkpoint: Arc<Checkpoint>,
+    ) -> Self {
         let socket = UdpSocket::bind(SocketAddrV4::new(Ipv4Addr::UNSPECIFIED, 0)).map_err(|err| {
             util::fail_with_message(format!("could not bind the socket: {err}").as_ref());
         }).unwrap();
+        socket.set_nonblocking(true).or_fail_with_message("cannot set socket to nonblocking mode");
 
         let mut registry = Registry::new().or_fail_with_message("could not create registry");
 
-        let file_handle = OpenOptions::new()
-            .write(true)
-            .create_new(true)
-            .open(file_name).map_err(|err|{
-                util::fail_with_message(format!("error occurred while opening the file {err}").as_str());
-            }).unwrap();
-
         registry.add_interest(EventType::Read, socket.as_raw_fd()).map_err(|err|
             util::fail_with_message(format!("could not register interest for {}", err).as_ref())
         ).unwrap();
 
-        let mut segment_byte_ranges = SegmentByteRangeIter::new(file_size, Segment::SIZE);
-        let window = Window::new(&mut segment_byte_ranges);
-
         Self {
             socket,
             registry,
-            window,
-            segment_byte_ranges,
+            sender: BatchSender::new(server_address),
+            request_batch: Vec::with_capacity(BatchSender::BATCH_SIZE),
+            next_send_at: Instant::now(),
+            congestion_window: CongestionWindow::new(Window::SIZE),
+            rtt_estimator: RttEstimator::new(Self::MIN_TIMEOUT, Self::TIMEOUT),
+            window_size: Window::SIZE,
+            statistics: DownloadStatistics::default(),
             server_address,
-            file_size,
-            file_handle,
+            output,
+            received,
+            checkpoint,
         }
     }
 
+    /// Changes the number of segments of the sliding window, which also bounds the congestion window.
+    pub fn set_window_size(&mut self, window_size: usize) {
+        self.window_size = window_size;
+        self.congestion_window = CongestionWindow::new(window_size);
+    }
+
+    pub fn statistics(&self) -> &DownloadStatistics {
+        &self.statistics
+    }
+
     /* warning: as of current implementation there is only one item registered.
         This function works correctly if this assumption holds.
     */
     fn await_socket_read_ready(&mut self, timeout: &Duration) -> Notification {
+        self.statistics.wait_calls += 1;
         match self.registry.await_events(timeout) {
             registry::Notification::Timeout => Notification::Timeout,
             registry::Notification::Events(_, sleep_time) => Notification::ReadReady(sleep_time),
         }
     }
 
-    fn send_window_with_buf(&mut self, request_buffer: &mut String) {
-        for segment in self.window.unacknowledged_segments() {
-            request_buffer.clear();
-            write!(request_buffer, "{}", segment.request()).unwrap();
-            self.socket.send_to(request_buffer.as_ref(), self.server_address)
-                .or_fail_with_message("cannot send to the server");
+    /// Number of requests sent per pacing tick, so that the congestion window is spread over one round trip time.
+    fn pacing_burst_size(&self) -> usize {
+        match self.rtt_estimator.smoothed() {
+            Some(smoothed) if smoothed > Self::PACING_TICK => {
+                let ticks_per_round_trip = smoothed.as_secs_f64() / Self::PACING_TICK.as_secs_f64();
+                ((self.congestion_window.size() as f64 / ticks_per_round_trip).ceil() as usize).max(1)
+            }
+            _ => self.congestion_window.size(),
+        }
+    }
+
+    /// Sends the next paced burst of requests with as few syscalls as possible.
+    /// Lost segments are requested again first, but only while the congestion window has room.
+    fn send_burst(&mut self, window: &mut Window, now: Instant) {
+        let mut burst_left = self.pacing_burst_size();
+        while burst_left > 0 {
+            let room = self.congestion_window.size().saturating_sub(window.in_flight_count());
+            self.request_batch.clear();
+            while self.request_batch.len() < room.min(burst_left).min(BatchSender::BATCH_SIZE) {
+                match window.next_request() {
+                    Some(byte_range) => self.request_batch.push(byte_range),
+                    None => break,
+                }
+            }
+            if self.request_batch.is_empty() {
+                break;
+            }
+            let sent_count = self.sender.send(&self.socket, &self.request_batch).map_err(|err| {
+                util::fail_with_message(format!("cannot send to the server: {err}").as_ref());
+            }).unwrap();
+            self.statistics.send_calls += 1;
+            self.statistics.requests_sent += sent_count;
+            for byte_range in &self.request_batch[..sent_count] {
+                let transmission_count = window[byte_range].transmission_count() + 1;
+                let deadline = now + self.rtt_estimator.retransmission_timeout(transmission_count);
+                window.mark_sent(byte_range, now, deadline);
+            }
+            for byte_range in self.request_batch[sent_count..].iter().rev() {
+                window.unsend_request(byte_range);
+            }
+            if sent_count < self.request_batch.len() {
+                break;  /* Send buffer is full, retry with the next tick. */
+            }
+            burst_left -= sent_count;
         }
+        self.next_send_at = now + Self::PACING_TICK;
     }
 
-    fn store_segments(&mut self, message_buffer: &mut [u8]) {
+    fn store_segments(&mut self, window: &mut Window, message_buffer: &mut [u8]) {
         loop {
+            self.statistics.receive_calls += 1;
             match self.socket.recv_from(message_buffer) {
-                Ok((message_size, SocketAddr::V4(sender))) if sender == self.server_address && Response::is_message_size_valid(message_size)  => {
-                    let response = Response::new(message_buffer);
+                Ok((message_size, SocketAddr::V4(sender))) if sender == self.server_address => {
+                    let response = match Response::parse(&message_buffer[..message_size]) {
+                        Ok(response) => response,
+                        Err(_) => continue,  /* Malformed datagrams are ignored. */
+                    };
                     /* If segment is outside of window we ignore it. */
-                    if self.window.contains(response.byte_range()) {
-                        /* If the segment is a duplicate we ignore it. */
-                        let segment = &mut self.window[response.byte_range()];
-                        if !segment.is_received() {
+                    if window.contains(response.byte_range()) {
+                        let segment = &window[response.byte_range()];
+                        let round_trip_time = segment.round_trip_time(Instant::now());
+                        /* If the segment is a duplicate, also one received by another downloader, we ignore it. */
+                        if response.byte_range() == segment.byte_range() && window.acknowledge(response.byte_range()) {
                             debug_assert_eq!(response.data().len(), response.byte_range().len());
-                            segment.write_all(response.data()).unwrap();
+                            if let Some(round_trip_time) = round_trip_time {
+                                self.rtt_estimator.add_sample(round_trip_time);
+                            }
+                            self.output.write_at(response.byte_range().start, response.data());
+                            self.checkpoint.mark_written(response.byte_range().start / Segment::SIZE);
+                            self.congestion_window.on_response();
                         }
                     }
                 }
@@ -165,40 +270,71 @@ impl Downloader {
         }
     }
 
+    /// Downloads the whole file and removes its checkpoint.
     pub fn download(&mut self) {
-        let mut request_buffer = String::with_capacity(Request::MAX_SIZE);
+        self.download_range(0..self.output.len());
+        self.checkpoint.finish().map_err(|err| {
+            util::fail_with_message(format!("could not remove the checkpoint: {err}").as_ref());
+        }).unwrap();
+    }
+
+    /// Downloads all segments of the byte range that have not been received yet,
+    /// start of the range has to be a multiple of `Segment::SIZE`.
+    /// Congestion window and round trip time estimate carry over between ranges.
+    pub fn download_range(&mut self, byte_range: ByteRange) {
+        let first_seg_index = byte_range.start / Segment::SIZE;
+        let last_seg_index = (byte_range.end + Segment::SIZE - 1) / Segment::SIZE;
+        /* Segments received before, also by a previous run of the client, are not requested again. */
+        let first_missing_index = match self.received.first_missing(first_seg_index..last_seg_index) {
+            Some(seg_index) => seg_index,
+            None => return,
+        };
         let mut response_buffer = vec![0; Response::MAX_SIZE].into_boxed_slice();
-        let mut bytes_downloaded = 0;
-        let mut timeout = Self::TIMEOUT;
-
-        while bytes_downloaded < self.file_size {
-            self.socket.set_nonblocking(false).or_fail_with_message("cannot set socket to blocking mode");
-            self.send_window_with_buf(&mut request_buffer);
-            self.socket.set_nonblocking(true).or_fail_with_message("cannot set socket to nonblocking mode");
-            match self.await_socket_read_ready(&timeout) {
-                Notification::Timeout   => {
-                    timeout = Self::TIMEOUT;
-                    let segments = self.window.shrink();
-                    for segment in segments {
-                        self.file_handle.write_all(segment.as_ref()).map_err(|err| {
-                            util::fail_with_message(format!("could not append to file: {err}").as_ref());
-                        }).unwrap();
-                        bytes_downloaded += segment.len();
-                    }}
-                Notification::ReadReady(sleep_time) => {
-                    timeout = timeout.saturating_sub(sleep_time);
-                    self.store_segments(&mut response_buffer)
+        let mut segment_byte_ranges = SegmentByteRangeIter::with_range(
+            first_missing_index * Segment::SIZE..byte_range.end,
+            Segment::SIZE,
+        );
+        let mut window = Window::with_capacity(&mut segment_byte_ranges, self.received.clone(), self.window_size);
+
+        while !window.is_complete() {
+            let now = Instant::now();
+            self.checkpoint.save_if_due(now).map_err(|err| {
+                util::fail_with_message(format!("could not save the checkpoint: {err}").as_ref());
+            }).unwrap();
+            for _ in 0..window.expire_timers(now) {
+                self.congestion_window.on_loss();
+            }
+            let can_send = window.has_requests() &&
+                window.in_flight_count() < self.congestion_window.size();
+            if can_send && now >= self.next_send_at {
+                self.send_burst(&mut window, now);
+            }
+
+            let wake_up_at = match (can_send, window.next_deadline()) {
+                (true, Some(deadline)) => deadline.min(self.next_send_at),
+                (true, None) => self.next_send_at,
+                (false, Some(deadline)) => deadline,
+                /* Only segments received by other downloaders are left, pick them up from the bitmap. */
+                (false, None) => {
+                    window.advance(&mut segment_byte_ranges);
+                    continue;
+                },
+            };
+            match self.await_socket_read_ready(&wake_up_at.saturating_duration_since(Instant::now())) {
+                Notification::Timeout => {},
+                Notification::ReadReady(_) => {
+                    self.store_segments(&mut window, &mut response_buffer);
+                    window.advance(&mut segment_byte_ranges);
                 },
             };
-            self.window.extend(&mut self.segment_byte_ranges);
         }
-        debug_assert_eq!(bytes_downloaded, self.file_size);
     }
 }
 
 impl From<DownloaderConfig> for Downloader {
     fn from(config: DownloaderConfig) -> Self {
-        Self::new(config.address, config.file_name.as_ref(), config.size)
+        let (output, received, checkpoint) = config.create_output();
+        Self::new(config.address, output, received, checkpoint)
     }
 }
 
@@ -207,6 +343,8 @@ pub struct DownloaderConfig {
     pub address: SocketAddrV4,
     pub file_name: String,
     pub size: usize,
+    pub worker_count: usize,
+    pub replica_addresses: Vec<SocketAddrV4>,
 }
 
 impl DownloaderConfig {
@@ -227,6 +365,78 @@ impl DownloaderConfig {
             .or_fail_with_message("file length missing")
             .parse()
             .or_fail_with_message("invalid format of file length");
-        Self { address: SocketAddrV4::new(ip_address, port), size, file_name }
+        let worker_count = iter.next()
+            .map(|worker_count| worker_count.parse().or_fail_with_message("invalid format of worker count"))
+            .unwrap_or(1);
+        if worker_count == 0 {
+            util::fail_with_message("worker count must be positive");
+        }
+        let replica_addresses = iter
+            .map(|address| address.parse().or_fail_with_message("invalid format of replica address, expected ipv4:port"))
+            .collect();
+        Self { address: SocketAddrV4::new(ip_address, port), size, file_name, worker_count, replica_addresses }
+    }
+
+    /// Creates the output file, the bitmap of its received segments and its checkpoint.
+    /// If the checkpoint of a previous run exists, the download is resumed and the existing file is reused.
+    pub fn create_output(&self) -> (Arc<MappedFile>, Arc<SegmentBitmap>, Arc<Checkpoint>) {
+        let checkpoint_path = Checkpoint::path_for(&self.file_name);
+        let written = Checkpoint::load(&checkpoint_path, self.size).map_err(|err| {
+            util::fail_with_message(format!("could not resume from {}: {err}", checkpoint_path.display()).as_str());
+        }).unwrap();
+        let segment_count = (self.size + Segment::SIZE - 1) / Segment::SIZE;
+        let is_resumed = written.is_some();
+        let (output, written) = match written {
+            Some(written) => (MappedFile::open(self.file_name.as_ref(), self.size), written),
+            None => (MappedFile::create(self.file_name.as_ref(), self.size), SegmentBitmap::new(segment_count)),
+        };
+        let output = Arc::new(output.map_err(|err|{
+            util::fail_with_message(format!("error occurred while opening the file {err}").as_str());
+        }).unwrap());
+        let received = SegmentBitmap::from_words(segment_count, &written.snapshot()).unwrap();
+        let checkpoint = Checkpoint::new(checkpoint_path, output.clone(), written);
+        /* Fresh output is saved right away, otherwise a run killed before the first save leaves a file
+           without checkpoint, which the next run refuses to overwrite. */
+        if !is_resumed {
+            checkpoint.save().map_err(|err| {
+                util::fail_with_message(format!("could not save checkpoint {}: {err}", checkpoint.path().display()).as_str());
+            }).unwrap();
+        }
+        (output, Arc::new(received), Arc::new(checkpoint))
+    }
+}
+
+#[cfg(test)]
+mod tests_create_output {
+    use std::fs;
+    use std::net::{Ipv4Addr, SocketAddrV4};
+
+    use super::DownloaderConfig;
+    use crate::checkpoint::Checkpoint;
+    use crate::segment::Segment;
+
+    #[test]
+    fn test_fresh_output_is_resumable_before_first_save() {
+        let file_name = std::env::temp_dir()
+            .join(format!("transport-{}-fresh", std::process::id()))
+            .to_str().unwrap().to_owned();
+        let checkpoint_path = Checkpoint::path_for(&file_name);
+        let _ = fs::remove_file(&file_name);
+        let _ = fs::remove_file(&checkpoint_path);
+        let config = DownloaderConfig {
+            address: SocketAddrV4::new(Ipv4Addr::LOCALHOST, 40001),
+            file_name: file_name.clone(),
+            size: 10 * Segment::SIZE,
+            worker_count: 1,
+            replica_addresses: Vec::new(),
+        };
+        let (_, received, checkpoint) = config.create_output();
+        assert!(checkpoint_path.exists());
+        /* Process killed right away, the next run resumes instead of refusing the existing file. */
+        drop((received, checkpoint));
+        let (_, received, checkpoint) = config.create_output();
+        assert_eq!(0, received.count());
+        checkpoint.finish().unwrap();
+        fs::remove_file(&file_name).unwrap();
     }
 }
@@ -7,6 +7,14 @@ mod util;
 mod messages;
 mod window;
 mod downloader;
+mod sender;
+mod congestion;
+mod bitmap;
+mod output;
+mod parallel;
+mod checkpoint;
+#[cfg(test)]
+mod benchmark;
 
 use libc;
 use std::env;
@@ -17,8 +25,15 @@ use crate::downloader::DownloaderConfig;
     maybe newline character does not match specification?
 */
 
+/* Usage: transport <server ipv4> <port> <file name> <size> [worker count] [replica ipv4:port]...
+    Interrupted download is resumed as long as <file name>.checkpoint is left next to the file.
+*/
 fn main() {
     let config = DownloaderConfig::try_from(env::args());
-    let mut downloader = Downloader::from(config);
-    downloader.download()
+    if config.worker_count > 1 {
+        parallel::download(&config);
+    } else {
+        let mut downloader = Downloader::from(config);
+        downloader.download()
+    }
 }
@@ -5,8 +5,6 @@
 
 use std::ops::{Range, RangeInclusive};
 use std::fmt::{Debug, Display, Formatter};
-use std::str;
-use crate::util::FailWithMessage;
 
 
 pub type ByteRange = Range<usize>;
@@ -15,9 +13,17 @@ pub type ByteRange = Range<usize>;
 pub const MAX_MESSAGE_SIZE: usize = Response::MAX_SIZE;
 
 
+/// Reasons for which a datagram is not a valid response.
+#[derive(Debug, Copy, Clone, Eq, PartialEq)]
+pub enum ParseError {
+    InvalidSize,
+    InvalidHeader,
+    InvalidNumber,
+    InvalidDataLength,
+}
+
+
 pub struct Response<'message> {
-    message_bytes: &'message [u8],
-    header: &'message str,
     data: &'message [u8],
     byte_range: Range<usize>,
 }
@@ -28,6 +34,7 @@ impl<'message> Response<'message> {
     const MIN_START: usize = 1;
     const MAX_LENGTH: usize = 4;
     const MIN_LENGTH: usize = 1;
+    const PREFIX: &'static [u8] = b"DATA ";
     pub const MIN_SIZE: usize = Self::DATA_SIZE + Self::MIN_HEADER_SIZE;
     pub const MAX_SIZE: usize = Self::DATA_SIZE + Self::MAX_HEADER_SIZE;
     pub const MAX_HEADER_SIZE: usize = Self::BASE_HEADER_SIZE + Self::MAX_START + Self::MAX_LENGTH;
@@ -46,36 +53,21 @@ impl<'message> Response<'message> {
         Self::MIN_HEADER_SIZE <= size && size <= Self::MAX_HEADER_SIZE
     }
 
-    /* Note: this should be a TryFrom (return Result, not panic straight away) */
-
-    /// Response Message in our communication protocol.
-    ///
-    /// # Panics
+    /// Response Message in our communication protocol, `message_bytes` has to hold exactly one datagram.
     ///
-    /// This function will panic if message_bytes does not contain valid response.
-    /// Response message is as follow:
-    pub fn new(message_bytes: &'message [u8]) -> Self {
-        let newline_index = message_bytes
-            .iter()
-            .position(|&byte| byte == '\n' as u8)
-            .or_fail_with_message(r#"invalid response format, no Line Feed '\n') found"#);
-        let (header_bytes, other ) = message_bytes.split_at(newline_index);
-        let header= str::from_utf8(header_bytes).or_fail_with_message("invalid response format, header is not valid utf");
-        let mut words = header.split_whitespace();
-        let start = words.nth(1)
-            .or_fail_with_message("invalid response header format, start missing")
-            .parse()
-            .or_fail_with_message("invalid response header format, start is not a number");
-        let length = words.next()
-            .or_fail_with_message("invalid response header format, length missing")
-            .parse::<usize>()
-            .or_fail_with_message("invalid response header format, length is not a number");
-
-        let byte_range = start..(start + length);
-        assert!(length <= 500);
-        let data = &other[1..length + 1];
-
-        Self { message_bytes, header, data, byte_range }
+    /// Response message is as follows: `DATA start length\n` followed by `length` bytes of data.
+    /// Header is parsed in place, without any allocation nor conversion to `str`.
+    pub fn parse(message_bytes: &'message [u8]) -> Result<Self, ParseError> {
+        if !Self::is_message_size_valid(message_bytes.len()) {
+            return Err(ParseError::InvalidSize);
+        }
+        let rest = message_bytes.strip_prefix(Self::PREFIX).ok_or(ParseError::InvalidHeader)?;
+        let (start, rest) = parse_decimal(rest, Self::MAX_START, b' ')?;
+        let (length, data) = parse_decimal(rest, Self::MAX_LENGTH, b'\n')?;
+        if length > Self::DATA_SIZE || length != data.len() {
+            return Err(ParseError::InvalidDataLength);
+        }
+        Ok(Self { data, byte_range: start..(start + length) })
     }
 
     pub fn byte_range(&self) -> &Range<usize> {
@@ -87,6 +79,27 @@ impl<'message> Response<'message> {
     }
 }
 
+impl<'message> TryFrom<&'message [u8]> for Response<'message> {
+    type Error = ParseError;
+
+    fn try_from(message_bytes: &'message [u8]) -> Result<Self, Self::Error> {
+        Self::parse(message_bytes)
+    }
+}
+
+/// Parses at most `max_digits` decimal digits terminated with `terminator`, returns the number and bytes after the terminator.
+fn parse_decimal(bytes: &[u8], max_digits: usize, terminator: u8) -> Result<(usize, &[u8]), ParseError> {
+    let mut value = 0;
+    for (i, &byte) in bytes.iter().enumerate().take(max_digits + 1) {
+        match byte {
+            b'0'..=b'9' => value = value * 10 + (byte - b'0') as usize,
+            _ if byte == terminator && i > 0 => return Ok((value, &bytes[i + 1..])),
+            _ => return Err(ParseError::InvalidNumber),
+        }
+    }
+    Err(ParseError::InvalidNumber)
+}
+
 impl Debug for Response<'_> {
     fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
         f.debug_struct("Response")
@@ -107,6 +120,7 @@ impl<'range> Request<'range> {
     const MIN_START: usize = 1;
     const MAX_LENGTH: usize = 4;
     const MIN_LENGTH: usize = 1;
+    const PREFIX: &'static [u8] = b"GET ";
     pub const MAX_SIZE: usize = Self::BASE_HEADER_SIZE + Self::MAX_START + Self::MAX_LENGTH;
     pub const MIN_SIZE: usize = Self::BASE_HEADER_SIZE + Self::MIN_START + Self::MIN_LENGTH;
 
@@ -115,14 +129,103 @@ impl<'range> Request<'range> {
     }
     
     pub fn header_length(&self) -> usize {
-        let start = (self.byte_range.start as f64).log10() as usize;
-        let len = (self.byte_range.len() as f64).log10() as usize;
-        Self::BASE_HEADER_SIZE + start + len
+        Self::BASE_HEADER_SIZE + decimal_digit_count(self.byte_range.start) + decimal_digit_count(self.byte_range.len())
+    }
+
+    /// Writes the constant part of the request, buffer becomes a template for `encode_into_template`.
+    pub fn write_template(buffer: &mut [u8]) {
+        debug_assert!(buffer.len() >= Self::MAX_SIZE);
+        buffer[..Self::PREFIX.len()].copy_from_slice(Self::PREFIX);
+    }
+
+    /// Patches digits of the request into the buffer prepared with `write_template`, no formatting machinery is involved.
+    ///
+    /// Returns length of the request.
+    /// Buffer has to hold at least `MAX_SIZE` bytes.
+    pub fn encode_into_template(&self, buffer: &mut [u8]) -> usize {
+        debug_assert_eq!(&buffer[..Self::PREFIX.len()], Self::PREFIX);
+        let mut position = Self::PREFIX.len();
+        position += write_decimal(self.byte_range.start, &mut buffer[position..]);
+        buffer[position] = b' ';
+        position += 1;
+        position += write_decimal(self.byte_range.len(), &mut buffer[position..]);
+        buffer[position] = b'\n';
+        position + 1
     }
 }
 
+fn decimal_digit_count(value: usize) -> usize {
+    let mut digit_count = 1;
+    let mut rest = value / 10;
+    while rest > 0 {
+        digit_count += 1;
+        rest /= 10;
+    }
+    digit_count
+}
+
+/// Writes decimal digits of the value at the front of the buffer, returns their number.
+fn write_decimal(value: usize, buffer: &mut [u8]) -> usize {
+    let digit_count = decimal_digit_count(value);
+    let mut rest = value;
+    for digit in buffer[..digit_count].iter_mut().rev() {
+        *digit = b'0' + (rest % 10) as u8;
+        rest /= 10;
+    }
+    digit_count
+}
+
 impl Display for Request<'_> {
     fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
         write!(f, "GET {} {}\n", self.byte_range.start, self.byte_range.len())
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::{ParseError, Request, Response};
+
+    fn response_bytes(header: &str, data_len: usize) -> Vec<u8> {
+        let mut bytes = header.as_bytes().to_vec();
+        bytes.resize(header.len() + data_len, b'x');
+        bytes
+    }
+
+    #[test]
+    fn test_encode_matches_display() {
+        let mut buffer = [0; Request::MAX_SIZE];
+        Request::write_template(&mut buffer);
+        for byte_range in [0..500, 9500..10000, 99999500..99999999, 7..8] {
+            let request = Request::new(&byte_range);
+            let length = request.encode_into_template(&mut buffer);
+            assert_eq!(request.to_string().as_bytes(), &buffer[..length]);
+            assert_eq!(request.header_length(), length);
+        }
+    }
+
+    #[test]
+    fn test_parse_valid_response() {
+        let bytes = response_bytes("DATA 1500 500\n", 500);
+        let response = Response::parse(&bytes).unwrap();
+        assert_eq!(&(1500..2000), response.byte_range());
+        assert_eq!(500, response.data().len());
+    }
+
+    #[test]
+    fn test_parse_short_last_segment() {
+        let bytes = response_bytes("DATA 15000 34\n", 34);
+        let response = Response::parse(&bytes).unwrap();
+        assert_eq!(&(15000..15034), response.byte_range());
+    }
+
+    #[test]
+    fn test_parse_rejects_malformed_responses() {
+        assert_eq!(Some(ParseError::InvalidSize), Response::parse(b"DATA").err());
+        assert_eq!(Some(ParseError::InvalidHeader), Response::parse(&response_bytes("GET 0 500\n", 500)).err());
+        assert_eq!(Some(ParseError::InvalidNumber), Response::parse(&response_bytes("DATA x 500\n", 500)).err());
+        assert_eq!(Some(ParseError::InvalidNumber), Response::parse(&response_bytes("DATA  0 500\n", 500)).err());
+        assert_eq!(Some(ParseError::InvalidNumber), Response::parse(&response_bytes("DATA 123456789 5\n", 5)).err());
+        assert_eq!(Some(ParseError::InvalidDataLength), Response::parse(&response_bytes("DATA 0 500\n", 499)).err());
+        assert_eq!(Some(ParseError::InvalidDataLength), Response::parse(&response_bytes("DATA 0 501\n", 501)).err());
+    }
+}
@@ -0,0 +1,108 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes the memory mapped output file.
+//! Its whole size is allocated up front, so segments can be written straight to their final offsets in any order.
+//! File is shared by all download workers, each segment is written only by the worker that marked it received.
+
+#![allow(dead_code)]
+
+use std::fs::{File, OpenOptions};
+use std::io;
+use std::os::unix::prelude::*;
+use std::ptr;
+use std::slice;
+
+use crate::util::syscall;
+
+
+pub struct MappedFile {
+    file: File,
+    data: *mut u8,
+    len: usize,
+}
+
+impl MappedFile {
+    /// Creates new file of `len` bytes, fails if the file already exists.
+    pub fn create(file_name: &str, len: usize) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(file_name)?;
+        if len > 0 {
+            match syscall!(fallocate(file.as_raw_fd(), 0, 0, len as libc::off_t)) {
+                Ok(_) => {},
+                /* Some file systems cannot preallocate, a sparse file works too. */
+                Err(err) if err.raw_os_error() == Some(libc::EOPNOTSUPP) => file.set_len(len as u64)?,
+                Err(err) => return Err(err),
+            }
+        }
+        Self::map(file, len)
+    }
+
+    /// Opens file of a download that is being resumed, fails unless the file exists and has exactly `len` bytes.
+    pub fn open(file_name: &str, len: usize) -> io::Result<Self> {
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .open(file_name)?;
+        if file.metadata()?.len() != len as u64 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "file size does not match the download"));
+        }
+        Self::map(file, len)
+    }
+
+    fn map(file: File, len: usize) -> io::Result<Self> {
+        if len == 0 {
+            /* mmap rejects empty mappings and there is nothing to write anyway. */
+            return Ok(Self { file, data: ptr::null_mut(), len });
+        }
+        let data = unsafe {
+            libc::mmap(ptr::null_mut(), len, libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED, file.as_raw_fd(), 0)
+        };
+        if data == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Self { file, data: data as *mut u8, len })
+    }
+
+    /// Waits until all segments written so far reach the disk.
+    pub fn sync(&self) -> io::Result<()> {
+        if self.data.is_null() {
+            return Ok(());
+        }
+        syscall!(msync(self.data as *mut libc::c_void, self.len, libc::MS_SYNC)).map(|_| ())
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Callers must not write overlapping ranges concurrently.
+    ///
+    /// # Panics
+    ///
+    /// This function will panic if data does not fit in the file at the offset.
+    pub fn write_at(&self, offset: usize, data: &[u8]) {
+        assert!(offset <= self.len && data.len() <= self.len - offset, "write past the end of the mapped file");
+        if data.is_empty() {
+            return;
+        }
+        // safety: mapping is valid for len bytes and the range has been checked above.
+        let destination = unsafe { slice::from_raw_parts_mut(self.data.add(offset), data.len()) };
+        destination.copy_from_slice(data);
+    }
+}
+
+// safety: mapping lives as long as the struct and writes never overlap, see write_at.
+unsafe impl Send for MappedFile {}
+unsafe impl Sync for MappedFile {}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        if !self.data.is_null() {
+            // safety: data has been mapped with length len in create.
+            unsafe { libc::munmap(self.data as *mut libc::c_void, self.len); }
+        }
+    }
+}
@@ -0,0 +1,158 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes parallel download of a single file by many workers.
+//! Every worker runs its own Downloader (own socket, optionally own server replica) on a separate thread.
+//! Workers share the output file and the bitmap of received segments, file is split into chunks
+//! that are handed out with a work stealing queue.
+
+#![allow(dead_code)]
+
+use std::collections::VecDeque;
+use std::net::SocketAddrV4;
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+use crate::bitmap::SegmentBitmap;
+use crate::checkpoint::Checkpoint;
+use crate::downloader::{Downloader, DownloaderConfig};
+use crate::messages::ByteRange;
+use crate::output::MappedFile;
+use crate::segment::Segment;
+use crate::util;
+use crate::window::Window;
+
+
+/// Chunks of the file waiting to be downloaded, one deque per worker.
+///
+/// Worker takes chunks from the front of its own deque, once it runs dry it steals from the back of the longest one.
+/// With no chunks left, idle worker joins the in progress chunk with the most missing segments,
+/// so that a slow or lossy worker does not hold up the end of the download.
+/// Locks are taken only to hand out chunks, received segments are tracked with the lock-free bitmap.
+pub struct WorkQueue {
+    queues: Vec<Mutex<VecDeque<ByteRange>>>,
+    in_progress: Vec<Mutex<Option<ByteRange>>>,
+}
+
+impl WorkQueue {
+    pub const CHUNK_SIZE: usize = 2 * Window::SIZE * Segment::SIZE;
+
+    /// Splits the file into chunks, every worker starts with a contiguous part of the file.
+    pub fn new(file_size: usize, worker_count: usize) -> Self {
+        let chunks: Vec<ByteRange> = (0..file_size)
+            .step_by(Self::CHUNK_SIZE)
+            .map(|start| start..(start + Self::CHUNK_SIZE).min(file_size))
+            .collect();
+        let chunks_per_worker = (chunks.len() + worker_count - 1) / worker_count.max(1);
+        let queues = (0..worker_count)
+            .map(|worker_index| {
+                let first = (worker_index * chunks_per_worker).min(chunks.len());
+                let last = (first + chunks_per_worker).min(chunks.len());
+                Mutex::new(chunks[first..last].iter().cloned().collect())
+            })
+            .collect();
+        let in_progress = (0..worker_count).map(|_| Mutex::new(None)).collect();
+        Self { queues, in_progress }
+    }
+
+    fn steal(&self, worker_index: usize) -> Option<ByteRange> {
+        let victim = (0..self.queues.len())
+            .filter(|&victim| victim != worker_index)
+            .max_by_key(|&victim| self.queues[victim].lock().unwrap().len())?;
+        self.queues[victim].lock().unwrap().pop_back()
+    }
+
+    fn join_in_progress(&self, worker_index: usize, received: &SegmentBitmap) -> Option<ByteRange> {
+        let missing_count = |chunk: &ByteRange| {
+            let first = chunk.start / Segment::SIZE;
+            let last = (chunk.end + Segment::SIZE - 1) / Segment::SIZE;
+            received.missing_count(first..last)
+        };
+        (0..self.in_progress.len())
+            .filter(|&other| other != worker_index)
+            .filter_map(|other| self.in_progress[other].lock().unwrap().clone())
+            .map(|chunk| (missing_count(&chunk), chunk))
+            .filter(|(missing_count, _)| *missing_count > 0)
+            .max_by_key(|(missing_count, _)| *missing_count)
+            .map(|(_, chunk)| chunk)
+    }
+
+    /// Picks the next chunk for the worker, None once every segment is received or being downloaded by someone.
+    pub fn next(&self, worker_index: usize, received: &SegmentBitmap) -> Option<ByteRange> {
+        let own_chunk = self.queues[worker_index].lock().unwrap().pop_front();
+        let chunk = own_chunk
+            .or_else(|| self.steal(worker_index))
+            .or_else(|| self.join_in_progress(worker_index, received));
+        *self.in_progress[worker_index].lock().unwrap() = chunk.clone();
+        chunk
+    }
+}
+
+
+/// Downloads the file with `config.worker_count` workers, worker i talks to the i-th of the server
+/// and its replicas, in a round robin fashion.
+pub fn download(config: &DownloaderConfig) {
+    let (output, received, checkpoint) = config.create_output();
+    let work_queue = WorkQueue::new(config.size, config.worker_count);
+    let server_addresses: Vec<SocketAddrV4> = std::iter::once(config.address)
+        .chain(config.replica_addresses.iter().cloned())
+        .collect();
+
+    thread::scope(|scope| {
+        for worker_index in 0..config.worker_count {
+            let server_address = server_addresses[worker_index % server_addresses.len()];
+            let output: Arc<MappedFile> = output.clone();
+            let received: Arc<SegmentBitmap> = received.clone();
+            let checkpoint: Arc<Checkpoint> = checkpoint.clone();
+            let work_queue = &work_queue;
+            scope.spawn(move || {
+                let mut downloader = Downloader::new(server_address, output, received.clone(), checkpoint);
+                while let Some(chunk) = work_queue.next(worker_index, &received) {
+                    downloader.download_range(chunk);
+                }
+            });
+        }
+    });
+    debug_assert!(received.is_complete());
+    checkpoint.finish().map_err(|err| {
+        util::fail_with_message(format!("could not remove the checkpoint: {err}").as_ref());
+    }).unwrap();
+}
+
+#[cfg(test)]
+mod tests {
+    use super::WorkQueue;
+    use crate::bitmap::SegmentBitmap;
+    use crate::segment::Segment;
+
+    #[test]
+    fn test_chunks_cover_the_file() {
+        let file_size = 5 * WorkQueue::CHUNK_SIZE + 123;
+        let work_queue = WorkQueue::new(file_size, 2);
+        let received = SegmentBitmap::new((file_size + Segment::SIZE - 1) / Segment::SIZE);
+        let mut chunks: Vec<_> = std::iter::from_fn(|| work_queue.next(0, &received)).take(6).collect();
+        chunks.sort_by_key(|chunk| chunk.start);
+        assert_eq!(6, chunks.len());
+        assert_eq!(0, chunks[0].start);
+        assert!(chunks.windows(2).all(|pair| pair[0].end == pair[1].start));
+        assert_eq!(file_size, chunks[5].end);
+    }
+
+    #[test]
+    fn test_own_chunks_go_first_then_stealing_from_the_back() {
+        let work_queue = WorkQueue::new(4 * WorkQueue::CHUNK_SIZE, 2);
+        let received = SegmentBitmap::new(4 * WorkQueue::CHUNK_SIZE / Segment::SIZE);
+        assert_eq!(Some(0..WorkQueue::CHUNK_SIZE), work_queue.next(0, &received));
+        assert_eq!(Some(WorkQueue::CHUNK_SIZE..2 * WorkQueue::CHUNK_SIZE), work_queue.next(0, &received));
+        assert_eq!(Some(3 * WorkQueue::CHUNK_SIZE..4 * WorkQueue::CHUNK_SIZE), work_queue.next(0, &received));
+    }
+
+    #[test]
+    fn test_idle_worker_joins_chunk_in_progress() {
+        let work_queue = WorkQueue::new(WorkQueue::CHUNK_SIZE, 2);
+        let received = SegmentBitmap::new(WorkQueue::CHUNK_SIZE / Segment::SIZE);
+        let chunk = work_queue.next(0, &received);
+        assert_eq!(chunk, work_queue.next(1, &received));
+        (0..received.len()).for_each(|index| { received.set(index); });
+        assert_eq!(None, work_queue.next(1, &received));
+    }
+}
@@ -12,22 +12,12 @@ use std::collections::HashMap;
 use std::io;
 use std::os::unix::io::{AsRawFd, RawFd};
 use std::time::{Duration, Instant};
-use crate::util::FailWithMessage;
+use crate::util::{syscall, FailWithMessage};
 
 
 /* TODO: expose EventType instead of epoll_event (in registry' await_events())  */
 
 
-macro_rules! syscall {
-    ($func_name: ident ( $($arg: expr),* $(,)* ) ) => {
-        {
-            let result = unsafe { libc::$func_name($($arg,)* ) };
-            if result == -1 { Err(std::io::Error::last_os_error()) } else { Ok(result) }
-        }
-    }
-}
-
-
 #[derive(Debug, Copy, Clone, Hash, Eq, PartialEq)]
 pub enum EventType {
     Read,
@@ -110,7 +100,8 @@ impl Registry {
                 self.epoll_fd,
                 self.events.as_mut_ptr() as *mut epoll_event,
                 Self::MAX_LISTENER_COUNT as libc::c_int,
-                timeout.as_millis() as libc::c_int,
+                /* Round up, so that waiting for a sub-millisecond deadline does not turn into a busy loop. */
+                ((timeout.as_micros() + 999) / 1000) as libc::c_int,
             )
         ).map_err(|err| {
             util::fail_with_message(format!("error during epoll wait: {err}").as_ref());
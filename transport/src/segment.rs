@@ -1,62 +1,61 @@
 //! Mikołaj Depta 328690
 //!
 //! This module contains segments in which files are downloaded.
+//! Segment only tracks requests for its byte range, received data goes straight to the output file.
 
 #![allow(dead_code)]
 
-use std::io::{Write};
+use std::time::{Duration, Instant};
 use crate::messages::{ByteRange, Request, Response};
 
 
-#[derive(Debug, Eq, PartialEq, Clone)]
-enum Status {
-    Received,
-    NotReceived,
-}
-
-impl Default for Status {
-    fn default() -> Self {
-        Self::NotReceived
-    }
-}
-
-
 #[derive(Debug, Clone)]
 pub struct Segment {
     byte_range: ByteRange,
-    status: Status,
-    data: Vec<u8>,
+    last_sent_at: Option<Instant>,
+    transmission_count: u32,
+    deadline: Option<Instant>,
 }
 
 impl Segment {
     pub const SIZE: usize = Response::DATA_SIZE;
 
     pub fn new(byte_range: ByteRange) -> Self {
-        Self::with_buffer(byte_range, Vec::with_capacity(Self::SIZE))
+        Self { byte_range, last_sent_at: None, transmission_count: 0, deadline: None }
     }
 
-    pub fn with_buffer(byte_range: ByteRange, mut data: Vec<u8>) -> Self {
-        data.clear();
-        Self { byte_range, status: Default::default(), data }
+    pub fn len(&self) -> usize {
+        self.byte_range.len()
     }
 
-    pub fn set_data(&mut self, data: &[u8]) {
-        self.data.clear();
-        self.status = Status::Received;
-        self.data.extend(data.iter().take(Self::SIZE));
+    /// Records that the request for the segment has been sent, a response is awaited until the deadline.
+    pub fn mark_sent(&mut self, now: Instant, deadline: Instant) {
+        self.last_sent_at = Some(now);
+        self.transmission_count += 1;
+        self.deadline = Some(deadline);
     }
 
-    pub fn is_received(&self) -> bool {
-        self.status == Status::Received
+    pub fn transmission_count(&self) -> u32 {
+        self.transmission_count
     }
 
-    pub fn len(&self) -> usize {
-        self.data.len()
+    /// Deadline of the request in flight, None if segment is not awaited.
+    pub fn deadline(&self) -> Option<Instant> {
+        self.deadline
     }
 
-    pub fn yield_buffer(mut self) -> Vec<u8> {
-        self.data.clear();
-        self.data
+    /// Stops awaiting the response, returns true if a request was in flight.
+    pub fn clear_deadline(&mut self) -> bool {
+        self.deadline.take().is_some()
+    }
+
+    /// Round trip time of the response received now, None for retransmitted segments
+    /// since the response cannot be matched with the request it answers (Karn's algorithm).
+    pub fn round_trip_time(&self, now: Instant) -> Option<Duration> {
+        match (self.transmission_count, self.last_sent_at) {
+            (1, Some(sent_at)) => Some(now - sent_at),
+            _ => None,
+        }
     }
 
     pub fn byte_range(&self) -> &ByteRange {
@@ -68,31 +67,8 @@ impl Segment {
     }
 }
 
-impl Write for Segment {
-    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
-        self.set_data(buf);
-        Ok(self.data.len())
-    }
-
-    fn flush(&mut self) -> std::io::Result<()> {
-        Ok(())
-    }
-}
-
 impl From<ByteRange> for Segment {
     fn from(byte_range: ByteRange) -> Self {
         Self::new(byte_range)
     }
 }
-
-impl AsRef<[u8]> for Segment {
-    fn as_ref(&self) -> &[u8] {
-        self.data.as_ref()
-    }
-}
-
-impl AsMut<[u8]> for Segment {
-    fn as_mut(&mut self) -> &mut [u8] {
-        self.data.as_mut()
-    }
-}
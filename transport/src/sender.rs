@@ -0,0 +1,68 @@
+//! Mikołaj Depta 328690
+//!
+//! This module exposes the batch sender which sends many requests with a single sendmmsg syscall.
+
+#![allow(dead_code)]
+
+use std::io;
+use std::mem;
+use std::net::{SocketAddrV4, UdpSocket};
+use std::os::unix::prelude::*;
+
+use crate::messages::{ByteRange, Request};
+use crate::util::syscall;
+
+
+pub struct BatchSender {
+    buffers: Box<[[u8; Request::MAX_SIZE]]>,
+    iovecs: Box<[libc::iovec]>,
+    headers: Box<[libc::mmsghdr]>,
+    address: libc::sockaddr_in,
+}
+
+impl BatchSender {
+    pub const BATCH_SIZE: usize = 64;
+
+    pub fn new(server_address: SocketAddrV4) -> Self {
+        let mut buffers = vec![[0; Request::MAX_SIZE]; Self::BATCH_SIZE].into_boxed_slice();
+        buffers.iter_mut().for_each(|buffer| Request::write_template(buffer));
+        // safety: iovec and mmsghdr are plain C structs for which all zeroes is a valid value.
+        let iovecs = vec![unsafe { mem::zeroed::<libc::iovec>() }; Self::BATCH_SIZE].into_boxed_slice();
+        let headers = vec![unsafe { mem::zeroed::<libc::mmsghdr>() }; Self::BATCH_SIZE].into_boxed_slice();
+        let address = libc::sockaddr_in {
+            sin_family: libc::AF_INET as libc::sa_family_t,
+            sin_port: server_address.port().to_be(),
+            sin_addr: libc::in_addr { s_addr: u32::from(*server_address.ip()).to_be() },
+            sin_zero: [0; 8],
+        };
+        Self { buffers, iovecs, headers, address }
+    }
+
+    /// Sends requests for up to `BATCH_SIZE` first byte ranges with a single syscall.
+    ///
+    /// Returns number of requests that have been sent, which is 0 if the socket send buffer is full.
+    pub fn send(&mut self, socket: &UdpSocket, byte_ranges: &[ByteRange]) -> io::Result<usize> {
+        let count = byte_ranges.len().min(Self::BATCH_SIZE);
+        if count == 0 {
+            return Ok(0);
+        }
+        /* Pointers are set up on every call, so that the sender can be freely moved. */
+        for (i, byte_range) in byte_ranges[..count].iter().enumerate() {
+            let length = Request::new(byte_range).encode_into_template(&mut self.buffers[i]);
+            self.iovecs[i] = libc::iovec {
+                iov_base: self.buffers[i].as_mut_ptr() as *mut libc::c_void,
+                iov_len: length,
+            };
+            let header = &mut self.headers[i].msg_hdr;
+            header.msg_name = &mut self.address as *mut libc::sockaddr_in as *mut libc::c_void;
+            header.msg_namelen = mem::size_of::<libc::sockaddr_in>() as libc::socklen_t;
+            header.msg_iov = &mut self.iovecs[i];
+            header.msg_iovlen = 1;
+        }
+        match syscall!(sendmmsg(socket.as_raw_fd(), self.headers.as_mut_ptr(), count as libc::c_uint, 0)) {
+            Ok(sent) => Ok(sent as usize),
+            Err(err) if err.kind() == io::ErrorKind::WouldBlock => Ok(0),
+            Err(err) => Err(err),
+        }
+    }
+}
@@ -6,6 +6,19 @@
 
 use std::process;
 
+
+/// Calls libc function, turns -1 result into the last os error.
+macro_rules! syscall {
+    ($func_name: ident ( $($arg: expr),* $(,)* ) ) => {
+        {
+            let result = unsafe { libc::$func_name($($arg,)* ) };
+            if result == -1 { Err(std::io::Error::last_os_error()) } else { Ok(result) }
+        }
+    }
+}
+
+pub(crate) use syscall;
+
 pub fn fail_with_message(message: &str) -> ! {
     eprintln!("{}", message);
     process::exit(1)
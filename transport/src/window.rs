@@ -2,11 +2,18 @@
 //!
 //! This module exposes the sliding window.
 //! It helps manage simultaneous segment downloads and reliable assembly into final file.
+//! Every request in flight has its own retransmission deadline, deadlines are kept in a min-heap
+//! so that only segments whose timeout expired are requested again.
+//! Received segments of the whole file are tracked in a bitmap shared with other windows, window slides past them.
 
 #![allow(dead_code)]
 
-use std::collections::VecDeque;
+use std::cmp::Reverse;
+use std::collections::{BinaryHeap, VecDeque};
 use std::ops::{Index, IndexMut, Range};
+use std::sync::Arc;
+use std::time::Instant;
+use crate::bitmap::SegmentBitmap;
 use crate::messages::ByteRange;
 
 use crate::segment::Segment;
@@ -15,28 +22,63 @@ use crate::segment::Segment;
 #[derive(Debug)]
 pub struct Window {
     queue: VecDeque<Segment>,
-    received_buffer: Vec<Segment>,
+    capacity: usize,
+    received: Arc<SegmentBitmap>,
     read_seg_count: usize,
+    /* Absolute index of the first segment that has never been requested, such segments form a suffix of the queue. */
+    next_unsent_index: usize,
+    /* Deadlines of requests in flight, entries of segments that got received in the meantime are skipped lazily. */
+    timers: BinaryHeap<Reverse<(Instant, usize)>>,
+    retransmissions: VecDeque<usize>,
+    in_flight_count: usize,
 }
 
 impl Window {
-    const SIZE: usize = 1000;
+    pub const SIZE: usize = 1000;
 
-    pub fn new(segment_byte_ranges: &mut impl Iterator<Item=ByteRange>) -> Self {
-        let mut queue = VecDeque::with_capacity(Self::SIZE);
-        queue.extend(segment_byte_ranges.map(Segment::new).take(Self::SIZE));
-        let received_buffer = Vec::new();
-        Self { queue, received_buffer, read_seg_count: 0 }
+    /// Creates window over segments of the byte ranges, segments that are already received are skipped.
+    pub fn new(segment_byte_ranges: &mut impl Iterator<Item=ByteRange>, received: Arc<SegmentBitmap>) -> Self {
+        Self::with_capacity(segment_byte_ranges, received, Self::SIZE)
+    }
+
+    /// Creates window that holds up to `capacity` segments instead of `SIZE`.
+    pub fn with_capacity(
+        segment_byte_ranges: &mut impl Iterator<Item=ByteRange>,
+        received: Arc<SegmentBitmap>,
+        capacity: usize,
+    ) -> Self {
+        debug_assert!(capacity > 0);
+        let mut queue = VecDeque::with_capacity(capacity);
+        queue.extend(segment_byte_ranges.map(Segment::new).take(capacity));
+        let read_seg_count = queue.front().map_or(0, |segment| segment.byte_range().start / Segment::SIZE);
+        let mut window = Self {
+            queue,
+            capacity,
+            received,
+            read_seg_count,
+            next_unsent_index: read_seg_count,
+            timers: BinaryHeap::with_capacity(capacity),
+            retransmissions: VecDeque::with_capacity(capacity),
+            in_flight_count: 0,
+        };
+        window.advance(segment_byte_ranges);
+        window
     }
 
     fn slide_len(&self) -> usize {
-        self.queue.iter().take_while(|segment| segment.is_received()).count()
+        (self.read_seg_count..self.read_seg_count + self.queue.len())
+            .take_while(|&seg_index| self.received.get(seg_index))
+            .count()
     }
 
-    pub fn shrink(&mut self) -> &[Segment] {
-        self.received_buffer.extend(self.queue.drain(0..self.slide_len()));
-        self.read_seg_count += self.received_buffer.len();
-        self.received_buffer.as_ref()
+    /// Drops received segments from the front of the window.
+    ///
+    /// Returns number of segments dropped.
+    pub fn shrink(&mut self) -> usize {
+        let slide_len = self.slide_len();
+        self.queue.drain(0..slide_len);
+        self.read_seg_count += slide_len;
+        slide_len
     }
 
     pub fn len(&self) -> usize {
@@ -44,37 +86,139 @@ impl Window {
     }
 
     pub fn extend(&mut self, segment_byte_ranges: &mut impl Iterator<Item=ByteRange>) {
-        while let Some(free_segment) = self.received_buffer.pop() {
-            if let Some(byte_range) = segment_byte_ranges.next() {
-                let mut data = free_segment.yield_buffer();
-                data.clear();
-                self.queue.push_back(Segment::with_buffer(byte_range, data));
-            } else {
-                break;
-            }
+        let free_count = self.capacity - self.queue.len();
+        self.queue.extend(segment_byte_ranges.map(Segment::new).take(free_count));
+    }
+
+    /// Slides the window past all received segments at its front, refilling it from the byte ranges.
+    pub fn advance(&mut self, segment_byte_ranges: &mut impl Iterator<Item=ByteRange>) {
+        while self.shrink() > 0 {
+            self.extend(segment_byte_ranges);
         }
     }
 
+    pub fn is_received(&self, byte_range: &ByteRange) -> bool {
+        self.received.get(byte_range.start / Segment::SIZE)
+    }
+
+    /// Returns true once the window slid past all of its segments.
+    pub fn is_complete(&self) -> bool {
+        self.queue.is_empty()
+    }
+
     /* TODO: test this */
     pub fn contains(&self, other: &Range<usize>) -> bool {
         self.read_seg_count * Segment::SIZE <= other.start &&
             other.start < (self.read_seg_count + self.queue.len()) * Segment::SIZE
     }
 
-    pub fn unacknowledged_segments(&mut self) -> impl Iterator<Item=&mut Segment> {
-        self.queue.iter_mut().filter(|segment| !segment.is_received())
+    fn segment_mut(&mut self, seg_index: usize) -> Option<&mut Segment> {
+        seg_index.checked_sub(self.read_seg_count).and_then(|offset| self.queue.get_mut(offset))
+    }
+
+    /// Number of requests whose responses are still awaited.
+    pub fn in_flight_count(&self) -> usize {
+        self.in_flight_count
+    }
+
+    /// Moves segments whose deadlines passed to the retransmission queue.
+    ///
+    /// Returns number of requests that have been lost.
+    pub fn expire_timers(&mut self, now: Instant) -> usize {
+        let mut lost_count = 0;
+        while let Some(&Reverse((deadline, seg_index))) = self.timers.peek() {
+            if deadline > now {
+                break;
+            }
+            self.timers.pop();
+            let segment = match self.segment_mut(seg_index) {
+                /* Stale entry, segment got received or has been requested again since. */
+                Some(segment) if segment.deadline() == Some(deadline) => segment,
+                _ => continue,
+            };
+            segment.clear_deadline();
+            self.in_flight_count -= 1;
+            /* Segment received by another window is not lost. */
+            if !self.received.get(seg_index) {
+                self.retransmissions.push_back(seg_index);
+                lost_count += 1;
+            }
+        }
+        lost_count
+    }
+
+    /// Earliest deadline of requests in flight, it might belong to a segment that got received in the meantime.
+    pub fn next_deadline(&self) -> Option<Instant> {
+        self.timers.peek().map(|&Reverse((deadline, _))| deadline)
+    }
+
+    /// Returns true if there is any segment that should be requested.
+    pub fn has_requests(&self) -> bool {
+        !self.retransmissions.is_empty() || self.next_unsent_index < self.read_seg_count + self.queue.len()
+    }
+
+    /// Picks the next segment that should be requested, lost segments go before the ones never requested.
+    /// Segment is not considered in flight until `mark_sent` is called.
+    pub fn next_request(&mut self) -> Option<ByteRange> {
+        while let Some(seg_index) = self.retransmissions.pop_front() {
+            if self.received.get(seg_index) {
+                continue;
+            }
+            if let Some(segment) = self.segment_mut(seg_index) {
+                return Some(segment.byte_range().clone());
+            }
+        }
+        self.next_unsent_index = self.next_unsent_index.max(self.read_seg_count);
+        while self.next_unsent_index < self.read_seg_count + self.queue.len() {
+            let seg_index = self.next_unsent_index;
+            self.next_unsent_index += 1;
+            if !self.received.get(seg_index) {
+                return Some(self.queue[seg_index - self.read_seg_count].byte_range().clone());
+            }
+        }
+        None
+    }
+
+    /// Returns segment picked with `next_request` that could not be sent, it will be picked again first.
+    pub fn unsend_request(&mut self, byte_range: &ByteRange) {
+        self.retransmissions.push_front(byte_range.start / Segment::SIZE);
+    }
+
+    pub fn mark_sent(&mut self, byte_range: &ByteRange, now: Instant, deadline: Instant) {
+        let seg_index = byte_range.start / Segment::SIZE;
+        let segment = &mut self[byte_range];
+        debug_assert!(segment.deadline().is_none());
+        segment.mark_sent(now, deadline);
+        self.timers.push(Reverse((deadline, seg_index)));
+        self.in_flight_count += 1;
+    }
+
+    /// Marks segment as received and stops awaiting it.
+    ///
+    /// Returns false if the segment has already been received.
+    pub fn acknowledge(&mut self, byte_range: &ByteRange) -> bool {
+        if !self.received.set(byte_range.start / Segment::SIZE) {
+            return false;
+        }
+        if self[byte_range].clear_deadline() {
+            self.in_flight_count -= 1;
+        }
+        true
     }
 }
 
 #[cfg(test)]
 mod tests {
     use super::Window;
+    use std::time::{Duration, Instant};
+    use std::sync::Arc;
+    use crate::bitmap::SegmentBitmap;
     use crate::downloader::SegmentByteRangeIter;
 
     #[test]
     fn test_contains_edge_1() {
         let mut seg_iter = SegmentByteRangeIter::new(2000000, 500);
-        let window = Window::new(&mut seg_iter);
+        let window = Window::new(&mut seg_iter, Arc::new(SegmentBitmap::new(4000)));
 
         let mut seg_iter_copy = SegmentByteRangeIter::new(2000000, 2000000);
 
@@ -84,7 +228,7 @@ mod tests {
     #[test]
     fn test_contains_edge_2() {
         let mut seg_iter = SegmentByteRangeIter::new(2000000, 500);
-        let window = Window::new(&mut seg_iter);
+        let window = Window::new(&mut seg_iter, Arc::new(SegmentBitmap::new(4000)));
 
         let mut seg_iter_copy = SegmentByteRangeIter::new(2000000, 500);
 
@@ -94,11 +238,61 @@ mod tests {
     #[test]
     fn test_contains_edge_3() {
         let mut seg_iter = SegmentByteRangeIter::new(2000000, 500);
-        let window = Window::new(&mut seg_iter);
+        let window = Window::new(&mut seg_iter, Arc::new(SegmentBitmap::new(4000)));
 
         let mut seg_iter_copy = SegmentByteRangeIter::new(2000000, 500);
         assert!(!window.contains(dbg!(&seg_iter_copy.nth(1000).unwrap())));
     }
+
+    #[test]
+    fn test_shrink_and_extend() {
+        let mut seg_iter = SegmentByteRangeIter::new(600000, 500);
+        let mut window = Window::new(&mut seg_iter, Arc::new(SegmentBitmap::new(1200)));
+        assert!(window.acknowledge(&(0..500)));
+        assert!(!window.acknowledge(&(0..500)));
+        assert!(window.acknowledge(&(1000..1500)));
+        assert_eq!(1, window.shrink());
+        window.extend(&mut seg_iter);
+        assert_eq!(Window::SIZE, window.len());
+        assert!(window.contains(&(500000..500500)));
+        assert_eq!(Some(500..1000), window.next_request());
+        assert_eq!(Some(1500..2000), window.next_request());
+    }
+
+    #[test]
+    fn test_only_expired_segments_are_requested_again() {
+        let mut seg_iter = SegmentByteRangeIter::new(1500, 500);
+        let mut window = Window::new(&mut seg_iter, Arc::new(SegmentBitmap::new(3)));
+        let now = Instant::now();
+        for deadline in [now + Duration::from_millis(10), now + Duration::from_millis(20)] {
+            let byte_range = window.next_request().unwrap();
+            window.mark_sent(&byte_range, now, deadline);
+        }
+        assert_eq!(2, window.in_flight_count());
+        assert!(window.acknowledge(&(500..1000)));
+        assert_eq!(1, window.in_flight_count());
+        assert_eq!(1, window.expire_timers(now + Duration::from_millis(30)));
+        assert_eq!(0, window.in_flight_count());
+        assert_eq!(Some(0..500), window.next_request());
+        assert_eq!(Some(1000..1500), window.next_request());
+        assert_eq!(None, window.next_request());
+    }
+
+    #[test]
+    fn test_window_over_byte_range_skips_received_segments() {
+        let received = Arc::new(SegmentBitmap::new(10));
+        (4..6).for_each(|index| { received.set(index); });
+        received.set(7);
+        let mut seg_iter = SegmentByteRangeIter::with_range(2000..4000, 500);
+        let mut window = Window::new(&mut seg_iter, received);
+        assert!(window.contains(&(3000..3500)));
+        assert!(!window.contains(&(2500..3000)));
+        assert_eq!(Some(3000..3500), window.next_request());
+        assert_eq!(None, window.next_request());
+        assert!(window.acknowledge(&(3000..3500)));
+        window.advance(&mut seg_iter);
+        assert!(window.is_complete());
+    }
 }
 
 impl Index<&ByteRange> for Window {